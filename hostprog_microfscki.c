@@ -48,6 +48,16 @@ struct imgdata {
 	__u32 d_rawsz;
 };
 
+/* Block data which can be shared between files, see
+ * %MICROFS_FLAG_SHAREDBLKS.
+ */
+struct imgblk {
+	/* Offset of the block data. */
+	__u64 b_offset;
+	/* Block data size. */
+	__u64 b_length;
+};
+
 /* Description of an image.
  */
 struct imgdesc {
@@ -77,10 +87,18 @@ struct imgdesc {
 	__u64 de_metadatasz;
 	/* Size of the image data (pointers + blocks). */
 	__u64 de_datasz;
+	/* First fragment block pointer referenced by a file. */
+	__u64 de_fragptrfirst;
+	/* Last fragment block pointer referenced by a file. */
+	__u64 de_fragptrlast;
 	/* Number of found inodes/dentries. */
 	__u64 de_inodes;
 	/* Quick access to the superblock. */
 	struct microfs_sb* de_sb;
+	/* Quick access to the superblock extension (if any). */
+	struct microfs_sb_large* de_lsb;
+	/* Base of the pointers in the fragment table. */
+	__u64 de_fragbase;
 	/* Do a quick check. */
 	int de_quickie;
 	/* Change mode to match the image when extracting. */
@@ -93,10 +111,18 @@ struct imgdesc {
 	int de_pedantic;
 	/* Stack of all regular files, used to find duplicates. */
 	struct hostprog_stack* de_datastack;
+	/* Data of all blocks if blocks can be shared. */
+	struct imgblk* de_blks;
+	/* Number of blocks in %de_blks. */
+	__u64 de_nblks;
+	/* Room in %de_blks. */
+	__u64 de_maxblks;
 	/* Compression library to use. */
 	const struct hostprog_lib* de_lib;
 	/* Private data for the compression library. */
 	void* de_lib_data;
+	/* Libraries used by the image, indexed by %microfs_codecidx(). */
+	struct hostprog_codec de_codecs[MICROFS_MAXCODECS];
 };
 
 static void usage(const char* const exe, FILE* const dest)
@@ -234,7 +260,18 @@ sb_retry:
 		error("bad superblock signature");
 	}
 	
-	desc->de_innersz = __le32_to_cpu(desc->de_sb->s_size);
+	/* The sizes of a large image are given by the superblock
+	 * extension.
+	 */
+	if (__le32_to_cpu(desc->de_sb->s_flags) & MICROFS_FLAG_LARGEIMAGE) {
+		desc->de_lsb = (struct microfs_sb_large*)(desc->de_sb + 1);
+		desc->de_innersz = __le64_to_cpu(desc->de_lsb->sl_size);
+		desc->de_fragbase = __le64_to_cpu(desc->de_lsb->sl_fragbase);
+		if (desc->de_fragbase > desc->de_innersz)
+			error("invalid fragment base: 0x%llx", desc->de_fragbase);
+	} else {
+		desc->de_innersz = __le32_to_cpu(desc->de_sb->s_size);
+	}
 	if (desc->de_innersz > desc->de_outersz) {
 		error("superblock size > image outer size: s_size=%llu, de_outersz=%llu",
 			desc->de_innersz, desc->de_outersz);
@@ -265,14 +302,59 @@ sb_retry:
 		if (desc->de_lib->hl_init(&desc->de_lib_data, desc->de_blksz) < 0)
 			error("failed to init %s", desc->de_lib->hl_info->li_name);
 		
-		desc->de_decompressionbufsz = desc->de_lib->hl_upperbound(desc->de_lib_data, desc->de_blksz);
+		desc->de_codecs[microfs_codecidx(lib)] = (struct hostprog_codec){
+			desc->de_lib, desc->de_lib_data
+		};
+		
+		/* The data of the other libraries follows the data of the
+		 * primary library in the order of their ids.
+		 */
+		const __u32 flags = __le32_to_cpu(desc->de_sb->s_flags);
+		__u64 dd_sz = libinfo_ddsz(desc->de_lib->hl_info, flags);
+		__u64 dd_offset = padding + sizeof(*desc->de_sb) + sb_largesz(flags);
+		__u64 dictsz = 0;
+		if (dd_sz && desc->de_lib->hl_ck_dd(desc->de_lib_data, desc->de_image,
+				desc->de_innersz, dd_offset, &dictsz) < 0)
+			error("decompressor specific data check failed");
+		
+		const __u32 codecs = (__u32)__le16_to_cpu(desc->de_sb->s_codecs) << 8;
+		if (codecs && !(__le32_to_cpu(desc->de_sb->s_flags) & MICROFS_FLAG_MIXEDCODECS))
+			error("additional compression libraries given without the flag");
+		
+		for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+			const int id = MICROFS_FLAG_DECOMPRESSOR_ZLIB << i;
+			if (!(codecs & id))
+				continue;
+			if (id == lib)
+				error("the primary compression library is given twice");
+			
+			struct hostprog_codec* codec = &desc->de_codecs[i];
+			codec->hc_lib = hostprog_lib_find_byid(id);
+			if (!codec->hc_lib)
+				error("could not find a compression library with id 0x%x", id);
+			if (codec->hc_lib->hl_init(&codec->hc_lib_data, desc->de_blksz) < 0)
+				error("failed to init %s", codec->hc_lib->hl_info->li_name);
+			if (libinfo_ddsz(codec->hc_lib->hl_info, flags)
+					&& codec->hc_lib->hl_ck_dd(codec->hc_lib_data, desc->de_image,
+						desc->de_innersz, dd_offset + dd_sz, &dictsz) < 0)
+				error("decompressor specific data check failed");
+			dd_sz += libinfo_ddsz(codec->hc_lib->hl_info, flags);
+		}
+		
+		for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+			const struct hostprog_codec* codec = &desc->de_codecs[i];
+			const __u64 upperbound = codec->hc_lib
+				? codec->hc_lib->hl_upperbound(codec->hc_lib_data, desc->de_blksz)
+				: 0;
+			if (upperbound > desc->de_decompressionbufsz)
+				desc->de_decompressionbufsz = upperbound;
+		}
 		desc->de_decompressionbuf = malloc(desc->de_decompressionbufsz);
 		if (!desc->de_decompressionbuf)
 			error("failed to allocate the decompression buffer");
 		
 		const __u64 actual_root_offset = __le32_to_cpu(desc->de_sb->s_root.i_offset);
-		const __u64 expected_root_offset = padding + sizeof(*desc->de_sb)
-			+ desc->de_lib->hl_info->li_dd_sz;
+		const __u64 expected_root_offset = dd_offset + dd_sz;
 		
 		const int invalid_offset = (
 			actual_root_offset != 0 &&
@@ -283,11 +365,9 @@ sb_retry:
 			error("invalid root offset value");
 		}
 		
-		desc->de_metadatasz = expected_root_offset;
-		
-		__u64 dd_offset = padding + sizeof(*desc->de_sb);
-		if (desc->de_lib->hl_ck_dd(desc->de_lib_data, desc->de_image + dd_offset) < 0)
-			error("decompressor specific data check failed");
+		/* The dictionaries are stored after the data of the files.
+		 */
+		desc->de_metadatasz = expected_root_offset + dictsz;
 	}
 }
 
@@ -308,44 +388,350 @@ static void ck_crc(struct imgdesc* const desc)
 	message(VERBOSITY_0, "CRC: %x", sb_crc);
 }
 
+/* Decompress (or copy, if it is stored uncompressed) the %length
+ * bytes of block data at %offset to %desc->de_decompressionbuf with
+ * the library given by %codec, the size of the decompressed data
+ * is returned.
+ */
+static __u32 ck_block(struct imgdesc* const desc, const struct hostprog_codec* codec,
+	const __u64 offset, const __u64 length, const int stored)
+{
+	__u32 decompressionbufsz = desc->de_decompressionbufsz;
+	
+	if (stored) {
+		memcpy(desc->de_decompressionbuf, desc->de_image + offset, length);
+		decompressionbufsz = length;
+	} else {
+		int implerr = 0;
+		int err = codec->hc_lib->hl_decompress(codec->hc_lib_data,
+			desc->de_decompressionbuf, &decompressionbufsz,
+			desc->de_image + offset, length, &implerr);
+		if (err < 0) {
+			error("decompression failed: %s",
+				codec->hc_lib->hl_strerror(codec->hc_lib_data, implerr));
+		}
+	}
+	return decompressionbufsz;
+}
+
+/* Check the tail of a file which is stored in a fragment block,
+ * the fragment reference is found at %fr_offset.
+ */
+static void ck_fragment(struct imgdesc* const desc, const __u64 fr_offset,
+	char* tail_data, const __u64 tail_sz)
+{
+	const struct microfs_fragment* fragment = (const struct microfs_fragment*)
+		(desc->de_image + fr_offset);
+	
+	__u64 fr_blkptr = __le32_to_cpu(fragment->fr_blkptr);
+	__u64 fr_tailoffset = __le32_to_cpu(fragment->fr_offset);
+	
+	if (fr_blkptr + 2 * (MICROFS_IOFFSET_WIDTH / 8) > desc->de_innersz)
+		error("invalid fragment block pointer 0x%x at 0x%x",
+			(__u32)fr_blkptr, (__u32)fr_offset);
+	
+	__u64 blk_data_offset = desc->de_fragbase + __le32_to_cpu(
+		*(__le32*)(desc->de_image + fr_blkptr));
+	__u64 blk_data_length = desc->de_fragbase + __le32_to_cpu(
+		*(__le32*)(desc->de_image + fr_blkptr + MICROFS_IOFFSET_WIDTH / 8))
+		- blk_data_offset;
+	
+	if (blk_data_length == 0 || blk_data_length > desc->de_decompressionbufsz
+			|| blk_data_offset + blk_data_length > desc->de_innersz)
+		error("invalid fragment block data length %llu at 0x%llx",
+			blk_data_length, blk_data_offset);
+	
+	/* Fragment blocks are always compressed with the primary
+	 * library.
+	 */
+	__u32 decompressed = ck_block(desc, &desc->de_codecs[microfs_codecidx(
+		desc->de_lib->hl_info->li_id)], blk_data_offset, blk_data_length, 0);
+	if (fr_tailoffset + tail_sz > decompressed)
+		error("the tail at 0x%x (%llu bytes at %llu) is outside of"
+			" the fragment block (%u bytes)", (__u32)fr_offset,
+			tail_sz, fr_tailoffset, decompressed);
+	
+	if (tail_data) {
+		memcpy(tail_data, desc->de_decompressionbuf + fr_tailoffset,
+			tail_sz);
+	}
+	
+	if (!desc->de_fragptrlast) {
+		desc->de_fragptrfirst = fr_blkptr;
+		desc->de_fragptrlast = fr_blkptr;
+	} else if (fr_blkptr < desc->de_fragptrfirst) {
+		desc->de_fragptrfirst = fr_blkptr;
+	} else if (fr_blkptr > desc->de_fragptrlast) {
+		desc->de_fragptrlast = fr_blkptr;
+	}
+}
+
+/* Check the sub-frames of a block of %blk_size bytes which
+ * data (%blk_data_length bytes at %blk_data_offset) starts with
+ * a sub-frame index, see %MICROFS_FLAG_SUBFRAMES. The block is
+ * decompressed to %blk_dest unless it is NULL.
+ */
+static void ck_frames(struct imgdesc* const desc,
+	const struct hostprog_codec* const codec, const __u64 blk_data_offset,
+	const __u64 blk_data_length, const __u64 blk_size, const __u64 framesz,
+	char* blk_dest)
+{
+	const __u32 flags = __le32_to_cpu(desc->de_sb->s_flags);
+	const __le32* idx = (const __le32*)(desc->de_image + blk_data_offset);
+	const __u64 frames = i_blks(blk_size, framesz);
+	
+	__u64 start = i_frameidxsz(blk_size, framesz);
+	if (start > blk_data_length)
+		error("the sub-frame index at 0x%x is truncated",
+			(__u32)blk_data_offset);
+	
+	for (__u64 i = 0; i < frames; i++) {
+		const __u64 end = i + 1 < frames ? __le32_to_cpu(idx[i])
+			: blk_data_length;
+		const __u64 frame_size = i_blksz(blk_size, i, framesz);
+		if (end < start || end > blk_data_length
+				|| end - start > desc->de_decompressionbufsz)
+			error("invalid sub-frame %llu (%llu to %llu) in the block"
+				" at 0x%x", i, start, end, (__u32)blk_data_offset);
+		
+		if (end == start) {
+			if (!(flags & MICROFS_FLAG_ZEROBLOCKS))
+				error("zero sub-frame data length at 0x%x",
+					(__u32)(blk_data_offset + start));
+			start = end;
+			continue;
+		}
+		
+		__u32 decompressed = ck_block(desc, codec, blk_data_offset + start,
+			end - start, (flags & MICROFS_FLAG_STOREDBLOCKS)
+				&& end - start == frame_size);
+		if (decompressed != frame_size)
+			error("sub-frame %llu in the block at 0x%x decompressed to"
+				" %u bytes, expected %llu bytes", i,
+				(__u32)blk_data_offset, decompressed, frame_size);
+		
+		if (blk_dest) {
+			memcpy(blk_dest + i * framesz, desc->de_decompressionbuf,
+				decompressed);
+		}
+		start = end;
+	}
+}
+
+/* Unpack the packed block pointers of %blks blocks at %offset,
+ * see %MICROFS_FLAG_PACKEDBLKPTRS. The chunk data offsets must
+ * agree with the data lengths before them.
+ */
+static __u32* ck_packedptrs(struct imgdesc* const desc, const __u64 offset,
+	const __u64 blks, const __u32 lenbits)
+{
+	const __u64 chunks = i_blks(blks, MICROFS_BLKPTR_CHUNKBLKS);
+	const __le32* chunkptrs = (const __le32*)(desc->de_image + offset);
+	const __u8* lens = (const __u8*)desc->de_image + offset
+		+ chunks * (MICROFS_IOFFSET_WIDTH / 8);
+	
+	if (offset + i_packedptrsz(blks, lenbits) > desc->de_innersz)
+		error("the packed block pointers at 0x%x are out of bounds",
+			(__u32)offset);
+	
+	__u32* ptrs = malloc((blks + 1) * sizeof(*ptrs));
+	if (!ptrs)
+		error("failed to allocate the block pointers");
+	
+	ptrs[0] = __le32_to_cpu(chunkptrs[0]);
+	for (__u64 i = 0; i < blks; i++) {
+		if (i % MICROFS_BLKPTR_CHUNKBLKS == 0
+				&& __le32_to_cpu(chunkptrs[i / MICROFS_BLKPTR_CHUNKBLKS]) != ptrs[i])
+			error("the packed block pointers at 0x%x disagree for block %llu:"
+				" 0x%x != 0x%x", (__u32)offset, i,
+				__le32_to_cpu(chunkptrs[i / MICROFS_BLKPTR_CHUNKBLKS]), ptrs[i]);
+		ptrs[i + 1] = ptrs[i] + i_packedlen(lens, i, lenbits);
+	}
+	
+	return ptrs;
+}
+
+/* Account for %blk_data_length bytes of block data at
+ * %blk_data_offset. Blocks that can be shared are accounted for
+ * by ck_desc() once all files are checked.
+ */
+static void ck_blkdata(struct imgdesc* const desc, struct imgdata* const imgd,
+	const __u64 blk_data_offset, const __u64 blk_data_length)
+{
+	if (!(__le32_to_cpu(desc->de_sb->s_flags) & MICROFS_FLAG_SHAREDBLKS)) {
+		desc->de_datasz += blk_data_length;
+		imgd->d_rawsz += blk_data_length;
+		return;
+	}
+	
+	if (desc->de_nblks == desc->de_maxblks) {
+		desc->de_maxblks = desc->de_maxblks ? desc->de_maxblks * 2 : 64;
+		desc->de_blks = realloc(desc->de_blks,
+			desc->de_maxblks * sizeof(*desc->de_blks));
+		if (!desc->de_blks)
+			error("failed to allocate the block data extents");
+	}
+	desc->de_blks[desc->de_nblks].b_offset = blk_data_offset;
+	desc->de_blks[desc->de_nblks].b_length = blk_data_length;
+	desc->de_nblks++;
+}
+
+/* Get the number of bytes that %inode stores inline in its
+ * dentry.
+ */
+static __u32 ck_inlinesz(const struct imgdesc* const desc,
+	const struct microfs_inode* const inode)
+{
+	return i_inlinesz(__le32_to_cpu(desc->de_sb->s_flags),
+		__le16_to_cpu(inode->i_mode), i_getsize(inode));
+}
+
 static void ck_compression(struct imgdesc* const desc,
 	const struct microfs_inode* const inode, const __u64 inode_offset,
 	char* inode_data, __u64 inode_sz)
 {
+	/* Inline data is a part of the dentry and it is accounted
+	 * for as metadata by ck_dir().
+	 */
+	if (ck_inlinesz(desc, inode)) {
+		if (inode_data) {
+			memcpy(inode_data, desc->de_image
+				+ __le32_to_cpu(inode->i_offset), inode_sz);
+		}
+		return;
+	}
+	
+	const __u32 flags = __le32_to_cpu(desc->de_sb->s_flags);
+	const int fragments = !!(flags & MICROFS_FLAG_FRAGMENTS);
+	const int fileinfo = i_hasfileinfo(flags);
+	const __u32 fileinfosz = i_fileinfosz(flags);
+	
+	/* The file info word (if any) gives the library, the block
+	 * size and the sub-frame size of the file.
+	 */
+	const struct hostprog_codec* codec = &desc->de_codecs[microfs_codecidx(
+		desc->de_lib->hl_info->li_id)];
+	__u64 blksz = desc->de_blksz;
+	__u64 framesz = 0;
+	__u32 lenbits = 0;
+	if (fileinfo) {
+		const __u32 info = __le32_to_cpu(*(__le32*)(desc->de_image
+			+ __le32_to_cpu(inode->i_offset)));
+		const __u32 id = info & MICROFS_FLAG_MASK_DECOMPRESSOR;
+		const __u32 blkshift = info & MICROFS_FILEINFO_MASK_BLKSHIFT;
+		const __u32 frameshift = (info & MICROFS_FILEINFO_MASK_FRAMESHIFT)
+			>> MICROFS_FILEINFO_FRAMESHIFT_LSB;
+		if (id) {
+			if (!(flags & MICROFS_FLAG_MIXEDCODECS) || microfs_codecidx(id) < 0
+					|| !desc->de_codecs[microfs_codecidx(id)].hc_lib)
+				error("invalid compression library id 0x%x for the inode at 0x%x",
+					id, (__u32)inode_offset);
+			codec = &desc->de_codecs[microfs_codecidx(id)];
+		}
+		if (blkshift) {
+			if (!(flags & MICROFS_FLAG_FILEBLKSZ) || blkshift > desc->de_blkshift
+					|| blkshift < MICROFS_MINBLKSZ_SHIFT)
+				error("invalid block shift %u for the inode at 0x%x",
+					blkshift, (__u32)inode_offset);
+			blksz = 1 << blkshift;
+		}
+		if (frameshift) {
+			if (!(flags & MICROFS_FLAG_SUBFRAMES) || (1ULL << frameshift) >= blksz
+					|| frameshift < MICROFS_MINBLKSZ_SHIFT)
+				error("invalid sub-frame shift %u for the inode at 0x%x",
+					frameshift, (__u32)inode_offset);
+			framesz = 1 << frameshift;
+		}
+		lenbits = (info & MICROFS_FILEINFO_MASK_LENBITS)
+			>> MICROFS_FILEINFO_LENBITS_LSB;
+		if (lenbits == MICROFS_FILEINFO_EXTENTS
+				? !(flags & MICROFS_FLAG_SHAREDBLKS)
+				: lenbits && (!(flags & MICROFS_FLAG_PACKEDBLKPTRS)
+					|| lenbits > MICROFS_IOFFSET_WIDTH))
+			error("invalid length width %u for the inode at 0x%x",
+				lenbits, (__u32)inode_offset);
+	}
+	if (!framesz)
+		framesz = blksz;
+	
+	const __u64 tail_sz = i_fragtail(inode_sz, blksz, fragments);
+	
 	/* The offset can still be invalid, but it is difficult to
 	 * tell untill we try to uncompress the file data.
 	 */
 	__u64 blk_nr = 0;
-	__u64 blk_ptrs = i_blks(inode_sz, desc->de_blksz) + 1;
+	__u64 blk_ptrs = i_ptrblks(inode_sz, blksz, fragments) + 1;
 	__u64 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
 	__u64 blk_data_length = 0;
 	
-	const __u64 blk_ptrs_totalsz = blk_ptrs * blk_ptr_length;
+	const __u64 blk_ptrs_totalsz = i_blkptrsz(inode_sz, blksz,
+		fragments, fileinfosz, lenbits);
 	
 	__u64 checked;
-	__u64 unchecked = inode_sz;
+	__u64 unchecked = inode_sz - tail_sz;
+	
+	const int stored_blks = !!(flags & MICROFS_FLAG_STOREDBLOCKS);
+	const int zero_blks = !!(flags & MICROFS_FLAG_ZEROBLOCKS);
+	
+	/* Block extents are a start and an end pointer per block,
+	 * see %MICROFS_FLAG_SHAREDBLKS.
+	 */
+	const int extents = lenbits == MICROFS_FILEINFO_EXTENTS;
 	
 	__u64 inode_data_offset = 0;
-	__u64 blk_ptr_offset = __le32_to_cpu(inode->i_offset);
-	__u64 blk_data_offset = __le32_to_cpu(*(__le32*)(desc->de_image
-		+ blk_ptr_offset));
+	__u64 blk_ptr_offset = __le32_to_cpu(inode->i_offset) + fileinfosz;
+	__u32* ptrs = lenbits && !extents && unchecked
+		? ck_packedptrs(desc, blk_ptr_offset, blk_ptrs - 1, lenbits) : NULL;
+	
+	/* The block pointers of a large image are relative to the
+	 * data base that follows the file info word.
+	 */
+	__u64 data_base = 0;
+	if (flags & MICROFS_FLAG_LARGEIMAGE) {
+		__le64 base;
+		memcpy(&base, desc->de_image + __le32_to_cpu(inode->i_offset)
+			+ sizeof(__le32), sizeof(base));
+		data_base = __le64_to_cpu(base);
+		if (data_base > desc->de_innersz)
+			error("invalid data base 0x%llx for the inode at 0x%x",
+				data_base, (__u32)inode_offset);
+	}
+	__u64 blk_data_offset = data_base + (ptrs ? ptrs[0] : unchecked
+		? __le32_to_cpu(*(__le32*)(desc->de_image + blk_ptr_offset)) : 0);
 	
 	struct imgdata* imgd = malloc(sizeof(*imgd));
 	if (!imgd)
 		error("failed to allocate an image data entry");
-	imgd->d_offset = blk_ptr_offset;
+	imgd->d_offset = __le32_to_cpu(inode->i_offset);
 	imgd->d_blkptrsz = blk_ptrs_totalsz;
 	imgd->d_rawsz = 0;
 	
-	blk_ptr_offset += blk_ptr_length;
+	if (unchecked)
+		blk_ptr_offset += blk_ptr_length;
 	desc->de_metadatasz += blk_ptrs_totalsz;
 	
-	do {
+	while (unchecked) {
 		checked = 0;
-		blk_data_length = __le32_to_cpu(*(__le32*)(desc->de_image
-			+ blk_ptr_offset)) - blk_data_offset;
+		blk_data_length = data_base + (ptrs ? ptrs[blk_nr + 1]
+			: __le32_to_cpu(*(__le32*)(desc->de_image + blk_ptr_offset)))
+			- blk_data_offset;
 		
-		if (blk_data_length > desc->de_decompressionbufsz) {
+		const __u64 blk_size = i_blksz(inode_sz, blk_nr, blksz);
+		
+		if (framesz < blk_size && blk_data_length != 0) {
+			/* The sub-frames are checked one by one, the block as a
+			 * whole is never decompressed.
+			 */
+			ck_frames(desc, codec, blk_data_offset, blk_data_length,
+				blk_size, framesz,
+				inode_data ? inode_data + inode_data_offset : NULL);
+			
+			ck_blkdata(desc, imgd, blk_data_offset, blk_data_length);
+			
+			checked = blk_size;
+			blk_data_offset += blk_data_length;
+			inode_data_offset += blk_size;
+		} else if (blk_data_length > desc->de_decompressionbufsz) {
 			error("the block data length is too big:"
 				" unchecked=%llu, blk_nr=%llu, blk_ptrs=%llu,"
 				" blk_data_length=%llu, de_decompressionbufsz=%llu,"
@@ -357,32 +743,31 @@ static void ck_compression(struct imgdesc* const desc,
 				(__u32)blk_ptr_offset, (__u32)blk_data_offset,
 				(__u32)inode_data_offset, (__u32)inode_offset,
 				inode_sz);
+		} else if (blk_data_length == 0 && zero_blks) {
+			/* The extracted file has already been truncated to its
+			 * full size, skipping the block leaves a real hole.
+			 */
+			checked = blk_size;
+			inode_data_offset += checked;
 		} else if (blk_data_length == 0) {
 			error("zero block data length at 0x%x", (__u32)blk_data_offset);
 		} else {
-			__u32 decompressionbufsz = desc->de_decompressionbufsz;
-			
-			int implerr = 0;
-			int err = desc->de_lib->hl_decompress(desc->de_lib_data,
-				desc->de_decompressionbuf, &decompressionbufsz,
-				desc->de_image + blk_data_offset, blk_data_length,
-				&implerr);
-			if (err < 0) {
-				error("decompression failed: %s",
-					desc->de_lib->hl_strerror(desc->de_lib_data, implerr));
-			}
+			/* A block is stored uncompressed if its data length is
+			 * equal to its size.
+			 */
+			__u32 decompressionbufsz = ck_block(desc, codec, blk_data_offset,
+				blk_data_length, stored_blks && blk_data_length == blk_size);
 			
 			if (inode_data) {
 				memcpy(inode_data + inode_data_offset,
 					desc->de_decompressionbuf, decompressionbufsz);
 			}
 			
+			ck_blkdata(desc, imgd, blk_data_offset, blk_data_length);
+			
 			checked = decompressionbufsz;
 			blk_data_offset += blk_data_length;
 			inode_data_offset += decompressionbufsz;
-			
-			desc->de_datasz += blk_data_length;
-			imgd->d_rawsz += blk_data_length;
 		}
 		
 		blk_nr += 1;
@@ -397,7 +782,20 @@ static void ck_compression(struct imgdesc* const desc,
 		} else
 			unchecked -= checked;
 		
-	} while (unchecked);
+		if (extents && unchecked) {
+			blk_data_offset = data_base
+				+ __le32_to_cpu(*(__le32*)(desc->de_image + blk_ptr_offset));
+			blk_ptr_offset += blk_ptr_length;
+		}
+	}
+	
+	free(ptrs);
+	
+	if (tail_sz) {
+		ck_fragment(desc, __le32_to_cpu(inode->i_offset) + blk_ptrs_totalsz
+			- sizeof(struct microfs_fragment),
+			inode_data ? inode_data + inode_data_offset : NULL, tail_sz);
+	}
 	
 	if (hostprog_stack_push(desc->de_datastack, imgd) < 0)
 		error("failed to push an entry to the data file stack: %s",
@@ -415,7 +813,8 @@ static void ck_file(struct imgdesc* const desc,
 			path->p_path + desc->de_extractdirlen, (__u32)offset);
 	
 	__u64 i_offset = __le32_to_cpu(inode->i_offset);
-	if (i_offset < offset + next)
+	__u64 i_inline = ck_inlinesz(desc, inode);
+	if (i_inline ? i_offset != offset + next - i_inline : i_offset < offset + next)
 		error("invalid offset for file \"%s\" at 0x%x",
 			path->p_path + desc->de_extractdirlen, (__u32)offset);
 	
@@ -460,7 +859,8 @@ static void ck_symlink(struct imgdesc* const desc,
 			path->p_path + desc->de_extractdirlen, (__u32)offset);
 	
 	__u64 i_offset = __le32_to_cpu(inode->i_offset);
-	if (i_offset < offset + next)
+	__u64 i_inline = ck_inlinesz(desc, inode);
+	if (i_inline ? i_offset != offset + next - i_inline : i_offset < offset + next)
 		error("invalid offset for symlink \"%s\" at 0x%x",
 			path->p_path + desc->de_extractdirlen, (__u32)offset);
 	
@@ -585,6 +985,103 @@ static void ck_metadata(struct imgdesc* const desc,
 	}
 }
 
+/* Check the hashed index of a non-empty directory, %dentries
+ * holds the %count dentry offsets (relative to the first dentry)
+ * in ascending order.
+ */
+static void ck_dirindex(struct imgdesc* const desc,
+	const struct microfs_inode* const inode,
+	const __u32* const dentries, const __u32 count)
+{
+	const __u64 dir_offset = __le32_to_cpu(inode->i_offset);
+	const __u64 dir_size = i_getsize(inode);
+	const __u64 offset = microfs_dirindex_offset(dir_offset, dir_size);
+	
+	if (offset + sizeof(struct microfs_dirindex) > desc->de_outersz)
+		error("directory index at 0x%x is out of bounds", (__u32)offset);
+	
+	const struct microfs_dirindex* index = (struct microfs_dirindex*)
+		(desc->de_image + offset);
+	const __u32 buckets = __le32_to_cpu(index->di_buckets);
+	const __u32 entries = __le32_to_cpu(index->di_entries);
+	
+	if (entries != count) {
+		error("directory index at 0x%x has %u entries, expected %u",
+			(__u32)offset, entries, count);
+	}
+	if (buckets != microfs_dirindex_buckets(entries)) {
+		error("directory index at 0x%x has %u buckets, expected %u",
+			(__u32)offset, buckets, microfs_dirindex_buckets(entries));
+	}
+	
+	const __u32 size = microfs_dirindex_size(entries);
+	if (offset + size > desc->de_outersz)
+		error("directory index at 0x%x is out of bounds", (__u32)offset);
+	
+	const __le32* bucket = (const __le32*)(index + 1);
+	const struct microfs_dirindex_entry* entry =
+		(const struct microfs_dirindex_entry*)(bucket + buckets + 1);
+	
+	if (__le32_to_cpu(bucket[0]) != 0 || __le32_to_cpu(bucket[buckets]) != entries)
+		error("directory index at 0x%x has bad bucket bounds", (__u32)offset);
+	
+	char* seen = calloc(count, 1);
+	if (!seen)
+		error("failed to allocate the directory index check buffer");
+	
+	for (__u32 b = 0; b < buckets; b++) {
+		const __u32 start = __le32_to_cpu(bucket[b]);
+		const __u32 end = __le32_to_cpu(bucket[b + 1]);
+		if (start > end || end > entries) {
+			error("directory index at 0x%x has a bad bucket %u: %u-%u",
+				(__u32)offset, b, start, end);
+		}
+		for (__u32 i = start; i < end; i++) {
+			const __u32 hash = __le32_to_cpu(entry[i].de_hash);
+			const __u32 de_offset = __le32_to_cpu(entry[i].de_offset);
+			
+			/* Find the dentry the entry points to.
+			 */
+			__u32 lo = 0;
+			__u32 hi = count;
+			while (lo < hi) {
+				__u32 mid = lo + (hi - lo) / 2;
+				if (dentries[mid] < de_offset)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo == count || dentries[lo] != de_offset) {
+				error("directory index entry at 0x%x does not point to"
+					" a dentry: 0x%x", (__u32)offset, de_offset);
+			}
+			if (seen[lo]++) {
+				error("directory index at 0x%x has more than one entry"
+					" for the dentry at 0x%x", (__u32)offset,
+					(__u32)(dir_offset + de_offset));
+			}
+			
+			const struct microfs_inode* dentry = (struct microfs_inode*)
+				(desc->de_image + dir_offset + de_offset);
+			const __u32 expected = microfs_namehash((const char*)(dentry + 1),
+				dentry->i_namelen);
+			if (hash != expected) {
+				error("directory index entry for the dentry at 0x%x has"
+					" a bad hash: 0x%x, expected 0x%x",
+					(__u32)(dir_offset + de_offset), hash, expected);
+			}
+			if ((hash & (buckets - 1)) != b) {
+				error("directory index entry for the dentry at 0x%x is"
+					" in the wrong bucket: %u", (__u32)(dir_offset + de_offset), b);
+			}
+		}
+	}
+	
+	free(seen);
+	
+	desc->de_metadatasz += offset - (dir_offset + dir_size) + size;
+}
+
 static void ck_dir(struct imgdesc* const desc,
 	const struct microfs_inode* const inode,
 	struct hostprog_path* const path)
@@ -600,6 +1097,20 @@ static void ck_dir(struct imgdesc* const desc,
 	
 	unsigned char prev_name0 = '\0';
 	
+	const int dirindex = dir_size > 0 &&
+		(__le32_to_cpu(desc->de_sb->s_flags) & MICROFS_FLAG_DIRINDEX);
+	
+	__u32* dentries = NULL;
+	__u32 dentries_count = 0;
+	if (dirindex) {
+		/* There can not be more dentries than this.
+		 */
+		dentries = malloc(dir_size / (sizeof(struct microfs_inode) + 1)
+			* sizeof(*dentries));
+		if (!dentries)
+			error("failed to allocate the dentry offsets");
+	}
+	
 	while (dir_offset < dir_size) {
 		struct microfs_inode* dentry = (struct microfs_inode*)
 			(desc->de_image + offset);
@@ -620,7 +1131,7 @@ static void ck_dir(struct imgdesc* const desc,
 			error("failed to add \"%s\" to the path", name);
 		
 		mode_t mode = __le16_to_cpu(dentry->i_mode);
-		__u64 next = sizeof(*dentry) + namelen;
+		__u64 next = i_dentrysz(dentry, __le32_to_cpu(desc->de_sb->s_flags));
 		
 		message(VERBOSITY_1, " ck %c %s (0x%x)",
 			nodtype(mode), path->p_path + desc->de_extractdirlen,
@@ -650,6 +1161,9 @@ static void ck_dir(struct imgdesc* const desc,
 		
 		ck_metadata(desc, dentry, offset, path);
 		
+		if (dentries)
+			dentries[dentries_count++] = dir_offset;
+		
 		offset += next;
 		dir_offset += next;
 		desc->de_metadatasz += next;
@@ -659,6 +1173,11 @@ static void ck_dir(struct imgdesc* const desc,
 		hostprog_path_dirnamelvl(path, dir_lvl);
 	}
 	
+	if (dentries) {
+		ck_dirindex(desc, inode, dentries, dentries_count);
+		free(dentries);
+	}
+	
 	free(namebuf);
 }
 
@@ -670,6 +1189,48 @@ static int imgdataoffsetcmp(const void* d1, const void* d2)
 		- (int)(*(const struct imgdata**)d2)->d_offset;
 }
 
+/* Comparison callback for %qsort().
+ */
+static int imgblkoffsetcmp(const void* b1, const void* b2)
+{
+	const struct imgblk* blk1 = b1;
+	const struct imgblk* blk2 = b2;
+	return blk1->b_offset < blk2->b_offset ? -1 : blk1->b_offset > blk2->b_offset;
+}
+
+/* Account for the data of the blocks of all files, each block is
+ * counted once no matter how many files share it. Blocks which
+ * data overlaps without being the same are not shared properly.
+ */
+static void ck_blks(struct imgdesc* const desc)
+{
+	if (!desc->de_nblks)
+		return;
+	
+	qsort(desc->de_blks, desc->de_nblks, sizeof(*desc->de_blks),
+		imgblkoffsetcmp);
+	
+	__u64 end = 0;
+	for (__u64 i = 0; i < desc->de_nblks; i++) {
+		const struct imgblk* blk = &desc->de_blks[i];
+		if (i && blk->b_offset == blk[-1].b_offset) {
+			if (blk->b_length != blk[-1].b_length)
+				error("strange block share at 0x%llx: %llu != %llu bytes",
+					blk->b_offset, blk->b_length, blk[-1].b_length);
+			continue;
+		}
+		if (blk->b_offset < end)
+			error("the block data at 0x%llx overlaps the block data"
+				" before it", blk->b_offset);
+		end = blk->b_offset + blk->b_length;
+		desc->de_datasz += blk->b_length;
+	}
+	
+	free(desc->de_blks);
+	desc->de_blks = NULL;
+	desc->de_nblks = 0;
+}
+
 static void ck_desc(struct imgdesc* const desc)
 {
 	const int files = hostprog_stack_size(desc->de_datastack);
@@ -690,8 +1251,23 @@ static void ck_desc(struct imgdesc* const desc)
 		}
 	}
 	
+	ck_blks(desc);
+	
+	/* The fragment table and the fragment blocks are shared by
+	 * all files with a tail, they are accounted for once.
+	 */
+	if (desc->de_fragptrlast) {
+		const __u64 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
+		desc->de_metadatasz += desc->de_fragptrlast - desc->de_fragptrfirst
+			+ 2 * blk_ptr_length;
+		desc->de_datasz += __le32_to_cpu(*(__le32*)(desc->de_image
+			+ desc->de_fragptrlast + blk_ptr_length))
+			- __le32_to_cpu(*(__le32*)(desc->de_image + desc->de_fragptrfirst));
+	}
+	
 	__u32 de_files = desc->de_inodes;
-	__u32 sb_files = __le16_to_cpu(desc->de_sb->s_files);
+	__u32 sb_files = desc->de_lsb ? __le32_to_cpu(desc->de_lsb->sl_files)
+		: __le16_to_cpu(desc->de_sb->s_files);
 	if (de_files != sb_files) {
 		error("file count mismatch: ck=%u, sb=%u",
 			de_files, sb_files);
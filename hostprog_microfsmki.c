@@ -26,9 +26,96 @@
 #include "dev.h"
 #include "devtable.h"
 
+#include <pthread.h>
+
 /* getopt() args, see usage().
  */
-#define MKI_OPTIONS "hvepqsZSb:u:n:c:D:l:"
+#define MKI_OPTIONS "hvepqsirfIzkLxZSb:B:F:u:n:c:D:l:m:j:"
+
+/* Max number of compression threads, see -j.
+ */
+#define MKI_MAXTHREADS 256
+
+/* Number of jobs queued ahead for each compression thread.
+ */
+#define MKI_THREADJOBS 4
+
+/* Size of the buffer used to hash a file, see find_duplicates().
+ */
+#define MKI_HASHBUFSZ 65536
+
+/* The samples used to train a dictionary are at most this many
+ * times bigger than the dictionary, see train_dictionary().
+ */
+#define MKI_DICTSAMPLES 100
+
+/* Select the compression library named by %cr_lib for the files
+ * which paths match %cr_pattern.
+ */
+struct codecrule {
+	/* Library name. */
+	const char* cr_lib;
+	/* Pattern for %fnmatch(). */
+	const char* cr_pattern;
+};
+
+/* Use blocks of %br_blksz bytes for the files which paths match
+ * %br_pattern.
+ */
+struct blkszrule {
+	/* Block size. */
+	__u64 br_blksz;
+	/* Pattern for %fnmatch(). */
+	const char* br_pattern;
+};
+
+/* A block of a file, used to find the blocks which are shared
+ * between files, see find_sharedblks().
+ */
+struct blkref {
+	/* Hash of the uncompressed block. */
+	__u64 br_hash;
+	/* Entry that the block belongs to. */
+	struct entry* br_ent;
+	/* Offset of the block in the file. */
+	__u64 br_offset;
+	/* Size of the block. */
+	__u32 br_size;
+	/* Is the block a hole (in which case it is never shared)? */
+	int br_hole;
+	/* Block which data is used instead (NULL if none). */
+	const struct blkref* br_same;
+	/* Worst-case offset of the block data, relative to the data
+	 * of the first file.
+	 */
+	__u64 br_worstoffset;
+	/* Start of the block data, set by pack_data(). */
+	__u64 br_start;
+	/* End of the block data, set by pack_data(). */
+	__u64 br_end;
+};
+
+/* Samples of the data compressed by the primary library, see
+ * train_dictionary().
+ */
+struct dictsamples {
+	/* Samples, stored back to back. */
+	char* ds_data;
+	/* Number of bytes used in %ds_data. */
+	__u64 ds_datasz;
+	/* Size of %ds_data. */
+	__u64 ds_maxdatasz;
+	/* Size of each sample. */
+	size_t* ds_sizes;
+	/* Number of samples. */
+	__u32 ds_nsamples;
+	/* Number of slots in %ds_sizes. */
+	__u32 ds_maxsamples;
+	/* Every %ds_stride sub-frame (or block) is sampled. */
+	__u64 ds_stride;
+	/* Number of sub-frames (or blocks) seen so far. */
+	__u64 ds_frames;
+};
 
 /* Simple representation of an inode/dentry.
  */
@@ -47,6 +134,18 @@ struct entry {
 	__u64 e_size;
 	/* Block pointers required for for the entry (if reg or lnk). */
 	__u32 e_blkptrs;
+	/* Compression library used for the blocks (if reg or lnk). */
+	const struct hostprog_codec* e_codec;
+	/* Block size used for the data (if reg or lnk). */
+	__u64 e_blksz;
+	/* Left shift for %e_blksz. */
+	__u64 e_blkshift;
+	/* Sub-frame size used for the blocks (if reg or lnk). */
+	__u64 e_framesz;
+	/* Left shift for %e_framesz. */
+	__u64 e_frameshift;
+	/* Width of the packed block data lengths (zero if not packed). */
+	__u64 e_lenbits;
 	/* File descriptor used when mapping the entry. */
 	int e_fd;
 	/* Uncompressed file data. */
@@ -55,12 +154,118 @@ struct entry {
 	__u64 e_ioffset;
 	/* Offset of the data. */
 	__u64 e_dataoffset;
+	/* Fragment block holding the tail (if the entry has one). */
+	__u32 e_fragblk;
+	/* Offset of the tail in the fragment block. */
+	__u32 e_fragoffset;
+	/* Has the tail been given a place in a fragment block? */
+	int e_fragpacked;
 	/* First child for an non-empty directory. */
 	struct entry* e_firstchild;
 	/* Next sibling in the directory that contains this entry. */
 	struct entry* e_sibling;
 	/* Linked list of other entries with the same file content. */
 	struct entry* e_same;
+	/* Has the entry been queued for write_data()? */
+	int e_queued;
+	/* Device of the file, used to find hard links. */
+	dev_t e_dev;
+	/* Inode of the file, used to find hard links. */
+	ino_t e_ino;
+	/* Hash of the file content (if needed to find duplicates). */
+	__u64 e_hash;
+	/* Position of the entry in %sp_regstack as it was pushed. */
+	__u64 e_regnr;
+	/* Blocks of the file (if they can be shared). */
+	struct blkref* e_blkrefs;
+};
+
+/* A block, a sub-frame of a block or a fragment block to be
+ * compressed by the packer, see packer_get().
+ */
+struct packjob {
+	/* Library used for the data, indexed by %microfs_codecidx(). */
+	int pj_codec;
+	/* Data to compress. */
+	char* pj_input;
+	/* Number of bytes at %pj_input. */
+	__u32 pj_inputsz;
+	/* Check if the data is all zeros before compressing it? */
+	int pj_holes;
+	/* Is the data all zeros (in which case it is not compressed)? */
+	int pj_hole;
+	/* Compressed data, room for %sp_compressionbufsz bytes. */
+	char* pj_output;
+	/* Number of bytes at %pj_output. */
+	__u32 pj_outputsz;
+	/* Result of the compression. */
+	int pj_err;
+	/* Library specific error. */
+	int pj_implerr;
+	/* Has the job been done? */
+	int pj_done;
+};
+
+/* A compression thread and its own instances of the libraries.
+ */
+struct packthread {
+	/* The thread. */
+	pthread_t pt_thread;
+	/* The packer that the thread belongs to. */
+	struct packer* pt_packer;
+	/* Libraries in use, indexed by %microfs_codecidx(). */
+	struct hostprog_codec pt_codecs[MICROFS_MAXCODECS];
+};
+
+/* Compresses the data of the image on %pk_nthreads threads. The
+ * jobs are queued in the order that the data is written to the
+ * image and the writer takes them off the queue in that same
+ * order, which is why the image is identical no matter how many
+ * threads are used.
+ */
+struct packer {
+	/* Protects the job counters and %pj_done. */
+	pthread_mutex_t pk_mutex;
+	/* Signaled when a job is queued or the threads should exit. */
+	pthread_cond_t pk_queuedcond;
+	/* Signaled when a job is done. */
+	pthread_cond_t pk_donecond;
+	/* Ring of jobs. */
+	struct packjob* pk_jobs;
+	/* Number of jobs in %pk_jobs. */
+	__u64 pk_njobs;
+	/* Size of the output buffer of each job. */
+	__u64 pk_jobsz;
+	/* Next job for the writer (the counters grow forever, the
+	 * slot of a job is the counter modulo %pk_njobs).
+	 */
+	__u64 pk_head;
+	/* Next job for the threads. */
+	__u64 pk_next;
+	/* Next job to queue. */
+	__u64 pk_tail;
+	/* Compression threads (none if the writer compresses). */
+	struct packthread* pk_threads;
+	/* Number of threads in %pk_threads. */
+	__u64 pk_nthreads;
+	/* Tell the threads to exit? */
+	int pk_exit;
+	/* Entries which data is written, in order. */
+	struct hostprog_stack* pk_ents;
+	/* Entry that the writer is at. */
+	__u64 pk_written;
+	/* Entry that jobs are queued for. */
+	__u64 pk_ent;
+	/* Has %pk_ent been loaded? */
+	int pk_entloaded;
+	/* Offset of the next block of %pk_ent to queue. */
+	__u64 pk_blkoffset;
+	/* Next sub-frame of that block to queue. */
+	__u64 pk_frame;
+	/* Next fragment block to queue. */
+	__u64 pk_frag;
+	/* Are the fragment blocks complete (so that they can be queued)? */
+	int pk_fragready;
 };
 
 /* Specification for the image.
@@ -74,10 +279,12 @@ struct imgspec {
 	const char* sp_name;
 	/* Device table file. */
 	const char* sp_devtable;
-	/* Buffer used for compressing blocks. */
-	char* sp_compressionbuf;
-	/* Size of sp_compressionbuf. */
+	/* Size of the buffer used for compressing a block. */
 	__u64 sp_compressionbufsz;
+	/* Number of threads used to hash and compress the data. */
+	__u64 sp_threads;
+	/* Compresses the data, see write_data(). */
+	struct packer* sp_packer;
 	/* Image file descriptor when writing the file. */
 	int sp_fd;
 	/* Pad the image? */
@@ -88,6 +295,34 @@ struct imgspec {
 	int sp_incsocks;
 	/* Make everything owned by root. */
 	int sp_squashperms;
+	/* Write a hashed index for each directory. */
+	int sp_dirindex;
+	/* Store blocks that do not compress uncompressed. */
+	int sp_storedblocks;
+	/* Pack the tails of files into shared fragment blocks. */
+	int sp_fragments;
+	/* Store the data of tiny files and symlinks in their dentries. */
+	int sp_inlinedata;
+	/* Store blocks of zeros as holes. */
+	int sp_zeroblocks;
+	/* Pack the block pointers of each file. */
+	int sp_packedblkptrs;
+	/* Allow the image to be bigger than MICROFS_MAXIMGSIZE. */
+	int sp_largeimage;
+	/* Share identical blocks between files. */
+	int sp_sharedblks;
+	/* Compress the data against a dictionary. */
+	int sp_dictionary;
+	/* Number of fragment blocks. */
+	__u64 sp_fragblks;
+	/* Number of bytes used in each fragment block. */
+	__u32* sp_fragused;
+	/* Uncompressed fragment blocks, filled by pack_data(). */
+	char* sp_fragdata;
+	/* Offset of the fragment table. */
+	__u64 sp_fragtable;
+	/* Offset of the first fragment block. */
+	__u64 sp_fragbase;
 	/* Host page size. */
 	__u64 sp_pagesz;
 	/* Left shift for the block size. */
@@ -100,6 +335,8 @@ struct imgspec {
 	__u64 sp_regnodes;
 	/* Identical regular files. */
 	__u64 sp_duplicatenodes;
+	/* Blocks which data is shared with another block. */
+	__u64 sp_sharedblkcount;
 	/* Special files. */
 	__u64 sp_specnodes;
 	/* Skipped files. */
@@ -128,6 +365,18 @@ struct imgspec {
 	void* sp_lib_data;
 	/* Library cmd line options. */
 	char* sp_lib_options;
+	/* Libraries in use, indexed by %microfs_codecidx(). */
+	struct hostprog_codec sp_codecs[MICROFS_MAXCODECS];
+	/* Rules used to select the library of each file. */
+	struct codecrule* sp_codecrules;
+	/* Number of rules in %sp_codecrules. */
+	__u64 sp_ncodecrules;
+	/* Rules used to select the block size of each file. */
+	struct blkszrule* sp_blkszrules;
+	/* Number of rules in %sp_blkszrules. */
+	__u64 sp_nblkszrules;
+	/* Sub-frame size for bigger blocks (zero if none). */
+	__u64 sp_framesz;
 };
 
 /* Set the uid or gid for the given entry and check for
@@ -161,32 +410,176 @@ static size_t namelen(const char* const name)
 	return namelen;
 }
 
+/* Get the number of bytes of data that %ent stores inline in
+ * its dentry.
+ */
+static inline __u32 entry_inlinesz(const struct imgspec* const spec,
+	const struct entry* const ent)
+{
+	return i_inlinesz(spec->sp_inlinedata ? MICROFS_FLAG_INLINEDATA : 0,
+		ent->e_mode, ent->e_size);
+}
+
+/* Get the given %path relative to the root directory.
+ */
+static const char* relative_path(const struct imgspec* const spec,
+	const char* const path)
+{
+	const char* relpath = path + strlen(spec->sp_rootdir);
+	while (*relpath == '/')
+		relpath++;
+	return relpath;
+}
+
+/* Determine if the block pointers of each file are preceded by
+ * a file info word, see %i_hasfileinfo().
+ */
+static inline int spec_fileinfo(const struct imgspec* const spec)
+{
+	return spec->sp_ncodecrules || spec->sp_nblkszrules || spec->sp_framesz
+		|| spec->sp_packedblkptrs || spec->sp_largeimage || spec->sp_sharedblks;
+}
+
+/* Get the number of bytes of decompressor data that %lib has
+ * in the image, see %libinfo_ddsz().
+ */
+static inline __u32 spec_ddsz(const struct imgspec* const spec,
+	const struct hostprog_lib* const lib)
+{
+	return libinfo_ddsz(lib->hl_info,
+		spec->sp_dictionary ? MICROFS_FLAG_DICTIONARY : 0);
+}
+
+/* Get the number of bytes that precede the block pointers of
+ * each file, see %i_fileinfosz().
+ */
+static inline __u32 spec_fileinfosz(const struct imgspec* const spec)
+{
+	return (spec_fileinfo(spec) ? sizeof(__le32) : 0)
+		+ (spec->sp_largeimage ? sizeof(__le64) : 0);
+}
+
+/* Get the library used for the data of the file at %path, the
+ * first rule which pattern matches the path (relative to the
+ * root directory) decides it.
+ */
+static const struct hostprog_codec* select_codec(const struct imgspec* const spec,
+	const char* const path)
+{
+	const char* relpath = relative_path(spec, path);
+	
+	for (__u64 i = 0; i < spec->sp_ncodecrules; i++) {
+		const struct codecrule* rule = &spec->sp_codecrules[i];
+		if (fnmatch(rule->cr_pattern, relpath, 0) == 0) {
+			const struct hostprog_lib* lib = hostprog_lib_find_byname(rule->cr_lib);
+			return &spec->sp_codecs[microfs_codecidx(lib->hl_info->li_id)];
+		}
+	}
+	return &spec->sp_codecs[microfs_codecidx(spec->sp_lib->hl_info->li_id)];
+}
+
+/* Set the block size used for the data of %ent, the first rule
+ * which pattern matches its path decides it. The block size of
+ * the image is used if no rule matches.
+ */
+static void select_blksz(const struct imgspec* const spec,
+	struct entry* const ent)
+{
+	const char* relpath = relative_path(spec, ent->e_path);
+	
+	ent->e_blksz = spec->sp_blksz;
+	for (__u64 i = 0; i < spec->sp_nblkszrules; i++) {
+		if (fnmatch(spec->sp_blkszrules[i].br_pattern, relpath, 0) == 0) {
+			ent->e_blksz = spec->sp_blkszrules[i].br_blksz;
+			break;
+		}
+	}
+	
+	ent->e_blkshift = 0;
+	for (__u64 blksz = ent->e_blksz; blksz > 1; blksz >>= 1)
+		ent->e_blkshift++;
+	
+	/* Blocks bigger than the sub-frame size are split into
+	 * sub-frames, smaller blocks are left as they are.
+	 */
+	ent->e_framesz = ent->e_blksz;
+	ent->e_frameshift = ent->e_blkshift;
+	if (spec->sp_framesz && spec->sp_framesz < ent->e_blksz) {
+		ent->e_framesz = spec->sp_framesz;
+		ent->e_frameshift = 0;
+		for (__u64 framesz = ent->e_framesz; framesz > 1; framesz >>= 1)
+			ent->e_frameshift++;
+	}
+	
+	if (ent->e_codec->hc_lib->hl_info->li_min_blksz == 0
+			&& ent->e_framesz < spec->sp_pagesz) {
+		warning("block size of \"%s\" smaller than page size of host"
+			" - the resulting image can not be used on this host",
+			ent->e_path);
+	}
+}
+
+/* Get the worst-case size of the data of a block of %ent. A
+ * block split into sub-frames can get bigger than a block that
+ * is not, because of its sub-frame index and because each of
+ * its sub-frames can compress to its worst-case size.
+ */
+static __u64 entry_blkupperbound(const struct entry* const ent)
+{
+	const struct hostprog_codec* codec = ent->e_codec;
+	const __u64 blkub = codec->hc_lib->hl_upperbound(codec->hc_lib_data,
+		ent->e_blksz);
+	const __u64 frames = i_blks(ent->e_blksz, ent->e_framesz);
+	const __u64 frameub = i_frameidxsz(ent->e_blksz, ent->e_framesz)
+		+ codec->hc_lib->hl_upperbound(codec->hc_lib_data, ent->e_framesz)
+			* frames;
+	return frames > 1 && frameub > blkub ? frameub : blkub;
+}
+
 /* Update the upperbound image size for the given spec and
- * get the size of the of the inode and its name in return,
- * which is handy for updating the size of a directory entry.
+ * get the size of the of the inode, its name and its inline
+ * data in return, which is handy for updating the size of a
+ * directory entry.
  */
 static __u64 update_upperbound(struct imgspec* const spec,
 	struct entry* const ent, __u64 namelen)
 {
-	const __u64 inodesz = sizeof(struct microfs_inode) + namelen;
+	const __u64 inodesz = sizeof(struct microfs_inode) + namelen
+		+ entry_inlinesz(spec, ent);
 	spec->sp_upperbound += inodesz;
-	if ((S_ISREG(ent->e_mode) || S_ISLNK(ent->e_mode)) && ent->e_size) {
+	if (entry_inlinesz(spec, ent)) {
+		spec->sp_datasz += ent->e_size;
+	} else if ((S_ISREG(ent->e_mode) || S_ISLNK(ent->e_mode)) && ent->e_size) {
 		/* The size of a compressed file can never get bigger than
 		 * it would be if all its blocks would compress to their
 		 * worst-case sizes. (Most likely this will rarely happen
 		 * "naturally", but sometimes it is okay to be a pessimist.)
 		 */
-		const __u64 blks = i_blks(ent->e_size, spec->sp_blksz);
-		ent->e_blkptrs = blks + 1;
+		const __u64 blks = i_ptrblks(ent->e_size, ent->e_blksz,
+			spec->sp_fragments);
+		if (spec->sp_packedblkptrs) {
+			/* The block data lengths must be as wide as it takes to
+			 * hold the worst-case length, as the block pointers are
+			 * laid out before any data is compressed.
+			 */
+			ent->e_lenbits = 0;
+			for (__u64 ub = entry_blkupperbound(ent); ub > 0; ub >>= 1)
+				ent->e_lenbits++;
+		}
+		ent->e_blkptrs = i_blkptrsz(ent->e_size, ent->e_blksz,
+			spec->sp_fragments, spec_fileinfosz(spec), ent->e_lenbits)
+			/ (MICROFS_IOFFSET_WIDTH / 8);
 		spec->sp_blkptrs += ent->e_blkptrs;
 		spec->sp_datasz += ent->e_size;
 		spec->sp_realdatasz += ent->e_size;
 		spec->sp_upperbound += (MICROFS_IOFFSET_WIDTH / 8) * ent->e_blkptrs
-			+ spec->sp_lib->hl_upperbound(spec->sp_lib_data, spec->sp_blksz) * blks;
+			+ entry_blkupperbound(ent) * blks;
 	}
 	
-	if (++spec->sp_files > MICROFS_MAXFILES)
-		error("too many files, the upper limit is %llu", MICROFS_MAXFILES);
+	const __u64 maxfiles = spec->sp_largeimage
+		? MICROFS_MAXLARGEFILES : MICROFS_MAXFILES;
+	if (++spec->sp_files > maxfiles)
+		error("too many files, the upper limit is %llu", maxfiles);
 	
 	return inodesz;
 }
@@ -284,6 +677,8 @@ static unsigned int walk_directory(struct imgspec* const spec,
 		ent->e_mode = st.st_mode;
 		ent->e_size = st.st_size;
 		ent->e_fd = -1;
+		ent->e_dev = st.st_dev;
+		ent->e_ino = st.st_ino;
 		
 		ENTRY_SET_XID(spec, ent, e_uid, st.st_uid, MICROFS_IUID_WIDTH);
 		ENTRY_SET_XID(spec, ent, e_gid, st.st_gid, MICROFS_IGID_WIDTH);
@@ -304,7 +699,10 @@ static unsigned int walk_directory(struct imgspec* const spec,
 				error("failed to copy the entry path for \"%s\"",
 					path->p_path);
 			}
-			if (spec->sp_shareblocks) {
+			ent->e_codec = select_codec(spec, path->p_path);
+			select_blksz(spec, ent);
+			if (spec->sp_shareblocks && !entry_inlinesz(spec, ent)) {
+				ent->e_regnr = spec->sp_regstack->st_index;
 				if (hostprog_stack_push(spec->sp_regstack, ent) < 0)
 					error("failed to push an entry to the regular file stack: %s",
 						strerror(errno));
@@ -372,18 +770,42 @@ static void write_superblock(struct imgspec* const spec, char* base,
 {
 	__u64 padding = superblock_offset(spec);
 	__u64 offset = padding + sizeof(struct microfs_sb)
-		+ spec->sp_lib->hl_info->li_dd_sz;
+		+ (spec->sp_largeimage ? sizeof(struct microfs_sb_large) : 0)
+		+ spec_ddsz(spec, spec->sp_lib);
+	__u32 codecs = 0;
+	
+	for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+		const struct hostprog_lib* lib = spec->sp_codecs[i].hc_lib;
+		if (lib && lib != spec->sp_lib) {
+			offset += spec_ddsz(spec, lib);
+			codecs |= lib->hl_info->li_id;
+		}
+	}
 	
 	struct microfs_sb* sb = (struct microfs_sb*)(base + padding);
 	
+	const __u64 blocks = (sz - 1) / spec->sp_blksz + 1;
+	
+	/* The sizes of a large image are given by the superblock
+	 * extension, the ones in the superblock are saturated.
+	 */
 	sb->s_magic = __cpu_to_le32(MICROFS_MAGIC);
-	sb->s_size = sz == MICROFS_MAXIMGSIZE ? 0 : __cpu_to_le32(sz);
+	sb->s_size = sz >= MICROFS_MAXIMGSIZE ? 0 : __cpu_to_le32(sz);
 	sb->s_crc = 0;
-	sb->s_blocks = __cpu_to_le32((sz - 1) / spec->sp_blksz + 1);
-	sb->s_files = __cpu_to_le16(spec->sp_files);
+	sb->s_blocks = __cpu_to_le32(blocks > UINT32_MAX ? UINT32_MAX : blocks);
+	sb->s_files = __cpu_to_le16(spec->sp_files > MICROFS_MAXFILES
+		? MICROFS_MAXFILES : spec->sp_files);
 	sb->s_blkshift = __cpu_to_le16(spec->sp_blkshift);
-	
-	if (sb->s_size == 0) {
+	sb->s_codecs = __cpu_to_le16(codecs >> 8);
+	
+	if (spec->sp_largeimage) {
+		struct microfs_sb_large* lsb = (struct microfs_sb_large*)(sb + 1);
+		lsb->sl_size = __cpu_to_le64(sz);
+		lsb->sl_blocks = __cpu_to_le64(blocks);
+		lsb->sl_fragbase = __cpu_to_le64(spec->sp_fragbase);
+		lsb->sl_files = __cpu_to_le32(spec->sp_files);
+		lsb->sl_future = 0;
+	} else if (sb->s_size == 0) {
 		warning("this image is exactly %llu bytes (as big as is possible),"
 			" this special case is not well tested", MICROFS_MAXIMGSIZE);
 	}
@@ -395,6 +817,30 @@ static void write_superblock(struct imgspec* const spec, char* base,
 	sb->s_ctime = __cpu_to_le32(nowish.tv_sec);
 	
 	__u32 flags = spec->sp_lib->hl_info->li_id;
+	if (spec->sp_dirindex)
+		flags |= MICROFS_FLAG_DIRINDEX;
+	if (spec->sp_storedblocks)
+		flags |= MICROFS_FLAG_STOREDBLOCKS;
+	if (spec->sp_fragments)
+		flags |= MICROFS_FLAG_FRAGMENTS;
+	if (spec->sp_inlinedata)
+		flags |= MICROFS_FLAG_INLINEDATA;
+	if (spec->sp_zeroblocks)
+		flags |= MICROFS_FLAG_ZEROBLOCKS;
+	if (spec->sp_ncodecrules)
+		flags |= MICROFS_FLAG_MIXEDCODECS;
+	if (spec->sp_nblkszrules)
+		flags |= MICROFS_FLAG_FILEBLKSZ;
+	if (spec->sp_framesz)
+		flags |= MICROFS_FLAG_SUBFRAMES;
+	if (spec->sp_packedblkptrs)
+		flags |= MICROFS_FLAG_PACKEDBLKPTRS;
+	if (spec->sp_largeimage)
+		flags |= MICROFS_FLAG_LARGEIMAGE;
+	if (spec->sp_sharedblks)
+		flags |= MICROFS_FLAG_SHAREDBLKS;
+	if (spec->sp_dictionary)
+		flags |= MICROFS_FLAG_DICTIONARY;
 	
 	sb->s_flags = __cpu_to_le32(flags);
 	
@@ -417,12 +863,154 @@ static void write_superblock(struct imgspec* const spec, char* base,
 	message(VERBOSITY_0, "CRC: %x", crc);
 }
 
-/* Write any decompressor specific data.
+/* Write any decompressor specific data, the data for the other
+ * libraries in use follows the data of the primary library in
+ * the order of their ids. Libraries which have no data in the
+ * image (see %libinfo_ddsz()) are skipped.
  */
 static __u64 write_decompressordata(struct imgspec* const spec,
 	char* base, __u64 offset)
 {
-	return spec->sp_lib->hl_mk_dd(spec->sp_lib_data, base, offset);
+	if (spec_ddsz(spec, spec->sp_lib))
+		offset = spec->sp_lib->hl_mk_dd(spec->sp_lib_data, base, offset);
+	
+	for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+		const struct hostprog_codec* codec = &spec->sp_codecs[i];
+		if (codec->hc_lib && codec->hc_lib != spec->sp_lib
+				&& spec_ddsz(spec, codec->hc_lib))
+			offset = codec->hc_lib->hl_mk_dd(codec->hc_lib_data, base, offset);
+	}
+	return offset;
+}
+
+/* Write the dictionaries of the libraries in use (if any) after
+ * the data of the image, each one is referred to by the data
+ * written by write_decompressordata().
+ */
+static __u64 write_dictionaries(struct imgspec* const spec,
+	char* base, __u64 offset)
+{
+	__u64 dd_offset = superblock_offset(spec) + sizeof(struct microfs_sb)
+		+ (spec->sp_largeimage ? sizeof(struct microfs_sb_large) : 0);
+	
+	if (!spec->sp_dictionary)
+		return offset;
+	
+	if (offset + spec->sp_lib->hl_mk_dictsz(spec->sp_lib_data) > spec->sp_upperbound)
+		error("out of space, the image can not hold the dictionary");
+	
+	if (spec_ddsz(spec, spec->sp_lib)) {
+		offset = spec->sp_lib->hl_mk_dict(spec->sp_lib_data, base, dd_offset, offset);
+		dd_offset += spec_ddsz(spec, spec->sp_lib);
+	}
+	
+	for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+		const struct hostprog_codec* codec = &spec->sp_codecs[i];
+		if (codec->hc_lib && codec->hc_lib != spec->sp_lib
+				&& spec_ddsz(spec, codec->hc_lib)) {
+			offset = codec->hc_lib->hl_mk_dict(codec->hc_lib_data, base,
+				dd_offset, offset);
+			dd_offset += spec_ddsz(spec, codec->hc_lib);
+		}
+	}
+	return offset;
+}
+
+/* Write the hashed index for the non-empty directory %dir, which
+ * dentries were written at %dir_offset.
+ */
+static __u64 write_dirindex(const struct entry* const dir,
+	const __u64 dir_offset, char* base, __u64 offset)
+{
+	__u32 entries = 0;
+	for (const struct entry* ent = dir->e_firstchild; ent; ent = ent->e_sibling)
+		entries++;
+	
+	const __u32 buckets = microfs_dirindex_buckets(entries);
+	
+	offset = microfs_dirindex_offset(dir_offset, offset - dir_offset);
+	
+	struct microfs_dirindex* index = (struct microfs_dirindex*)(base + offset);
+	__le32* bucket = (__le32*)(index + 1);
+	struct microfs_dirindex_entry* entry = (struct microfs_dirindex_entry*)
+		(bucket + buckets + 1);
+	
+	index->di_buckets = __cpu_to_le32(buckets);
+	index->di_entries = __cpu_to_le32(entries);
+	
+	/* Count the entries in each bucket (shifted by one) and turn
+	 * the counts into start indices.
+	 */
+	memset(bucket, 0, (buckets + 1) * sizeof(*bucket));
+	for (const struct entry* ent = dir->e_firstchild; ent; ent = ent->e_sibling) {
+		const __u32 b = microfs_namehash(ent->e_name, strlen(ent->e_name))
+			& (buckets - 1);
+		bucket[b + 1] = __cpu_to_le32(__le32_to_cpu(bucket[b + 1]) + 1);
+	}
+	for (__u32 b = 0; b < buckets; b++) {
+		bucket[b + 1] = __cpu_to_le32(__le32_to_cpu(bucket[b + 1])
+			+ __le32_to_cpu(bucket[b]));
+	}
+	
+	/* The entries of a bucket are stored in dentry order.
+	 */
+	__u32* cursor = malloc(buckets * sizeof(*cursor));
+	if (!cursor)
+		error("failed to allocate the directory index cursors");
+	for (__u32 b = 0; b < buckets; b++)
+		cursor[b] = __le32_to_cpu(bucket[b]);
+	
+	for (const struct entry* ent = dir->e_firstchild; ent; ent = ent->e_sibling) {
+		const __u32 hash = microfs_namehash(ent->e_name, strlen(ent->e_name));
+		struct microfs_dirindex_entry* e = &entry[cursor[hash & (buckets - 1)]++];
+		e->de_hash = __cpu_to_le32(hash);
+		e->de_offset = __cpu_to_le32(ent->e_ioffset - dir_offset);
+	}
+	
+	free(cursor);
+	
+	return offset + microfs_dirindex_size(entries);
+}
+
+static void load_entry_data(struct entry* const ent)
+{
+	if (S_ISREG(ent->e_mode)) {
+		ent->e_fd = open(ent->e_path, O_RDONLY);
+		if (ent->e_fd < 0)
+			error("failed to open \"%s\": %s", ent->e_path, strerror(errno));
+		
+		ent->e_data = mmap(NULL, ent->e_size, PROT_READ, MAP_PRIVATE, ent->e_fd, 0);
+		if (ent->e_data == MAP_FAILED)
+			error("failed to map \"%s\": %s", ent->e_path, strerror(errno));
+		
+	} else if (S_ISLNK(ent->e_mode)) {
+		ent->e_data = malloc(ent->e_size);
+		if (!ent->e_data)
+			error("failed to allocate room for the data");
+		
+		if (readlink(ent->e_path, ent->e_data, ent->e_size) < 0) {
+			error("failed read link \"%s\": %s",
+				ent->e_path, strerror(errno));
+		}
+	} else {
+		error("failed to load \"%s\": unexpected file mode '%c'",
+			ent->e_path, nodtype(ent->e_mode));
+	}
+}
+
+static void unload_entry_data(struct entry* const ent)
+{
+	if (S_ISREG(ent->e_mode)) {
+		munmap(ent->e_data, ent->e_size);
+		close(ent->e_fd);
+		ent->e_fd = -1;
+	} else if (S_ISLNK(ent->e_mode)) {
+		free(ent->e_data);
+	} else {
+		error("well... this should be impossible:"
+			" unexpected file mode '%c'", nodtype(ent->e_mode));
+	}
+	ent->e_data = NULL;
 }
 
 /* Write metadata for the given entries, but not their actual
@@ -435,6 +1023,7 @@ static __u64 write_metadata(struct imgspec* const spec,
 	if (hostprog_stack_create(&metastack, 64, 64))
 		error("failed to create the meta stack: %s", strerror(errno));
 	
+	struct entry* dir = spec->sp_root;
 	struct entry* ent = spec->sp_root->e_firstchild;
 	
 	/* The maximum possible size of the metadata is
@@ -445,6 +1034,7 @@ static __u64 write_metadata(struct imgspec* const spec,
 	
 	for (;;) {
 		__u64 dirstart = metastack->st_index;
+		__u64 dir_offset = offset;
 		while (ent) {
 			ent->e_ioffset = offset;
 			struct microfs_inode* inode = (struct microfs_inode*)(base + offset);
@@ -463,6 +1053,19 @@ static __u64 write_metadata(struct imgspec* const spec,
 			memcpy(base + offset, ent->e_name, inode->i_namelen);
 			offset += inode->i_namelen;
 			
+			/* Inline data follows the name and is never touched
+			 * by write_data().
+			 */
+			const __u32 inlinesz = entry_inlinesz(spec, ent);
+			if (inlinesz) {
+				load_entry_data(ent);
+				memcpy(base + offset, ent->e_data, inlinesz);
+				unload_entry_data(ent);
+				ent->e_dataoffset = offset;
+				inode->i_offset = __cpu_to_le32(offset);
+				offset += inlinesz;
+			}
+			
 			if (ent->e_firstchild) {
 				if (hostprog_stack_push(metastack, ent) < 0)
 					error("failed to push an entry to the meta stack: %s",
@@ -471,6 +1074,9 @@ static __u64 write_metadata(struct imgspec* const spec,
 			ent = ent->e_sibling;
 		}
 		
+		if (spec->sp_dirindex && dir->e_firstchild)
+			offset = write_dirindex(dir, dir_offset, base, offset);
+		
 		if (!metastack->st_index)
 			break;
 		
@@ -489,6 +1095,7 @@ static __u64 write_metadata(struct imgspec* const spec,
 				strerror(errno));
 		
 		set_dataoffset(ent, base, offset);
+		dir = ent;
 		ent = ent->e_firstchild;
 	}
 	hostprog_stack_destroy(metastack);
@@ -496,127 +1103,567 @@ static __u64 write_metadata(struct imgspec* const spec,
 	return offset;
 }
 
-static void load_entry_data(struct entry* const ent)
+/* Write a block pointer to %data_offset, which is relative to
+ * %data_base (see %MICROFS_FLAG_LARGEIMAGE).
+ */
+inline static void pack_data_blkptr(char* base, __u64* blkptr_offset,
+	const __u64* data_offset, const __u64 data_base)
 {
-	if (S_ISREG(ent->e_mode)) {
-		ent->e_fd = open(ent->e_path, O_RDONLY);
-		if (ent->e_fd < 0)
-			error("failed to open \"%s\": %s", ent->e_path, strerror(errno));
-		
-		ent->e_data = mmap(NULL, ent->e_size, PROT_READ, MAP_PRIVATE, ent->e_fd, 0);
-		if (ent->e_data == MAP_FAILED)
-			error("failed to map \"%s\": %s", ent->e_path, strerror(errno));
-		
-	} else if (S_ISLNK(ent->e_mode)) {
-		ent->e_data = malloc(ent->e_size);
-		if (!ent->e_data)
-			error("failed to allocate room for the data");
-		
-		if (readlink(ent->e_path, ent->e_data, ent->e_size) < 0) {
-			error("failed read link \"%s\": %s",
-				ent->e_path, strerror(errno));
-		}
-	} else {
-		error("failed to load \"%s\": unexpected file mode '%c'",
-			ent->e_path, nodtype(ent->e_mode));
+	__le32* blkptr = (__le32*)(base + *blkptr_offset);
+	if (*data_offset - data_base > UINT32_MAX) {
+		error("the data at offset %llu is too far from its base %llu,"
+			" the data of a file (or the fragment blocks) can not span"
+			" more than %llu bytes", *data_offset, data_base,
+			MICROFS_MAXIMGSIZE);
 	}
+	*blkptr = __cpu_to_le32(*data_offset - data_base);
+	*blkptr_offset += MICROFS_IOFFSET_WIDTH / 8;
 }
 
-static void unload_entry_data(struct entry* const ent)
+/* Write the fragment reference for the tail of %ent and copy
+ * the tail to its place in the fragment block.
+ */
+static void pack_tail(struct imgspec* const spec, struct entry* ent,
+	char* base, __u64* blkptr_offset, const __u64 tail)
 {
-	if (S_ISREG(ent->e_mode)) {
-		munmap(ent->e_data, ent->e_size);
-		close(ent->e_fd);
-		ent->e_fd = -1;
-	} else if (S_ISLNK(ent->e_mode)) {
-		free(ent->e_data);
-	} else {
-		error("well... this should be impossible:"
-			" unexpected file mode '%c'", nodtype(ent->e_mode));
+	struct microfs_fragment* fragment = (struct microfs_fragment*)
+		(base + *blkptr_offset);
+	fragment->fr_blkptr = __cpu_to_le32(spec->sp_fragtable
+		+ ent->e_fragblk * (MICROFS_IOFFSET_WIDTH / 8));
+	fragment->fr_offset = __cpu_to_le32(ent->e_fragoffset);
+	*blkptr_offset += sizeof(*fragment);
+	
+	memcpy(spec->sp_fragdata + ent->e_fragblk * spec->sp_blksz
+		+ ent->e_fragoffset, ent->e_data + ent->e_size - tail, tail);
+	
+	message(VERBOSITY_1, "%llu bytes in fragment %u\t\t%s",
+		tail, ent->e_fragblk, ent->e_path);
+}
+
+/* Compress the data of %job with the given libraries.
+ */
+static void packjob_run(const struct hostprog_codec* const codecs,
+	struct packjob* const job, const __u64 bufsz)
+{
+	if (job->pj_holes && hostprog_iszero(job->pj_input, job->pj_inputsz)) {
+		job->pj_hole = 1;
+		return;
 	}
-	ent->e_data = NULL;
+	
+	const struct hostprog_codec* codec = &codecs[job->pj_codec];
+	
+	job->pj_outputsz = bufsz;
+	job->pj_err = codec->hc_lib->hl_compress(codec->hc_lib_data,
+		job->pj_output, &job->pj_outputsz,
+		job->pj_input, job->pj_inputsz,
+		&job->pj_implerr);
 }
 
-inline static void pack_data_blkptr(char* base, __u64* blkptr_offset, __u64* data_offset)
+static void* packer_thread(void* arg)
 {
-	__le32* blkptr = (__le32*)(base + *blkptr_offset);
-	*blkptr = __cpu_to_le32(*data_offset);
-	*blkptr_offset += MICROFS_IOFFSET_WIDTH / 8;
+	struct packthread* thread = arg;
+	struct packer* pk = thread->pt_packer;
+	
+	pthread_mutex_lock(&pk->pk_mutex);
+	for (;;) {
+		while (pk->pk_next == pk->pk_tail && !pk->pk_exit)
+			pthread_cond_wait(&pk->pk_queuedcond, &pk->pk_mutex);
+		if (pk->pk_next == pk->pk_tail)
+			break;
+		
+		struct packjob* job = &pk->pk_jobs[pk->pk_next++ % pk->pk_njobs];
+		if (job->pj_done)
+			continue;
+		
+		pthread_mutex_unlock(&pk->pk_mutex);
+		packjob_run(thread->pt_codecs, job, pk->pk_jobsz);
+		pthread_mutex_lock(&pk->pk_mutex);
+		
+		job->pj_done = 1;
+		pthread_cond_broadcast(&pk->pk_donecond);
+	}
+	pthread_mutex_unlock(&pk->pk_mutex);
+	
+	return NULL;
 }
 
-static void pack_data(struct imgspec* const spec, struct entry* ent,
-	char* base, __u64* blkptr_offset, __u64* data_offset)
+/* Queue the next job, in the order that pack_data() and
+ * write_fragments() consume them, and get zero in return if
+ * there is no room left or nothing left to queue.
+ */
+static int packer_queue(struct imgspec* const spec)
 {
-	__u64 ent_sz = ent->e_size;
-	char* ent_data = ent->e_data;
+	struct packer* pk = spec->sp_packer;
 	
-	const __u64 orig_data_offset = *data_offset;
+	if (pk->pk_tail - pk->pk_head == pk->pk_njobs)
+		return 0;
 	
-	pack_data_blkptr(base, blkptr_offset, data_offset);
+	struct packjob job = {
+		.pj_codec = microfs_codecidx(spec->sp_lib->hl_info->li_id)
+	};
 	
-	do {
-		__u32 compr_sz = spec->sp_compressionbufsz;
-		__u32 compr_input = ent_sz > spec->sp_blksz ? spec->sp_blksz : ent_sz;
-		ent_sz -= compr_input;
-		
-		int implerr = 0;
-		int err = spec->sp_lib->hl_compress(spec->sp_lib_data,
-			spec->sp_compressionbuf, &compr_sz,
-			ent_data, compr_input,
-			&implerr);
-		if (err < 0) {
-			error("compression failed for \"%s\": %s", ent->e_path,
-				spec->sp_lib->hl_strerror(spec->sp_lib_data, implerr));
-		}
-		
-		if (compr_sz >= compr_input) {
-			message(VERBOSITY_2, ">>> data from offset %llu to %llu in \"%s\""
-				" \"compressed\" from %zu bytes to %zu bytes",
-				(__u64)(ent_data - ent->e_data),
-				(__u64)(ent_data + compr_input - ent->e_data),
-				ent->e_path, (size_t)compr_input, (size_t)compr_sz);
+	const __u64 nents = pk->pk_ents->st_index;
+	for (;;) {
+		if (pk->pk_ent == nents) {
+			if (!pk->pk_fragready || pk->pk_frag == spec->sp_fragblks)
+				return 0;
+			job.pj_input = spec->sp_fragdata + pk->pk_frag * spec->sp_blksz;
+			job.pj_inputsz = spec->sp_fragused[pk->pk_frag++];
+			goto queue;
 		}
 		
-		if (*data_offset + compr_sz > spec->sp_upperbound) {
-			/* This can only happen if sp_upperbound was truncated to
-			 * MICROFS_MAXIMGSIZE in create_imgspec(), otherwise it is
-			 * guaranteed that the upper bound can fit all data even if
-			 * we get the worst possible compression result for each block
-			 * of data.
+		struct entry* ent = pk->pk_ents->st_slots[pk->pk_ent];
+		if (!pk->pk_entloaded) {
+			/* Do not keep too many files open.
 			 */
-			error("out of space, the image can not hold more data");
+			if (pk->pk_ent > pk->pk_written + pk->pk_njobs)
+				return 0;
+			load_entry_data(ent);
+			pk->pk_entloaded = 1;
 		}
 		
-		memcpy(base + *data_offset, spec->sp_compressionbuf, compr_sz);
-		ent_data += compr_input;
-		*data_offset += compr_sz;
-		
-		pack_data_blkptr(base, blkptr_offset, data_offset);
+		const __u64 datasz = ent->e_size - i_fragtail(ent->e_size,
+			ent->e_blksz, spec->sp_fragments);
+		if (pk->pk_blkoffset < datasz) {
+			char* blk = ent->e_data + pk->pk_blkoffset;
+			const __u64 blksz = datasz - pk->pk_blkoffset > ent->e_blksz
+				? ent->e_blksz : datasz - pk->pk_blkoffset;
+			const __u64 frames = i_blks(blksz, ent->e_framesz);
+			
+			if (pk->pk_frame == 0 && ent->e_blkrefs
+					&& ent->e_blkrefs[pk->pk_blkoffset / ent->e_blksz].br_same) {
+				/* The data of a shared block is already written.
+				 */
+				pk->pk_blkoffset += blksz;
+				continue;
+			}
+			
+			job.pj_codec = microfs_codecidx(ent->e_codec->hc_lib->hl_info->li_id);
+			if (pk->pk_frame == 0 && spec->sp_zeroblocks
+					&& hostprog_iszero(blk, blksz)) {
+				job.pj_input = blk;
+				job.pj_inputsz = blksz;
+				job.pj_hole = 1;
+				pk->pk_blkoffset += blksz;
+			} else if (frames > 1) {
+				job.pj_input = blk + pk->pk_frame * ent->e_framesz;
+				job.pj_inputsz = i_blksz(blksz, pk->pk_frame, ent->e_framesz);
+				job.pj_holes = spec->sp_zeroblocks;
+				if (++pk->pk_frame == frames) {
+					pk->pk_frame = 0;
+					pk->pk_blkoffset += blksz;
+				}
+			} else {
+				job.pj_input = blk;
+				job.pj_inputsz = blksz;
+				pk->pk_blkoffset += blksz;
+			}
+			goto queue;
+		}
 		
-	} while (ent_sz);
+		pk->pk_ent++;
+		pk->pk_entloaded = 0;
+		pk->pk_blkoffset = 0;
+	}
 	
-	__u64 newsz = *data_offset - orig_data_offset;
-	int changesz = newsz - ent->e_size;
-	message(VERBOSITY_1, "%6.2f%% (%+d bytes)\t\t%s",
-		(changesz * 100) / (double)ent->e_size, changesz, ent->e_path);
+queue:
+	pthread_mutex_lock(&pk->pk_mutex);
+	struct packjob* slot = &pk->pk_jobs[pk->pk_tail++ % pk->pk_njobs];
+	job.pj_output = slot->pj_output;
+	job.pj_done = job.pj_hole;
+	*slot = job;
+	pthread_cond_signal(&pk->pk_queuedcond);
+	pthread_mutex_unlock(&pk->pk_mutex);
+	
+	return 1;
 }
 
-static void do_write_data(struct imgspec* const spec, struct entry* ent,
-	char* base, __u64* blkptr_offset, __u64* data_offset)
+/* Determine if the data of entry %ent_nr has been loaded.
+ */
+static inline int packer_loaded(const struct packer* const pk,
+	const __u64 ent_nr)
 {
-	do {
-		if (ent->e_path && ent->e_dataoffset == 0) {
-			set_dataoffset(ent, base, *blkptr_offset);
-			load_entry_data(ent);
-			pack_data(spec, ent, base, blkptr_offset, data_offset);
-			unload_entry_data(ent);
-		} else if (ent->e_firstchild) {
-			do_write_data(spec, ent->e_firstchild, base,
-				blkptr_offset, data_offset);
+	return pk->pk_ent > ent_nr || (pk->pk_ent == ent_nr && pk->pk_entloaded);
+}
+
+/* Make sure that the data of entry %ent_nr is loaded.
+ */
+static void packer_load(struct imgspec* const spec, const __u64 ent_nr)
+{
+	struct packer* pk = spec->sp_packer;
+	
+	pk->pk_written = ent_nr;
+	while (!packer_loaded(pk, ent_nr)) {
+		if (!packer_queue(spec) && !packer_loaded(pk, ent_nr))
+			error("failed to queue the data of entry %llu", ent_nr);
+	}
+}
+
+/* Get the next job once it is done, the job stays at the head of
+ * the queue until packer_put() is called.
+ */
+static const struct packjob* packer_get(struct imgspec* const spec)
+{
+	struct packer* pk = spec->sp_packer;
+	
+	while (packer_queue(spec))
+		;
+	if (pk->pk_head == pk->pk_tail)
+		error("the compression queue is unexpectedly empty");
+	
+	struct packjob* job = &pk->pk_jobs[pk->pk_head % pk->pk_njobs];
+	if (!pk->pk_nthreads) {
+		if (!job->pj_done) {
+			packjob_run(spec->sp_codecs, job, pk->pk_jobsz);
+			job->pj_done = 1;
+		}
+		return job;
+	}
+	
+	pthread_mutex_lock(&pk->pk_mutex);
+	while (!job->pj_done)
+		pthread_cond_wait(&pk->pk_donecond, &pk->pk_mutex);
+	pthread_mutex_unlock(&pk->pk_mutex);
+	
+	return job;
+}
+
+/* Remove the job at the head of the queue.
+ */
+static void packer_put(struct imgspec* const spec)
+{
+	struct packer* pk = spec->sp_packer;
+	
+	pthread_mutex_lock(&pk->pk_mutex);
+	pk->pk_head++;
+	/* Holes are done when they are queued, so the threads might
+	 * not have reached them yet.
+	 */
+	if (pk->pk_next < pk->pk_head)
+		pk->pk_next = pk->pk_head;
+	pthread_mutex_unlock(&pk->pk_mutex);
+}
+
+/* Write the next compressed block or sub-frame of a block of
+ * %ent to %data_offset and get the number of bytes written in
+ * return. Nothing is written for data which is a hole, see
+ * %MICROFS_FLAG_SUBFRAMES.
+ */
+static __u32 pack_frame(struct imgspec* const spec, struct entry* ent,
+	char* base, const __u64 data_offset)
+{
+	const struct hostprog_codec* codec = ent->e_codec;
+	const struct packjob* job = packer_get(spec);
+	
+	const char* input = job->pj_input;
+	const __u32 input_sz = job->pj_inputsz;
+	
+	if (job->pj_hole) {
+		message(VERBOSITY_2, ">>> data from offset %llu to %llu in \"%s\""
+			" is a hole", (__u64)(input - ent->e_data),
+			(__u64)(input + input_sz - ent->e_data), ent->e_path);
+		packer_put(spec);
+		return 0;
+	}
+	
+	if (job->pj_err < 0) {
+		error("compression failed for \"%s\": %s", ent->e_path,
+			codec->hc_lib->hl_strerror(codec->hc_lib_data, job->pj_implerr));
+	}
+	
+	const char* output = job->pj_output;
+	__u32 compr_sz = job->pj_outputsz;
+	
+	if (compr_sz >= input_sz) {
+		message(VERBOSITY_2, ">>> data from offset %llu to %llu in \"%s\""
+			" \"compressed\" from %zu bytes to %zu bytes",
+			(__u64)(input - ent->e_data),
+			(__u64)(input + input_sz - ent->e_data),
+			ent->e_path, (size_t)input_sz, (size_t)compr_sz);
+		if (spec->sp_storedblocks) {
+			/* A block which data length is equal to its size is
+			 * stored uncompressed, which is also why a block that
+			 * compressed to exactly its own size must be stored.
+			 */
+			output = input;
+			compr_sz = input_sz;
+		}
+	}
+	
+	if (data_offset + compr_sz > spec->sp_upperbound) {
+		/* This can only happen if sp_upperbound was truncated to
+		 * the max image size in create_imgspec(), otherwise it is
+		 * guaranteed that the upper bound can fit all data even if
+		 * we get the worst possible compression result for each block
+		 * of data.
+		 */
+		error("out of space, the image can not hold more data");
+	}
+	
+	memcpy(base + data_offset, output, compr_sz);
+	packer_put(spec);
+	return compr_sz;
+}
+
+/* Pack the %blks + 1 block pointers at %ptrs (see pack_data())
+ * to %offset, see %MICROFS_FLAG_PACKEDBLKPTRS.
+ */
+static void pack_packedptrs(const struct entry* const ent, char* base,
+	const __u64 offset, const __le32* const ptrs, const __u64 blks)
+{
+	const __u64 chunks = i_blks(blks, MICROFS_BLKPTR_CHUNKBLKS);
+	__u8* lens = (__u8*)base + offset + chunks * (MICROFS_IOFFSET_WIDTH / 8);
+	
+	for (__u64 i = 0; i < chunks; i++)
+		((__le32*)(base + offset))[i] = ptrs[i * MICROFS_BLKPTR_CHUNKBLKS];
+	
+	for (__u64 i = 0, bit = 0; i < blks; i++) {
+		const __u32 len = __le32_to_cpu(ptrs[i + 1]) - __le32_to_cpu(ptrs[i]);
+		if (ent->e_lenbits < 32 && len >> ent->e_lenbits)
+			error("block %llu of \"%s\" is too big for its packed length",
+				i, ent->e_path);
+		for (__u64 j = 0; j < ent->e_lenbits; j++, bit++) {
+			if (len & (1U << j))
+				lens[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+}
+
+static void pack_data(struct imgspec* const spec, struct entry* ent,
+	char* base, __u64* blkptr_offset, __u64* data_offset)
+{
+	const __u64 tail = i_fragtail(ent->e_size, ent->e_blksz,
+		spec->sp_fragments);
+	const struct hostprog_codec* codec = ent->e_codec;
+	
+	__u64 ent_sz = ent->e_size - tail;
+	char* ent_data = ent->e_data;
+	
+	const __u64 orig_data_offset = *data_offset;
+	const __u64 blks = i_ptrblks(ent->e_size, ent->e_blksz,
+		spec->sp_fragments);
+	const int extents = ent->e_lenbits == MICROFS_FILEINFO_EXTENTS;
+	
+	/* The base of a large image must not be after any of the
+	 * shared blocks of the file, see find_sharedblks().
+	 */
+	__u64 data_base = spec->sp_largeimage ? orig_data_offset : 0;
+	for (__u64 i = 0; spec->sp_largeimage && extents && i < blks; i++) {
+		const struct blkref* same = ent->e_blkrefs[i].br_same;
+		if (same && same->br_start < data_base)
+			data_base = same->br_start;
+	}
+	
+	if (spec_fileinfo(spec)) {
+		/* The file info word precedes the block pointers.
+		 */
+		__le32* fileinfo = (__le32*)(base + *blkptr_offset);
+		*fileinfo = __cpu_to_le32((spec->sp_ncodecrules
+				? codec->hc_lib->hl_info->li_id : 0)
+			| (spec->sp_nblkszrules ? ent->e_blkshift : 0)
+			| (ent->e_framesz < ent->e_blksz ? ent->e_frameshift
+				<< MICROFS_FILEINFO_FRAMESHIFT_LSB : 0)
+			| ent->e_lenbits << MICROFS_FILEINFO_LENBITS_LSB);
+		*blkptr_offset += MICROFS_IOFFSET_WIDTH / 8;
+	}
+	
+	if (spec->sp_largeimage) {
+		/* The block pointers are relative to the start of the data
+		 * of the file, which follows the file info word.
+		 */
+		const __le64 database = __cpu_to_le64(data_base);
+		memcpy(base + *blkptr_offset, &database, sizeof(database));
+		*blkptr_offset += sizeof(database);
+	}
+	
+	if (!ent_sz) {
+		pack_tail(spec, ent, base, blkptr_offset, tail);
+		return;
+	}
+	
+	/* Packed block pointers are written once all blocks are in
+	 * place, until then the pointers are kept in a scratch buffer.
+	 * Block extents are written as they are, a pair per block.
+	 */
+	__le32* ptrs = NULL;
+	char* ptrs_base = base;
+	__u64 ptrs_offset = *blkptr_offset;
+	if (ent->e_lenbits && !extents) {
+		ptrs = malloc((blks + 1) * sizeof(*ptrs));
+		if (!ptrs)
+			error("failed to allocate the block pointers for \"%s\"",
+				ent->e_path);
+		ptrs_base = (char*)ptrs;
+		ptrs_offset = 0;
+	}
+	
+	if (!extents)
+		pack_data_blkptr(ptrs_base, &ptrs_offset, data_offset, data_base);
+	
+	__u64 blk_nr = 0;
+	do {
+		__u32 compr_input = ent_sz > ent->e_blksz ? ent->e_blksz : ent_sz;
+		ent_sz -= compr_input;
+		
+		struct blkref* ref = ent->e_blkrefs ? &ent->e_blkrefs[blk_nr++] : NULL;
+		if (ref && ref->br_same) {
+			message(VERBOSITY_2, ">>> data from offset %llu to %llu in \"%s\""
+				" is shared with \"%s\"", (__u64)(ent_data - ent->e_data),
+				(__u64)(ent_data + compr_input - ent->e_data), ent->e_path,
+				ref->br_same->br_ent->e_path);
+			ent_data += compr_input;
+			pack_data_blkptr(ptrs_base, &ptrs_offset,
+				&ref->br_same->br_start, data_base);
+			pack_data_blkptr(ptrs_base, &ptrs_offset,
+				&ref->br_same->br_end, data_base);
+			continue;
+		}
+		
+		if (ref)
+			ref->br_start = *data_offset;
+		if (extents)
+			pack_data_blkptr(ptrs_base, &ptrs_offset, data_offset, data_base);
+		
+		const struct packjob* job = packer_get(spec);
+		if (job->pj_hole && job->pj_inputsz == compr_input) {
+			/* A hole is a block which pointers are equal. A block
+			 * which is all zeros is queued as a single job even if
+			 * it has sub-frames.
+			 */
+			message(VERBOSITY_2, ">>> data from offset %llu to %llu in \"%s\""
+				" is a hole", (__u64)(ent_data - ent->e_data),
+				(__u64)(ent_data + compr_input - ent->e_data), ent->e_path);
+			packer_put(spec);
+			ent_data += compr_input;
+			if (ref)
+				ref->br_end = *data_offset;
+			pack_data_blkptr(ptrs_base, &ptrs_offset, data_offset, data_base);
+			continue;
+		}
+		
+		const __u64 frames = i_blks(compr_input, ent->e_framesz);
+		if (frames > 1) {
+			/* The sub-frame index is followed by the sub-frames,
+			 * each entry is the end of a sub-frame relative to the
+			 * start of the block data.
+			 */
+			__le32* idx = (__le32*)(base + *data_offset);
+			__u64 frame_offset = *data_offset
+				+ i_frameidxsz(compr_input, ent->e_framesz);
+			if (frame_offset > spec->sp_upperbound)
+				error("out of space, the image can not hold more data");
+			for (__u64 i = 0; i < frames; i++) {
+				frame_offset += pack_frame(spec, ent, base, frame_offset);
+				if (i + 1 < frames)
+					idx[i] = __cpu_to_le32(frame_offset - *data_offset);
+			}
+			*data_offset = frame_offset;
+		} else {
+			*data_offset += pack_frame(spec, ent, base, *data_offset);
+		}
+		
+		ent_data += compr_input;
+		if (ref)
+			ref->br_end = *data_offset;
+		pack_data_blkptr(ptrs_base, &ptrs_offset, data_offset, data_base);
+		
+	} while (ent_sz);
+	
+	if (ent->e_lenbits && !extents) {
+		pack_packedptrs(ent, base, *blkptr_offset, ptrs, blks);
+		*blkptr_offset += i_packedptrsz(blks, ent->e_lenbits);
+		free(ptrs);
+	} else {
+		*blkptr_offset = ptrs_offset;
+	}
+	
+	__u64 oldsz = ent->e_size - tail;
+	__u64 newsz = *data_offset - orig_data_offset;
+	int changesz = newsz - oldsz;
+	message(VERBOSITY_1, "%6.2f%% (%+d bytes)\t\t%s",
+		(changesz * 100) / (double)oldsz, changesz, ent->e_path);
+	
+	if (tail)
+		pack_tail(spec, ent, base, blkptr_offset, tail);
+}
+
+/* Collect the entries which data is written by write_data(), in
+ * the order that it is written. Duplicates share the data of the
+ * first entry.
+ */
+static void queue_entries(struct imgspec* const spec, struct entry* ent)
+{
+	do {
+		if (ent->e_path && !entry_inlinesz(spec, ent) && !ent->e_queued) {
+			for (struct entry* same = ent; same; same = same->e_same)
+				same->e_queued = 1;
+			if (hostprog_stack_push(spec->sp_packer->pk_ents, ent) < 0)
+				error("failed to queue \"%s\"", ent->e_path);
+		} else if (ent->e_firstchild) {
+			queue_entries(spec, ent->e_firstchild);
 		}
 	} while ((ent = ent->e_sibling));
 }
 
+static void do_write_data(struct imgspec* const spec, char* base,
+	__u64* blkptr_offset, __u64* data_offset)
+{
+	struct packer* pk = spec->sp_packer;
+	const __u64 nents = pk->pk_ents->st_index;
+	
+	for (__u64 i = 0; i < nents; i++) {
+		struct entry* ent = pk->pk_ents->st_slots[i];
+		packer_load(spec, i);
+		set_dataoffset(ent, base, *blkptr_offset);
+		pack_data(spec, ent, base, blkptr_offset, data_offset);
+		unload_entry_data(ent);
+	}
+}
+
+/* Compress the fragment blocks and write them after the data
+ * of all files. Their pointers make up the fragment table.
+ */
+static void write_fragments(struct imgspec* const spec, char* base,
+	__u64* data_offset)
+{
+	__u64 blkptr_offset = spec->sp_fragtable;
+	
+	/* The fragment table of a large image is relative to the
+	 * first fragment block.
+	 */
+	spec->sp_fragbase = spec->sp_largeimage ? *data_offset : 0;
+	
+	pack_data_blkptr(base, &blkptr_offset, data_offset, spec->sp_fragbase);
+	
+	/* All tails are in place now.
+	 */
+	spec->sp_packer->pk_fragready = 1;
+	
+	for (__u64 i = 0; i < spec->sp_fragblks; i++) {
+		/* Fragment blocks are never stored uncompressed, as their
+		 * size is not known to the kernel.
+		 */
+		const struct packjob* job = packer_get(spec);
+		if (job->pj_err < 0) {
+			error("compression failed for fragment %llu: %s", i,
+				spec->sp_lib->hl_strerror(spec->sp_lib_data, job->pj_implerr));
+		}
+		
+		const __u32 compr_sz = job->pj_outputsz;
+		if (*data_offset + compr_sz > spec->sp_upperbound)
+			error("out of space, the image can not hold more data");
+		
+		memcpy(base + *data_offset, job->pj_output, compr_sz);
+		*data_offset += compr_sz;
+		packer_put(spec);
+		
+		pack_data_blkptr(base, &blkptr_offset, data_offset, spec->sp_fragbase);
+		
+		message(VERBOSITY_2, ">>> fragment %llu compressed from %u bytes"
+			" to %u bytes", i, spec->sp_fragused[i], compr_sz);
+	}
+}
+
 /* Write the actual data for the given entries along with
  * the block pointers for it.
  */
@@ -628,67 +1675,649 @@ static __u64 write_data(struct imgspec* const spec, char* base, __u64 offset)
 		__u64 blkptr_offset = offset;
 		__u64 data_offset = offset + spec->sp_blkptrs * blkptr_length;
 		
-		do_write_data(spec, spec->sp_root->e_firstchild, base,
-			&blkptr_offset, &data_offset);
+		/* The metadata is addressed by 32-bit offsets, even in a
+		 * large image.
+		 */
+		if (data_offset > MICROFS_MAXIMGSIZE) {
+			error("the metadata (%llu bytes) does not fit in the first"
+				" %llu bytes of the image", data_offset, MICROFS_MAXIMGSIZE);
+		}
+		
+		/* The fragment table is the last part of the block pointers.
+		 */
+		if (spec->sp_fragblks) {
+			spec->sp_fragtable = data_offset
+				- (spec->sp_fragblks + 1) * blkptr_length;
+		}
+		
+		do_write_data(spec, base, &blkptr_offset, &data_offset);
+		
+		if (spec->sp_fragblks)
+			write_fragments(spec, base, &data_offset);
 		
 		return data_offset;
 	}
 	return offset;
 }
 
-/* Comparison callback for %qsort().
+static inline void set_fragment(struct entry* const ent,
+	const __u32 fragblk, const __u32 fragoffset)
+{
+	for (struct entry* same = ent; same; same = same->e_same) {
+		same->e_fragblk = fragblk;
+		same->e_fragoffset = fragoffset;
+		same->e_fragpacked = 1;
+	}
+}
+
+/* Give the tail of each file a place in a fragment block, the
+ * files are visited in the same order as by do_write_data() so
+ * that files in the same directory share fragment blocks.
+ */
+static void do_pack_fragments(struct imgspec* const spec, struct entry* ent)
+{
+	do {
+		if (ent->e_path && !ent->e_fragpacked) {
+			const __u32 tail = i_fragtail(ent->e_size, ent->e_blksz, 1);
+			if (!tail || entry_inlinesz(spec, ent))
+				continue;
+			if (!spec->sp_fragblks || spec->sp_fragused[spec->sp_fragblks - 1]
+					+ tail > spec->sp_blksz) {
+				spec->sp_fragused = realloc(spec->sp_fragused,
+					(spec->sp_fragblks + 1) * sizeof(*spec->sp_fragused));
+				if (!spec->sp_fragused)
+					error("failed to allocate the fragment block sizes");
+				spec->sp_fragused[spec->sp_fragblks++] = 0;
+			}
+			set_fragment(ent, spec->sp_fragblks - 1,
+				spec->sp_fragused[spec->sp_fragblks - 1]);
+			spec->sp_fragused[spec->sp_fragblks - 1] += tail;
+		} else if (ent->e_firstchild) {
+			do_pack_fragments(spec, ent->e_firstchild);
+		}
+	} while ((ent = ent->e_sibling));
+}
+
+static void pack_fragments(struct imgspec* const spec)
+{
+	if (!spec->sp_root->e_firstchild)
+		return;
+	
+	do_pack_fragments(spec, spec->sp_root->e_firstchild);
+	
+	if (!spec->sp_fragblks)
+		return;
+	
+	spec->sp_fragdata = calloc(spec->sp_fragblks, spec->sp_blksz);
+	if (!spec->sp_fragdata)
+		error("failed to allocate the fragment blocks");
+	
+	spec->sp_blkptrs += spec->sp_fragblks + 1;
+	spec->sp_upperbound += (MICROFS_IOFFSET_WIDTH / 8) * (spec->sp_fragblks + 1)
+		+ spec->sp_lib->hl_upperbound(spec->sp_lib_data, spec->sp_blksz)
+			* spec->sp_fragblks;
+}
+
+/* Determine if the data of %ent is compressed by the primary
+ * library, and could thus be sampled to train its dictionary.
  */
-static int entryszcmp(const void* ent1, const void* ent2)
+static inline int entry_sampled(const struct imgspec* const spec,
+	const struct entry* const ent)
 {
-	return (int)(*(const struct entry**)ent1)->e_size
-		- (int)(*(const struct entry**)ent2)->e_size;
+	return ent->e_path && ent->e_size && !entry_inlinesz(spec, ent)
+		&& ent->e_codec->hc_lib == spec->sp_lib;
 }
 
+/* Get the size of the data that could be sampled to train the
+ * dictionary of the primary library.
+ */
+static __u64 dictsample_datasz(const struct imgspec* const spec,
+	const struct entry* ent)
+{
+	__u64 datasz = 0;
+	
+	do {
+		if (entry_sampled(spec, ent))
+			datasz += ent->e_size;
+		else if (ent->e_firstchild)
+			datasz += dictsample_datasz(spec, ent->e_firstchild);
+	} while ((ent = ent->e_sibling));
+	
+	return datasz;
+}
+
+/* Sample every %ds_stride sub-frame (or block) of the data of
+ * the given entries, sub-frames of zeros are not sampled.
+ */
+static void dictsample_entries(const struct imgspec* const spec,
+	struct entry* ent, struct dictsamples* const samples)
+{
+	do {
+		if (entry_sampled(spec, ent)) {
+			const __u64 frames = i_blks(ent->e_size, ent->e_framesz);
+			const __u64 skip = (samples->ds_stride
+				- samples->ds_frames % samples->ds_stride) % samples->ds_stride;
+			if (skip >= frames) {
+				samples->ds_frames += frames;
+				continue;
+			}
+			
+			load_entry_data(ent);
+			for (__u64 i = 0; i < frames; i++) {
+				if (samples->ds_frames++ % samples->ds_stride)
+					continue;
+				
+				const char* frame = ent->e_data + i * ent->e_framesz;
+				const __u64 framesz = i_blksz(ent->e_size, i, ent->e_framesz);
+				if (samples->ds_datasz + framesz > samples->ds_maxdatasz)
+					break;
+				if (hostprog_iszero(frame, framesz))
+					continue;
+				
+				if (samples->ds_nsamples == samples->ds_maxsamples) {
+					samples->ds_maxsamples = samples->ds_maxsamples
+						? samples->ds_maxsamples * 2 : 64;
+					samples->ds_sizes = realloc(samples->ds_sizes,
+						samples->ds_maxsamples * sizeof(*samples->ds_sizes));
+					if (!samples->ds_sizes)
+						error("failed to allocate the dictionary sample sizes");
+				}
+				memcpy(samples->ds_data + samples->ds_datasz, frame, framesz);
+				samples->ds_datasz += framesz;
+				samples->ds_sizes[samples->ds_nsamples++] = framesz;
+			}
+			unload_entry_data(ent);
+		} else if (ent->e_firstchild) {
+			dictsample_entries(spec, ent->e_firstchild, samples);
+		}
+	} while ((ent = ent->e_sibling));
+}
+
+/* Train the dictionary of the primary library (if it uses one)
+ * on a sample of the data that it compresses. The sub-frames (or
+ * blocks) are sampled evenly over all files, as they are the
+ * units that the data is compressed in.
+ */
+static void train_dictionary(struct imgspec* const spec)
+{
+	const __u32 dictsz = spec->sp_lib->hl_mk_dictsz(spec->sp_lib_data);
+	if (!dictsz || !spec->sp_root->e_firstchild)
+		return;
+	
+	spec->sp_upperbound += dictsz;
+	
+	struct dictsamples samples;
+	memset(&samples, 0, sizeof(samples));
+	
+	samples.ds_maxdatasz = (__u64)dictsz * MKI_DICTSAMPLES;
+	samples.ds_stride = dictsample_datasz(spec, spec->sp_root->e_firstchild)
+		/ samples.ds_maxdatasz + 1;
+	samples.ds_data = malloc(samples.ds_maxdatasz);
+	if (!samples.ds_data)
+		error("failed to allocate the dictionary samples");
+	
+	dictsample_entries(spec, spec->sp_root->e_firstchild, &samples);
+	
+	int implerr;
+	if (spec->sp_lib->hl_mk_train(spec->sp_lib_data, samples.ds_data,
+			samples.ds_sizes, samples.ds_nsamples, &implerr) < 0) {
+		warning("failed to train a dictionary on %u samples (%s),"
+			" the data is compressed without one", samples.ds_nsamples,
+			spec->sp_lib->hl_strerror(spec->sp_lib_data, implerr));
+	} else {
+		message(VERBOSITY_0, "Dictionary samples: %u (%llu bytes)",
+			samples.ds_nsamples, samples.ds_datasz);
+	}
+	
+	free(samples.ds_sizes);
+	free(samples.ds_data);
+}
+
+/* Compare the given keys of two entries, and then the order in
+ * which they were found by walk_directory().
+ */
+static int entrykeycmp(const struct entry* const ent1,
+	const struct entry* const ent2, const __u64* const keys1,
+	const __u64* const keys2, const size_t nkeys)
+{
+	for (size_t i = 0; i < nkeys; i++) {
+		if (keys1[i] != keys2[i])
+			return keys1[i] < keys2[i] ? -1 : 1;
+	}
+	return ent1->e_regnr < ent2->e_regnr ? -1 : ent1->e_regnr > ent2->e_regnr;
+}
+
+/* Comparison callback for %qsort(), orders the entries by size,
+ * data layout and inode so that hard links end up next to each
+ * other.
+ */
+static int entryinocmp(const void* p1, const void* p2)
+{
+	const struct entry* ent1 = *(const struct entry**)p1;
+	const struct entry* ent2 = *(const struct entry**)p2;
+	
+	const __u64 keys1[] = {
+		ent1->e_size, ent1->e_blksz, ent1->e_framesz,
+		ent1->e_codec->hc_lib->hl_info->li_id, ent1->e_dev, ent1->e_ino
+	};
+	const __u64 keys2[] = {
+		ent2->e_size, ent2->e_blksz, ent2->e_framesz,
+		ent2->e_codec->hc_lib->hl_info->li_id, ent2->e_dev, ent2->e_ino
+	};
+	return entrykeycmp(ent1, ent2, keys1, keys2,
+		sizeof(keys1) / sizeof(*keys1));
+}
+
+/* Comparison callback for %qsort(), orders the entries by size,
+ * content hash and data layout. The first entry of a group of
+ * duplicates is the one that write_data() comes across first.
+ */
+static int entryhashcmp(const void* p1, const void* p2)
+{
+	const struct entry* ent1 = *(const struct entry**)p1;
+	const struct entry* ent2 = *(const struct entry**)p2;
+	
+	const __u64 keys1[] = {
+		ent1->e_size, ent1->e_hash, ent1->e_blksz, ent1->e_framesz,
+		ent1->e_codec->hc_lib->hl_info->li_id
+	};
+	const __u64 keys2[] = {
+		ent2->e_size, ent2->e_hash, ent2->e_blksz, ent2->e_framesz,
+		ent2->e_codec->hc_lib->hl_info->li_id
+	};
+	return entrykeycmp(ent1, ent2, keys1, keys2,
+		sizeof(keys1) / sizeof(*keys1));
+}
+
+/* Determine if the data of %ent1 and %ent2 would be laid out the
+ * same way if they were found to have the same content.
+ */
+static inline int entry_sameshape(const struct entry* const ent1,
+	const struct entry* const ent2)
+{
+	return ent1->e_size == ent2->e_size
+		&& ent1->e_blksz == ent2->e_blksz
+		&& ent1->e_framesz == ent2->e_framesz
+		&& ent1->e_codec == ent2->e_codec;
+}
+
+static inline int entry_sameinode(const struct entry* const ent1,
+	const struct entry* const ent2)
+{
+	return ent1->e_dev == ent2->e_dev && ent1->e_ino == ent2->e_ino;
+}
+
+/* Files to hash, shared by the threads of hash_entries().
+ */
+struct hashqueue {
+	/* Protects %hq_next. */
+	pthread_mutex_t hq_mutex;
+	/* The image spec. */
+	const struct imgspec* hq_spec;
+	/* Hashes a file, see hash_entry() and hash_blocks(). */
+	void (*hq_hash)(const struct imgspec* const, struct entry* const,
+		char*, const size_t);
+	/* The files. */
+	struct entry** hq_ents;
+	/* Number of files in %hq_ents. */
+	__u64 hq_nents;
+	/* Next file to hash. */
+	__u64 hq_next;
+};
+
+/* Hash the content of %ent, reading it %bufsz bytes at a time
+ * into %buf.
+ */
+static void hash_entry(const struct imgspec* const spec,
+	struct entry* const ent, char* buf, const size_t bufsz)
+{
+	(void)spec;
+	
+	if (S_ISLNK(ent->e_mode)) {
+		load_entry_data(ent);
+		ent->e_hash = hostprog_hash(HOSTPROG_HASH_INIT,
+			ent->e_data, ent->e_size);
+		unload_entry_data(ent);
+		return;
+	}
+	
+	int fd = open(ent->e_path, O_RDONLY);
+	if (fd < 0)
+		error("failed to open \"%s\": %s", ent->e_path, strerror(errno));
+	
+	__u64 hash = HOSTPROG_HASH_INIT;
+	ssize_t sz;
+	while ((sz = read(fd, buf, bufsz)) != 0) {
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz < 0)
+			error("failed to read \"%s\": %s", ent->e_path, strerror(errno));
+		hash = hostprog_hash(hash, buf, sz);
+	}
+	
+	close(fd);
+	ent->e_hash = hash;
+}
+
+/* Hash each block of %ent (see find_sharedblks()), a block of
+ * zeros is a hole if holes are in use.
+ */
+static void hash_blocks(const struct imgspec* const spec,
+	struct entry* const ent, char* buf, const size_t bufsz)
+{
+	(void)buf;
+	(void)bufsz;
+	
+	if (!ent->e_blkrefs)
+		return;
+	
+	const __u64 datasz = ent->e_size - i_fragtail(ent->e_size,
+		ent->e_blksz, spec->sp_fragments);
+	const __u64 blks = i_ptrblks(ent->e_size, ent->e_blksz,
+		spec->sp_fragments);
+	
+	load_entry_data(ent);
+	for (__u64 i = 0; i < blks; i++) {
+		struct blkref* ref = &ent->e_blkrefs[i];
+		ref->br_ent = ent;
+		ref->br_offset = i * ent->e_blksz;
+		ref->br_size = i_blksz(datasz, i, ent->e_blksz);
+		ref->br_hole = spec->sp_zeroblocks
+			&& hostprog_iszero(ent->e_data + ref->br_offset, ref->br_size);
+		ref->br_hash = hostprog_hash(HOSTPROG_HASH_INIT,
+			ent->e_data + ref->br_offset, ref->br_size);
+	}
+	unload_entry_data(ent);
+}
+
+static void* hash_thread(void* arg)
+{
+	struct hashqueue* hq = arg;
+	
+	char* buf = malloc(MKI_HASHBUFSZ);
+	if (!buf)
+		error("failed to allocate the hash buffer");
+	
+	for (;;) {
+		pthread_mutex_lock(&hq->hq_mutex);
+		const __u64 i = hq->hq_next++;
+		pthread_mutex_unlock(&hq->hq_mutex);
+		if (i >= hq->hq_nents)
+			break;
+		hq->hq_hash(hq->hq_spec, hq->hq_ents[i], buf, MKI_HASHBUFSZ);
+	}
+	
+	free(buf);
+	return NULL;
+}
+
+/* Hash the given files with %hash on %sp_threads threads.
+ */
+static void hash_entries(const struct imgspec* const spec,
+	struct entry** ents, const __u64 nents,
+	void (*hash)(const struct imgspec* const, struct entry* const,
+		char*, const size_t))
+{
+	struct hashqueue hq = {
+		.hq_spec = spec,
+		.hq_hash = hash,
+		.hq_ents = ents,
+		.hq_nents = nents
+	};
+	pthread_mutex_init(&hq.hq_mutex, NULL);
+	
+	const __u64 nthreads = spec->sp_threads < nents ? spec->sp_threads : nents;
+	if (nthreads > 1) {
+		pthread_t* threads = malloc(nthreads * sizeof(*threads));
+		if (!threads)
+			error("failed to allocate the hash threads");
+		for (__u64 i = 0; i < nthreads; i++) {
+			int err = pthread_create(&threads[i], NULL, hash_thread, &hq);
+			if (err)
+				error("failed to create a hash thread: %s", strerror(err));
+		}
+		for (__u64 i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	} else {
+		hash_thread(&hq);
+	}
+	
+	pthread_mutex_destroy(&hq.hq_mutex);
+}
+
+static void link_duplicate(struct imgspec* const spec, struct entry* ent,
+	struct entry* duplicate)
+{
+	message(VERBOSITY_1, "%s == %s", ent->e_path, duplicate->e_path);
+	if (ent->e_same)
+		duplicate->e_same = ent->e_same;
+	ent->e_same = duplicate;
+	spec->sp_duplicatenodes += 1;
+	
+	spec->sp_blkptrs -= duplicate->e_blkptrs;
+	spec->sp_realdatasz -= duplicate->e_size;
+}
+
+/* Find the files with identical content. Hard links are found by
+ * their inode, the other files are only hashed if their size and
+ * layout matches another file, and only files with the same hash
+ * are compared.
+ */
 static void find_duplicates(struct imgspec* const spec)
 {
-	if (hostprog_stack_size(spec->sp_regstack) < 2)
+	struct entry** ents = (struct entry**)spec->sp_regstack->st_slots;
+	const __u64 files = spec->sp_regstack->st_index;
+	
+	if (files < 2)
 		return;
 	
-	qsort(spec->sp_regstack->st_slots, hostprog_stack_size(spec->sp_regstack),
-		sizeof(*spec->sp_regstack->st_slots), entryszcmp);
+	qsort(ents, files, sizeof(*ents), entryinocmp);
 	
-	const int files = hostprog_stack_size(spec->sp_regstack);
+	struct hostprog_stack* hashstack = NULL;
+	if (hostprog_stack_create(&hashstack, 64, 64) < 0)
+		error("failed to create the hash stack");
 	
-	for (int i = 0, last_sz = 0, last_i = 0; i < files; i++) {
-		struct entry* ent_i = (struct entry*)spec->sp_regstack->st_slots[i];
-		if (!ent_i)
+	for (__u64 i = 0, j; i < files; i = j) {
+		__u64 inodes = 1;
+		for (j = i + 1; j < files && entry_sameshape(ents[i], ents[j]); j++) {
+			if (!entry_sameinode(ents[j - 1], ents[j]))
+				inodes++;
+		}
+		if (inodes < 2)
 			continue;
-		
-		if (last_sz != (int)ent_i->e_size) {
-			last_sz = ent_i->e_size;
-			last_i = i;
+		for (__u64 k = i; k < j; k++) {
+			if (k == i || !entry_sameinode(ents[k - 1], ents[k])) {
+				if (hostprog_stack_push(hashstack, ents[k]) < 0)
+					error("failed to push an entry to the hash stack");
+			}
 		}
+	}
+	
+	hash_entries(spec, (struct entry**)hashstack->st_slots,
+		hashstack->st_index, hash_entry);
+	hostprog_stack_destroy(hashstack);
+	
+	/* Hard links share the hash of the first link.
+	 */
+	for (__u64 i = 1; i < files; i++) {
+		if (entry_sameshape(ents[i - 1], ents[i])
+				&& entry_sameinode(ents[i - 1], ents[i]))
+			ents[i]->e_hash = ents[i - 1]->e_hash;
+	}
+	
+	qsort(ents, files, sizeof(*ents), entryhashcmp);
+	
+	for (__u64 i = 0; i < files; i++) {
+		struct entry* ent_i = ents[i];
+		if (!ent_i)
+			continue;
 		
-		for (int j = last_i; j < files; j++) {
-			struct entry* ent_j = (struct entry*)spec->sp_regstack->st_slots[j];
-			if (!ent_j || ent_i == ent_j) {
+		for (__u64 j = i + 1; j < files; j++) {
+			struct entry* ent_j = ents[j];
+			if (!ent_j) {
 				continue;
-			} else if (ent_i->e_size != ent_j->e_size) {
+			} else if (!entry_sameshape(ent_i, ent_j)
+					|| ent_i->e_hash != ent_j->e_hash) {
 				break;
 			}
 			
-			load_entry_data(ent_i);
-			load_entry_data(ent_j);
-			if (memcmp(ent_i->e_data, ent_j->e_data, ent_i->e_size) == 0) {
-				message(VERBOSITY_1, "%s == %s", ent_i->e_path, ent_j->e_path);
-				if (ent_i->e_same)
-					ent_j->e_same = ent_i->e_same;
-				ent_i->e_same = ent_j;
-				spec->sp_regstack->st_slots[j] = NULL;
-				spec->sp_duplicatenodes += 1;
-				
-				spec->sp_blkptrs -= ent_j->e_blkptrs;
-				spec->sp_realdatasz -= ent_j->e_size;
+			if (!entry_sameinode(ent_i, ent_j)) {
+				/* Confirm that the content really is the same.
+				 */
+				if (!ent_i->e_data)
+					load_entry_data(ent_i);
+				load_entry_data(ent_j);
+				int same = memcmp(ent_i->e_data, ent_j->e_data,
+					ent_i->e_size) == 0;
+				unload_entry_data(ent_j);
+				if (!same)
+					continue;
 			}
+			
+			link_duplicate(spec, ent_i, ent_j);
+			ents[j] = NULL;
+		}
+		
+		if (ent_i->e_data)
 			unload_entry_data(ent_i);
-			unload_entry_data(ent_j);
+	}
+}
+
+/* Get the data of the block %ref, the data of the entry it
+ * belongs to is loaded unless it is %ent or *%loaded (which
+ * is unloaded first).
+ */
+static const char* blkref_data(const struct blkref* const ref,
+	struct entry* const ent, struct entry** const loaded)
+{
+	if (ref->br_ent != ent && ref->br_ent != *loaded) {
+		if (*loaded)
+			unload_entry_data(*loaded);
+		*loaded = ref->br_ent;
+		load_entry_data(*loaded);
+	}
+	return ref->br_ent->e_data + ref->br_offset;
+}
+
+/* Find the blocks which data is identical to the data of a block
+ * written before them, such a block shares the data of the first
+ * one instead of being written again. The blocks are hashed, and
+ * only blocks with the same hash, size and layout are compared.
+ * The files with shared blocks get block extents instead of block
+ * pointers, see %MICROFS_FLAG_SHAREDBLKS.
+ */
+static void find_sharedblks(struct imgspec* const spec)
+{
+	struct hostprog_stack* ents = spec->sp_packer->pk_ents;
+	const __u64 nents = ents->st_index;
+	
+	__u64 nblks = 0;
+	for (__u64 i = 0; i < nents; i++) {
+		struct entry* ent = ents->st_slots[i];
+		const __u64 blks = i_ptrblks(ent->e_size, ent->e_blksz,
+			spec->sp_fragments);
+		if (!blks)
+			continue;
+		ent->e_blkrefs = calloc(blks, sizeof(*ent->e_blkrefs));
+		if (!ent->e_blkrefs)
+			error("failed to allocate the blocks of \"%s\"", ent->e_path);
+		nblks += blks;
+	}
+	
+	hash_entries(spec, (struct entry**)ents->st_slots, nents, hash_blocks);
+	
+	/* The blocks which data is written, hashed with open
+	 * addressing.
+	 */
+	__u64 tablesz = 1;
+	while (tablesz < 2 * nblks)
+		tablesz <<= 1;
+	const struct blkref** table = calloc(tablesz, sizeof(*table));
+	if (!table)
+		error("failed to allocate the block table");
+	
+	struct entry* loaded = NULL;
+	__u64 worstoffset = 0;
+	
+	for (__u64 i = 0; i < nents; i++) {
+		struct entry* ent = ents->st_slots[i];
+		if (!ent->e_blkrefs)
+			continue;
+		
+		const __u64 blks = i_ptrblks(ent->e_size, ent->e_blksz,
+			spec->sp_fragments);
+		const __u64 blkub = entry_blkupperbound(ent);
+		
+		/* The block pointers of a large image are relative to a
+		 * base, the shared blocks of a file must not be too far
+		 * from the end of its data even in the worst case.
+		 */
+		const __u64 worstend = worstoffset + blks * blkub;
+		
+		__u64 shared = 0;
+		__u64 sharedsz = 0;
+		
+		load_entry_data(ent);
+		for (__u64 j = 0; j < blks; j++) {
+			struct blkref* ref = &ent->e_blkrefs[j];
+			if (ref->br_hole)
+				continue;
+			
+			__u64 slot = ref->br_hash & (tablesz - 1);
+			for (; table[slot]; slot = (slot + 1) & (tablesz - 1)) {
+				const struct blkref* other = table[slot];
+				if (other->br_hash != ref->br_hash
+						|| other->br_size != ref->br_size
+						|| other->br_ent->e_framesz != ent->e_framesz
+						|| other->br_ent->e_codec != ent->e_codec
+						|| (spec->sp_largeimage
+							&& worstend - other->br_worstoffset > UINT32_MAX))
+					continue;
+				if (memcmp(blkref_data(other, ent, &loaded),
+						ent->e_data + ref->br_offset, ref->br_size) == 0) {
+					ref->br_same = other;
+					break;
+				}
+			}
+			
+			if (ref->br_same) {
+				shared++;
+				sharedsz += ref->br_size;
+				continue;
+			}
+			
+			ref->br_worstoffset = worstoffset;
+			worstoffset += blkub;
+			table[slot] = ref;
 		}
+		unload_entry_data(ent);
+		
+		if (!shared)
+			continue;
+		
+		/* Block extents take more room than block pointers, but
+		 * the data of the shared blocks is not written.
+		 */
+		const __u64 blkptrs = i_blkptrsz(ent->e_size, ent->e_blksz,
+			spec->sp_fragments, spec_fileinfosz(spec), MICROFS_FILEINFO_EXTENTS)
+			/ (MICROFS_IOFFSET_WIDTH / 8);
+		spec->sp_blkptrs += blkptrs - ent->e_blkptrs;
+		spec->sp_upperbound += (MICROFS_IOFFSET_WIDTH / 8)
+			* (blkptrs - ent->e_blkptrs);
+		spec->sp_upperbound -= blkub * shared;
+		spec->sp_realdatasz -= sharedsz;
+		spec->sp_sharedblkcount += shared;
+		ent->e_blkptrs = blkptrs;
+		ent->e_lenbits = MICROFS_FILEINFO_EXTENTS;
+		
+		message(VERBOSITY_1, "%llu of %llu blocks shared\t\t%s",
+			shared, blks, ent->e_path);
 	}
+	
+	if (loaded)
+		unload_entry_data(loaded);
+	free(table);
 }
 
 static struct entry* devtable_find_entry(struct entry* walker,
@@ -837,18 +2466,34 @@ static void usage(const char* const exe, FILE* const dest,
 		" -p          pad by %d bytes to make room for boot code\n"
 		" -q          squash permissions (make everything owned by root)\n"
 		" -s          include sockets in the image\n"
+		" -i          write a hashed index for each directory\n"
+		" -r          store blocks that do not compress uncompressed\n"
+		" -f          pack the tails of files into shared fragment blocks\n"
+		" -I          store tiny files and symlinks inline in their dentries\n"
+		" -z          store blocks of zeros as holes\n"
+		" -k          pack the block pointers of each file\n"
+		" -L          allow the image to be bigger than 4 GiB\n"
+		" -x          share identical blocks between files\n"
 		" -S          do NOT eliminate regular file duplicates\n"
 		" -b <int>    desired block size in bytes (power of two; min=%d, max=%d)\n"
+		" -B <str>    use smaller blocks for the files matching a pattern\n"
+		" -F <int>    split bigger blocks into sub-frames of the given size\n"
 		" -u <int>    artificial upper bound given in bytes\n"
 		" -P <int>    pad image size to a multiple of the given power of two (default=%llu)\n"
 		" -n <str>    give the image a name\n"
 		" -c <str>    compression library to use (default=zlib)\n"
 		" -D <str>    use the given file as a device table\n"
 		" -l <str>    pass options to the compression library\n"
+		" -m <str>    compress the files matching a pattern with another library\n"
+		" -j <int>    number of threads used to hash and compress the data (default=1)\n"
 		" dirname     root of the directory tree to be compressed\n"
 		" outfile     image output file\n"
 		"\nCompression options (-l) are given as:\n"
 		" -l param_name0=value0,param_name1,param_name2=value2,...\n"
+		"\nLibrary rules (-m) are given as (the first matching rule is used):\n"
+		" -m library:pattern\n"
+		"\nBlock size rules (-B) are given as (the first matching rule is used):\n"
+		" -B blocksize:pattern\n"
 		"\n", exe, MKI_OPTIONS, exe, MICROFS_PADDING,
 		MICROFS_MINBLKSZ, MICROFS_MAXBLKSZ, spec->sp_pagesz);
 	
@@ -864,24 +2509,158 @@ static void usage(const char* const exe, FILE* const dest,
 	exit(dest == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-static void lib_options(struct imgspec* spec)
+/* Pass the library options to the given instance %data of the
+ * primary library.
+ */
+static void lib_options(const struct imgspec* const spec, void* data)
 {
 	if (spec->sp_lib_options) {
-		char* options = spec->sp_lib_options;
+		/* The options are split in place, and each compression
+		 * thread has its own instance of the library.
+		 */
+		char* options = strdup(spec->sp_lib_options);
+		if (!options)
+			error("failed to allocate the library options");
+		char* cursor = options;
 		char* token;
 		char* value;
-		while ((token = strsep(&options, ","))) {
+		while ((token = strsep(&cursor, ","))) {
 			if ((value = strchr(token, '=')))
 				*value++ = '\0';
-			if (spec->sp_lib->hl_mk_option(spec->sp_lib_data,
-					token, value) < 0) {
+			if (spec->sp_lib->hl_mk_option(data, token, value) < 0) {
 				error("failed to handle library option %s=%s: %s",
 					token, value, strerror(errno));
 			}
 		}
+		free(options);
 	}
 }
 
+/* Initialize the libraries named by the library rules, the
+ * primary library must already be initialized.
+ */
+static void init_codecs(struct imgspec* spec)
+{
+	const struct hostprog_lib* primary = spec->sp_lib;
+	
+	spec->sp_codecs[microfs_codecidx(primary->hl_info->li_id)]
+		= (struct hostprog_codec){ primary, spec->sp_lib_data };
+	
+	for (__u64 i = 0; i < spec->sp_ncodecrules; i++) {
+		const struct hostprog_lib* lib = hostprog_lib_find_byname(
+			spec->sp_codecrules[i].cr_lib);
+		if (!lib) {
+			error("could not find a compression library named %s",
+				spec->sp_codecrules[i].cr_lib);
+		}
+		if (!lib->hl_compiled)
+			error("%s support has not been compiled", lib->hl_info->li_name);
+		
+		struct hostprog_codec* codec = &spec->sp_codecs[microfs_codecidx(
+			lib->hl_info->li_id)];
+		if (codec->hc_lib)
+			continue;
+		
+		codec->hc_lib = lib;
+		if (lib->hl_init(&codec->hc_lib_data, spec->sp_blksz) < 0)
+			error("failed to init %s", lib->hl_info->li_name);
+		if (lib->hl_info->li_min_blksz == 0 && spec->sp_blksz < spec->sp_pagesz) {
+			warning("block size smaller than page size of host"
+				" - the resulting image can not be used on this host");
+		}
+		spec->sp_upperbound += spec_ddsz(spec, lib);
+	}
+}
+
+/* Create the packer, each compression thread has its own
+ * instances of the libraries in use.
+ */
+static void init_packer(struct imgspec* spec)
+{
+	struct packer* pk = malloc(sizeof(*pk));
+	if (!pk)
+		error("failed to allocate the packer");
+	memset(pk, 0, sizeof(*pk));
+	spec->sp_packer = pk;
+	
+	/* The writer compresses the data itself when a single
+	 * thread is used.
+	 */
+	pk->pk_nthreads = spec->sp_threads > 1 ? spec->sp_threads : 0;
+	pk->pk_njobs = pk->pk_nthreads ? pk->pk_nthreads * MKI_THREADJOBS : 1;
+	pk->pk_jobsz = spec->sp_compressionbufsz;
+	
+	pk->pk_jobs = calloc(pk->pk_njobs, sizeof(*pk->pk_jobs));
+	if (!pk->pk_jobs)
+		error("failed to allocate the compression jobs");
+	for (__u64 i = 0; i < pk->pk_njobs; i++) {
+		pk->pk_jobs[i].pj_output = malloc(pk->pk_jobsz);
+		if (!pk->pk_jobs[i].pj_output)
+			error("failed to allocate the compression buffers");
+	}
+	
+	if (hostprog_stack_create(&pk->pk_ents, 64, 64) < 0)
+		error("failed to create the entry queue");
+	
+	pthread_mutex_init(&pk->pk_mutex, NULL);
+	pthread_cond_init(&pk->pk_queuedcond, NULL);
+	pthread_cond_init(&pk->pk_donecond, NULL);
+	
+	pk->pk_threads = calloc(pk->pk_nthreads, sizeof(*pk->pk_threads));
+	if (pk->pk_nthreads && !pk->pk_threads)
+		error("failed to allocate the compression threads");
+	
+	for (__u64 i = 0; i < pk->pk_nthreads; i++) {
+		struct packthread* thread = &pk->pk_threads[i];
+		thread->pt_packer = pk;
+		for (int j = 0; j < MICROFS_MAXCODECS; j++) {
+			const struct hostprog_lib* lib = spec->sp_codecs[j].hc_lib;
+			if (!lib)
+				continue;
+			thread->pt_codecs[j].hc_lib = lib;
+			if (lib->hl_init(&thread->pt_codecs[j].hc_lib_data,
+					spec->sp_blksz) < 0)
+				error("failed to init %s", lib->hl_info->li_name);
+			if (lib == spec->sp_lib) {
+				lib_options(spec, thread->pt_codecs[j].hc_lib_data);
+				if (lib->hl_mk_usedict(thread->pt_codecs[j].hc_lib_data,
+						spec->sp_lib_data) < 0)
+					error("failed to share the dictionary of %s", lib->hl_info->li_name);
+			}
+		}
+		int err = pthread_create(&thread->pt_thread, NULL,
+			packer_thread, thread);
+		if (err)
+			error("failed to create a compression thread: %s", strerror(err));
+	}
+}
+
+static void destroy_packer(struct imgspec* spec)
+{
+	struct packer* pk = spec->sp_packer;
+	
+	pthread_mutex_lock(&pk->pk_mutex);
+	pk->pk_exit = 1;
+	pthread_cond_broadcast(&pk->pk_queuedcond);
+	pthread_mutex_unlock(&pk->pk_mutex);
+	
+	for (__u64 i = 0; i < pk->pk_nthreads; i++)
+		pthread_join(pk->pk_threads[i].pt_thread, NULL);
+	
+	for (__u64 i = 0; i < pk->pk_njobs; i++)
+		free(pk->pk_jobs[i].pj_output);
+	free(pk->pk_jobs);
+	free(pk->pk_threads);
+	hostprog_stack_destroy(pk->pk_ents);
+	
+	pthread_cond_destroy(&pk->pk_donecond);
+	pthread_cond_destroy(&pk->pk_queuedcond);
+	pthread_mutex_destroy(&pk->pk_mutex);
+	
+	free(pk);
+	spec->sp_packer = NULL;
+}
+
 static struct imgspec* create_imgspec(int argc, char* argv[])
 {
 	struct imgspec* spec = malloc(sizeof(*spec));
@@ -904,6 +2683,7 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	spec->sp_pagesz = sysconf(_SC_PAGESIZE);
 	spec->sp_blksz = MICROFS_DEFAULBLKSZ;
 	spec->sp_szpad = spec->sp_pagesz;
+	spec->sp_threads = 1;
 	
 	if (argc < 2)
 		usage(argc > 0 ? argv[0] : "microfsmki", stderr, spec);
@@ -915,6 +2695,7 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	char optionbuffer[3];
 	while ((option = getopt(argc, argv, MKI_OPTIONS)) != EOF) {
 		size_t len;
+		char* pattern;
 		switch (option) {
 			case 'h':
 				usage(argv[0], stdout, spec);
@@ -934,6 +2715,30 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 			case 's':
 				spec->sp_incsocks = 1;
 				break;
+			case 'i':
+				spec->sp_dirindex = 1;
+				break;
+			case 'r':
+				spec->sp_storedblocks = 1;
+				break;
+			case 'f':
+				spec->sp_fragments = 1;
+				break;
+			case 'I':
+				spec->sp_inlinedata = 1;
+				break;
+			case 'z':
+				spec->sp_zeroblocks = 1;
+				break;
+			case 'k':
+				spec->sp_packedblkptrs = 1;
+				break;
+			case 'L':
+				spec->sp_largeimage = 1;
+				break;
+			case 'x':
+				spec->sp_sharedblks = 1;
+				break;
 			case 'S':
 				spec->sp_shareblocks = 0;
 				break;
@@ -949,6 +2754,28 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 						MICROFS_MINBLKSZ, MICROFS_MAXBLKSZ);
 				}
 				break;
+			case 'B':
+				pattern = strchr(optarg, ':');
+				if (!pattern)
+					error("block size rules are given as blocksize:pattern");
+				*pattern++ = '\0';
+				spec->sp_blkszrules = realloc(spec->sp_blkszrules,
+					(spec->sp_nblkszrules + 1) * sizeof(*spec->sp_blkszrules));
+				if (!spec->sp_blkszrules)
+					error("failed to allocate the block size rules");
+				opt_strtolx(ul, optiontostr(option, optionbuffer), optarg,
+					spec->sp_blkszrules[spec->sp_nblkszrules].br_blksz);
+				spec->sp_blkszrules[spec->sp_nblkszrules++].br_pattern = pattern;
+				break;
+			case 'F':
+				opt_strtolx(ull, optiontostr(option, optionbuffer),
+					optarg, spec->sp_framesz);
+				if (!microfs_ispow2(spec->sp_framesz))
+					error("the sub-frame size must be a power of two");
+				if (spec->sp_framesz < MICROFS_MINBLKSZ)
+					error("sub-frame size out of boundaries, %llu given; min=%d",
+						spec->sp_framesz, MICROFS_MINBLKSZ);
+				break;
 			case 'u':
 				opt_strtolx(ull, optiontostr(option, optionbuffer),
 					optarg, spec->sp_usrupperbound);
@@ -979,6 +2806,25 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 			case 'l':
 				spec->sp_lib_options = optarg;
 				break;
+			case 'm':
+				pattern = strchr(optarg, ':');
+				if (!pattern)
+					error("library rules are given as library:pattern");
+				*pattern++ = '\0';
+				spec->sp_codecrules = realloc(spec->sp_codecrules,
+					(spec->sp_ncodecrules + 1) * sizeof(*spec->sp_codecrules));
+				if (!spec->sp_codecrules)
+					error("failed to allocate the library rules");
+				spec->sp_codecrules[spec->sp_ncodecrules++]
+					= (struct codecrule){ optarg, pattern };
+				break;
+			case 'j':
+				opt_strtolx(ull, optiontostr(option, optionbuffer),
+					optarg, spec->sp_threads);
+				if (spec->sp_threads < 1 || spec->sp_threads > MKI_MAXTHREADS)
+					error("thread count out of boundaries, %llu given;"
+						" min=1, max=%d", spec->sp_threads, MKI_MAXTHREADS);
+				break;
 			default:
 				/* Ignore it.
 				 */
@@ -997,6 +2843,20 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	if (spec->sp_usrupperbound % spec->sp_blksz != 0)
 		error("upper bound must be a multiple of the block size");
 	
+	/* The block size of the image is the largest block size that
+	 * a file can use, the buffers of the kernel are sized after it.
+	 */
+	for (__u64 i = 0; i < spec->sp_nblkszrules; i++) {
+		const __u64 rule_blksz = spec->sp_blkszrules[i].br_blksz;
+		if (!microfs_ispow2(rule_blksz))
+			error("the block size must be a power of two");
+		if (rule_blksz < MICROFS_MINBLKSZ || rule_blksz > spec->sp_blksz) {
+			error("block size out of boundaries, %llu given;"
+				" min=%d, max=%llu", rule_blksz,
+				MICROFS_MINBLKSZ, spec->sp_blksz);
+		}
+	}
+	
 	if (hostprog_stack_create(&spec->sp_regstack, 64, 64) < 0)
 		error("failed to create the regular file stack");
 	
@@ -1006,6 +2866,8 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	}
 	
 	spec->sp_upperbound = sizeof(struct microfs_sb);
+	if (spec->sp_largeimage)
+		spec->sp_upperbound += sizeof(struct microfs_sb_large);
 	if (spec->sp_pad)
 		spec->sp_upperbound += MICROFS_PADDING;
 	
@@ -1019,9 +2881,12 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	if (spec->sp_lib->hl_init(&spec->sp_lib_data, spec->sp_blksz) < 0)
 		error("failed to init %s", spec->sp_lib->hl_info->li_name);
 	
-	lib_options(spec);
+	lib_options(spec, spec->sp_lib_data);
+	
+	spec->sp_dictionary = spec->sp_lib->hl_mk_dictsz(spec->sp_lib_data) != 0;
+	spec->sp_upperbound += spec_ddsz(spec, spec->sp_lib);
 	
-	spec->sp_upperbound += spec->sp_lib->hl_info->li_dd_sz;
+	init_codecs(spec);
 	
 	if (spec->sp_lib->hl_info->li_min_blksz == 0 && spec->sp_blksz < spec->sp_pagesz) {
 		warning("block size smaller than page size of host"
@@ -1056,6 +2921,47 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 		devtable_parse(devtable_process_dentry, spec,
 			spec->sp_devtable, MICROFS_ISIZE_WIDTH);
 	
+	if (spec->sp_fragments)
+		pack_fragments(spec);
+	
+	train_dictionary(spec);
+	
+	/* The worst case compression scenario will always fit in the
+	 * buffer since the upper bound for a data size smaller than
+	 * a block is always smaller than the upper bound for an entire
+	 * block.
+	 */
+	for (int i = 0; i < MICROFS_MAXCODECS; i++) {
+		const struct hostprog_codec* codec = &spec->sp_codecs[i];
+		const __u64 upperbound = codec->hc_lib
+			? codec->hc_lib->hl_upperbound(codec->hc_lib_data, spec->sp_blksz)
+			: 0;
+		if (upperbound > spec->sp_compressionbufsz)
+			spec->sp_compressionbufsz = upperbound;
+	}
+	
+	init_packer(spec);
+	
+	/* The files are queued in the order that their data is
+	 * written, which is the order that blocks are shared in.
+	 */
+	if (spec->sp_root->e_firstchild)
+		queue_entries(spec, spec->sp_root->e_firstchild);
+	
+	if (spec->sp_sharedblks)
+		find_sharedblks(spec);
+	
+	/* A directory index is at most three bytes of alignment, a
+	 * header and one extra bucket start, plus two bucket starts
+	 * and one entry per dentry.
+	 */
+	if (spec->sp_dirindex) {
+		spec->sp_upperbound += (spec->sp_dirnodes + 1)
+			* (3 + sizeof(struct microfs_dirindex) + sizeof(__le32))
+			+ spec->sp_files * (2 * sizeof(__le32)
+				+ sizeof(struct microfs_dirindex_entry));
+	}
+	
 	if (spec->sp_usrupperbound && spec->sp_upperbound > spec->sp_usrupperbound) {
 		warning("the estimated upper bound %llu is larger than the"
 			" user requested upper bound %llu", spec->sp_upperbound,
@@ -1067,12 +2973,14 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	spec->sp_upperbound = sz_blkceil(spec->sp_upperbound,
 		MICROFS_MAXBLKSZ);
 	
-	if (spec->sp_upperbound > MICROFS_MAXIMGSIZE) {
+	const __u64 maxsz = spec->sp_largeimage
+		? MICROFS_MAXLARGEIMGSIZE : MICROFS_MAXIMGSIZE;
+	if (spec->sp_upperbound > maxsz) {
 		warning("upper bound image size (absolute worst-case scenario)"
 			" of %llu bytes is larger than the max image size of %llu bytes,"
 			" there might not be room for everything", spec->sp_upperbound,
-			MICROFS_MAXIMGSIZE);
-		spec->sp_upperbound = MICROFS_MAXIMGSIZE;
+			maxsz);
+		spec->sp_upperbound = maxsz;
 	}
 	
 	int flags = O_RDWR | O_CREAT | O_TRUNC;
@@ -1080,19 +2988,9 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	if (spec->sp_fd < 0)
 		error("failed to open \"%s\": %s", spec->sp_rootdir, strerror(errno));
 	
-	/* The worst case compression scenario will always fit in the
-	 * buffer since the upper bound for a data size smaller than
-	 * a block is always smaller than the upper bound for an entire
-	 * block.
-	 */
-	spec->sp_compressionbufsz = spec->sp_lib->hl_upperbound(
-		spec->sp_lib_data, spec->sp_blksz);
-	spec->sp_compressionbuf = malloc(spec->sp_compressionbufsz);
-	if (!spec->sp_compressionbuf)
-		error("failed to allocate the compression buffer");
-	
 	message(VERBOSITY_1, "Block size: %llu", spec->sp_blksz);
 	message(VERBOSITY_1, "Block shift: %llu", spec->sp_blkshift);
+	message(VERBOSITY_1, "Compression threads: %llu", spec->sp_threads);
 	
 	message(VERBOSITY_0, "Compression library: %s", spec->sp_lib->hl_info->li_name);
 	message(VERBOSITY_0, "Upper bound image size: %llu bytes", spec->sp_upperbound);
@@ -1100,11 +2998,14 @@ static struct imgspec* create_imgspec(int argc, char* argv[])
 	message(VERBOSITY_0, "Directories: %llu", spec->sp_dirnodes);
 	message(VERBOSITY_0, "Regular files: %llu", spec->sp_regnodes);
 	message(VERBOSITY_0, "Duplicate files: %llu", spec->sp_duplicatenodes);
+	if (spec->sp_sharedblks)
+		message(VERBOSITY_0, "Shared blocks: %llu", spec->sp_sharedblkcount);
 	message(VERBOSITY_0, "Special files: %llu", spec->sp_specnodes);
 	message(VERBOSITY_0, "Skipped files: %llu", spec->sp_skipnodes);
 	message(VERBOSITY_1, "Data size: %llu", spec->sp_datasz);
 	message(VERBOSITY_1, "Real data size: %llu", spec->sp_realdatasz);
 	message(VERBOSITY_1, "Block pointers required: %llu", spec->sp_blkptrs);
+	message(VERBOSITY_1, "Fragment blocks: %llu", spec->sp_fragblks);
 	
 	if (spec->sp_skipnodes) {
 		warning("not all files will be included in the image");
@@ -1125,11 +3026,15 @@ static void materialize_imgspec(struct imgspec* const spec)
 	if (image == MAP_FAILED)
 		error("failed to mmap the image file: %s", strerror(errno));
 	
-	__u64 offset = superblock_offset(spec) + sizeof(struct microfs_sb);
+	__u64 offset = superblock_offset(spec) + sizeof(struct microfs_sb)
+		+ (spec->sp_largeimage ? sizeof(struct microfs_sb_large) : 0);
 	
 	offset = write_decompressordata(spec, image, offset);
 	offset = write_metadata(spec, image, offset);
 	offset = write_data(spec, image, offset);
+	offset = write_dictionaries(spec, image, offset);
+	
+	destroy_packer(spec);
 	
 	const __u64 innersz = offset;
 	const __u64 outersz = sz_blkceil(offset, spec->sp_szpad);
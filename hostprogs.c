@@ -50,6 +50,42 @@ int fykshuffle(void** slots, const size_t length)
 	return 0;
 }
 
+int hostprog_iszero(const void* data, size_t sz)
+{
+	const unsigned char* p = data;
+	
+	/* OR together a few words at a time, the inner loop has no
+	 * branches and is easily vectorized by the compiler.
+	 */
+	while (sz >= 64) {
+		__u64 words[8];
+		__u64 acc = 0;
+		memcpy(words, p, sizeof(words));
+		for (size_t i = 0; i < 8; i++)
+			acc |= words[i];
+		if (acc)
+			return 0;
+		p += 64;
+		sz -= 64;
+	}
+	while (sz--) {
+		if (*p++)
+			return 0;
+	}
+	return 1;
+}
+
+__u64 hostprog_hash(__u64 hash, const void* data, size_t sz)
+{
+	const unsigned char* p = data;
+	
+	while (sz--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 int hostprog_werror = 0;
 int hostprog_verbosity = 0;
 
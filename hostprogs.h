@@ -40,6 +40,7 @@
 #include <time.h>
 
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <unistd.h>
 
@@ -163,6 +164,19 @@ static inline char nodtype(const mode_t mode)
  */
 int fykshuffle(void** slots, size_t length);
 
+/* Determine if the %sz bytes at %data are all zero.
+ */
+int hostprog_iszero(const void* data, size_t sz);
+
+/* Initial value for %hostprog_hash().
+ */
+#define HOSTPROG_HASH_INIT 0xcbf29ce484222325ULL
+
+/* Continue the 64-bit FNV-1a hash %hash over the %sz bytes at
+ * %data, which makes it possible to hash data in chunks.
+ */
+__u64 hostprog_hash(__u64 hash, const void* data, size_t sz);
+
 /* Skewed number in [min, max].
  */
 static inline int rand_nonuniform_range(int min, int max)
@@ -96,10 +96,47 @@ __u64 hostprog_lib_mk_dd(void* data, char* base, __u64 offset)
 	return offset;
 }
 
-int hostprog_lib_ck_dd(void* data, char* dd)
+__u32 hostprog_lib_mk_dictsz(void* data)
 {
 	(void)data;
-	(void)dd;
+	return 0;
+}
+
+int hostprog_lib_mk_train(void* data, const char* samples,
+	const size_t* samplesz, __u32 nsamples, int* implerr)
+{
+	(void)data;
+	(void)samples;
+	(void)samplesz;
+	(void)nsamples;
+	*implerr = 0;
+	return 0;
+}
+
+int hostprog_lib_mk_usedict(void* data, void* src)
+{
+	(void)data;
+	(void)src;
+	return 0;
+}
+
+__u64 hostprog_lib_mk_dict(void* data, char* base, __u64 dd_offset,
+	__u64 offset)
+{
+	(void)data;
+	(void)base;
+	(void)dd_offset;
+	return offset;
+}
+
+int hostprog_lib_ck_dd(void* data, char* base, __u64 sz, __u64 offset,
+	__u64* dictsz)
+{
+	(void)data;
+	(void)base;
+	(void)sz;
+	(void)offset;
+	(void)dictsz;
 	return 0;
 }
 
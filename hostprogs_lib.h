@@ -40,8 +40,28 @@ struct hostprog_lib {
 	int (*hl_mk_option)(void* data, const char* name, const char* value);
 	/* Write "on-disk" decompressor data. */
 	__u64 (*hl_mk_dd)(void* data, char* base, __u64 offset);
-	/* Check "on-disk" decompressor data. */
-	int (*hl_ck_dd)(void* data, char* dd);
+	/* Get the max size of the dictionary to train (zero if the
+	 * library does not use one).
+	 */
+	__u32 (*hl_mk_dictsz)(void* data);
+	/* Train the dictionary on %nsamples samples stored back to
+	 * back at %samples.
+	 */
+	int (*hl_mk_train)(void* data, const char* samples,
+		const size_t* samplesz, __u32 nsamples, int* implerr);
+	/* Compress using the dictionary trained by the instance %src. */
+	int (*hl_mk_usedict)(void* data, void* src);
+	/* Write the dictionary (if any) to %offset and refer to it from
+	 * the "on-disk" decompressor data at %dd_offset.
+	 */
+	__u64 (*hl_mk_dict)(void* data, char* base, __u64 dd_offset,
+		__u64 offset);
+	/* Check "on-disk" decompressor data at %offset in the image of
+	 * %sz bytes at %base, the size of the dictionary that it refers
+	 * to (if any) is added to %dictsz.
+	 */
+	int (*hl_ck_dd)(void* data, char* base, __u64 sz, __u64 offset,
+		__u64* dictsz);
 	/* Compress data. */
 	int (*hl_compress)(void* data, void* destbuf, __u32* destbufsz,
 		void* srcbuf, __u32 srcbufsz, int* implerr);
@@ -54,6 +74,15 @@ struct hostprog_lib {
 	const char* (*hl_strerror)(void* data, int implerr);
 };
 
+/* A compression library along with its private data.
+ */
+struct hostprog_codec {
+	/* The library. */
+	const struct hostprog_lib* hc_lib;
+	/* Private data for the library. */
+	void* hc_lib_data;
+};
+
 extern const struct hostprog_lib hostprog_lib_zlib;
 extern const struct hostprog_lib hostprog_lib_lz4;
 extern const struct hostprog_lib hostprog_lib_lzo;
@@ -70,7 +99,14 @@ const struct hostprog_lib** hostprog_lib_all(void);
 void hostprog_lib_mk_usage(FILE* const dest);
 int hostprog_lib_mk_option(void* data, const char* name, const char* value);
 __u64 hostprog_lib_mk_dd(void* data, char* base, __u64 offset);
-int hostprog_lib_ck_dd(void* data, char* base);
+__u32 hostprog_lib_mk_dictsz(void* data);
+int hostprog_lib_mk_train(void* data, const char* samples,
+	const size_t* samplesz, __u32 nsamples, int* implerr);
+int hostprog_lib_mk_usedict(void* data, void* src);
+__u64 hostprog_lib_mk_dict(void* data, char* base, __u64 dd_offset,
+	__u64 offset);
+int hostprog_lib_ck_dd(void* data, char* base, __u64 sz, __u64 offset,
+	__u64* dictsz);
 
 __u32 hostprog_lib_zlib_crc32(char* data, __u64 sz);
 
@@ -86,6 +86,10 @@ const struct hostprog_lib hostprog_lib_lzo = {
 	.hl_mk_usage = hostprog_lib_mk_usage,
 	.hl_mk_option = hostprog_lib_mk_option,
 	.hl_mk_dd = hostprog_lib_mk_dd,
+	.hl_mk_dictsz = hostprog_lib_mk_dictsz,
+	.hl_mk_train = hostprog_lib_mk_train,
+	.hl_mk_usedict = hostprog_lib_mk_usedict,
+	.hl_mk_dict = hostprog_lib_mk_dict,
 	.hl_ck_dd = hostprog_lib_ck_dd,
 	.hl_compress = hostprog_lib_lzo_compress,
 	.hl_decompress = hostprog_lib_lzo_decompress,
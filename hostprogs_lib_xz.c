@@ -187,12 +187,16 @@ static __u64 hostprog_lib_xz_mk_dd(void* data, char* base, __u64 offset)
 	return offset + hostprog_lib_xz.hl_info->li_dd_sz;
 }
 
-static int hostprog_lib_xz_ck_dd(void* data, char* dd)
+static int hostprog_lib_xz_ck_dd(void* data, char* base, __u64 sz, __u64 offset,
+	__u64* dictsz)
 {
 	int err = -1;
-	struct microfs_dd_xz* dd_xz = (struct microfs_dd_xz*)dd;
+	struct microfs_dd_xz* dd_xz = (struct microfs_dd_xz*)(base + offset);
 	struct hostprog_lib_xz_data* xz_data = data;
 	
+	(void)sz;
+	(void)dictsz;
+	
 	if (__le32_to_cpu(dd_xz->dd_magic) == MICROFS_DD_XZ_MAGIC) {
 		xz_data->d_opts.dict_size = __le32_to_cpu(dd_xz->dd_dictsz);
 		if (xz_data->d_opts.dict_size >= LZMA_DICT_SIZE_MIN)
@@ -294,6 +298,10 @@ const struct hostprog_lib hostprog_lib_xz = {
 	.hl_mk_usage = hostprog_lib_xz_mk_usage,
 	.hl_mk_option = hostprog_lib_xz_mk_option,
 	.hl_mk_dd = hostprog_lib_xz_mk_dd,
+	.hl_mk_dictsz = hostprog_lib_mk_dictsz,
+	.hl_mk_train = hostprog_lib_mk_train,
+	.hl_mk_usedict = hostprog_lib_mk_usedict,
+	.hl_mk_dict = hostprog_lib_mk_dict,
 	.hl_ck_dd = hostprog_lib_xz_ck_dd,
 	.hl_compress = hostprog_lib_xz_compress,
 	.hl_decompress = hostprog_lib_xz_decompress,
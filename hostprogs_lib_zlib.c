@@ -32,7 +32,17 @@
 __u32 hostprog_lib_zlib_crc32(char* data, __u64 sz)
 {
 	__u32 crc = crc32(0L, Z_NULL, 0);
-	return crc32(crc, (Bytef*)data, sz);
+	
+	/* The length taken by crc32() is an uInt, a large image is
+	 * checksummed piece by piece.
+	 */
+	while (sz > 0) {
+		const uInt n = sz > (1U << 30) ? (1U << 30) : sz;
+		crc = crc32(crc, (Bytef*)data, n);
+		data += n;
+		sz -= n;
+	}
+	return crc;
 }
 
 #ifdef HOSTPROGS_LIB_ZLIB
@@ -87,8 +97,10 @@ err_args:
 static int hostprog_lib_zlib_compress(void* data, void* destbuf, __u32* destbufsz,
 	void* srcbuf, __u32 srcbufsz, int* implerr)
 {
-	*implerr = compress2((Bytef*)destbuf, (uLongf*)destbufsz,
+	uLongf destsz = *destbufsz;
+	*implerr = compress2((Bytef*)destbuf, &destsz,
 		(Bytef*)srcbuf, (uLongf)srcbufsz, *(int*)data);
+	*destbufsz = destsz;
 	return *implerr == Z_OK ? 0 : -1;
 }
 
@@ -97,8 +109,10 @@ static int hostprog_lib_zlib_decompress(void* data, void* destbuf, __u32* destbu
 {
 	(void)data;
 	
-	*implerr = uncompress((Bytef*)destbuf, (uLongf*)destbufsz,
+	uLongf destsz = *destbufsz;
+	*implerr = uncompress((Bytef*)destbuf, &destsz,
 		(Bytef*)srcbuf, (uLongf)srcbufsz);
+	*destbufsz = destsz;
 	return *implerr == Z_OK ? 0 : -1;
 }
 
@@ -123,6 +137,10 @@ const struct hostprog_lib hostprog_lib_zlib = {
 	.hl_mk_usage = hostprog_lib_zlib_mk_usage,
 	.hl_mk_option = hostprog_lib_zlib_mk_option,
 	.hl_mk_dd = hostprog_lib_mk_dd,
+	.hl_mk_dictsz = hostprog_lib_mk_dictsz,
+	.hl_mk_train = hostprog_lib_mk_train,
+	.hl_mk_usedict = hostprog_lib_mk_usedict,
+	.hl_mk_dict = hostprog_lib_mk_dict,
 	.hl_ck_dd = hostprog_lib_ck_dd,
 	.hl_compress = hostprog_lib_zlib_compress,
 	.hl_decompress = hostprog_lib_zlib_decompress,
@@ -29,11 +29,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <zdict.h>
 #include <zstd.h>
 
+/* zdict refuses to train dictionaries smaller than this.
+ */
+#define HOSTPROG_LIB_ZSTD_MINDICTSZ 256
+
 struct hostprog_lib_zstd_data {
 	int d_compression;
 	ZSTD_CCtx* d_cctx;
+	ZSTD_DCtx* d_dctx;
+	__u32 d_maxdictsz;
+	char* d_dict;
+	__u32 d_dictsz;
+	__u32 d_dictid;
+	ZSTD_CDict* d_cdict;
+	ZSTD_DDict* d_ddict;
 };
 
 static int hostprog_lib_zstd_init(void** data, __u32 blksz)
@@ -45,10 +57,12 @@ static int hostprog_lib_zstd_init(void** data, __u32 blksz)
 	if (!(*data = zstd_data = malloc(sizeof(*zstd_data)))) {
 		goto err_mem;
 	}
+	memset(zstd_data, 0, sizeof(*zstd_data));
 	
 	zstd_data->d_compression = 15;
 	zstd_data->d_cctx = ZSTD_createCCtx();
-	if (zstd_data->d_cctx == NULL) {
+	zstd_data->d_dctx = ZSTD_createDCtx();
+	if (zstd_data->d_cctx == NULL || zstd_data->d_dctx == NULL) {
 		goto err_mem;
 	}
 	
@@ -64,6 +78,7 @@ static void hostprog_lib_zstd_mk_usage(FILE* const dest)
 {
 	fprintf(dest,
 		" compression=<int>     select compression level\n"
+		" dictionary=<int>      train a dictionary of at most this many bytes\n"
 	);
 }
 
@@ -81,6 +96,16 @@ static int hostprog_lib_zstd_mk_option(void* data,
 			goto err_args;
 		}
 		return 0;
+	} else if (strcmp(name, "dictionary") == 0) {
+		if (!value) {
+			goto err_args;
+		}
+		opt_strtolx(ul, "dictionary", value, zstd_data->d_maxdictsz);
+		if (zstd_data->d_maxdictsz < HOSTPROG_LIB_ZSTD_MINDICTSZ
+				|| zstd_data->d_maxdictsz > MICROFS_DD_ZSTD_MAXDICTSZ) {
+			goto err_args;
+		}
+		return 0;
 	}
 
 err_args:
@@ -88,13 +113,137 @@ err_args:
 	return -1;
 }
 
+static __u64 hostprog_lib_zstd_mk_dd(void* data, char* base, __u64 offset)
+{
+	struct microfs_dd_zstd* dd_zstd = (struct microfs_dd_zstd*)(base + offset);
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	
+	dd_zstd->dd_magic = __cpu_to_le32(MICROFS_DD_ZSTD_MAGIC);
+	dd_zstd->dd_dictsz = __cpu_to_le32(zstd_data->d_dictsz);
+	dd_zstd->dd_dictid = __cpu_to_le32(zstd_data->d_dictid);
+	dd_zstd->dd_future = 0;
+	dd_zstd->dd_dictoffset = 0;
+	
+	return offset + hostprog_lib_zstd.hl_info->li_dd_sz;
+}
+
+static __u32 hostprog_lib_zstd_mk_dictsz(void* data)
+{
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	
+	return zstd_data->d_maxdictsz;
+}
+
+static int hostprog_lib_zstd_mk_train(void* data, const char* samples,
+	const size_t* samplesz, __u32 nsamples, int* implerr)
+{
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	
+	char* dict = malloc(zstd_data->d_maxdictsz);
+	if (!dict) {
+		*implerr = -1;
+		return -1;
+	}
+	
+	const size_t result = ZDICT_trainFromBuffer(dict, zstd_data->d_maxdictsz,
+		samples, samplesz, nsamples);
+	if (ZDICT_isError(result)) {
+		free(dict);
+		*implerr = (int)result;
+		return -1;
+	}
+	
+	zstd_data->d_cdict = ZSTD_createCDict(dict, result, zstd_data->d_compression);
+	if (!zstd_data->d_cdict) {
+		free(dict);
+		*implerr = -1;
+		return -1;
+	}
+	
+	zstd_data->d_dict = dict;
+	zstd_data->d_dictsz = result;
+	zstd_data->d_dictid = ZDICT_getDictID(dict, result);
+	
+	*implerr = 0;
+	return 0;
+}
+
+static int hostprog_lib_zstd_mk_usedict(void* data, void* src)
+{
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	const struct hostprog_lib_zstd_data* src_data = src;
+	
+	/* A CDict is read-only once created, so it can be used by
+	 * any number of instances at the same time.
+	 */
+	zstd_data->d_dict = src_data->d_dict;
+	zstd_data->d_dictsz = src_data->d_dictsz;
+	zstd_data->d_dictid = src_data->d_dictid;
+	zstd_data->d_cdict = src_data->d_cdict;
+	
+	return 0;
+}
+
+static __u64 hostprog_lib_zstd_mk_dict(void* data, char* base, __u64 dd_offset,
+	__u64 offset)
+{
+	struct microfs_dd_zstd* dd_zstd = (struct microfs_dd_zstd*)(base + dd_offset);
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	
+	if (!zstd_data->d_dictsz)
+		return offset;
+	
+	memcpy(base + offset, zstd_data->d_dict, zstd_data->d_dictsz);
+	dd_zstd->dd_dictoffset = __cpu_to_le64(offset);
+	
+	return offset + zstd_data->d_dictsz;
+}
+
+static int hostprog_lib_zstd_ck_dd(void* data, char* base, __u64 sz, __u64 offset,
+	__u64* dictsz)
+{
+	struct microfs_dd_zstd* dd_zstd = (struct microfs_dd_zstd*)(base + offset);
+	struct hostprog_lib_zstd_data* zstd_data = data;
+	
+	if (__le32_to_cpu(dd_zstd->dd_magic) != MICROFS_DD_ZSTD_MAGIC)
+		return -1;
+	
+	zstd_data->d_dictsz = __le32_to_cpu(dd_zstd->dd_dictsz);
+	zstd_data->d_dictid = __le32_to_cpu(dd_zstd->dd_dictid);
+	if (zstd_data->d_dictsz == 0)
+		return 0;
+	
+	const __u64 dictoffset = __le64_to_cpu(dd_zstd->dd_dictoffset);
+	if (zstd_data->d_dictsz > MICROFS_DD_ZSTD_MAXDICTSZ
+			|| dictoffset < offset + hostprog_lib_zstd.hl_info->li_dd_sz
+			|| dictoffset + zstd_data->d_dictsz > sz) {
+		return -1;
+	}
+	
+	zstd_data->d_dict = base + dictoffset;
+	if (ZSTD_getDictID_fromDict(zstd_data->d_dict, zstd_data->d_dictsz)
+			!= zstd_data->d_dictid) {
+		return -1;
+	}
+	
+	zstd_data->d_ddict = ZSTD_createDDict(zstd_data->d_dict, zstd_data->d_dictsz);
+	if (!zstd_data->d_ddict)
+		return -1;
+	
+	*dictsz += zstd_data->d_dictsz;
+	return 0;
+}
+
 static int hostprog_lib_zstd_compress(void* data, void* destbuf, __u32* destbufsz,
 	void* srcbuf, __u32 srcbufsz, int* implerr)
 {
 	struct hostprog_lib_zstd_data* zstd_data = data;
 
-	const size_t result = ZSTD_compressCCtx(zstd_data->d_cctx,
-		destbuf, *destbufsz, srcbuf, srcbufsz, zstd_data->d_compression);
+	const size_t result = zstd_data->d_cdict
+		? ZSTD_compress_usingCDict(zstd_data->d_cctx, destbuf, *destbufsz,
+			srcbuf, srcbufsz, zstd_data->d_cdict)
+		: ZSTD_compressCCtx(zstd_data->d_cctx, destbuf, *destbufsz,
+			srcbuf, srcbufsz, zstd_data->d_compression);
 	
 	if (ZSTD_isError(result)) {
 		*implerr = (int)result;
@@ -109,9 +258,12 @@ static int hostprog_lib_zstd_compress(void* data, void* destbuf, __u32* destbufs
 static int hostprog_lib_zstd_decompress(void* data, void* destbuf, __u32* destbufsz,
 	void* srcbuf, __u32 srcbufsz, int* implerr)
 {
-	(void)data;
+	struct hostprog_lib_zstd_data* zstd_data = data;
 	
-	const size_t result = ZSTD_decompress(destbuf, *destbufsz, srcbuf, srcbufsz);
+	const size_t result = zstd_data->d_ddict
+		? ZSTD_decompress_usingDDict(zstd_data->d_dctx, destbuf, *destbufsz,
+			srcbuf, srcbufsz, zstd_data->d_ddict)
+		: ZSTD_decompress(destbuf, *destbufsz, srcbuf, srcbufsz);
 
 	if (ZSTD_isError(result)) {
 		*implerr = -1;
@@ -142,8 +294,12 @@ const struct hostprog_lib hostprog_lib_zstd = {
 	.hl_init = hostprog_lib_zstd_init,
 	.hl_mk_usage = hostprog_lib_zstd_mk_usage,
 	.hl_mk_option = hostprog_lib_zstd_mk_option,
-	.hl_mk_dd = hostprog_lib_mk_dd,
-	.hl_ck_dd = hostprog_lib_ck_dd,
+	.hl_mk_dd = hostprog_lib_zstd_mk_dd,
+	.hl_mk_dictsz = hostprog_lib_zstd_mk_dictsz,
+	.hl_mk_train = hostprog_lib_zstd_mk_train,
+	.hl_mk_usedict = hostprog_lib_zstd_mk_usedict,
+	.hl_mk_dict = hostprog_lib_zstd_mk_dict,
+	.hl_ck_dd = hostprog_lib_zstd_ck_dd,
 	.hl_compress = hostprog_lib_zstd_compress,
 	.hl_decompress = hostprog_lib_zstd_decompress,
 	.hl_upperbound = hostprog_lib_zstd_upperbound,
@@ -29,6 +29,19 @@ struct libinfo {
 	const __u32 li_min_blksz;
 	const __u32 li_max_blksz;
 	const __u32 li_dd_sz;
+	/* Flag without which there is no decompressor data (zero if
+	 * the decompressor data is always present).
+	 */
+	const __u32 li_dd_flag;
 	const char* li_name;
 };
 
+/* Get the size of the decompressor data of %info in an image
+ * with the given flags.
+ */
+static inline __u32 libinfo_ddsz(const struct libinfo* const info,
+	const __u32 flags)
+{
+	return (flags & info->li_dd_flag) == info->li_dd_flag ? info->li_dd_sz : 0;
+}
+
@@ -27,6 +27,7 @@ static const struct libinfo libinfo_lzo = {
 	.li_min_blksz = 0,
 	.li_max_blksz = MICROFS_MAXBLKSZ,
 	.li_dd_sz = 0,
+	.li_dd_flag = 0,
 	.li_name = "lzo"
 };
 
@@ -29,6 +29,7 @@ static const struct libinfo libinfo_xz = {
 	.li_min_blksz = MICROFS_MINBLKSZ,
 	.li_max_blksz = MICROFS_MAXBLKSZ,
 	.li_dd_sz = sizeof(struct microfs_dd_xz),
+	.li_dd_flag = 0,
 	.li_name = "xz"
 };
 
@@ -27,6 +27,7 @@ static const struct libinfo libinfo_zlib = {
 	.li_min_blksz = MICROFS_MINBLKSZ,
 	.li_max_blksz = MICROFS_MAXBLKSZ,
 	.li_dd_sz = 0,
+	.li_dd_flag = 0,
 	.li_name = "zlib"
 };
 
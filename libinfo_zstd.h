@@ -29,7 +29,8 @@ static const struct libinfo libinfo_zstd = {
 	.li_id = MICROFS_FLAG_DECOMPRESSOR_ZSTD,
 	.li_min_blksz = MICROFS_MINBLKSZ,
 	.li_max_blksz = MICROFS_MAXBLKSZ,
-	.li_dd_sz = 0,
+	.li_dd_sz = sizeof(struct microfs_dd_zstd),
+	.li_dd_flag = MICROFS_FLAG_DICTIONARY,
 	.li_name = "zstd"
 };
 
@@ -70,6 +70,88 @@ static inline __u32 i_blks(const __u32 sz, const __u32 blksz)
 	return sz == 0 ? 0 : (sz - 1) / blksz + 1;
 }
 
+/* Get the uncompressed size of block %blk_nr of a file of
+ * %size bytes with the given %blksz.
+ */
+static inline __u32 i_blksz(const __u32 sz, const __u32 blk_nr,
+	const __u32 blksz)
+{
+	const __u32 rest = sz - blk_nr * blksz;
+	return rest < blksz ? rest : blksz;
+}
+
+/* Get the number of blocks with block pointers for a file of
+ * %size bytes. The tail of the file is not one of them if it
+ * is stored in a fragment (see %MICROFS_FLAG_FRAGMENTS).
+ */
+static inline __u32 i_ptrblks(const __u32 sz, const __u32 blksz,
+	const int fragments)
+{
+	return fragments ? sz / blksz : i_blks(sz, blksz);
+}
+
+/* Get the number of bytes of a file of %size bytes that are
+ * stored in a fragment.
+ */
+static inline __u32 i_fragtail(const __u32 sz, const __u32 blksz,
+	const int fragments)
+{
+	return fragments ? sz % blksz : 0;
+}
+
+/* Get the size of the packed block pointers of %blks blocks which
+ * data lengths are %lenbits bits wide, see
+ * %MICROFS_FLAG_PACKEDBLKPTRS.
+ */
+static inline __u32 i_packedptrsz(const __u32 blks, const __u32 lenbits)
+{
+	return i_blks(blks, MICROFS_BLKPTR_CHUNKBLKS) * (MICROFS_IOFFSET_WIDTH / 8)
+		+ i_blks(blks * lenbits, MICROFS_IOFFSET_WIDTH) * (MICROFS_IOFFSET_WIDTH / 8);
+}
+
+/* Get the data length of block %blk_nr from the bit packed
+ * lengths at %lens, see %MICROFS_FLAG_PACKEDBLKPTRS.
+ */
+static inline __u32 i_packedlen(const __u8* const lens, const __u32 blk_nr,
+	const __u32 lenbits)
+{
+	const __u32 bit = blk_nr * lenbits;
+	const __u8* p = lens + bit / 8;
+	__u32 i = (bit % 8 + lenbits + 7) / 8;
+	__u64 value = 0;
+	while (i-- > 0)
+		value = (value << 8) | p[i];
+	return (value >> (bit % 8)) & ((1ULL << lenbits) - 1);
+}
+
+/* Get the size of the block pointers (and the %fileinfosz bytes
+ * that precede them, see %i_fileinfosz(), and the fragment
+ * reference) of a file of %size bytes. The block pointers are
+ * packed unless %lenbits is zero, or extents if %lenbits is
+ * %MICROFS_FILEINFO_EXTENTS.
+ */
+static inline __u32 i_blkptrsz(const __u32 sz, const __u32 blksz,
+	const int fragments, const __u32 fileinfosz, const __u32 lenbits)
+{
+	const __u32 blks = i_ptrblks(sz, blksz, fragments);
+	return (blks ? (lenbits == MICROFS_FILEINFO_EXTENTS
+			? blks * 2 * (MICROFS_IOFFSET_WIDTH / 8)
+			: lenbits ? i_packedptrsz(blks, lenbits)
+			: (blks + 1) * (MICROFS_IOFFSET_WIDTH / 8)) : 0)
+		+ fileinfosz
+		+ (i_fragtail(sz, blksz, fragments) ? sizeof(struct microfs_fragment) : 0);
+}
+
+/* Get the size of the sub-frame index that starts the data of
+ * a block of %blk_size bytes which is split into sub-frames of
+ * %framesz bytes, see %MICROFS_FLAG_SUBFRAMES.
+ */
+static inline __u32 i_frameidxsz(const __u32 blk_size, const __u32 framesz)
+{
+	const __u32 frames = i_blks(blk_size, framesz);
+	return frames > 1 ? (frames - 1) * (MICROFS_IOFFSET_WIDTH / 8) : 0;
+}
+
 /* Round up the given %size to a multiple of the given block
  * size. The given %blksz must be a power of two.
  */
@@ -93,38 +175,162 @@ struct microfs_data_buffer {
 	/* Number of bytes of %d_data that is used. */
 	__u32 d_used;
 	/* The offset that the data was read from. */
-	__u32 d_offset;
-	/* Buffer lock. */
-	struct mutex d_mutex;
+	__u64 d_offset;
+};
+
+/* Largest metadata record that can cross a page boundary.
+ */
+#define MICROFS_METADATA_BOUNCESZ \
+	(sizeof(struct microfs_inode) + MICROFS_MAXNAMELEN)
+
+/* A reference to metadata in the block device page cache, see
+ * %__microfs_get_metadata().
+ */
+struct microfs_metadata_ref {
+	/* The buffer head pinning the page, if any. */
+	struct buffer_head* mr_bh;
+	/* Copy of a record that crosses a page boundary. */
+	char mr_bounce[MICROFS_METADATA_BOUNCESZ];
+};
+
+/* A decompressed block held by %microfs_filedata_cache.
+ */
+struct microfs_filedata_entry {
+	/* The data, %d_offset is the offset of the compressed block. */
+	struct microfs_data_buffer fe_buf;
+	/* Number of readers using the entry, protected by %fc_lock. */
+	__u32 fe_users;
+	/* Position in %fc_lru (or %fc_scratchlist). */
+	struct list_head fe_lru;
+	/* Position in the %fc_buckets chain of %d_offset. */
+	struct hlist_node fe_hash;
+};
+
+/* Decompressed blocks that have been used by the exceptional
+ * read path (that is; when the data can not be decompressed
+ * directly into the page cache). The blocks are keyed by their
+ * compressed offset, found through a hash table and evicted
+ * in LRU order.
+ * 
+ * Blocks are decompressed into scratch buffers owned by the
+ * reader, without holding any lock, and the buffer is then
+ * swapped into the cache by %microfs_filedata_cache_insert().
+ */
+struct microfs_filedata_cache {
+	/* Protects %fc_lru, %fc_buckets and the entry bookkeeping. */
+	spinlock_t fc_lock;
+	/* The entries, most recently used first. */
+	struct list_head fc_lru;
+	/* Cached entries hashed on %d_offset. */
+	struct hlist_head* fc_buckets;
+	/* log2 of the number of buckets. */
+	__u32 fc_hashbits;
+	/* The entries. */
+	struct microfs_filedata_entry* fc_entries;
+	/* Number of entries. */
+	__u32 fc_nentries;
+	/* Number of bytes allocated for each entry. */
+	__u32 fc_entrysz;
+	/* Free scratch buffers. */
+	struct list_head fc_scratchlist;
+	/* Number of allocated scratch buffers. */
+	__u32 fc_nscratch;
+	/* Woken when a scratch buffer is freed. */
+	wait_queue_head_t fc_waitqueue;
+	/* Number of blocks served from the cache. */
+	atomic64_t fc_hits;
+	/* Number of blocks decompressed into the cache. */
+	atomic64_t fc_misses;
 };
 
 /* In-memory super block.
  */
 struct microfs_sb_info {
 	/* Image size. */
-	__u32 si_size;
+	__u64 si_size;
 	/* Feature flags. */
 	__u32 si_flags;
 	/* Number of blocks. */
-	__u32 si_blocks;
+	__u64 si_blocks;
 	/* Number of files. */
-	__u16 si_files;
+	__u32 si_files;
+	/* Base of the pointers in the fragment table, see
+	 * %MICROFS_FLAG_LARGEIMAGE.
+	 */
+	__u64 si_fragbase;
 	/* Image creation time. */
 	__u32 si_ctime;
 	/* Block size left shift. */
 	__u16 si_blkshift;
 	/* Block size. */
 	__u32 si_blksz;
-	/* Metadata block pointer buffer. */
-	struct microfs_data_buffer si_metadata_blkptrbuf;
-	/* Metadata dentry/inode buffer. */
-	struct microfs_data_buffer si_metadata_dentrybuf;
-	/* Compressed file data buffer. */
-	struct microfs_data_buffer si_filedatabuf;
+	/* Decompressed file data cache. */
+	struct microfs_filedata_cache si_filedatacache;
 	/* Block data decompressor. */
 	const struct microfs_decompressor* si_decompressor;
 	/* Block data decompressor private storage. */
 	struct microfs_decompressor_data* si_decompressor_data;
+	/* The other decompressors of the image (indexed by
+	 * %microfs_codecidx()), see %MICROFS_FLAG_MIXEDCODECS. Each
+	 * one is held by a %microfs_sb_info of its own which is only
+	 * ever handed to that decompressor.
+	 */
+	struct microfs_sb_info* si_codecs[MICROFS_MAXCODECS];
+	/* Max number of bytes used for cached block pointers. */
+	__u64 si_blkptrcachesz;
+	/* Number of bytes used for cached block pointers. */
+	atomic64_t si_blkptrcacheused;
+	/* Directories smaller than this (in bytes) are not indexed. */
+	__u32 si_dirindexthreshold;
+	/* Max number of bytes used for in-memory directory indexes. */
+	__u64 si_dirindexcachesz;
+	/* Number of bytes used for in-memory directory indexes. */
+	atomic64_t si_dirindexcacheused;
+	/* Preloaded metadata (if any), see %__microfs_preload_metadata(). */
+	char* si_metadata;
+	/* Size of %si_metadata. */
+	__u32 si_metadatasz;
+	/* The super block, for the decompressors which keep some of
+	 * their data outside of the decompressor data area.
+	 */
+	struct super_block* si_sb;
+};
+
+/* In-memory inode.
+ */
+struct microfs_inode_info {
+	/* Block pointers (if loaded), see %__microfs_load_blkptrs(). */
+	__u32* ii_blkptrs;
+	/* Number of bytes allocated for %ii_blkptrs. */
+	__u32 ii_blkptrssz;
+	/* Directory index (if built), see %__microfs_load_dirindex(). */
+	__u32* ii_dirindex;
+	/* Number of bytes allocated for %ii_dirindex. */
+	__u32 ii_dirindexsz;
+	/* The decompressor of the file, see %__microfs_load_fileinfo(). */
+	struct microfs_sb_info* ii_codec;
+	/* Block size left shift of the file. */
+	__u16 ii_blkshift;
+	/* Block size of the file. */
+	__u32 ii_blksz;
+	/* Sub-frame size left shift of the file (equal to %ii_blkshift
+	 * if its blocks are not split), see %MICROFS_FLAG_SUBFRAMES.
+	 */
+	__u16 ii_frameshift;
+	/* Sub-frame size of the file. */
+	__u32 ii_framesz;
+	/* Width of the packed block data lengths of the file (zero if
+	 * not packed), see %MICROFS_FLAG_PACKEDBLKPTRS.
+	 */
+	__u16 ii_lenbits;
+	/* Base of the block pointers of the file, see
+	 * %MICROFS_FLAG_LARGEIMAGE.
+	 */
+	__u64 ii_database;
+	/* Serializes the loading of %ii_blkptrs and %ii_dirindex. */
+	struct mutex ii_mutex;
+	/* The VFS inode. */
+	struct inode ii_vfs_inode;
 };
 
 typedef int (*microfs_decompressor_data_creator)(struct microfs_sb_info* sbi,
@@ -156,7 +362,8 @@ struct microfs_decompressor {
 	/* Reset the decompressor. */
 	int (*dc_reset)(struct microfs_sb_info* sbi, void* data);
 	/* Prepare the decompressor for %__microfs_copy_filedata_exceptionally. */
-	int (*dc_exceptionally_begin)(struct microfs_sb_info* sbi, void* data);
+	int (*dc_exceptionally_begin)(struct microfs_sb_info* sbi, void* data,
+		struct microfs_data_buffer* destbuf);
 	/* Prepare the decompressor for %__microfs_copy_filedata_nominally. */
 	int (*dc_nominally_begin)(struct microfs_sb_info* sbi, void* data,
 		struct page** pages, __u32 npages);
@@ -240,7 +447,8 @@ struct microfs_decompressor {
  * > %creator = %microfs_decompressor_data_singleton_create()
  * 
  * When using public decompressor data, it is worth remembering
- * that %microfs_decompressor, %acquirer, %creator and block size
+ * that %microfs_decompressor, %acquirer, %creator, block size
+ * and the "on-disk" decompressor data (such as the zstd dictionary)
  * for the mounted images must be the same in order to have them
  * successfully share a decompressor data instance.
  */
@@ -259,6 +467,10 @@ struct microfs_decompressor_data {
 	void* dd_private;
 	/* Decompressor info from the image. */
 	void* dd_info;
+	/* Copy of the "on-disk" decompressor data (NULL if the
+	 * decompressor has none).
+	 */
+	char* dd_ondisk;
 	/* Get the decompressor data for use. */
 	int (*dd_get)(struct microfs_sb_info* sbi, void** dest);
 	/* Put the decompressor data after use. */
@@ -280,6 +492,11 @@ static inline struct microfs_sb_info* MICROFS_SB(struct super_block* sb)
 	return sb->s_fs_info;
 }
 
+static inline struct microfs_inode_info* MICROFS_I(struct inode* inode)
+{
+	return container_of(inode, struct microfs_inode_info, ii_vfs_inode);
+}
+
 /* Get the inode number for the given on-disk inode.
  */
 static inline unsigned long microfs_get_ino(const struct microfs_inode*
@@ -294,6 +511,25 @@ static inline __u32 microfs_get_offset(const struct inode* const inode)
 	return inode->i_ino;
 }
 
+/* Get the offset of the block pointers of the given VFS inode,
+ * they follow the file info word and the data base if the image
+ * has them (see %i_fileinfosz()).
+ */
+static inline __u32 microfs_get_blkptroffset(const struct inode* const inode)
+{
+	return microfs_get_offset(inode)
+		+ i_fileinfosz(MICROFS_SB(inode->i_sb)->si_flags);
+}
+
+/* Get the number of bytes stored inline in the dentry of the
+ * given VFS inode, see %MICROFS_FLAG_INLINEDATA.
+ */
+static inline __u32 microfs_get_inlinesz(struct inode* const inode)
+{
+	return i_inlinesz(MICROFS_SB(inode->i_sb)->si_flags, inode->i_mode,
+		i_size_read(inode));
+}
+
 /* Get a VFS inode for the given on-disk inode.
  */
 struct inode* microfs_get_inode(struct super_block* sb,
@@ -301,10 +537,10 @@ struct inode* microfs_get_inode(struct super_block* sb,
 
 typedef int (*microfs_read_blks_consumer)(struct super_block* sb,
 	void* data, struct buffer_head** bhs, __u32 nbhs,
-	__u32 offset, __u32 length);
+	__u64 offset, __u32 length);
 
 typedef int (*microfs_read_blks_recycler)(struct super_block* sb,
-	void* data, __u32 offset, __u32 length,
+	void* data, __u64 offset, __u32 length,
 	microfs_read_blks_consumer consumer);
 
 /* Read PAGE_SIZEd blocks from the image. %consumer will be
@@ -317,19 +553,137 @@ int __microfs_read_blks(struct super_block* sb,
 	struct address_space* mapping, void* data,
 	microfs_read_blks_recycler recycler,
 	microfs_read_blks_consumer consumer,
-	__u32 offset, __u32 length);
+	__u64 offset, __u32 length);
+
+/* Like %__microfs_read_blks(), except that %consumer is called
+ * as soon as the blocks have been submitted for reading. It is
+ * up to %consumer to use %__microfs_wait_blks() on the blocks
+ * before it touches them, which allows it to work on the first
+ * blocks while the rest of them are read.
+ */
+int __microfs_read_blks_progressively(struct super_block* sb,
+	struct address_space* mapping, void* data,
+	microfs_read_blks_recycler recycler,
+	microfs_read_blks_consumer consumer,
+	__u64 offset, __u32 length);
+
+/* Wait for the given buffer heads to be read.
+ */
+int __microfs_wait_blks(struct buffer_head** bhs, __u32 nbhs);
+
+/* Get a pointer to %length bytes of metadata at the given offset.
+ * The data is used in place in the preloaded metadata or in the
+ * block device page cache, unless it crosses a page boundary of
+ * the latter, in which case it is copied to %ref. The data is valid until %__microfs_put_metadata() is
+ * called for %ref.
+ */
+void* __microfs_get_metadata(struct super_block* sb, __u64 offset,
+	__u32 length, struct microfs_metadata_ref* ref);
+
+/* Release a reference, see %__microfs_get_metadata().
+ */
+void __microfs_put_metadata(struct microfs_metadata_ref* ref);
+
+/* Get the on-disk inode at the given offset, followed by its
+ * name. The data must be released with %__microfs_put_metadata().
+ */
+struct microfs_inode* __microfs_get_dentry(struct super_block* sb,
+	__u32 offset, struct microfs_metadata_ref* ref);
+
+/* Read the entire metadata region of the image (everything up
+ * to the end of the last block pointer table, or the fragment
+ * table if the image has one) into memory, later
+ * calls to %__microfs_get_metadata() are served from the copy.
+ */
+int __microfs_preload_metadata(struct super_block* sb,
+	const struct microfs_inode* root);
+
+/* Release the preloaded metadata, see %__microfs_preload_metadata().
+ */
+void __microfs_unload_metadata(struct super_block* sb);
+
+/* Create a cache of at most %cachesz bytes (but with at least
+ * one entry) where each entry holds %entrysz bytes.
+ */
+int microfs_filedata_cache_create(struct microfs_filedata_cache* fc,
+	__u64 cachesz, __u32 entrysz);
+
+/* Free the memory held by the cache.
+ */
+void microfs_filedata_cache_destroy(struct microfs_filedata_cache* fc);
 
-/* Read data from the image, a pointer to the data at the
- * given offset is returned.
+/* Get the entry holding the block at the given compressed offset,
+ * NULL is returned on a miss. The entry must be returned with
+ * %microfs_filedata_cache_put().
  */
-void* __microfs_read(struct super_block* sb,
-	struct microfs_data_buffer* destbuf, __u32 offset, __u32 length);
+struct microfs_filedata_entry* microfs_filedata_cache_get(
+	struct microfs_filedata_cache* fc, __u64 offset);
+
+/* Return an entry, see %microfs_filedata_cache_get().
+ */
+void microfs_filedata_cache_put(struct microfs_filedata_cache* fc,
+	struct microfs_filedata_entry* entry);
+
+/* Get a scratch buffer that a block can be decompressed to.
+ */
+struct microfs_filedata_entry* microfs_filedata_cache_scratch_get(
+	struct microfs_filedata_cache* fc);
+
+/* Return a scratch buffer, see %microfs_filedata_cache_scratch_get().
+ */
+void microfs_filedata_cache_scratch_put(struct microfs_filedata_cache* fc,
+	struct microfs_filedata_entry* scratch);
+
+/* Move the data decompressed to %scratch into the cache, the
+ * cache entry now holding the block at the given offset is
+ * returned (it must be returned with %microfs_filedata_cache_put()).
+ * NULL is returned if every entry is in use, in which case the
+ * data is left in %scratch.
+ */
+struct microfs_filedata_entry* microfs_filedata_cache_insert(
+	struct microfs_filedata_cache* fc, struct microfs_filedata_entry* scratch,
+	__u64 offset);
+
+/* Set up the decompressor and the block size of the given
+ * regular file or symlink, they are given by its file info word
+ * if the image has one for each file (see %i_hasfileinfo()).
+ */
+int __microfs_load_fileinfo(struct super_block* sb, struct inode* inode);
+
+/* Get the block pointers for the given regular file or symlink.
+ * They are read from the image and cached on the first call,
+ * NULL is returned if they can not be cached (in which case
+ * they must be read from the image every time they are needed).
+ */
+__u32* __microfs_load_blkptrs(struct super_block* sb, struct inode* inode);
+
+/* Release the cached block pointers for the given inode.
+ */
+void __microfs_unload_blkptrs(struct super_block* sb, struct inode* inode);
+
+/* Get the in-memory index for the given directory. It is built
+ * on the first call and has the layout of %microfs_dirindex, but
+ * in host byte order. NULL is returned if the directory is too
+ * small to be indexed or if the index can not be cached.
+ */
+__u32* __microfs_load_dirindex(struct super_block* sb, struct inode* inode);
+
+/* Release the in-memory index for the given directory.
+ */
+void __microfs_unload_dirindex(struct super_block* sb, struct inode* inode);
 
 /* Fill the given page with data, if possible by inflating
  * it directly from the buffer head(s) to the page cache page(s).
  */
 int __microfs_readpage(struct file* file, struct page* page);
 
+/* Fill the given readahead pages with data. The block data for
+ * the pages is located up front and then read from the image
+ * in as few requests as possible.
+ */
+int __microfs_readpages(struct file* file, struct address_space* mapping,
+	struct list_head* pages, unsigned nr_pages);
+
 /* Init a decompressor for %sbi.
  * 
  * See %microfs_decompressor_data.
@@ -338,6 +692,21 @@ int microfs_decompressor_init(struct microfs_sb_info* sbi, char* dd,
 	microfs_decompressor_data_acquirer acquirer,
 	microfs_decompressor_data_creator creator);
 
+/* Init the decompressors given by %codecs for %sbi, see
+ * %MICROFS_FLAG_MIXEDCODECS. Their decompressor data is stored
+ * back to back (in id order) at %dd, the size of it is added
+ * to *%ddsz.
+ */
+int microfs_decompressor_init_codecs(struct microfs_sb_info* sbi, char* dd,
+	__u32 codecs, __u32* ddsz,
+	microfs_decompressor_data_acquirer acquirer,
+	microfs_decompressor_data_creator creator);
+
+/* Release the decompressors acquired by
+ * %microfs_decompressor_init_codecs().
+ */
+void microfs_decompressor_exit_codecs(struct microfs_sb_info* sbi);
+
 /* Used by decompressors without any persistant decompressor
  * data.
  */
@@ -399,7 +768,8 @@ typedef int (*decompressor_impl_buffer_end_consumer)(struct microfs_sb_info* sbi
 int decompressor_impl_buffer_create(struct microfs_sb_info* sbi, void** dest, __u32 upperbound);
 int decompressor_impl_buffer_destroy(struct microfs_sb_info* sbi, void* data);
 int decompressor_impl_buffer_reset(struct microfs_sb_info* sbi, void* data);
-int decompressor_impl_buffer_exceptionally_begin(struct microfs_sb_info* sbi, void* data);
+int decompressor_impl_buffer_exceptionally_begin(struct microfs_sb_info* sbi, void* data,
+	struct microfs_data_buffer* destbuf);
 int decompressor_impl_buffer_nominally_begin(struct microfs_sb_info* sbi,
 	void* data, struct page** pages, __u32 npages);
 int decompressor_impl_buffer_copy_nominally_needpage(struct microfs_sb_info* sbi,
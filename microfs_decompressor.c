@@ -80,3 +80,69 @@ err:
 	return err;
 }
 
+int microfs_decompressor_init_codecs(struct microfs_sb_info* sbi, char* dd,
+	__u32 codecs, __u32* ddsz,
+	microfs_decompressor_data_acquirer acquirer,
+	microfs_decompressor_data_creator creator)
+{
+	int i;
+	int err = 0;
+	
+	struct microfs_sb_info* csbi;
+	
+	for (i = 0; i < MICROFS_MAXCODECS; i++) {
+		__u32 id = MICROFS_FLAG_DECOMPRESSOR_ZLIB << i;
+		if (!(codecs & id))
+			continue;
+		
+		csbi = kzalloc(sizeof(*csbi), GFP_KERNEL);
+		if (!csbi) {
+			pr_err("failed to allocate the sb info for decompressor 0x%x\n", id);
+			err = -ENOMEM;
+			goto err;
+		}
+		
+		/* The decompressors only care about the block size and
+		 * their own data.
+		 */
+		csbi->si_size = sbi->si_size;
+		csbi->si_flags = (sbi->si_flags & ~MICROFS_FLAG_MASK_DECOMPRESSOR) | id;
+		csbi->si_blocks = sbi->si_blocks;
+		csbi->si_blkshift = sbi->si_blkshift;
+		csbi->si_blksz = sbi->si_blksz;
+		csbi->si_sb = sbi->si_sb;
+		
+		err = microfs_decompressor_init(csbi, dd + *ddsz, acquirer, creator);
+		if (err < 0) {
+			if (csbi->si_decompressor_data && csbi->si_decompressor_data->dd_release)
+				csbi->si_decompressor_data->dd_release(csbi);
+			kfree(csbi);
+			goto err;
+		}
+		
+		*ddsz += libinfo_ddsz(csbi->si_decompressor->dc_info, csbi->si_flags);
+		sbi->si_codecs[i] = csbi;
+	}
+	
+	return 0;
+	
+err:
+	microfs_decompressor_exit_codecs(sbi);
+	return err;
+}
+
+void microfs_decompressor_exit_codecs(struct microfs_sb_info* sbi)
+{
+	int i;
+	
+	for (i = 0; i < MICROFS_MAXCODECS; i++) {
+		struct microfs_sb_info* csbi = sbi->si_codecs[i];
+		if (!csbi)
+			continue;
+		if (csbi->si_decompressor_data)
+			csbi->si_decompressor_data->dd_release(csbi);
+		kfree(csbi);
+		sbi->si_codecs[i] = NULL;
+	}
+}
+
@@ -40,6 +40,8 @@ static void microfs_decompressor_data_manager_release_private(struct microfs_sb_
 		sbi->si_decompressor_data->dd_destroy(sbi, sbi->si_decompressor_data
 			->dd_private);
 	}
+	sbi->si_decompressor->dc_data_exit(sbi, sbi->si_decompressor_data);
+	kfree(sbi->si_decompressor_data->dd_ondisk);
 	kfree(sbi->si_decompressor_data);
 }
 
@@ -59,6 +61,9 @@ int microfs_decompressor_data_manager_acquire_private(struct microfs_sb_info* sb
 {
 	int err;
 	
+	const __u32 ddsz = libinfo_ddsz(sbi->si_decompressor->dc_info,
+		sbi->si_flags);
+	
 	*dest = kzalloc(sizeof(**dest), GFP_KERNEL);
 	if (!*dest) {
 		pr_err("failed to alloc the decompressor data\n");
@@ -72,6 +77,15 @@ int microfs_decompressor_data_manager_acquire_private(struct microfs_sb_info* sb
 	(*dest)->dd_creator = creator;
 	(*dest)->dd_release = microfs_decompressor_data_manager_release_private;
 	
+	if (ddsz) {
+		(*dest)->dd_ondisk = kmemdup(dd, ddsz, GFP_KERNEL);
+		if (!(*dest)->dd_ondisk) {
+			pr_err("failed to copy the decompressor data\n");
+			err = -ENOMEM;
+			goto err_ondisk;
+		}
+	}
+	
 	err = sbi->si_decompressor->dc_data_init(sbi, dd, *dest);
 	if (err) {
 		pr_err("%s: could not init the decompressor data",
@@ -82,6 +96,10 @@ int microfs_decompressor_data_manager_acquire_private(struct microfs_sb_info* sb
 	return creator(sbi, *dest);
 	
 err_data:
+	kfree((*dest)->dd_ondisk);
+err_ondisk:
+	kfree(*dest);
+	*dest = NULL;
 err_alloc:
 	return err;
 }
@@ -93,6 +111,9 @@ int microfs_decompressor_data_manager_acquire_public(struct microfs_sb_info* sbi
 	int err = 0;
 	struct microfs_decompressor_data* walker = NULL;
 	
+	const __u32 ddsz = libinfo_ddsz(sbi->si_decompressor->dc_info,
+		sbi->si_flags);
+	
 	*dest = NULL;
 	
 	mutex_lock(&__manager_mutex);
@@ -100,7 +121,10 @@ int microfs_decompressor_data_manager_acquire_public(struct microfs_sb_info* sbi
 		if (
 			walker->dd_blksz == sbi->si_blksz &&
 			walker->dd_decompressor == sbi->si_decompressor &&
-			walker->dd_creator == creator
+			walker->dd_creator == creator &&
+			(ddsz
+				? walker->dd_ondisk && memcmp(walker->dd_ondisk, dd, ddsz) == 0
+				: !walker->dd_ondisk)
 		) {
 			*dest = walker;
 			break;
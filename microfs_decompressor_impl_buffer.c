@@ -28,6 +28,7 @@ struct decompressor_impl_buffer_data {
 	__u32 ib_outputbufusedsz;
 	struct page** ib_pages;
 	__u32 ib_npages;
+	struct microfs_data_buffer* ib_destbuf;
 };
 
 int decompressor_impl_buffer_create(struct microfs_sb_info* sbi,
@@ -45,6 +46,7 @@ int decompressor_impl_buffer_create(struct microfs_sb_info* sbi,
 	
 	dat->ib_pages = NULL;
 	dat->ib_npages = 0;
+	dat->ib_destbuf = NULL;
 	
 #define DATA_BUF(Data, Name, Size) \
 	do { \
@@ -96,12 +98,14 @@ int decompressor_impl_buffer_reset(struct microfs_sb_info* sbi, void* data)
 	return 0;
 }
 
-int decompressor_impl_buffer_exceptionally_begin(struct microfs_sb_info* sbi, void* data)
+int decompressor_impl_buffer_exceptionally_begin(struct microfs_sb_info* sbi, void* data,
+	struct microfs_data_buffer* destbuf)
 {
 	struct decompressor_impl_buffer_data* ibdat = data;
 	pr_spam("decompressor_impl_buffer_exceptionally_begin: ibdat=0x%p\n", ibdat);
 	ibdat->ib_pages = NULL;
 	ibdat->ib_npages = 0;
+	ibdat->ib_destbuf = destbuf;
 	return 0;
 }
 
@@ -112,6 +116,7 @@ int decompressor_impl_buffer_nominally_begin(struct microfs_sb_info* sbi, void*
 	pr_spam("decompressor_impl_buffer_nominally_begin: ibdat=0x%p\n", ibdat);
 	ibdat->ib_pages = pages;
 	ibdat->ib_npages = npages;
+	ibdat->ib_destbuf = NULL;
 	return 0;
 }
 
@@ -203,9 +208,9 @@ int decompressor_impl_buffer_end(struct microfs_sb_info* sbi, void* data,
 	struct decompressor_impl_buffer_data* ibdat = data;
 	
 	__u32 outputsz = ibdat->ib_pages?
-		ibdat->ib_outputbufsz: sbi->si_filedatabuf.d_size;
+		ibdat->ib_outputbufsz: ibdat->ib_destbuf->d_size;
 	char* output = ibdat->ib_pages?
-		ibdat->ib_outputbuf: sbi->si_filedatabuf.d_data;
+		ibdat->ib_outputbuf: ibdat->ib_destbuf->d_data;
 	
 	if (*err) {
 		goto err_decompress;
@@ -214,8 +219,8 @@ int decompressor_impl_buffer_end(struct microfs_sb_info* sbi, void* data,
 	pr_spam("decompressor_impl_buffer_end: data->ib_pages=0x%p, data->ib_npages=%u\n",
 			ibdat->ib_pages, ibdat->ib_npages);
 	pr_spam("decompressor_impl_buffer_end: output=0x%p,"
-			" data->ib_outputbuf=0x%p, sbi->si_filedatabuf.d_data=0x%p\n",
-		output, ibdat->ib_outputbuf, sbi->si_filedatabuf.d_data);
+			" data->ib_outputbuf=0x%p, data->ib_destbuf=0x%p\n",
+		output, ibdat->ib_outputbuf, ibdat->ib_destbuf);
 	
 	*err = consumer(sbi, data, implerr,
 		ibdat->ib_inputbuf, ibdat->ib_inputbufusedsz,
@@ -250,7 +255,7 @@ int decompressor_impl_buffer_end(struct microfs_sb_info* sbi, void* data,
 		/* Called by %__microfs_copy_filedata_exceptionally. The data
 		 * is stored in the correct buffer. Everything is fine.
 		 */
-		sbi->si_filedatabuf.d_used = outputsz;
+		ibdat->ib_destbuf->d_used = outputsz;
 	}
 	
 	pr_spam("decompressor_impl_buffer_end: done\n");
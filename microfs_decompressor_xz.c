@@ -118,19 +118,19 @@ static int decompressor_xz_reset(struct microfs_sb_info* sbi, void* data)
 
 
 static int decompressor_xz_exceptionally_begin(struct microfs_sb_info* sbi,
-	void* data)
+	void* data, struct microfs_data_buffer* destbuf)
 {
 	struct decompressor_xz_data* xzdat = data;
 
 	pr_spam("decompressor_xz_exceptionally_begin: xzdat=0x%p\n", xzdat);
 	
-	sbi->si_filedatabuf.d_offset = MICROFS_MAXIMGSIZE - 1;
-	sbi->si_filedatabuf.d_used = 0;
+	(void)sbi;
+	
 	xzdat->xz_buf.in = NULL;
 	xzdat->xz_buf.in_size = 0;
 	xzdat->xz_buf.in_pos = 0;
-	xzdat->xz_buf.out = sbi->si_filedatabuf.d_data;
-	xzdat->xz_buf.out_size = sbi->si_filedatabuf.d_size;
+	xzdat->xz_buf.out = destbuf->d_data;
+	xzdat->xz_buf.out_size = destbuf->d_size;
 	xzdat->xz_buf.out_pos = 0;
 	
 	xzdat->xz_totalout = 0;
@@ -84,18 +84,18 @@ static int decompressor_zlib_reset(struct microfs_sb_info* sbi, void* data)
 }
 
 static int decompressor_zlib_exceptionally_begin(struct microfs_sb_info* sbi,
-	void* data)
+	void* data, struct microfs_data_buffer* destbuf)
 {
 	struct decompressor_zlib_data* zdat = data;
 	
 	pr_spam("decompressor_zlib_exceptionally_begin: zdat=0x%p\n", zdat);
 
-	sbi->si_filedatabuf.d_offset = MICROFS_MAXIMGSIZE - 1;
-	sbi->si_filedatabuf.d_used = 0;
+	(void)sbi;
+	
 	zdat->z_strm.avail_in = 0;
 	zdat->z_strm.next_in = NULL;
-	zdat->z_strm.avail_out = sbi->si_filedatabuf.d_size;
-	zdat->z_strm.next_out = sbi->si_filedatabuf.d_data;
+	zdat->z_strm.avail_out = destbuf->d_size;
+	zdat->z_strm.next_out = destbuf->d_data;
 	
 	return 0;
 }
@@ -23,6 +23,7 @@
 
 #ifdef MICROFS_DECOMPRESSOR_ZSTD
 
+#include <linux/vmalloc.h>
 #include <linux/zstd.h>
 
 struct decompressor_zstd_data {
@@ -34,8 +35,167 @@ struct decompressor_zstd_data {
 	ZSTD_outBuffer z_out_buf;
 	ZSTD_DStream* z_stream;
 	__u32 z_totalout;
+	/* Single-shot decompression context, see
+	 * %decompressor_zstd_consume_oneshot().
+	 */
+	void* z_dctx_workspace;
+	ZSTD_DCtx* z_dctx;
+	/* Can %vmap() be used (it might sleep)? */
+	int z_cansleep;
+	/* Does %z_out_buf cover the entire output of the block? */
+	int z_whole;
+	/* Is %z_pageaddr mapped by %kmap_atomic()? */
+	int z_atomic;
+	/* The %vmap()ed output pages (if any). */
+	void* z_vaddr;
+	/* Room for the pages of the bhs that are %vmap()ed. */
+	struct page** z_bhpages;
+	__u32 z_maxbhpages;
 };
 
+/* The dictionary of the image (if any), loaded once for each
+ * instance of the decompressor data, see %struct microfs_dd_zstd.
+ */
+struct decompressor_zstd_dict {
+	void* zd_dict;
+	__u32 zd_dictsz;
+	void* zd_workspace;
+	ZSTD_DDict* zd_ddict;
+};
+
+static int decompressor_zstd_read_dict(struct microfs_sb_info* sbi,
+	char* dest, __u64 offset, __u32 length)
+{
+	struct buffer_head* bh;
+	
+	while (length > 0) {
+		const __u32 pg_offset = offset & ~PAGE_MASK;
+		const __u32 chunk = min_t(__u32, length, PAGE_SIZE - pg_offset);
+		
+		bh = sb_bread(sbi->si_sb, offset >> PAGE_SHIFT);
+		if (!bh) {
+			pr_err("failed to read the zstd dictionary block"
+				" at offset 0x%llx\n", round_down(offset, PAGE_SIZE));
+			return -EIO;
+		}
+		memcpy(dest, bh->b_data + pg_offset, chunk);
+		brelse(bh);
+		
+		dest += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+	
+	return 0;
+}
+
+static int decompressor_zstd_data_init(struct microfs_sb_info* sbi, void* dd,
+	struct microfs_decompressor_data* data)
+{
+	int err;
+	struct microfs_dd_zstd* dd_zstd = dd;
+	struct decompressor_zstd_dict* zdict;
+	
+	__u32 dictsz = 0;
+	__u64 dictoffset = 0;
+	
+	/* Images without %MICROFS_FLAG_DICTIONARY have no zstd data,
+	 * %dd belongs to whatever follows it.
+	 */
+	if (sbi->si_flags & MICROFS_FLAG_DICTIONARY) {
+		dictsz = __le32_to_cpu(dd_zstd->dd_dictsz);
+		dictoffset = __le64_to_cpu(dd_zstd->dd_dictoffset);
+		
+		if (__le32_to_cpu(dd_zstd->dd_magic) != MICROFS_DD_ZSTD_MAGIC) {
+			pr_err("bad zstd decompressor data magic\n");
+			err = -EINVAL;
+			goto err;
+		}
+		
+		if (dictsz > MICROFS_DD_ZSTD_MAXDICTSZ
+				|| (dictsz && dictoffset + dictsz
+					> i_size_read(sbi->si_sb->s_bdev->bd_inode))) {
+			pr_err("bad zstd dictionary, %u bytes at offset 0x%llx\n",
+				dictsz, dictoffset);
+			err = -EINVAL;
+			goto err;
+		}
+	}
+	
+	zdict = kzalloc(sizeof(*zdict), GFP_KERNEL);
+	if (!zdict) {
+		err = -ENOMEM;
+		goto err;
+	}
+	data->dd_info = zdict;
+	
+	if (dictsz == 0)
+		return 0;
+	
+	/* The dictionary is referenced by the DDict, so it is kept
+	 * for as long as the decompressor data lives.
+	 */
+	zdict->zd_dictsz = dictsz;
+	zdict->zd_dict = vmalloc(dictsz);
+	zdict->zd_workspace = vmalloc(ZSTD_DDictWorkspaceBound());
+	if (!zdict->zd_dict || !zdict->zd_workspace) {
+		err = -ENOMEM;
+		goto err_dict;
+	}
+	
+	err = decompressor_zstd_read_dict(sbi, zdict->zd_dict, dictoffset, dictsz);
+	if (err < 0)
+		goto err_dict;
+	
+	zdict->zd_ddict = ZSTD_initDDict(zdict->zd_dict, dictsz,
+		zdict->zd_workspace, ZSTD_DDictWorkspaceBound());
+	if (!zdict->zd_ddict) {
+		pr_err("failed to load the zstd dictionary (id %u)\n",
+			__le32_to_cpu(dd_zstd->dd_dictid));
+		err = -EINVAL;
+		goto err_dict;
+	}
+	
+	return 0;
+	
+err_dict:
+	vfree(zdict->zd_workspace);
+	vfree(zdict->zd_dict);
+	kfree(zdict);
+	data->dd_info = NULL;
+err:
+	return err;
+}
+
+static int decompressor_zstd_data_exit(struct microfs_sb_info* sbi,
+	struct microfs_decompressor_data* data)
+{
+	struct decompressor_zstd_dict* zdict = data->dd_info;
+	
+	(void)sbi;
+	
+	if (zdict) {
+		vfree(zdict->zd_workspace);
+		vfree(zdict->zd_dict);
+		kfree(zdict);
+	}
+	
+	return 0;
+}
+
+static ZSTD_DStream* decompressor_zstd_init_stream(struct microfs_sb_info* sbi,
+	struct decompressor_zstd_data* zdat)
+{
+	struct decompressor_zstd_dict* zdict = sbi->si_decompressor_data->dd_info;
+	
+	if (zdict->zd_ddict) {
+		return ZSTD_initDStream_usingDDict(zdat->z_window_size,
+			zdict->zd_ddict, zdat->z_workspace, zdat->z_workspace_size);
+	}
+	return ZSTD_initDStream(zdat->z_window_size,
+		zdat->z_workspace, zdat->z_workspace_size);
+}
+
 static int decompressor_zstd_create(struct microfs_sb_info* sbi, void** dest)
 {
 	struct decompressor_zstd_data* zdat = kzalloc(sizeof(*zdat), GFP_KERNEL);
@@ -47,13 +207,38 @@ static int decompressor_zstd_create(struct microfs_sb_info* sbi, void** dest)
 	zdat->z_workspace = vmalloc(zdat->z_workspace_size);
 	if (zdat->z_workspace == NULL)
 		goto err_mem_workspace;
-	zdat->z_stream = ZSTD_initDStream(zdat->z_window_size,
-		zdat->z_workspace, zdat->z_workspace_size);
+	zdat->z_stream = decompressor_zstd_init_stream(sbi, zdat);
+	
+	zdat->z_dctx_workspace = vmalloc(ZSTD_DCtxWorkspaceBound());
+	if (zdat->z_dctx_workspace == NULL)
+		goto err_mem_dctx;
+	zdat->z_dctx = ZSTD_initDCtx(zdat->z_dctx_workspace,
+		ZSTD_DCtxWorkspaceBound());
+	
+	/* Compressed data bigger than a block is rare enough to
+	 * always be streamed.
+	 */
+	zdat->z_maxbhpages = DIV_ROUND_UP(max_t(__u32, sbi->si_blksz, PAGE_SIZE),
+		PAGE_SIZE) + 1;
+	zdat->z_bhpages = kmalloc_array(zdat->z_maxbhpages,
+		sizeof(*zdat->z_bhpages), GFP_KERNEL);
+	if (zdat->z_bhpages == NULL)
+		goto err_mem_bhpages;
+	
+	/* The percpu decompressor data is used with preemption
+	 * disabled.
+	 */
+	zdat->z_cansleep = sbi->si_decompressor_data->dd_creator
+		!= microfs_decompressor_data_percpu_create;
 	
 	*dest = zdat;
 	
 	return 0;
 
+err_mem_bhpages:
+	vfree(zdat->z_dctx_workspace);
+err_mem_dctx:
+	vfree(zdat->z_workspace);
 err_mem_workspace:
 	kfree(zdat);
 err_mem_zdat:
@@ -65,6 +250,8 @@ static int decompressor_zstd_destroy(struct microfs_sb_info* sbi, void* data)
 	struct decompressor_zstd_data* zdat = data;
 	
 	if (zdat) {
+		kfree(zdat->z_bhpages);
+		vfree(zdat->z_dctx_workspace);
 		vfree(zdat->z_workspace);
 		kfree(zdat);
 	}
@@ -81,28 +268,30 @@ static int decompressor_zstd_reset(struct microfs_sb_info* sbi, void* data)
 	if (unlikely(code != 0)) {
 		pr_err("failed to reset the inflate stream: %zu\n", code);
 		pr_err("reinitializing the stream\n");
-		zdat->z_stream = ZSTD_initDStream(zdat->z_window_size,
-			zdat->z_workspace, zdat->z_workspace_size);
+		zdat->z_stream = decompressor_zstd_init_stream(sbi, zdat);
 	}
 	
 	return 0;
 }
 
 static int decompressor_zstd_exceptionally_begin(struct microfs_sb_info* sbi,
-	void* data)
+	void* data, struct microfs_data_buffer* destbuf)
 {
 	struct decompressor_zstd_data* zdat = data;
 
 	pr_spam("decompressor_zstd_exceptionally_begin: zdat=0x%p\n", zdat);
 	
-	sbi->si_filedatabuf.d_offset = MICROFS_MAXIMGSIZE - 1;
-	sbi->si_filedatabuf.d_used = 0;
+	(void)sbi;
+	
 	zdat->z_in_buf.src = NULL;
 	zdat->z_in_buf.size = 0;
 	zdat->z_in_buf.pos = 0;
-	zdat->z_out_buf.dst = sbi->si_filedatabuf.d_data;
-	zdat->z_out_buf.size = sbi->si_filedatabuf.d_size;
+	zdat->z_out_buf.dst = destbuf->d_data;
+	zdat->z_out_buf.size = destbuf->d_size;
 	zdat->z_out_buf.pos = 0;
+	zdat->z_whole = 1;
+	zdat->z_atomic = 0;
+	zdat->z_vaddr = NULL;
 	
 	return 0;
 }
@@ -110,13 +299,12 @@ static int decompressor_zstd_exceptionally_begin(struct microfs_sb_info* sbi,
 static int decompressor_zstd_nominally_begin(struct microfs_sb_info* sbi,
 	void* data, struct page** pages, __u32 npages)
 {
+	__u32 i;
 	struct decompressor_zstd_data* zdat = data;
 	
 	pr_spam("decompressor_zstd_nominally_begin: zdat=0x%p\n", zdat);
 
 	(void)sbi;
-	(void)pages;
-	(void)npages;
 	
 	zdat->z_in_buf.src = NULL;
 	zdat->z_in_buf.size = 0;
@@ -124,6 +312,27 @@ static int decompressor_zstd_nominally_begin(struct microfs_sb_info* sbi,
 	zdat->z_out_buf.dst = NULL;
 	zdat->z_out_buf.size = 0;
 	zdat->z_out_buf.pos = 0;
+	zdat->z_atomic = 0;
+	zdat->z_vaddr = NULL;
+	
+	for (i = 0; i < npages && pages[i]; i++)
+		;
+	zdat->z_whole = i == npages && npages > 0;
+	
+	/* A single page is mapped by the stream as usual, more pages
+	 * are mapped back to back so that the block can be decompressed
+	 * in one go, see %decompressor_zstd_consumebhs().
+	 */
+	if (zdat->z_whole && npages > 1) {
+		if (zdat->z_cansleep)
+			zdat->z_vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+		if (zdat->z_vaddr) {
+			zdat->z_out_buf.dst = zdat->z_vaddr;
+			zdat->z_out_buf.size = npages * PAGE_SIZE;
+		} else {
+			zdat->z_whole = 0;
+		}
+	}
 	
 	return 0;
 }
@@ -133,7 +342,9 @@ static int decompressor_zstd_copy_nominally_needpage(struct microfs_sb_info* sbi
 {
 	struct decompressor_zstd_data* zdat = data;
 	(void)sbi;
-	return zdat->z_out_buf.pos == zdat->z_out_buf.size;
+	/* The %vmap()ed pages are all of the pages.
+	 */
+	return !zdat->z_vaddr && zdat->z_out_buf.pos == zdat->z_out_buf.size;
 }
 
 static int decompressor_zstd_copy_nominally_utilizepage(struct microfs_sb_info* sbi,
@@ -143,6 +354,7 @@ static int decompressor_zstd_copy_nominally_utilizepage(struct microfs_sb_info*
 	(void)sbi;
 	if (page) {
 		zdat->z_pageaddr = kmap_atomic(page);
+		zdat->z_atomic = 1;
 		zdat->z_out_buf.dst = zdat->z_pageaddr;
 		zdat->z_out_buf.size = PAGE_SIZE;
 		zdat->z_out_buf.pos = 0;
@@ -159,9 +371,78 @@ static int decompressor_zstd_copy_nominally_releasepage(struct microfs_sb_info*
 	(void)sbi;
 	(void)page;
 	kunmap_atomic(zdat->z_pageaddr);
+	zdat->z_atomic = 0;
 	return 0;
 }
 
+/* Decompress the entire block in one go, which is possible if
+ * %z_out_buf covers the output of the entire block and the block
+ * data is either stored in one bh or can be mapped back to back.
+ * Get zero in return if the data must be streamed.
+ */
+static int decompressor_zstd_consume_oneshot(struct microfs_sb_info* sbi,
+	struct decompressor_zstd_data* zdat, struct buffer_head** bhs,
+	__u32 nbhs, __u32* length, __u32* bh, __u32* bh_offset,
+	__u32* inflated, int* implerr, int* err)
+{
+	__u32 i;
+	size_t result;
+	const void* src;
+	void* bhs_vaddr = NULL;
+	struct decompressor_zstd_dict* zdict = sbi->si_decompressor_data->dd_info;
+	
+	const __u32 nbhpages = DIV_ROUND_UP(*bh_offset + *length, PAGE_SIZE);
+	
+	if (!zdat->z_whole || !zdat->z_out_buf.dst || zdat->z_out_buf.pos
+			|| zdat->z_in_buf.size || zdat->z_totalout || *length == 0
+			|| *bh + nbhpages > nbhs)
+		return 0;
+	
+	if (nbhpages == 1) {
+		src = bhs[*bh]->b_data + *bh_offset;
+	} else {
+		/* %vmap() can not be used while a page is atomically
+		 * mapped.
+		 */
+		if (!zdat->z_cansleep || zdat->z_atomic || nbhpages > zdat->z_maxbhpages)
+			return 0;
+		for (i = 0; i < nbhpages; i++)
+			zdat->z_bhpages[i] = bhs[*bh + i]->b_page;
+		bhs_vaddr = vmap(zdat->z_bhpages, nbhpages, VM_MAP, PAGE_KERNEL_RO);
+		if (!bhs_vaddr)
+			return 0;
+		src = bhs_vaddr + *bh_offset;
+	}
+	
+	pr_spam("decompressor_zstd_consume_oneshot: *length=%u, nbhpages=%u\n",
+		*length, nbhpages);
+	
+	result = zdict->zd_ddict
+		? ZSTD_decompress_usingDDict(zdat->z_dctx, zdat->z_out_buf.dst,
+			zdat->z_out_buf.size, src, *length, zdict->zd_ddict)
+		: ZSTD_decompressDCtx(zdat->z_dctx, zdat->z_out_buf.dst,
+			zdat->z_out_buf.size, src, *length);
+	
+	if (bhs_vaddr)
+		vunmap(bhs_vaddr);
+	
+	if (ZSTD_isError(result)) {
+		*implerr = ZSTD_getErrorCode(result);
+		pr_err("decompressor_zstd_consume_oneshot:"
+			" failed to inflate data, implerr %d\n", *implerr);
+		*err = -EIO;
+	} else {
+		zdat->z_out_buf.pos = result;
+		*inflated += result;
+	}
+	
+	*bh += nbhpages;
+	*bh_offset = 0;
+	*length = 0;
+	
+	return 1;
+}
+
 static int decompressor_zstd_consumebhs(struct microfs_sb_info* sbi,
 	void* data, struct buffer_head** bhs, __u32 nbhs, __u32* length,
 	__u32* bh, __u32* bh_offset, __u32* inflated, int* implerr)
@@ -178,6 +459,10 @@ static int decompressor_zstd_consumebhs(struct microfs_sb_info* sbi,
 	pr_spam("decompressor_zstd_consumebhs: *length=%u, *bh=%u, *bh_offset=%u, *inflated=%u\n",
 		*length, *bh, *bh_offset, *inflated);
 	
+	if (decompressor_zstd_consume_oneshot(sbi, zdat, bhs, nbhs, length,
+			bh, bh_offset, inflated, implerr, &err))
+		return err;
+	
 	do {
 		if (zdat->z_in_buf.size == zdat->z_in_buf.pos) {
 			pr_spam("decompressor_zstd_consumebhs: *bh=%u, bhs[*bh]=0x%p\n", *bh, bhs[*bh]);
@@ -251,17 +536,24 @@ static int decompressor_zstd_continue(struct microfs_sb_info* sbi,
 	return !err && implerr == 0 && (
 		zdat->z_in_buf.pos < zdat->z_in_buf.size || length > 0
 	) && (
-		zdat->z_out_buf.pos < zdat->z_out_buf.size || more_avail_out > 0
+		zdat->z_out_buf.pos < zdat->z_out_buf.size
+			|| (!zdat->z_vaddr && more_avail_out > 0)
 	);
 }
 
 static int decompressor_zstd_end(struct microfs_sb_info* sbi,
 	void* data, int* err, int* implerr, __u32* decompressed)
 {
+	struct decompressor_zstd_data* zdat = data;
+	
 	(void)sbi;
-	(void)data;
 	(void)decompressed;
 	
+	if (zdat->z_vaddr) {
+		vunmap(zdat->z_vaddr);
+		zdat->z_vaddr = NULL;
+	}
+	
 	if (*err) {
 		return -1;
 	} else if (!*err && *implerr != 0) {
@@ -277,8 +569,8 @@ const struct microfs_decompressor decompressor_zstd = {
 	.dc_info = &libinfo_zstd,
 	.dc_compiled = 1,
 	.dc_streamed = 1,
-	.dc_data_init = microfs_decompressor_data_init_noop,
-	.dc_data_exit = microfs_decompressor_data_exit_noop,
+	.dc_data_init = decompressor_zstd_data_init,
+	.dc_data_exit = decompressor_zstd_data_exit,
 	.dc_create = decompressor_zstd_create,
 	.dc_destroy = decompressor_zstd_destroy,
 	.dc_reset = decompressor_zstd_reset,
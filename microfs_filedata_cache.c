@@ -0,0 +1,284 @@
+/* microfs - Minimally Improved Compressed Read Only File System
+ * Copyright (C) 2012, 2013, 2014, 2015, 2016, 2017, ..., +%Y
+ * Erik Edlund <erik.edlund@32767.se>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "microfs.h"
+
+#include <linux/cpumask.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+
+static inline __u32 microfs_filedata_cache_scratch_ceil(void)
+{
+	return num_online_cpus() * 2;
+}
+
+static inline struct hlist_head* microfs_filedata_cache_bucket(
+	struct microfs_filedata_cache* fc, __u64 offset)
+{
+	return &fc->fc_buckets[hash_64(offset, fc->fc_hashbits)];
+}
+
+/* Find the entry holding the block at %offset, the caller must
+ * hold %fc_lock.
+ */
+static struct microfs_filedata_entry* microfs_filedata_cache_find(
+	struct microfs_filedata_cache* fc, __u64 offset)
+{
+	struct microfs_filedata_entry* entry;
+	
+	hlist_for_each_entry(entry, microfs_filedata_cache_bucket(fc, offset), fe_hash) {
+		if (entry->fe_buf.d_offset == offset)
+			return entry;
+	}
+	
+	return NULL;
+}
+
+static void microfs_filedata_entry_init(struct microfs_filedata_entry* entry,
+	__u32 entrysz)
+{
+	/* %d_data is allocated when the entry is first needed, so
+	 * mounting with a big cache costs nothing until the cache
+	 * is actually used.
+	 */
+	entry->fe_buf.d_data = NULL;
+	entry->fe_buf.d_size = entrysz;
+	entry->fe_buf.d_used = 0;
+	entry->fe_buf.d_offset = U64_MAX;
+	entry->fe_users = 0;
+	INIT_LIST_HEAD(&entry->fe_lru);
+	INIT_HLIST_NODE(&entry->fe_hash);
+}
+
+int microfs_filedata_cache_create(struct microfs_filedata_cache* fc,
+	__u64 cachesz, __u32 entrysz)
+{
+	__u32 i;
+	
+	fc->fc_entrysz = entrysz;
+	fc->fc_nentries = max_t(__u64, cachesz / entrysz, 1);
+	fc->fc_nscratch = 0;
+	/* Aim for a load factor of at most one. */
+	fc->fc_hashbits = max_t(__u32, order_base_2(fc->fc_nentries), 1);
+	
+	pr_devel("microfs_filedata_cache_create: cachesz=%llu, entrysz=%u, nentries=%u\n",
+		cachesz, fc->fc_entrysz, fc->fc_nentries);
+	
+	fc->fc_entries = kcalloc(fc->fc_nentries, sizeof(*fc->fc_entries), GFP_KERNEL);
+	if (!fc->fc_entries) {
+		pr_err("microfs_filedata_cache_create:"
+			" failed to allocate %u cache entries\n", fc->fc_nentries);
+		return -ENOMEM;
+	}
+	
+	fc->fc_buckets = kcalloc(1 << fc->fc_hashbits, sizeof(*fc->fc_buckets),
+		GFP_KERNEL);
+	if (!fc->fc_buckets) {
+		pr_err("microfs_filedata_cache_create:"
+			" failed to allocate %u cache buckets\n", 1 << fc->fc_hashbits);
+		kfree(fc->fc_entries);
+		fc->fc_entries = NULL;
+		return -ENOMEM;
+	}
+	
+	spin_lock_init(&fc->fc_lock);
+	init_waitqueue_head(&fc->fc_waitqueue);
+	INIT_LIST_HEAD(&fc->fc_lru);
+	INIT_LIST_HEAD(&fc->fc_scratchlist);
+	atomic64_set(&fc->fc_hits, 0);
+	atomic64_set(&fc->fc_misses, 0);
+	
+	for (i = 0; i < fc->fc_nentries; ++i) {
+		microfs_filedata_entry_init(&fc->fc_entries[i], entrysz);
+		list_add_tail(&fc->fc_entries[i].fe_lru, &fc->fc_lru);
+	}
+	
+	return 0;
+}
+
+void microfs_filedata_cache_destroy(struct microfs_filedata_cache* fc)
+{
+	__u32 i;
+	struct microfs_filedata_entry* scratch;
+	
+	if (fc->fc_entries) {
+		for (i = 0; i < fc->fc_nentries; ++i) {
+			WARN_ON(fc->fc_entries[i].fe_users);
+			kvfree(fc->fc_entries[i].fe_buf.d_data);
+		}
+		kfree(fc->fc_entries);
+		fc->fc_entries = NULL;
+		fc->fc_nentries = 0;
+		kfree(fc->fc_buckets);
+		fc->fc_buckets = NULL;
+		
+		while (!list_empty(&fc->fc_scratchlist)) {
+			scratch = list_entry(fc->fc_scratchlist.prev, typeof(*scratch), fe_lru);
+			list_del(&scratch->fe_lru);
+			kvfree(scratch->fe_buf.d_data);
+			kfree(scratch);
+			fc->fc_nscratch--;
+		}
+		
+		WARN_ON(fc->fc_nscratch);
+	}
+}
+
+struct microfs_filedata_entry* microfs_filedata_cache_get(
+	struct microfs_filedata_cache* fc, __u64 offset)
+{
+	struct microfs_filedata_entry* entry;
+	
+	spin_lock(&fc->fc_lock);
+	entry = microfs_filedata_cache_find(fc, offset);
+	if (entry) {
+		entry->fe_users += 1;
+		list_move(&entry->fe_lru, &fc->fc_lru);
+	}
+	spin_unlock(&fc->fc_lock);
+	
+	if (entry)
+		atomic64_inc(&fc->fc_hits);
+	
+	return entry;
+}
+
+void microfs_filedata_cache_put(struct microfs_filedata_cache* fc,
+	struct microfs_filedata_entry* entry)
+{
+	spin_lock(&fc->fc_lock);
+	BUG_ON(entry->fe_users == 0);
+	entry->fe_users -= 1;
+	spin_unlock(&fc->fc_lock);
+}
+
+struct microfs_filedata_entry* microfs_filedata_cache_scratch_get(
+	struct microfs_filedata_cache* fc)
+{
+	struct microfs_filedata_entry* scratch;
+	
+	while (1) {
+		spin_lock(&fc->fc_lock);
+		
+		if (!list_empty(&fc->fc_scratchlist)) {
+			scratch = list_entry(fc->fc_scratchlist.prev, typeof(*scratch), fe_lru);
+			list_del_init(&scratch->fe_lru);
+			spin_unlock(&fc->fc_lock);
+			break;
+		}
+		
+		if (fc->fc_nscratch < microfs_filedata_cache_scratch_ceil()) {
+			fc->fc_nscratch++;
+			spin_unlock(&fc->fc_lock);
+			
+			scratch = kmalloc(sizeof(*scratch), GFP_KERNEL);
+			if (!scratch) {
+				spin_lock(&fc->fc_lock);
+				fc->fc_nscratch--;
+				spin_unlock(&fc->fc_lock);
+				pr_err("microfs_filedata_cache_scratch_get:"
+					" failed to allocate a scratch buffer\n");
+				return ERR_PTR(-ENOMEM);
+			}
+			microfs_filedata_entry_init(scratch, fc->fc_entrysz);
+			break;
+		}
+		
+		spin_unlock(&fc->fc_lock);
+		wait_event(fc->fc_waitqueue, !list_empty(&fc->fc_scratchlist));
+	}
+	
+	if (!scratch->fe_buf.d_data) {
+		scratch->fe_buf.d_data = kvmalloc(scratch->fe_buf.d_size, GFP_KERNEL);
+		if (!scratch->fe_buf.d_data) {
+			pr_err("microfs_filedata_cache_scratch_get:"
+				" failed to allocate %u bytes for a scratch buffer\n",
+				scratch->fe_buf.d_size);
+			microfs_filedata_cache_scratch_put(fc, scratch);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+	
+	return scratch;
+}
+
+void microfs_filedata_cache_scratch_put(struct microfs_filedata_cache* fc,
+	struct microfs_filedata_entry* scratch)
+{
+	scratch->fe_buf.d_offset = U64_MAX;
+	scratch->fe_buf.d_used = 0;
+	
+	spin_lock(&fc->fc_lock);
+	list_add(&scratch->fe_lru, &fc->fc_scratchlist);
+	spin_unlock(&fc->fc_lock);
+	
+	wake_up(&fc->fc_waitqueue);
+}
+
+struct microfs_filedata_entry* microfs_filedata_cache_insert(
+	struct microfs_filedata_cache* fc, struct microfs_filedata_entry* scratch,
+	__u64 offset)
+{
+	char* data;
+	struct microfs_filedata_entry* entry;
+	struct microfs_filedata_entry* victim = NULL;
+	
+	atomic64_inc(&fc->fc_misses);
+	
+	spin_lock(&fc->fc_lock);
+	entry = microfs_filedata_cache_find(fc, offset);
+	if (entry) {
+		/* Another reader decompressed the same block at the
+		 * same time, use its data.
+		 */
+		entry->fe_users += 1;
+		list_move(&entry->fe_lru, &fc->fc_lru);
+		spin_unlock(&fc->fc_lock);
+		return entry;
+	}
+	
+	/* The least recently used entries are at the tail, entries
+	 * in use are usually recent so the walk is short.
+	 */
+	list_for_each_entry_reverse(entry, &fc->fc_lru, fe_lru) {
+		if (entry->fe_users == 0) {
+			victim = entry;
+			break;
+		}
+	}
+	
+	if (victim) {
+		/* Swap the buffers, the old data of the victim ends up in
+		 * the scratch buffer which is recycled by the caller.
+		 */
+		data = victim->fe_buf.d_data;
+		victim->fe_buf.d_data = scratch->fe_buf.d_data;
+		victim->fe_buf.d_used = scratch->fe_buf.d_used;
+		victim->fe_buf.d_offset = offset;
+		victim->fe_users = 1;
+		list_move(&victim->fe_lru, &fc->fc_lru);
+		hlist_del_init(&victim->fe_hash);
+		hlist_add_head(&victim->fe_hash,
+			microfs_filedata_cache_bucket(fc, offset));
+		scratch->fe_buf.d_data = data;
+	}
+	spin_unlock(&fc->fc_lock);
+	
+	return victim;
+}
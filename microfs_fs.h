@@ -28,6 +28,10 @@ __MICROFS_BEGIN_EXTERN_C
 #include <linux/fs.h>
 #include <linux/types.h>
 
+#ifndef __KERNEL__
+#include <sys/stat.h>
+#endif
+
 /* Just a random nice looking integer (which at the moment of
  * writing does not yield any search results on Google).
  */
@@ -37,6 +41,9 @@ __MICROFS_BEGIN_EXTERN_C
 #define MICROFS_DD_XZ_MAGIC 0x377a585a
 #define MICROFS_DD_XZ_CIGAM 0x5a587a37
 
+#define MICROFS_DD_ZSTD_MAGIC 0xfd2fb528
+#define MICROFS_DD_ZSTD_CIGAM 0x28b52ffd
+
 /* microfs signature.
  */
 #define MICROFS_SIGNATURE "MinIReadOnlyFSys"
@@ -82,6 +89,13 @@ __MICROFS_BEGIN_EXTERN_C
 #define MICROFS_MINIMGSIZE \
 	(1ULL << 12)
 
+/* %microfs_sb_large.sl_size determines the upper limit of an
+ * image with %MICROFS_FLAG_LARGEIMAGE. The metadata of such an
+ * image must still fit in the first %MICROFS_MAXIMGSIZE bytes.
+ */
+#define MICROFS_MAXLARGEIMGSIZE \
+	(1ULL << 48)
+
 /* %microfs_inode.i_namelen gives a maximum file name length
  * of 255 bytes (not actual characters (think UTF-8)).
  */
@@ -94,6 +108,11 @@ __MICROFS_BEGIN_EXTERN_C
 #define MICROFS_MAXCRAMSIZE \
 	((1ULL << 24) - 1)
 
+/* Regular files and symlinks up to this size are stored inline
+ * in their dentry, see %MICROFS_FLAG_INLINEDATA.
+ */
+#define MICROFS_MAXINLINESZ 128
+
 /* The maximum size of the metadata stored by a directory.
  */
 #define MICROFS_MAXDIRSIZE \
@@ -104,6 +123,12 @@ __MICROFS_BEGIN_EXTERN_C
 #define MICROFS_MAXFILES \
 	((1ULL << 16) - 1)
 
+/* %microfs_sb_large.sl_files determines the upper limit of an
+ * image with %MICROFS_FLAG_LARGEIMAGE.
+ */
+#define MICROFS_MAXLARGEFILES \
+	((1ULL << 32) - 1)
+
 #define MICROFS_SBSIGNATURE_LENGTH 16
 #define MICROFS_SBNAME_LENGTH 16
 
@@ -115,6 +140,7 @@ __MICROFS_BEGIN_EXTERN_C
  *                          with all past kernels.
  * 
  * 0x00000100 - 0x0000ff00: Decompressor types.
+ * 0x00010000 - 0xffff0000: Image layout features.
  */
 
 #define MICROFS_FLAG_DECOMPRESSOR_NULL 0x00000000
@@ -124,9 +150,105 @@ __MICROFS_BEGIN_EXTERN_C
 #define MICROFS_FLAG_DECOMPRESSOR_XZ   0x00000800
 #define MICROFS_FLAG_DECOMPRESSOR_ZSTD 0x00001000
 
+/* Each non-empty directory is followed by a %microfs_dirindex.
+ */
+#define MICROFS_FLAG_DIRINDEX          0x00010000
+/* Blocks which data length is equal to their uncompressed size
+ * are stored uncompressed.
+ */
+#define MICROFS_FLAG_STOREDBLOCKS      0x00020000
+/* The tail of each file (the data after its last full block)
+ * is stored in a shared fragment block, see %microfs_fragment.
+ */
+#define MICROFS_FLAG_FRAGMENTS         0x00040000
+/* The data of small regular files and symlinks is stored
+ * uncompressed right after the name in their dentry.
+ */
+#define MICROFS_FLAG_INLINEDATA        0x00080000
+/* Blocks of zeros take no data space, the two block pointers
+ * of such a hole are equal.
+ */
+#define MICROFS_FLAG_ZEROBLOCKS        0x00100000
+/* Files can be compressed with other decompressors than the one
+ * given by the flags, %microfs_sb.s_codecs holds the others. The
+ * decompressor of a file is given by its file info word, see
+ * %i_hasfileinfo(). Fragment blocks always use the decompressor
+ * given by the flags.
+ */
+#define MICROFS_FLAG_MIXEDCODECS       0x00200000
+/* Files can use smaller blocks than the image, the block shift
+ * of a file is given by its file info word.
+ */
+#define MICROFS_FLAG_FILEBLKSZ         0x00400000
+/* Blocks can be split into independently compressed sub-frames
+ * so that a page can be read without decompressing its entire
+ * block. The sub-frame shift of a file is given by its file info
+ * word. The data of a block with more than one sub-frame starts
+ * with the end offsets (%__le32, relative to the start of the
+ * block data) of all sub-frames but the last one, the sub-frames
+ * follow back to back. Sub-frames, rather than such blocks, are
+ * stored uncompressed or are holes.
+ */
+#define MICROFS_FLAG_SUBFRAMES         0x00800000
+/* The block pointers of a file can be packed, the width of its
+ * block data lengths is given by its file info word. The packed
+ * block pointers are the data offset of the first block of each
+ * chunk of %MICROFS_BLKPTR_CHUNKBLKS blocks (%__le32) followed by
+ * the bit packed (least significant bit first) data lengths of
+ * all blocks, padded to a multiple of four bytes.
+ */
+#define MICROFS_FLAG_PACKEDBLKPTRS     0x01000000
+/* The image can be bigger than %MICROFS_MAXIMGSIZE bytes and hold
+ * more than %MICROFS_MAXFILES files. The superblock is followed by
+ * a %microfs_sb_large, and the file info word of each file is
+ * followed by a %__le64 base which its block pointers are relative
+ * to. The fragment table is relative to
+ * %microfs_sb_large.sl_fragbase.
+ */
+#define MICROFS_FLAG_LARGEIMAGE        0x02000000
+/* Blocks can be shared between files. The block pointers of a
+ * file which lengths width is %MICROFS_FILEINFO_EXTENTS are the
+ * start and end data offsets (%__le32) of each of its blocks, the
+ * blocks need not be back to back nor belong to the file alone.
+ * A block which start and end are equal is a hole.
+ */
+#define MICROFS_FLAG_SHAREDBLKS        0x04000000
+/* The decompressors which can use a dictionary have decompressor
+ * data which refers to it, see %microfs_dd_zstd. Without the flag
+ * they have no decompressor data and use no dictionary.
+ */
+#define MICROFS_FLAG_DICTIONARY        0x08000000
+
 #define MICROFS_FLAG_MASK_OLDKERNELS   0x000000ff
 #define MICROFS_FLAG_MASK_DECOMPRESSOR 0x0000ff00
 
+/* The number of decompressor ids that fit in the mask.
+ */
+#define MICROFS_MAXCODECS 8
+
+/* The number of blocks per chunk of packed block pointers, see
+ * %MICROFS_FLAG_PACKEDBLKPTRS.
+ */
+#define MICROFS_BLKPTR_CHUNKBLKS 32
+
+/* The file info word holds the id of the decompressor of the
+ * file (masked by %MICROFS_FLAG_MASK_DECOMPRESSOR), its block
+ * shift, its sub-frame shift and the width in bits of its packed
+ * block data lengths. Zero means that the image default is used
+ * for the first two, that the blocks are not split into sub-frames
+ * and that the block pointers are not packed for the last two.
+ */
+#define MICROFS_FILEINFO_MASK_BLKSHIFT   0x000000ff
+#define MICROFS_FILEINFO_MASK_FRAMESHIFT 0x00ff0000
+#define MICROFS_FILEINFO_FRAMESHIFT_LSB  16
+#define MICROFS_FILEINFO_MASK_LENBITS    0xff000000
+#define MICROFS_FILEINFO_LENBITS_LSB     24
+
+/* The block data lengths width that marks block pointers as
+ * extents, see %MICROFS_FLAG_SHAREDBLKS.
+ */
+#define MICROFS_FILEINFO_EXTENTS 0xff
+
 #define MICROFS_SUPPORTED_FLAGS (0       \
 		| MICROFS_FLAG_MASK_OLDKERNELS   \
 		| MICROFS_FLAG_DECOMPRESSOR_ZLIB \
@@ -134,6 +256,18 @@ __MICROFS_BEGIN_EXTERN_C
 		| MICROFS_FLAG_DECOMPRESSOR_LZO  \
 		| MICROFS_FLAG_DECOMPRESSOR_XZ   \
 		| MICROFS_FLAG_DECOMPRESSOR_ZSTD \
+		| MICROFS_FLAG_DIRINDEX          \
+		| MICROFS_FLAG_STOREDBLOCKS      \
+		| MICROFS_FLAG_FRAGMENTS         \
+		| MICROFS_FLAG_INLINEDATA        \
+		| MICROFS_FLAG_ZEROBLOCKS        \
+		| MICROFS_FLAG_MIXEDCODECS       \
+		| MICROFS_FLAG_FILEBLKSZ         \
+		| MICROFS_FLAG_SUBFRAMES         \
+		| MICROFS_FLAG_PACKEDBLKPTRS     \
+		| MICROFS_FLAG_LARGEIMAGE        \
+		| MICROFS_FLAG_SHAREDBLKS        \
+		| MICROFS_FLAG_DICTIONARY        \
 	)
 
 /* "On-disk" inode.
@@ -182,8 +316,10 @@ struct microfs_sb {
 	__le32 s_ctime;
 	/* Block size left shift. */
 	__le16 s_blkshift;
-	/* Reserved. */
-	 __le16 s_future;
+	/* Decompressors used besides the one given by %s_flags (their
+	 * ids shifted right by eight bits), see %MICROFS_FLAG_MIXEDCODECS.
+	 */
+	__le16 s_codecs;
 	/* MICROFS_SIGNATURE. */
 	__u8 s_signature[MICROFS_SBSIGNATURE_LENGTH];
 	/* User defined image name. */
@@ -192,6 +328,23 @@ struct microfs_sb {
 	struct microfs_inode s_root;
 } __attribute__ ((packed));
 
+/* "On-disk" superblock extension, see %MICROFS_FLAG_LARGEIMAGE.
+ * The %microfs_sb.s_size, %microfs_sb.s_blocks and %microfs_sb.s_files
+ * of such an image are saturated.
+ */
+struct microfs_sb_large {
+	/* Image size. */
+	__le64 sl_size;
+	/* Number of blocks. */
+	__le64 sl_blocks;
+	/* Base of the pointers in the fragment table. */
+	__le64 sl_fragbase;
+	/* Number of files. */
+	__le32 sl_files;
+	/* Reserved for future use. */
+	__le32 sl_future;
+} __attribute__ ((packed));
+
 /* "On-disk" xz decompressor data.
  */
 struct microfs_dd_xz {
@@ -201,6 +354,118 @@ struct microfs_dd_xz {
 	__le32 dd_dictsz;
 }  __attribute__ ((packed));
 
+/* Max size of a zstd dictionary.
+ */
+#define MICROFS_DD_ZSTD_MAXDICTSZ (1 << 20)
+
+/* "On-disk" zstd decompressor data, only present in an image
+ * with %MICROFS_FLAG_DICTIONARY.
+ * 
+ * Every block compressed by zstd is compressed against the
+ * dictionary (if the image has one), which is stored as is at
+ * %dd_dictoffset. The dictionary is usually found after the data
+ * of all files, as it is trained on a sample of that data.
+ */
+struct microfs_dd_zstd {
+	/* MICROFS_DD_ZSTD_MAGIC. */
+	__le32 dd_magic;
+	/* Dictionary size (zero if there is no dictionary). */
+	__le32 dd_dictsz;
+	/* Dictionary id, as found in the dictionary header. */
+	__le32 dd_dictid;
+	/* Reserved for future use. */
+	__le32 dd_future;
+	/* Dictionary offset. */
+	__le64 dd_dictoffset;
+}  __attribute__ ((packed));
+
+/* "On-disk" directory index, see %MICROFS_FLAG_DIRINDEX.
+ * 
+ * The index is stored right after the dentries of the directory
+ * (aligned to four bytes, see %microfs_dirindex_offset()) and
+ * the header is followed by:
+ * 
+ * __le32 bucket[di_buckets + 1]
+ * struct microfs_dirindex_entry entry[di_entries]
+ * 
+ * The entries of bucket %n are entry[bucket[n]] up to (but not
+ * including) entry[bucket[n + 1]]. An entry is placed in bucket
+ * microfs_namehash(name) & (di_buckets - 1).
+ */
+struct microfs_dirindex {
+	/* Number of buckets, a power of two. */
+	__le32 di_buckets;
+	/* Number of entries (dentries in the directory). */
+	__le32 di_entries;
+} __attribute__ ((packed));
+
+/* "On-disk" directory index entry.
+ */
+struct microfs_dirindex_entry {
+	/* %microfs_namehash() of the dentry name. */
+	__le32 de_hash;
+	/* Dentry offset, relative to the first dentry of the directory. */
+	__le32 de_offset;
+} __attribute__ ((packed));
+
+/* "On-disk" fragment reference, see %MICROFS_FLAG_FRAGMENTS.
+ * 
+ * The reference is stored right after the block pointers of a
+ * file with a tail, a file which only has a tail has no block
+ * pointers at all. Fragment blocks are compressed just like any
+ * other block and are described by a pair of pointers (start and
+ * end) in the fragment table, which is stored after the block
+ * pointers of all files.
+ */
+struct microfs_fragment {
+	/* Offset of the pointer pair of the fragment block. */
+	__le32 fr_blkptr;
+	/* Offset of the tail in the uncompressed fragment block. */
+	__le32 fr_offset;
+} __attribute__ ((packed));
+
+/* FNV-1a hash of the given name.
+ */
+static inline __u32 microfs_namehash(const char* const name,
+	const __u32 namelen)
+{
+	__u32 i;
+	__u32 hash = 0x811c9dc5;
+	for (i = 0; i < namelen; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+/* Get the number of buckets used to index %entries dentries.
+ */
+static inline __u32 microfs_dirindex_buckets(const __u32 entries)
+{
+	__u32 buckets = 1;
+	while (buckets < entries)
+		buckets <<= 1;
+	return buckets;
+}
+
+/* Get the offset of the index for a directory which dentries
+ * start at %offset and are %size bytes.
+ */
+static inline __u32 microfs_dirindex_offset(const __u32 offset,
+	const __u32 size)
+{
+	return ((offset + size - 1) | 3) + 1;
+}
+
+/* Get the size of an index with the given number of entries.
+ */
+static inline __u32 microfs_dirindex_size(const __u32 entries)
+{
+	return sizeof(struct microfs_dirindex)
+		+ (microfs_dirindex_buckets(entries) + 1) * sizeof(__le32)
+		+ entries * sizeof(struct microfs_dirindex_entry);
+}
+
 static inline __u32 i_getsize(const struct microfs_inode* const ino)
 {
 	return __le32_to_cpu(ino->i_size);
@@ -211,11 +476,77 @@ static inline void i_setsize(struct microfs_inode* const ino, const __u32 size)
 	ino->i_size = __cpu_to_le32(size);
 }
 
+/* Get the number of bytes stored inline in the dentry of a file
+ * with the given %mode and %size (see %MICROFS_FLAG_INLINEDATA).
+ * The %microfs_inode.i_offset of such a file points at the data.
+ */
+static inline __u32 i_inlinesz(const __u32 flags, const __u16 mode,
+	const __u32 size)
+{
+	return (flags & MICROFS_FLAG_INLINEDATA) && (S_ISREG(mode) || S_ISLNK(mode))
+		&& size <= MICROFS_MAXINLINESZ ? size : 0;
+}
+
+/* Determine if the block pointers of the regular files and
+ * symlinks of an image with the given %flags are preceded by
+ * a %__le32 file info word. The %microfs_inode.i_offset of such
+ * a file points at the word.
+ */
+static inline int i_hasfileinfo(const __u32 flags)
+{
+	return !!(flags & (MICROFS_FLAG_MIXEDCODECS | MICROFS_FLAG_FILEBLKSZ
+		| MICROFS_FLAG_SUBFRAMES | MICROFS_FLAG_PACKEDBLKPTRS
+		| MICROFS_FLAG_LARGEIMAGE | MICROFS_FLAG_SHAREDBLKS));
+}
+
+/* Get the number of bytes that precede the block pointers of the
+ * regular files and symlinks of an image with the given %flags:
+ * the file info word and the data base (see
+ * %MICROFS_FLAG_LARGEIMAGE).
+ */
+static inline __u32 i_fileinfosz(const __u32 flags)
+{
+	return (i_hasfileinfo(flags) ? sizeof(__le32) : 0)
+		+ (flags & MICROFS_FLAG_LARGEIMAGE ? sizeof(__le64) : 0);
+}
+
+/* Get the size of the superblock extension of an image with the
+ * given %flags, see %MICROFS_FLAG_LARGEIMAGE.
+ */
+static inline __u32 sb_largesz(const __u32 flags)
+{
+	return flags & MICROFS_FLAG_LARGEIMAGE ? sizeof(struct microfs_sb_large) : 0;
+}
+
+/* Get the size of the given dentry: the inode, the name and any
+ * inline data.
+ */
+static inline __u32 i_dentrysz(const struct microfs_inode* const ino,
+	const __u32 flags)
+{
+	return sizeof(*ino) + ino->i_namelen + i_inlinesz(flags,
+		__le16_to_cpu(ino->i_mode), i_getsize(ino));
+}
+
 /* Determine if %sb->s_flags specifies unknown flags.
  */
 static inline int sb_unsupportedflags(const struct microfs_sb* const sb)
 {
-	return __le32_to_cpu(sb->s_flags) & ~(MICROFS_SUPPORTED_FLAGS);
+	return (__le32_to_cpu(sb->s_flags)
+		| ((__u32)__le16_to_cpu(sb->s_codecs) << 8)) & ~(MICROFS_SUPPORTED_FLAGS);
+}
+
+/* Get the index of the given decompressor id, in the range
+ * [0, %MICROFS_MAXCODECS), or -1 if it is not a single id.
+ */
+static inline int microfs_codecidx(const __u32 id)
+{
+	int i;
+	for (i = 0; i < MICROFS_MAXCODECS; i++) {
+		if (id == ((__u32)MICROFS_FLAG_DECOMPRESSOR_ZLIB << i))
+			return i;
+	}
+	return -1;
 }
 
 __MICROFS_END_EXTERN_C
@@ -24,6 +24,34 @@ static const struct file_operations microfs_dir_i_fops;
 
 static const struct address_space_operations microfs_i_a_ops;
 
+/* Copy the target of an inlined symlink out of the metadata, the
+ * result is owned by the VFS inode and released with it.
+ */
+static char* microfs_get_link(struct super_block* sb,
+	const struct microfs_inode* const minode)
+{
+	struct microfs_metadata_ref ref;
+	
+	__u32 size = i_getsize(minode);
+	
+	char* link;
+	char* data = __microfs_get_metadata(sb, __le32_to_cpu(minode->i_offset),
+		size, &ref);
+	if (unlikely(IS_ERR(data)))
+		return data;
+	
+	link = kmalloc(size + 1, GFP_KERNEL);
+	if (link) {
+		memcpy(link, data, size);
+		link[size] = '\0';
+	} else {
+		link = ERR_PTR(-ENOMEM);
+	}
+	
+	__microfs_put_metadata(&ref);
+	return link;
+}
+
 struct inode* microfs_get_inode(struct super_block* sb,
 	const struct microfs_inode* const minode, const __u32 offset)
 {
@@ -53,6 +81,17 @@ struct inode* microfs_get_inode(struct super_block* sb,
 			vinode->i_fop = &microfs_dir_i_fops;
 			break;
 		case S_IFLNK:
+			if (i_inlinesz(MICROFS_SB(sb)->si_flags,
+					__le16_to_cpu(minode->i_mode), i_getsize(minode))) {
+				char* link = microfs_get_link(sb, minode);
+				if (unlikely(IS_ERR(link))) {
+					iget_failed(vinode);
+					return (struct inode*)link;
+				}
+				vinode->i_link = link;
+				vinode->i_op = &simple_symlink_inode_operations;
+				break;
+			}
 			inode_nohighmem(vinode);
 			vinode->i_op = &page_symlink_inode_operations;
 			vinode->i_data.a_ops = &microfs_i_a_ops;
@@ -72,6 +111,14 @@ struct inode* microfs_get_inode(struct super_block* sb,
 		vinode->i_blocks = (size - 1) / 512 + 1;
 	}
 	
+	if (S_ISREG(vinode->i_mode) || S_ISLNK(vinode->i_mode)) {
+		int err = __microfs_load_fileinfo(sb, vinode);
+		if (unlikely(err)) {
+			iget_failed(vinode);
+			return ERR_PTR(err);
+		}
+	}
+	
 	/* Well, the time stamps are perhaps not super sane, they
 	 * should however be sane enough for practical purposes.
 	 */
@@ -101,6 +148,304 @@ static int microfs_readpage(struct file* file, struct page* page)
 	}
 }
 
+/* Fill the given pages with data, used for readahead.
+ */
+static int microfs_readpages(struct file* file, struct address_space* mapping,
+	struct list_head* pages, unsigned nr_pages)
+{
+	return __microfs_readpages(file, mapping, pages, nr_pages);
+}
+
+__u32* __microfs_load_dirindex(struct super_block* sb, struct inode* inode)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	struct microfs_metadata_ref ref;
+	
+	__u32 i;
+	__u32 b;
+	__u32 offset;
+	__u32 buckets;
+	__u32 entries = 0;
+	__u32 index_sz = 0;
+	__u32 dir_offset = microfs_get_offset(inode);
+	__u32 dir_size = i_size_read(inode);
+	__u32 max_entries = dir_size / (sizeof(struct microfs_inode) + 1);
+	
+	__u32* bucket;
+	__u32* entry;
+	__u32* scan = NULL;
+	
+	__u32* index = smp_load_acquire(&ii->ii_dirindex);
+	if (likely(index) || sbi->si_dirindexcachesz == 0
+			|| dir_size < sbi->si_dirindexthreshold || dir_size == 0)
+		return index;
+	
+	mutex_lock(&ii->ii_mutex);
+	
+	index = ii->ii_dirindex;
+	if (index)
+		goto out;
+	
+	/* Hash every dentry in a single pass, the index is sized when
+	 * the number of dentries is known.
+	 */
+	scan = kvmalloc(max_entries * sizeof(*scan) * 2, GFP_KERNEL);
+	if (!scan) {
+		pr_err("__microfs_load_dirindex: failed to allocate the scan buffer"
+			" for ino %lu\n", inode->i_ino);
+		goto err_scan;
+	}
+	
+	for (offset = 0; offset < dir_size; ++entries) {
+		struct microfs_inode* minode;
+		
+		if (unlikely(entries == max_entries)) {
+			pr_err("__microfs_load_dirindex: too many dentries"
+				" for ino %lu\n", inode->i_ino);
+			goto err_io;
+		}
+		
+		minode = __microfs_get_dentry(sb, dir_offset + offset, &ref);
+		if (unlikely(IS_ERR(minode))) {
+			pr_err("__microfs_load_dirindex: failed to read the dentry"
+				" at offset 0x%x\n", dir_offset + offset);
+			goto err_io;
+		}
+		scan[entries * 2] = microfs_namehash((char*)(minode + 1),
+			minode->i_namelen);
+		scan[entries * 2 + 1] = offset;
+		offset += i_dentrysz(minode, sbi->si_flags);
+		__microfs_put_metadata(&ref);
+	}
+	
+	index_sz = microfs_dirindex_size(entries);
+	if (atomic64_add_return(index_sz, &sbi->si_dirindexcacheused)
+			> sbi->si_dirindexcachesz) {
+		pr_spam("__microfs_load_dirindex: cache full, %u bytes needed"
+			" for ino %lu\n", index_sz, inode->i_ino);
+		goto err_full;
+	}
+	
+	index = kvmalloc(index_sz, GFP_KERNEL);
+	if (!index) {
+		pr_err("__microfs_load_dirindex: failed to allocate %u bytes"
+			" for ino %lu\n", index_sz, inode->i_ino);
+		goto err_mem;
+	}
+	
+	buckets = microfs_dirindex_buckets(entries);
+	bucket = index + 2;
+	entry = bucket + buckets + 1;
+	
+	index[0] = buckets;
+	index[1] = entries;
+	
+	/* Count the dentries in each bucket and place them, the bucket
+	 * starts are shifted one step while the entries are placed.
+	 */
+	memset(bucket, 0, (buckets + 1) * sizeof(*bucket));
+	for (i = 0; i < entries; ++i)
+		bucket[(scan[i * 2] & (buckets - 1)) + 1]++;
+	for (b = 0; b < buckets; ++b)
+		bucket[b + 1] += bucket[b];
+	for (i = 0; i < entries; ++i) {
+		__u32 slot = bucket[scan[i * 2] & (buckets - 1)]++;
+		entry[slot * 2] = scan[i * 2];
+		entry[slot * 2 + 1] = scan[i * 2 + 1];
+	}
+	memmove(bucket + 1, bucket, buckets * sizeof(*bucket));
+	bucket[0] = 0;
+	
+	kvfree(scan);
+	
+	pr_spam("__microfs_load_dirindex: %u dentries indexed for ino %lu\n",
+		entries, inode->i_ino);
+	
+	ii->ii_dirindexsz = index_sz;
+	smp_store_release(&ii->ii_dirindex, index);
+	
+	goto out;
+	
+err_mem:
+err_full:
+	atomic64_sub(index_sz, &sbi->si_dirindexcacheused);
+err_io:
+	kvfree(scan);
+err_scan:
+	index = NULL;
+out:
+	mutex_unlock(&ii->ii_mutex);
+	return index;
+}
+
+void __microfs_unload_dirindex(struct super_block* sb, struct inode* inode)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	
+	if (ii->ii_dirindex) {
+		kvfree(ii->ii_dirindex);
+		atomic64_sub(ii->ii_dirindexsz, &sbi->si_dirindexcacheused);
+		ii->ii_dirindex = NULL;
+		ii->ii_dirindexsz = 0;
+	}
+}
+
+/* Check if the dentry at %dentry_offset (relative to the first
+ * dentry of %dinode) is %dentry. 1 is returned and *%vinode is
+ * set on a match, 0 is returned if there is no match.
+ */
+static int microfs_lookup_candidate(struct inode* dinode,
+	struct dentry* dentry, __u32 dentry_offset, struct inode** vinode)
+{
+	struct super_block* sb = dinode->i_sb;
+	struct microfs_inode* minode;
+	struct microfs_metadata_ref ref;
+	
+	int found = 0;
+	
+	if (unlikely(dentry_offset >= i_size_read(dinode))) {
+		pr_err("microfs_lookup_candidate: bad dentry offset 0x%x"
+			" for ino %lu\n", dentry_offset, dinode->i_ino);
+		return -EIO;
+	}
+	
+	dentry_offset += microfs_get_offset(dinode);
+	minode = __microfs_get_dentry(sb, dentry_offset, &ref);
+	if (unlikely(IS_ERR(minode)))
+		return PTR_ERR(minode);
+	
+	if (dentry->d_name.len == minode->i_namelen && memcmp(
+			dentry->d_name.name, minode + 1, minode->i_namelen) == 0) {
+		struct inode* inode = microfs_get_inode(sb, minode, dentry_offset);
+		if (unlikely(IS_ERR(inode))) {
+			found = PTR_ERR(inode);
+		} else {
+			*vinode = inode;
+			found = 1;
+		}
+	}
+	
+	__microfs_put_metadata(&ref);
+	
+	return found;
+}
+
+/* Look up %dentry in %dinode using the in-memory %index, see
+ * %__microfs_load_dirindex(). *%vinode is left untouched if
+ * there is no such dentry.
+ */
+static int microfs_lookup_dirindex_cached(struct inode* dinode,
+	struct dentry* dentry, const __u32* index, struct inode** vinode)
+{
+	__u32 i;
+	__u32 buckets = index[0];
+	__u32 hash = microfs_namehash(dentry->d_name.name, dentry->d_name.len);
+	
+	const __u32* bucket = index + 2 + (hash & (buckets - 1));
+	const __u32* entry = index + 2 + buckets + 1;
+	
+	for (i = bucket[0]; i < bucket[1]; ++i) {
+		if (entry[i * 2] == hash) {
+			int found = microfs_lookup_candidate(dinode, dentry,
+				entry[i * 2 + 1], vinode);
+			if (found)
+				return found < 0 ? found : 0;
+		}
+	}
+	
+	return 0;
+}
+
+/* Look up %dentry in %dinode using the on-disk directory index
+ * (see %MICROFS_FLAG_DIRINDEX). *%vinode is left untouched if
+ * there is no such dentry.
+ */
+static int microfs_lookup_dirindex(struct inode* dinode,
+	struct dentry* dentry, struct inode** vinode)
+{
+	__u32 i;
+	__u32 hash;
+	__u32 buckets;
+	__u32 entries;
+	__u32 start;
+	__u32 end;
+	
+	__u32 dir_offset = microfs_get_offset(dinode);
+	__u32 dir_size = i_size_read(dinode);
+	__u32 index_offset = microfs_dirindex_offset(dir_offset, dir_size);
+	__u32 bucket_offset = index_offset + sizeof(struct microfs_dirindex);
+	__u32 entry_offset;
+	
+	struct super_block* sb = dinode->i_sb;
+	struct microfs_dirindex* index;
+	struct microfs_metadata_ref ref;
+	
+	__le32* bucket;
+	
+	pr_devel_once("microfs_lookup_dirindex: first call\n");
+	
+	index = __microfs_get_metadata(sb, index_offset, sizeof(*index), &ref);
+	if (unlikely(IS_ERR(index)))
+		return PTR_ERR(index);
+	buckets = __le32_to_cpu(index->di_buckets);
+	entries = __le32_to_cpu(index->di_entries);
+	__microfs_put_metadata(&ref);
+	
+	if (unlikely(!is_power_of_2(buckets))) {
+		pr_err("microfs_lookup_dirindex: bad index at 0x%x,"
+			" buckets=%u\n", index_offset, buckets);
+		return -EIO;
+	}
+	
+	hash = microfs_namehash(dentry->d_name.name, dentry->d_name.len);
+	
+	bucket = __microfs_get_metadata(sb, bucket_offset
+		+ (hash & (buckets - 1)) * sizeof(*bucket), sizeof(*bucket) * 2, &ref);
+	if (unlikely(IS_ERR(bucket)))
+		return PTR_ERR(bucket);
+	start = __le32_to_cpu(bucket[0]);
+	end = __le32_to_cpu(bucket[1]);
+	__microfs_put_metadata(&ref);
+	
+	if (unlikely(start > end || end > entries)) {
+		pr_err("microfs_lookup_dirindex: bad bucket in the index at 0x%x,"
+			" start=%u, end=%u, entries=%u\n", index_offset, start, end, entries);
+		return -EIO;
+	}
+	
+	pr_spam("microfs_lookup_dirindex: hash=0x%x, start=%u, end=%u\n",
+		hash, start, end);
+	
+	entry_offset = bucket_offset + (buckets + 1) * sizeof(*bucket);
+	
+	for (i = start; i < end; ++i) {
+		__u32 dentry_offset;
+		
+		int found;
+		
+		struct microfs_dirindex_entry* entry;
+		
+		entry = __microfs_get_metadata(sb, entry_offset + i * sizeof(*entry),
+			sizeof(*entry), &ref);
+		if (unlikely(IS_ERR(entry)))
+			return PTR_ERR(entry);
+		if (__le32_to_cpu(entry->de_hash) != hash) {
+			__microfs_put_metadata(&ref);
+			continue;
+		}
+		dentry_offset = __le32_to_cpu(entry->de_offset);
+		__microfs_put_metadata(&ref);
+		
+		found = microfs_lookup_candidate(dinode, dentry, dentry_offset, vinode);
+		if (found)
+			return found < 0 ? found : 0;
+	}
+	
+	return 0;
+}
+
 static struct dentry* microfs_lookup(struct inode* dinode,
 	struct dentry* dentry, unsigned int flags)
 {
@@ -110,25 +455,37 @@ static struct dentry* microfs_lookup(struct inode* dinode,
 	
 	struct inode* vinode = NULL;
 	struct super_block* sb = dinode->i_sb;
-	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode* minode = NULL;
+	struct microfs_metadata_ref ref;
 	
 	pr_devel_once("microfs_lookup: first call\n");
 	
-	mutex_lock(&sbi->si_metadata_dentrybuf.d_mutex);
+	if ((MICROFS_SB(sb)->si_flags & MICROFS_FLAG_DIRINDEX)
+			&& i_size_read(dinode) > 0) {
+		int ierr = microfs_lookup_dirindex(dinode, dentry, &vinode);
+		if (unlikely(ierr))
+			return ERR_PTR(ierr);
+		goto out;
+	} else {
+		__u32* index = __microfs_load_dirindex(sb, dinode);
+		if (index) {
+			int ierr = microfs_lookup_dirindex_cached(dinode, dentry,
+				index, &vinode);
+			if (unlikely(ierr))
+				return ERR_PTR(ierr);
+			goto out;
+		}
+	}
 	
 	while (offset < i_size_read(dinode)) {
-		struct microfs_inode* minode;
-		__u32 minodelen = sizeof(*minode);
-		
 		char* name;
-		__u8 namelen = MICROFS_MAXNAMELEN;
+		__u8 namelen;
 		
 		__u32 dir_offset = microfs_get_offset(dinode) + offset;
 		
 		int diff;
 		
-		minode = (struct microfs_inode*)__microfs_read(sb,
-			&sbi->si_metadata_dentrybuf, dir_offset, minodelen + namelen);
+		minode = __microfs_get_dentry(sb, dir_offset, &ref);
 		if (unlikely(IS_ERR(minode))) {
 			err = minode;
 			minode = NULL;
@@ -146,10 +503,10 @@ static struct dentry* microfs_lookup(struct inode* dinode,
 			break;
 		
 		namelen = minode->i_namelen;
-		offset += sizeof(*minode) + namelen;
+		offset += i_dentrysz(minode, MICROFS_SB(sb)->si_flags);
 		
 		if (dentry->d_name.len != namelen)
-			continue;
+			goto next;
 		
 		diff = memcmp(dentry->d_name.name, name, namelen);
 		if (!diff) {
@@ -161,116 +518,125 @@ static struct dentry* microfs_lookup(struct inode* dinode,
 			}
 			break;
 		} else if (diff > 0) {
-			continue;
+			goto next;
 		} else if (diff < 0) {
 			break;
 		} else {
 			/* Never reached.
 			 */
 		}
+next:
+		__microfs_put_metadata(&ref);
+		minode = NULL;
 	}
 	
 err_inode:
+	if (minode)
+		__microfs_put_metadata(&ref);
 err_io:
-	mutex_unlock(&sbi->si_metadata_dentrybuf.d_mutex);
 	if (unlikely(IS_ERR(err)))
 		return err;
 	
+out:
 	d_add(dentry, vinode);
 	
 	return NULL;
 }
 
+/* Pin the dentries of %vinode which start at %offset and are
+ * stored in the same page. The window always holds at least one
+ * complete dentry (which is bounced if it crosses a page boundary)
+ * and it must be returned with %__microfs_put_metadata().
+ */
+static char* microfs_get_dentries(struct inode* vinode, __u32 offset,
+	__u32* length, struct microfs_metadata_ref* ref)
+{
+	struct super_block* sb = vinode->i_sb;
+	struct microfs_inode* minode;
+	
+	__u32 window_offset = microfs_get_offset(vinode) + offset;
+	__u32 window_length = min_t(__u32, i_size_read(vinode) - offset,
+		PAGE_SIZE - (window_offset & ~PAGE_MASK));
+	
+	char* window = __microfs_get_metadata(sb, window_offset, window_length, ref);
+	if (unlikely(IS_ERR(window)))
+		return window;
+	
+	minode = (struct microfs_inode*)window;
+	if (unlikely(window_length < sizeof(*minode) ||
+			window_length < sizeof(*minode) + minode->i_namelen)) {
+		__microfs_put_metadata(ref);
+		minode = __microfs_get_dentry(sb, window_offset, ref);
+		if (unlikely(IS_ERR(minode)))
+			return (char*)minode;
+		window = (char*)minode;
+		window_length = sizeof(*minode) + minode->i_namelen;
+	}
+	
+	pr_spam("microfs_get_dentries: offset=0x%x, length=%u\n",
+		window_offset, window_length);
+	
+	*length = window_length;
+	return window;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
 
 static int microfs_iterate(struct file* file, struct dir_context* ctx)
 {
 	struct inode* vinode = file_inode(file);
-	struct super_block* sb = vinode->i_sb;
-	struct microfs_sb_info* sbi = MICROFS_SB(sb);
-	
-	char* fillbuf;
-	
-	int err = 0;
 	
 	__u32 offset = ctx->pos;
 	
 	pr_devel_once("microfs_iterate: first call\n");
 	
-	if (offset >= i_size_read(vinode))
-		return 0;
-	
-	fillbuf = kmalloc(MICROFS_MAXNAMELEN, GFP_KERNEL);
-	if (unlikely(!fillbuf)) {
-		pr_err("microfs_iterate: failed to allocate the fillbuf\n");
-		err = -ENOMEM;
-		goto err_fillbuf;
-	}
-	
 	while (offset < i_size_read(vinode)) {
-		struct microfs_inode* minode;
+		char* window;
 		
-		char* name;
-		__u8 namelen = MICROFS_MAXNAMELEN;
-		
-		__u32 next_offset;
-		__u32 dentry_offset;
+		__u32 pos;
+		__u32 length;
 		
-		ino_t ino;
-		umode_t mode;
+		struct microfs_metadata_ref ref;
 		
-		int err;
-		
-		mutex_lock(&sbi->si_metadata_dentrybuf.d_mutex);
-		
-		dentry_offset = microfs_get_offset(vinode) + offset;
-		minode = (struct microfs_inode*)__microfs_read(sb,
-			&sbi->si_metadata_dentrybuf, dentry_offset, sizeof(*minode) + namelen);
-		if (unlikely(IS_ERR(minode))) {
-			pr_err("microfs_iterate:"
-				" failed to read the inode at offset 0x%x\n", dentry_offset);
-			err = PTR_ERR(minode);
-			goto err_io;
+		window = microfs_get_dentries(vinode, offset, &length, &ref);
+		if (unlikely(IS_ERR(window))) {
+			pr_err("microfs_iterate: failed to read the dentries at offset 0x%x\n",
+				microfs_get_offset(vinode) + offset);
+			return PTR_ERR(window);
 		}
 		
+		for (pos = 0; pos + sizeof(struct microfs_inode) <= length; ) {
+			struct microfs_inode* minode = (struct microfs_inode*)(window + pos);
+			
+			__u8 namelen = minode->i_namelen;
+			__u32 next = i_dentrysz(minode, MICROFS_SB(vinode->i_sb)->si_flags);
+			
+			/* Inline data is not needed here, the dentry only has
+			 * to be complete up to the end of its name.
+			 */
+			if (pos + sizeof(*minode) + namelen > length)
+				break;
+			
 #if defined(DEBUG) && defined(DEBUG_INODES)
-		print_hex_dump(KERN_DEBUG, pr_fmt("microfs_iterate: inode: "),
-			DUMP_PREFIX_OFFSET, 16, 1, minode, sizeof(*minode), true);
-#endif
-		
-		name = (char*)(minode + 1);
-		namelen = minode->i_namelen;
-		
-#if defined(DEBUG) && defined(DEBUG_INODES)
-		pr_spam("microfs_iterate: inode name: %*.*s\n",
-			namelen, namelen, name);
+			print_hex_dump(KERN_DEBUG, pr_fmt("microfs_iterate: inode: "),
+				DUMP_PREFIX_OFFSET, 16, 1, minode, sizeof(*minode), true);
 #endif
+			
+			if (!dir_emit(ctx, (char*)(minode + 1), namelen,
+					microfs_get_ino(minode, microfs_get_offset(vinode) + offset),
+					__le16_to_cpu(minode->i_mode) >> 12)) {
+				__microfs_put_metadata(&ref);
+				return 0;
+			}
+			
+			pos += next;
+			ctx->pos = offset = offset + next;
+		}
 		
-		memcpy(fillbuf, name, namelen);
-		
-		next_offset = offset + sizeof(*minode) + namelen;
-		dentry_offset = microfs_get_offset(vinode) + offset;
-		ino = microfs_get_ino(minode, dentry_offset);
-		mode = __le16_to_cpu(minode->i_mode);
-		minode = NULL;
-		
-		mutex_unlock(&sbi->si_metadata_dentrybuf.d_mutex);
-		
-		if (!dir_emit(ctx, fillbuf, namelen, ino, mode >> 12))
-			break;
-		
-		ctx->pos = offset = next_offset;
+		__microfs_put_metadata(&ref);
 	}
 	
-	kfree(fillbuf);
-	
 	return 0;
-	
-err_io:
-	mutex_unlock(&sbi->si_metadata_dentrybuf.d_mutex);
-	kfree(fillbuf);
-err_fillbuf:
-	return err;
 }
 
 #else
@@ -279,10 +645,6 @@ static int microfs_readdir(struct file* file, void* dirent,
 	filldir_t filldir)
 {
 	struct inode* vinode = file_inode(file);
-	struct super_block* sb = vinode->i_sb;
-	struct microfs_sb_info* sbi = MICROFS_SB(sb);
-	
-	char* fillbuf;
 	
 	int err = 0;
 	
@@ -290,84 +652,55 @@ static int microfs_readdir(struct file* file, void* dirent,
 	
 	pr_devel_once("microfs_readdir: first call\n");
 	
-	if (offset >= i_size_read(vinode))
-		return 0;
-	
-	fillbuf = kmalloc(MICROFS_MAXNAMELEN, GFP_KERNEL);
-	if (unlikely(!fillbuf)) {
-		pr_err("microfs_readdir: failed to allocate the fillbuf\n");
-		err = -ENOMEM;
-		goto err_fillbuf;
-	}
-	
 	while (offset < i_size_read(vinode)) {
-		struct microfs_inode* minode;
-		
-		char* name;
-		__u8 namelen = MICROFS_MAXNAMELEN;
+		char* window;
 		
-		__u32 next_offset;
-		__u32 dentry_offset;
-		
-		ino_t ino;
-		umode_t mode;
-		
-		int err;
+		__u32 pos;
+		__u32 length;
 		
-		mutex_lock(&sbi->si_metadata_dentrybuf.d_mutex);
+		struct microfs_metadata_ref ref;
 		
-		dentry_offset = microfs_get_offset(vinode) + offset;
-		minode = (struct microfs_inode*)__microfs_read(sb,
-			&sbi->si_metadata_dentrybuf, dentry_offset, sizeof(*minode)
-				+ namelen);
-		if (unlikely(IS_ERR(minode))) {
-			pr_err("microfs_readdir:"
-				" failed to read the inode at offset 0x%x\n", dentry_offset);
-			err = PTR_ERR(minode);
-			goto err_io;
+		window = microfs_get_dentries(vinode, offset, &length, &ref);
+		if (unlikely(IS_ERR(window))) {
+			pr_err("microfs_readdir: failed to read the dentries at offset 0x%x\n",
+				microfs_get_offset(vinode) + offset);
+			return PTR_ERR(window);
 		}
 		
+		for (pos = 0; pos + sizeof(struct microfs_inode) <= length; ) {
+			struct microfs_inode* minode = (struct microfs_inode*)(window + pos);
+			
+			__u8 namelen = minode->i_namelen;
+			__u32 next = i_dentrysz(minode, MICROFS_SB(vinode->i_sb)->si_flags);
+			
+			/* Inline data is not needed here, the dentry only has
+			 * to be complete up to the end of its name.
+			 */
+			if (pos + sizeof(*minode) + namelen > length)
+				break;
+			
 #if defined(DEBUG) && defined(DEBUG_INODES)
-		print_hex_dump(KERN_DEBUG, pr_fmt("microfs_readdir: inode: "),
-			DUMP_PREFIX_OFFSET, 16, 1, minode, sizeof(*minode), true);
-#endif
-		
-		name = (char*)(minode + 1);
-		namelen = minode->i_namelen;
-		
-#if defined(DEBUG) && defined(DEBUG_INODES)
-		pr_spam("microfs_readdir: inode name: %*.*s\n",
-			namelen, namelen, name);
+			print_hex_dump(KERN_DEBUG, pr_fmt("microfs_readdir: inode: "),
+				DUMP_PREFIX_OFFSET, 16, 1, minode, sizeof(*minode), true);
 #endif
-		
-		memcpy(fillbuf, name, namelen);
-		
-		next_offset = offset + sizeof(*minode) + namelen;
-		dentry_offset = microfs_get_offset(vinode) + offset;
-		ino = microfs_get_ino(minode, dentry_offset);
-		mode = __le16_to_cpu(minode->i_mode);
-		minode = NULL;
-		
-		mutex_unlock(&sbi->si_metadata_dentrybuf.d_mutex);
-		
-		err = filldir(dirent, fillbuf, namelen, offset, ino, mode >> 12);
-		if (unlikely(err)) {
-			pr_err("microfs_readdir: filldir failed: %d\n", err);
-			break;
+			
+			err = filldir(dirent, (char*)(minode + 1), namelen, offset,
+				microfs_get_ino(minode, microfs_get_offset(vinode) + offset),
+				__le16_to_cpu(minode->i_mode) >> 12);
+			if (unlikely(err)) {
+				pr_err("microfs_readdir: filldir failed: %d\n", err);
+				__microfs_put_metadata(&ref);
+				return 0;
+			}
+			
+			pos += next;
+			file->f_pos = offset = offset + next;
 		}
 		
-		file->f_pos = offset = next_offset;
+		__microfs_put_metadata(&ref);
 	}
 	
-	kfree(fillbuf);
-	
 	return 0;
-	
-err_io:
-	mutex_unlock(&sbi->si_metadata_dentrybuf.d_mutex);
-	kfree(fillbuf);
-err_fillbuf:
-	return err;
 }
 
 #endif
@@ -387,6 +720,7 @@ static const struct file_operations microfs_dir_i_fops = {
 };
 
 static const struct address_space_operations microfs_i_a_ops = {
-	.readpage = microfs_readpage
+	.readpage = microfs_readpage,
+	.readpages = microfs_readpages
 };
 
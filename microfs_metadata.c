@@ -0,0 +1,299 @@
+/* microfs - Minimally Improved Compressed Read Only File System
+ * Copyright (C) 2012, 2013, 2014, 2015, 2016, 2017, ..., +%Y
+ * Erik Edlund <erik.edlund@32767.se>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "microfs.h"
+
+void* __microfs_get_metadata(struct super_block* sb, __u64 offset,
+	__u32 length, struct microfs_metadata_ref* ref)
+{
+	struct buffer_head* bh;
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	
+	__u32 pg_offset = offset & ~PAGE_MASK;
+	__u32 head;
+	
+	pr_devel_once("__microfs_get_metadata: first call\n");
+	
+	pr_spam("__microfs_get_metadata: offset=0x%llx, length=%u\n",
+		offset, length);
+	
+	ref->mr_bh = NULL;
+	
+	if (sbi->si_metadata && offset + length <= sbi->si_metadatasz)
+		return sbi->si_metadata + offset;
+	
+	if (unlikely(length == 0 || offset + length
+			> i_size_read(sb->s_bdev->bd_inode))) {
+		pr_err("__microfs_get_metadata: bad read, offset=0x%llx, length=%u\n",
+			offset, length);
+		return ERR_PTR(-EIO);
+	}
+	
+	bh = sb_bread(sb, offset >> PAGE_SHIFT);
+	if (unlikely(!bh)) {
+		pr_err("__microfs_get_metadata: failed to read the block"
+			" at offset 0x%llx\n", round_down(offset, PAGE_SIZE));
+		return ERR_PTR(-EIO);
+	}
+	
+	if (likely(pg_offset + length <= PAGE_SIZE)) {
+		/* The common case, the record is stored in one page and
+		 * the caller can use it in place.
+		 */
+		ref->mr_bh = bh;
+		return bh->b_data + pg_offset;
+	}
+	
+	if (unlikely(length > sizeof(ref->mr_bounce))) {
+		pr_err("__microfs_get_metadata: %u bytes at offset 0x%llx"
+			" cross a page boundary and can not be bounced\n",
+			length, offset);
+		brelse(bh);
+		return ERR_PTR(-EINVAL);
+	}
+	
+	head = PAGE_SIZE - pg_offset;
+	memcpy(ref->mr_bounce, bh->b_data + pg_offset, head);
+	brelse(bh);
+	
+	bh = sb_bread(sb, (offset >> PAGE_SHIFT) + 1);
+	if (unlikely(!bh)) {
+		pr_err("__microfs_get_metadata: failed to read the block"
+			" at offset 0x%llx\n", round_down(offset, PAGE_SIZE) + PAGE_SIZE);
+		return ERR_PTR(-EIO);
+	}
+	memcpy(ref->mr_bounce + head, bh->b_data, length - head);
+	brelse(bh);
+	
+	return ref->mr_bounce;
+}
+
+void __microfs_put_metadata(struct microfs_metadata_ref* ref)
+{
+	brelse(ref->mr_bh);
+	ref->mr_bh = NULL;
+}
+
+struct microfs_inode* __microfs_get_dentry(struct super_block* sb,
+	__u32 offset, struct microfs_metadata_ref* ref)
+{
+	__u8 namelen;
+	
+	struct microfs_inode* minode = __microfs_get_metadata(sb,
+		offset, sizeof(*minode), ref);
+	if (unlikely(IS_ERR(minode)))
+		return minode;
+	
+	namelen = minode->i_namelen;
+	if (likely((offset & ~PAGE_MASK) + sizeof(*minode) + namelen <= PAGE_SIZE))
+		return minode;
+	
+	/* The name continues on the next page.
+	 */
+	__microfs_put_metadata(ref);
+	return __microfs_get_metadata(sb, offset, sizeof(*minode) + namelen, ref);
+}
+
+int __microfs_preload_metadata(struct super_block* sb,
+	const struct microfs_inode* root)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_metadata_ref ref;
+	
+	int err = 0;
+	int fragments = sbi->si_flags & MICROFS_FLAG_FRAGMENTS;
+	int fileinfo = i_hasfileinfo(sbi->si_flags);
+	__u32 fileinfosz = i_fileinfosz(sbi->si_flags);
+	
+	__u32 head = 0;
+	__u32 tail = 0;
+	__u32 offset;
+	__u32 length;
+	__u32 end = __le32_to_cpu(root->i_offset) + i_getsize(root);
+	__u64 maxdirs = (__u64)sbi->si_files + 1;
+	
+	__u32* dirs;
+	char* metadata;
+	
+	if (!root->i_offset)
+		return 0;
+	
+	/* Walk the tree breadth first to find where the last dentry,
+	 * directory index and block pointer table ends.
+	 */
+	dirs = kvmalloc(maxdirs * sizeof(*dirs) * 2, GFP_KERNEL);
+	if (!dirs) {
+		pr_err("__microfs_preload_metadata: failed to allocate the dir queue\n");
+		err = -ENOMEM;
+		goto err_dirs;
+	}
+	
+	dirs[tail * 2] = __le32_to_cpu(root->i_offset);
+	dirs[tail * 2 + 1] = i_getsize(root);
+	tail++;
+	
+	while (head < tail) {
+		__u32 entries = 0;
+		__u32 dir_offset = dirs[head * 2];
+		__u32 dir_size = dirs[head * 2 + 1];
+		
+		head++;
+		
+		for (offset = 0; offset < dir_size; ++entries) {
+			__u32 i_offset;
+			__u32 i_size;
+			umode_t mode;
+			__u16 blkshift;
+			__u16 lenbits = 0;
+			
+			struct microfs_inode* minode = __microfs_get_dentry(sb,
+				dir_offset + offset, &ref);
+			if (unlikely(IS_ERR(minode))) {
+				err = PTR_ERR(minode);
+				goto err_walk;
+			}
+			
+			i_offset = __le32_to_cpu(minode->i_offset);
+			i_size = i_getsize(minode);
+			mode = __le16_to_cpu(minode->i_mode);
+			offset += i_dentrysz(minode, sbi->si_flags);
+			
+			__microfs_put_metadata(&ref);
+			
+			if (!i_offset)
+				continue;
+			
+			if (S_ISDIR(mode)) {
+				if (unlikely(tail == maxdirs)) {
+					pr_err("__microfs_preload_metadata: too many directories\n");
+					err = -EIO;
+					goto err_walk;
+				}
+				dirs[tail * 2] = i_offset;
+				dirs[tail * 2 + 1] = i_size;
+				tail++;
+				end = max_t(__u32, end, i_offset + i_size);
+			} else if ((S_ISREG(mode) || S_ISLNK(mode))
+					&& !i_inlinesz(sbi->si_flags, mode, i_size)) {
+				__u32 blksz = sbi->si_blksz;
+				if (fileinfo) {
+					/* The file info word gives the block size of
+					 * the file, see %MICROFS_FLAG_FILEBLKSZ, and the
+					 * width of its packed block data lengths (or that
+					 * its block pointers are extents).
+					 */
+					__le32* info = __microfs_get_metadata(sb, i_offset,
+						sizeof(*info), &ref);
+					if (unlikely(IS_ERR(info))) {
+						err = PTR_ERR(info);
+						goto err_walk;
+					}
+					blkshift = __le32_to_cpu(*info) & MICROFS_FILEINFO_MASK_BLKSHIFT;
+					lenbits = (__le32_to_cpu(*info) & MICROFS_FILEINFO_MASK_LENBITS)
+						>> MICROFS_FILEINFO_LENBITS_LSB;
+					__microfs_put_metadata(&ref);
+					if (unlikely(blkshift > sbi->si_blkshift || (blkshift
+							&& blkshift < MICROFS_MINBLKSZ_SHIFT)
+							|| (lenbits > MICROFS_IOFFSET_WIDTH
+								&& !(lenbits == MICROFS_FILEINFO_EXTENTS
+									&& (sbi->si_flags & MICROFS_FLAG_SHAREDBLKS))))) {
+						pr_err("__microfs_preload_metadata: invalid block"
+							" shift %u or length width %u\n", blkshift, lenbits);
+						err = -EIO;
+						goto err_walk;
+					}
+					if (blkshift)
+						blksz = 1 << blkshift;
+				}
+				end = max_t(__u32, end, i_offset + i_blkptrsz(i_size,
+					blksz, fragments, fileinfosz, lenbits));
+				if (i_fragtail(i_size, blksz, fragments)) {
+					/* The fragment table follows the block pointers of
+					 * all files, the pointer pair of the fragment block
+					 * is needed as well.
+					 */
+					__le32* fr_blkptr = __microfs_get_metadata(sb,
+						i_offset + i_blkptrsz(i_size, blksz, fragments,
+							fileinfosz, lenbits) - sizeof(struct microfs_fragment),
+						sizeof(*fr_blkptr), &ref);
+					if (unlikely(IS_ERR(fr_blkptr))) {
+						err = PTR_ERR(fr_blkptr);
+						goto err_walk;
+					}
+					end = max_t(__u32, end, __le32_to_cpu(*fr_blkptr)
+						+ 2 * (MICROFS_IOFFSET_WIDTH / 8));
+					__microfs_put_metadata(&ref);
+				}
+			}
+		}
+		
+		if ((sbi->si_flags & MICROFS_FLAG_DIRINDEX) && entries) {
+			end = max_t(__u32, end, microfs_dirindex_offset(dir_offset, dir_size)
+				+ microfs_dirindex_size(entries));
+		}
+	}
+	
+	kvfree(dirs);
+	dirs = NULL;
+	
+	metadata = kvmalloc(end, GFP_KERNEL);
+	if (!metadata) {
+		pr_err("__microfs_preload_metadata: failed to allocate %u bytes\n", end);
+		err = -ENOMEM;
+		goto err_metadata;
+	}
+	
+	for (offset = 0; offset < end; offset += length) {
+		void* data;
+		
+		length = min_t(__u32, end - offset, PAGE_SIZE - (offset & ~PAGE_MASK));
+		data = __microfs_get_metadata(sb, offset, length, &ref);
+		if (unlikely(IS_ERR(data))) {
+			err = PTR_ERR(data);
+			goto err_read;
+		}
+		memcpy(metadata + offset, data, length);
+		__microfs_put_metadata(&ref);
+	}
+	
+	pr_devel("__microfs_preload_metadata: %u bytes of metadata preloaded\n", end);
+	
+	sbi->si_metadatasz = end;
+	sbi->si_metadata = metadata;
+	
+	return 0;
+	
+err_read:
+	kvfree(metadata);
+err_metadata:
+err_walk:
+	kvfree(dirs);
+err_dirs:
+	pr_err("__microfs_preload_metadata: failed to preload the metadata\n");
+	return err;
+}
+
+void __microfs_unload_metadata(struct super_block* sb)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	
+	kvfree(sbi->si_metadata);
+	sbi->si_metadata = NULL;
+	sbi->si_metadatasz = 0;
+}
@@ -17,166 +17,600 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/mm.h>
+#include <linux/sort.h>
+
 #include "microfs.h"
 
+/* A range of page cache pages which is backed by one block
+ * (or by as many blocks that it takes to fill a page if the
+ * block size is smaller than PAGE_SIZE). The blocks of a file
+ * which blocks are split into sub-frames are its sub-frames,
+ * see %MICROFS_FLAG_SUBFRAMES.
+ */
 struct microfs_readpage_request {
+	/* Page cache pages to fill, busy pages are NULL. */
 	struct page** rr_pages;
+	/* Number of slots in %rr_pages. */
 	__u32 rr_npages;
+	/* Number of NULL slots in %rr_pages. */
+	__u32 rr_pgholes;
+	/* Offset into the first buffer head. */
 	__u32 rr_bhoffset;
+	/* Page index of %rr_pages[0]. */
+	pgoff_t rr_index;
+	/* Offset of the block data. */
+	__u64 rr_dataoffset;
+	/* Length of the block data (only the first run of back to back
+	 * blocks if %rr_gaps is set).
+	 */
+	__u32 rr_datalength;
+	/* The inode that the pages belong to. */
+	struct inode* rr_inode;
+	/* The decompressor of the blocks, see %MICROFS_FLAG_MIXEDCODECS. */
+	struct microfs_sb_info* rr_codec;
+	/* First block backing the pages. */
+	__u32 rr_blknr;
+	/* Number of blocks backing the pages. */
+	__u32 rr_blks;
+	/* Number of blocks that are stored uncompressed. */
+	__u32 rr_storedblks;
+	/* Number of blocks that are holes, see %MICROFS_FLAG_ZEROBLOCKS. */
+	__u32 rr_zeroblks;
+	/* Nonzero if the block data is not back to back, which happens
+	 * when a sub-frame index separates the blocks or when blocks
+	 * are shared (see %MICROFS_FLAG_SHAREDBLKS). The blocks are
+	 * then read one by one.
+	 */
+	int rr_gaps;
+	/* Length of the part of the tail stored in a fragment which
+	 * is covered by the pages (zero if none).
+	 */
+	__u32 rr_fraglength;
+	/* Offset of that part in the uncompressed fragment block. */
+	__u32 rr_fragoffset;
+	/* Offset of that part relative to the first page. */
+	__u32 rr_fragpos;
+	/* Offset of the fragment block data. */
+	__u64 rr_fragdataoffset;
+	/* Length of the fragment block data. */
+	__u32 rr_fragdatalength;
+	/* Result of the request. */
+	int rr_err;
 };
 
-/* The caller must hold the appropriate buffer lock.
+/* A block of a %microfs_readpage_request which blocks are read
+ * one by one, see %__microfs_fill_blocks_apart().
  */
-static int __microfs_find_block(struct super_block* const sb,
-	struct inode* const inode, __u32 blk_ptrs, __u32 blk_nr,
-	__u32* const blk_data_offset,
+struct microfs_readframe_request {
+	/* The request that the block belongs to. */
+	struct microfs_readpage_request* rf_rdreq;
+	/* Where the block data goes. */
+	char* rf_dest;
+	/* Uncompressed size of the block. */
+	__u32 rf_size;
+	/* Scratch buffer shared by the blocks of the request. */
+	struct microfs_filedata_entry* rf_scratch;
+};
+
+/* A number of %microfs_readpage_request:s which block data
+ * is stored back to back in the image.
+ */
+struct microfs_readpages_request {
+	/* The requests. */
+	struct microfs_readpage_request* rp_reqs;
+	/* Number of requests in %rp_reqs. */
+	__u32 rp_nreqs;
+};
+
+/* Get the extent of the block data described by the pair of
+ * block pointers at %blk_ptr_offset, which are relative to %base
+ * (see %MICROFS_FLAG_LARGEIMAGE).
+ */
+static int __microfs_find_extent(struct super_block* const sb,
+	__u32 blk_ptr_offset, __u64 base, __u64* const blk_data_offset,
 	__u32* const blk_data_length)
 {
 	void* buf_data;
 	
-	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_metadata_ref ref;
 	
 	int err = 0;
 	
 	__u32 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
-	__u32 blk_ptr_offset = microfs_get_offset(inode)
-		+ blk_nr * blk_ptr_length;
-	
-	pr_devel_once("microfs_find_block: first call\n");
 	
-	buf_data = __microfs_read(sb, &sbi->si_metadata_blkptrbuf,
-		blk_ptr_offset, blk_ptr_length);
+	buf_data = __microfs_get_metadata(sb, blk_ptr_offset,
+		blk_ptr_length * 2, &ref);
 	if (unlikely(IS_ERR(buf_data))) {
 		err = PTR_ERR(buf_data);
 		goto err_io;
 	}
-	*blk_data_offset = __le32_to_cpu(*(__le32*)buf_data);
 	
-	buf_data = __microfs_read(sb, &sbi->si_metadata_blkptrbuf,
-		blk_ptr_offset + blk_ptr_length, blk_ptr_length);
-	if (unlikely(IS_ERR(buf_data))) {
-		err = PTR_ERR(buf_data);
-		goto err_io;
-	}
+	*blk_data_offset = base + __le32_to_cpu(((__le32*)buf_data)[0]);
+	*blk_data_length = __le32_to_cpu(((__le32*)buf_data)[1])
+		- __le32_to_cpu(((__le32*)buf_data)[0]);
 	
-	*blk_data_length = __le32_to_cpu(*(__le32*)buf_data)
-		- *blk_data_offset;
+	__microfs_put_metadata(&ref);
 	
-	pr_spam("microfs_find_block: blk_data_offset=0x%x, blk_data_length=%u\n",
+	pr_spam("__microfs_find_extent: blk_data_offset=0x%llx, blk_data_length=%u\n",
 		*blk_data_offset, *blk_data_length);
 	
 err_io:
 	return err;
 }
 
-static int __microfs_copy_metadata(struct super_block* sb,
-	void* data, struct buffer_head** bhs, __u32 nbhs,
-	__u32 offset, __u32 length)
+/* Unpack the block pointers of chunk %chunk (out of %blk_ptrs
+ * blocks) of %inode to %blkptrs, which must have room for one
+ * pointer more than the number of blocks in the chunk, see
+ * %MICROFS_FLAG_PACKEDBLKPTRS.
+ */
+static int __microfs_unpack_chunk(struct super_block* const sb,
+	struct inode* const inode, __u32 blk_ptrs, __u32 chunk,
+	__u32* const blkptrs)
 {
+	void* buf_data;
+	
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	struct microfs_metadata_ref ref;
+	
 	__u32 i;
-	__u32 buf_offset;
+	__u32 first = chunk * MICROFS_BLKPTR_CHUNKBLKS;
+	__u32 n = min_t(__u32, blk_ptrs - first, MICROFS_BLKPTR_CHUNKBLKS);
+	__u32 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
+	__u32 lens_offset = microfs_get_blkptroffset(inode)
+		+ i_blks(blk_ptrs, MICROFS_BLKPTR_CHUNKBLKS) * blk_ptr_length;
+	__u32 lens_start = first * ii->ii_lenbits / 8;
+	__u32 lens_end = i_blks((first + n) * ii->ii_lenbits, 8);
 	
-	struct microfs_data_buffer* destbuf = data;
+	buf_data = __microfs_get_metadata(sb, microfs_get_blkptroffset(inode)
+		+ chunk * blk_ptr_length, blk_ptr_length, &ref);
+	if (unlikely(IS_ERR(buf_data)))
+		return PTR_ERR(buf_data);
 	
-	(void)sb;
-	(void)nbhs;
-	(void)offset;
+	blkptrs[0] = __le32_to_cpu(*(__le32*)buf_data);
 	
-	pr_spam("__microfs_copy_metadata: offset=0x%x, length=%u\n",
-		offset, length);
+	__microfs_put_metadata(&ref);
 	
-	for (
-		i = 0, buf_offset = 0, destbuf->d_used = 0;
-		i < nbhs && buf_offset < length;
-		i += 1, buf_offset += PAGE_SIZE
-	) {
-		destbuf->d_used += PAGE_SIZE;
-		memcpy(destbuf->d_data + buf_offset, bhs[i]->b_data, PAGE_SIZE);
+	buf_data = __microfs_get_metadata(sb, lens_offset + lens_start,
+		lens_end - lens_start, &ref);
+	if (unlikely(IS_ERR(buf_data)))
+		return PTR_ERR(buf_data);
+	
+	/* The lengths are read relative to the byte that holds the
+	 * first bit of the chunk.
+	 */
+	for (i = 0; i < n; ++i) {
+		blkptrs[i + 1] = blkptrs[i] + i_packedlen((__u8*)buf_data
+			- lens_start, first + i, ii->ii_lenbits);
 	}
 	
+	__microfs_put_metadata(&ref);
+	
 	return 0;
 }
 
-static int __microfs_recycle_metadata(struct super_block* sb,
-	void* data, __u32 offset, __u32 length,
-	microfs_read_blks_consumer consumer)
+static int __microfs_find_block(struct super_block* const sb,
+	struct inode* const inode, __u32 blk_ptrs, __u32 blk_nr,
+	__u64* const blk_data_offset,
+	__u32* const blk_data_length)
 {
-	__u32 buf_offset;
+	struct microfs_inode_info* ii = MICROFS_I(inode);
 	
-	struct microfs_data_buffer* destbuf = data;
+	__u32 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
+	__u32 blk_ptr_offset = microfs_get_blkptroffset(inode)
+		+ blk_nr * blk_ptr_length;
 	
-	(void)sb;
-	(void)consumer;
+	pr_devel_once("microfs_find_block: first call\n");
 	
-	if (offset >= destbuf->d_offset) {
-		buf_offset = offset - destbuf->d_offset;
-		if (buf_offset + length <= destbuf->d_size)
-			return 0;
+	if (ii->ii_lenbits == MICROFS_FILEINFO_EXTENTS) {
+		return __microfs_find_extent(sb, blk_ptr_offset + blk_nr * blk_ptr_length,
+			ii->ii_database, blk_data_offset, blk_data_length);
 	}
-	return -EIO;
+	
+	if (ii->ii_lenbits) {
+		__u32 blkptrs[MICROFS_BLKPTR_CHUNKBLKS + 1];
+		int err = __microfs_unpack_chunk(sb, inode, blk_ptrs,
+			blk_nr / MICROFS_BLKPTR_CHUNKBLKS, blkptrs);
+		if (unlikely(err))
+			return err;
+		blk_nr %= MICROFS_BLKPTR_CHUNKBLKS;
+		*blk_data_offset = ii->ii_database + blkptrs[blk_nr];
+		*blk_data_length = blkptrs[blk_nr + 1] - blkptrs[blk_nr];
+		return 0;
+	}
+	
+	return __microfs_find_extent(sb, blk_ptr_offset, ii->ii_database,
+		blk_data_offset, blk_data_length);
 }
 
-static int __microfs_copy_filedata_exceptionally(struct super_block* sb,
-	void* data, struct buffer_head** bhs, __u32 nbhs,
-	__u32 offset, __u32 length)
+/* Find the fragment block which holds the tail of %inode, see
+ * %MICROFS_FLAG_FRAGMENTS.
+ */
+static int __microfs_find_fragment(struct super_block* const sb,
+	struct inode* const inode, struct microfs_readpage_request* rdreq)
 {
-	__u32 decompressed = 0;
-	__u32 remaining;
-	__u32 available;
-	__u32 unused;
-	__u32 page;
-	__u32 buf_offset;
+	void* buf_data;
 	
-	void* decompressor = NULL;
 	struct microfs_sb_info* sbi = MICROFS_SB(sb);
-	struct microfs_readpage_request* rdreq = data;
+	struct microfs_metadata_ref ref;
+	
+	__u32 fr_blkptr;
+	__u32 fr_offset = microfs_get_offset(inode)
+		+ i_blkptrsz(i_size_read(inode), MICROFS_I(inode)->ii_blksz, 1,
+			i_fileinfosz(sbi->si_flags), MICROFS_I(inode)->ii_lenbits)
+		- sizeof(struct microfs_fragment);
+	
+	buf_data = __microfs_get_metadata(sb, fr_offset,
+		sizeof(struct microfs_fragment), &ref);
+	if (unlikely(IS_ERR(buf_data)))
+		return PTR_ERR(buf_data);
+	
+	fr_blkptr = __le32_to_cpu(((struct microfs_fragment*)buf_data)->fr_blkptr);
+	rdreq->rr_fragoffset = __le32_to_cpu(
+		((struct microfs_fragment*)buf_data)->fr_offset);
+	
+	__microfs_put_metadata(&ref);
+	
+	if (unlikely(rdreq->rr_fragoffset + rdreq->rr_fraglength > sbi->si_blksz)) {
+		pr_err("__microfs_find_fragment: invalid tail at offset %u"
+			" (%u bytes) for ino %lu\n", rdreq->rr_fragoffset,
+			rdreq->rr_fraglength, inode->i_ino);
+		return -EIO;
+	}
 	
-	int err = 0;
-	int implerr = 0;
+	return __microfs_find_extent(sb, fr_blkptr, sbi->si_fragbase,
+		&rdreq->rr_fragdataoffset, &rdreq->rr_fragdatalength);
+}
+
+int __microfs_load_fileinfo(struct super_block* sb, struct inode* inode)
+{
+	void* buf_data;
 	
-	if (bhs) {
-		mutex_lock(&sbi->si_filedatabuf.d_mutex);
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_sb_info* csbi = sbi;
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	struct microfs_metadata_ref ref;
+	
+	__u32 fileinfo;
+	__u32 id;
+	__u16 blkshift;
+	__u16 frameshift;
+	__u16 lenbits;
+	
+	ii->ii_codec = sbi;
+	ii->ii_blkshift = sbi->si_blkshift;
+	ii->ii_blksz = sbi->si_blksz;
+	ii->ii_frameshift = sbi->si_blkshift;
+	ii->ii_framesz = sbi->si_blksz;
+	ii->ii_lenbits = 0;
+	ii->ii_database = 0;
+	
+	if (!i_hasfileinfo(sbi->si_flags) || !microfs_get_offset(inode)
+			|| microfs_get_inlinesz(inode))
+		return 0;
+	
+	buf_data = __microfs_get_metadata(sb, microfs_get_offset(inode),
+		i_fileinfosz(sbi->si_flags), &ref);
+	if (unlikely(IS_ERR(buf_data)))
+		return PTR_ERR(buf_data);
+	
+	fileinfo = __le32_to_cpu(*(__le32*)buf_data);
+	if (sbi->si_flags & MICROFS_FLAG_LARGEIMAGE) {
+		/* The data base follows the file info word, it is not
+		 * necessarily aligned.
+		 */
+		__le64 base;
+		memcpy(&base, (char*)buf_data + sizeof(__le32), sizeof(base));
+		ii->ii_database = __le64_to_cpu(base);
 	}
 	
-	err = sbi->si_decompressor_data->dd_get(sbi, &decompressor);
-	if (err) {
-		pr_err("__microfs_copy_filedata_exceptionally:"
-			" failed to get the decompressor data\n");
-		goto err_dd_get;
+	__microfs_put_metadata(&ref);
+	
+	id = fileinfo & MICROFS_FLAG_MASK_DECOMPRESSOR;
+	if (id && id != (sbi->si_flags & MICROFS_FLAG_MASK_DECOMPRESSOR)) {
+		if (!(sbi->si_flags & MICROFS_FLAG_MIXEDCODECS)
+				|| microfs_codecidx(id) < 0 || !sbi->si_codecs[microfs_codecidx(id)]) {
+			pr_err("__microfs_load_fileinfo: invalid decompressor 0x%x"
+				" for ino %lu\n", id, inode->i_ino);
+			return -EIO;
+		}
+		csbi = sbi->si_codecs[microfs_codecidx(id)];
 	}
 	
-	pr_spam("__microfs_copy_filedata_exceptionally: offset=0x%x, length=%u\n",
-		offset, length);
+	blkshift = fileinfo & MICROFS_FILEINFO_MASK_BLKSHIFT;
+	if (blkshift && blkshift != sbi->si_blkshift) {
+		/* The buffers of the decompressors are sized for the block
+		 * size of the image, which is why a file can not use bigger
+		 * blocks.
+		 */
+		if (!(sbi->si_flags & MICROFS_FLAG_FILEBLKSZ)
+				|| blkshift < MICROFS_MINBLKSZ_SHIFT
+				|| blkshift > sbi->si_blkshift
+				|| (csbi->si_decompressor->dc_info->li_min_blksz == 0
+					&& blkshift < PAGE_SHIFT)) {
+			pr_err("__microfs_load_fileinfo: invalid block shift %u"
+				" for ino %lu\n", blkshift, inode->i_ino);
+			return -EIO;
+		}
+		ii->ii_blkshift = blkshift;
+		ii->ii_blksz = 1 << blkshift;
+	}
 	
-	if (bhs) {
-		__u32 bh = 0;
-		
-		int repeat = 0;
-		
-		sbi->si_decompressor->dc_reset(sbi, decompressor);
-		sbi->si_decompressor->dc_exceptionally_begin(sbi, decompressor);
-		
-		do {
-			err = sbi->si_decompressor->dc_consumebhs(sbi, decompressor,
-				bhs, nbhs, &length, &bh, &rdreq->rr_bhoffset,
-				&decompressed, &implerr);
-			repeat = sbi->si_decompressor->dc_continue(sbi, decompressor,
-				err, implerr, length, 0);
-		} while (repeat);
-		
-		if (sbi->si_decompressor->dc_end(sbi, decompressor, &err, &implerr, &decompressed) < 0)
-			goto err_inflate;
-		
-		sbi->si_filedatabuf.d_offset = offset;
-		sbi->si_filedatabuf.d_used = decompressed;
+	frameshift = (fileinfo & MICROFS_FILEINFO_MASK_FRAMESHIFT)
+		>> MICROFS_FILEINFO_FRAMESHIFT_LSB;
+	if (frameshift) {
+		if (!(sbi->si_flags & MICROFS_FLAG_SUBFRAMES)
+				|| frameshift < MICROFS_MINBLKSZ_SHIFT
+				|| frameshift >= ii->ii_blkshift
+				|| (csbi->si_decompressor->dc_info->li_min_blksz == 0
+					&& frameshift < PAGE_SHIFT)) {
+			pr_err("__microfs_load_fileinfo: invalid sub-frame shift %u"
+				" for ino %lu\n", frameshift, inode->i_ino);
+			return -EIO;
+		}
 	} else {
-		decompressed = sbi->si_filedatabuf.d_used;
-		pr_spam("__microfs_copy_filedata_exceptionally: cache hit for offset 0x%x"
-			" - %u bytes already decompressed in sbi->si_filedatabuf\n",
-				offset, decompressed);
+		frameshift = ii->ii_blkshift;
+	}
+	ii->ii_frameshift = frameshift;
+	ii->ii_framesz = 1 << frameshift;
+	
+	lenbits = (fileinfo & MICROFS_FILEINFO_MASK_LENBITS)
+		>> MICROFS_FILEINFO_LENBITS_LSB;
+	if (lenbits == MICROFS_FILEINFO_EXTENTS) {
+		if (!(sbi->si_flags & MICROFS_FLAG_SHAREDBLKS)) {
+			pr_err("__microfs_load_fileinfo: unexpected block extents"
+				" for ino %lu\n", inode->i_ino);
+			return -EIO;
+		}
+	} else if (lenbits && (!(sbi->si_flags & MICROFS_FLAG_PACKEDBLKPTRS)
+			|| lenbits > MICROFS_IOFFSET_WIDTH)) {
+		pr_err("__microfs_load_fileinfo: invalid length width %u"
+			" for ino %lu\n", lenbits, inode->i_ino);
+		return -EIO;
+	}
+	ii->ii_lenbits = lenbits;
+	
+	ii->ii_codec = csbi;
+	
+	return 0;
+}
+
+/* Get the extent of block %blk_nr, the block pointers are read
+ * from the image unless the cached block pointers of %inode are
+ * given by %blkptrs. Cached block extents (see
+ * %MICROFS_FLAG_SHAREDBLKS) are pairs of pointers.
+ */
+static int __microfs_get_block(struct super_block* const sb,
+	struct inode* const inode, const __u32* blkptrs, __u32 blk_ptrs,
+	__u32 blk_nr, __u64* const blk_data_offset,
+	__u32* const blk_data_length)
+{
+	if (blkptrs && MICROFS_I(inode)->ii_lenbits == MICROFS_FILEINFO_EXTENTS) {
+		*blk_data_offset = MICROFS_I(inode)->ii_database + blkptrs[2 * blk_nr];
+		*blk_data_length = blkptrs[2 * blk_nr + 1] - blkptrs[2 * blk_nr];
+		return 0;
+	}
+	if (blkptrs) {
+		*blk_data_offset = MICROFS_I(inode)->ii_database + blkptrs[blk_nr];
+		*blk_data_length = blkptrs[blk_nr + 1] - blkptrs[blk_nr];
+		return 0;
+	}
+	return __microfs_find_block(sb, inode, blk_ptrs, blk_nr,
+		blk_data_offset, blk_data_length);
+}
+
+/* Get the extent of sub-frame %frame_nr (counted from the start
+ * of the file), see %MICROFS_FLAG_SUBFRAMES. The extent of the
+ * sub-frame is read from the index that starts the data of its
+ * block, unless the block is not split.
+ */
+static int __microfs_get_frame(struct super_block* const sb,
+	struct inode* const inode, const __u32* blkptrs, __u32 blk_ptrs,
+	__u32 frame_nr, __u64* const frame_data_offset,
+	__u32* const frame_data_length)
+{
+	void* buf_data;
+	
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	struct microfs_metadata_ref ref;
+	
+	int err;
+	
+	__u32 shift = ii->ii_blkshift - ii->ii_frameshift;
+	__u32 blk_nr = frame_nr >> shift;
+	__u32 frame = frame_nr & ((1 << shift) - 1);
+	__u64 blk_data_offset;
+	__u32 blk_data_length;
+	__u32 blk_size;
+	__u32 frames;
+	__u32 first;
+	__u32 n;
+	__u32 start;
+	__u32 end;
+	
+	if (!shift) {
+		return __microfs_get_block(sb, inode, blkptrs, blk_ptrs, frame_nr,
+			frame_data_offset, frame_data_length);
+	}
+	
+	err = __microfs_get_block(sb, inode, blkptrs, blk_ptrs, blk_nr,
+		&blk_data_offset, &blk_data_length);
+	if (unlikely(err))
+		return err;
+	
+	blk_size = i_blksz(i_size_read(inode), blk_nr, ii->ii_blksz);
+	frames = i_blks(blk_size, ii->ii_framesz);
+	if (blk_data_length == 0 || frames == 1) {
+		/* Every sub-frame of a hole is a hole, and a block which
+		 * is not bigger than a sub-frame is not split.
+		 */
+		*frame_data_offset = blk_data_offset;
+		*frame_data_length = blk_data_length;
+		return 0;
+	}
+	
+	/* The start of the sub-frame is the end of the one before it
+	 * and the end of the last sub-frame is the end of the block.
+	 */
+	first = frame ? frame - 1 : 0;
+	n = (frame ? 1 : 0) + (frame + 1 < frames ? 1 : 0);
+	buf_data = __microfs_get_metadata(sb, blk_data_offset
+		+ first * (MICROFS_IOFFSET_WIDTH / 8),
+		n * (MICROFS_IOFFSET_WIDTH / 8), &ref);
+	if (unlikely(IS_ERR(buf_data)))
+		return PTR_ERR(buf_data);
+	
+	start = frame
+		? __le32_to_cpu(((__le32*)buf_data)[0])
+		: i_frameidxsz(blk_size, ii->ii_framesz);
+	end = frame + 1 < frames
+		? __le32_to_cpu(((__le32*)buf_data)[n - 1])
+		: blk_data_length;
+	
+	__microfs_put_metadata(&ref);
+	
+	if (unlikely(start < i_frameidxsz(blk_size, ii->ii_framesz)
+			|| start > end || end > blk_data_length)) {
+		pr_err("__microfs_get_frame: invalid sub-frame %u (%u to %u)"
+			" in block %u for ino %lu\n", frame, start, end, blk_nr,
+			inode->i_ino);
+		return -EIO;
 	}
 	
-	for (page = 0, buf_offset = 0, remaining = decompressed; page < rdreq->rr_npages;
+	*frame_data_offset = blk_data_offset + start;
+	*frame_data_length = end - start;
+	
+	pr_spam("__microfs_get_frame: frame_data_offset=0x%llx, frame_data_length=%u\n",
+		*frame_data_offset, *frame_data_length);
+	
+	return 0;
+}
+
+__u32* __microfs_load_blkptrs(struct super_block* sb, struct inode* inode)
+{
+	void* buf_data;
+	
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	struct microfs_metadata_ref ref;
+	
+	__u32 i;
+	__u32 j;
+	__u32 n;
+	__u32 blk_ptr_length = MICROFS_IOFFSET_WIDTH / 8;
+	__u32 blk_ptr_offset = microfs_get_blkptroffset(inode);
+	__u32 blk_ptrs = i_ptrblks(i_size_read(inode), ii->ii_blksz,
+		sbi->si_flags & MICROFS_FLAG_FRAGMENTS) + 1;
+	__u32 blk_ptrs_sz;
+	
+	int packed = ii->ii_lenbits && ii->ii_lenbits != MICROFS_FILEINFO_EXTENTS;
+	
+	__u32* blkptrs = smp_load_acquire(&ii->ii_blkptrs);
+	if (likely(blkptrs) || sbi->si_blkptrcachesz == 0 || blk_ptrs == 1)
+		return blkptrs;
+	
+	/* Block extents are a pair of pointers per block.
+	 */
+	if (ii->ii_lenbits == MICROFS_FILEINFO_EXTENTS)
+		blk_ptrs = (blk_ptrs - 1) * 2;
+	blk_ptrs_sz = blk_ptrs * sizeof(*ii->ii_blkptrs);
+	
+	mutex_lock(&ii->ii_mutex);
+	
+	blkptrs = ii->ii_blkptrs;
+	if (blkptrs)
+		goto out;
+	
+	if (atomic64_add_return(blk_ptrs_sz, &sbi->si_blkptrcacheused)
+			> sbi->si_blkptrcachesz) {
+		pr_spam("__microfs_load_blkptrs: cache full, %u bytes needed"
+			" for ino %lu\n", blk_ptrs_sz, inode->i_ino);
+		goto err_full;
+	}
+	
+	blkptrs = kvmalloc(blk_ptrs_sz, GFP_KERNEL);
+	if (!blkptrs) {
+		pr_err("__microfs_load_blkptrs: failed to allocate %u bytes"
+			" for ino %lu\n", blk_ptrs_sz, inode->i_ino);
+		goto err_mem;
+	}
+	
+	for (i = 0; packed && i < blk_ptrs - 1;
+			i += MICROFS_BLKPTR_CHUNKBLKS) {
+		if (__microfs_unpack_chunk(sb, inode, blk_ptrs - 1,
+				i / MICROFS_BLKPTR_CHUNKBLKS, blkptrs + i)) {
+			pr_err("__microfs_load_blkptrs: failed to unpack the block"
+				" pointers for ino %lu\n", inode->i_ino);
+			goto err_io;
+		}
+	}
+	
+	for (i = 0; !packed && i < blk_ptrs; i += n) {
+		/* Read as many pointers as the current page holds, a
+		 * pointer crossing the page boundary is read on its own.
+		 */
+		n = (PAGE_SIZE - ((blk_ptr_offset + i * blk_ptr_length) & ~PAGE_MASK))
+			/ blk_ptr_length;
+		n = clamp_t(__u32, n, 1, blk_ptrs - i);
+		buf_data = __microfs_get_metadata(sb,
+			blk_ptr_offset + i * blk_ptr_length, n * blk_ptr_length, &ref);
+		if (unlikely(IS_ERR(buf_data))) {
+			pr_err("__microfs_load_blkptrs: failed to read the block"
+				" pointers for ino %lu\n", inode->i_ino);
+			goto err_io;
+		}
+		for (j = 0; j < n; ++j)
+			blkptrs[i + j] = __le32_to_cpu(((__le32*)buf_data)[j]);
+		__microfs_put_metadata(&ref);
+	}
+	
+	pr_spam("__microfs_load_blkptrs: %u block pointers cached for ino %lu\n",
+		blk_ptrs, inode->i_ino);
+	
+	ii->ii_blkptrssz = blk_ptrs_sz;
+	smp_store_release(&ii->ii_blkptrs, blkptrs);
+	
+	goto out;
+	
+err_io:
+	kvfree(blkptrs);
+	blkptrs = NULL;
+err_mem:
+err_full:
+	atomic64_sub(blk_ptrs_sz, &sbi->si_blkptrcacheused);
+out:
+	mutex_unlock(&ii->ii_mutex);
+	return blkptrs;
+}
+
+void __microfs_unload_blkptrs(struct super_block* sb, struct inode* inode)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode_info* ii = MICROFS_I(inode);
+	
+	if (ii->ii_blkptrs) {
+		kvfree(ii->ii_blkptrs);
+		atomic64_sub(ii->ii_blkptrssz, &sbi->si_blkptrcacheused);
+		ii->ii_blkptrs = NULL;
+		ii->ii_blkptrssz = 0;
+	}
+}
+
+/* Copy the decompressed data held by %entry to the pages of
+ * %rdreq, the parts of the pages not covered by the data are
+ * zeroed.
+ */
+static void __microfs_copy_filedata_entry(struct microfs_readpage_request* rdreq,
+	struct microfs_filedata_entry* entry)
+{
+	__u32 remaining;
+	__u32 available;
+	__u32 unused;
+	__u32 page;
+	__u32 buf_offset;
+	
+	for (page = 0, buf_offset = 0, remaining = entry->fe_buf.d_used;
+			page < rdreq->rr_npages;
 			page += 1, buf_offset += PAGE_SIZE) {
 		available = min_t(__u32, remaining, PAGE_SIZE);
 		unused = PAGE_SIZE - available;
@@ -184,53 +618,340 @@ static int __microfs_copy_filedata_exceptionally(struct super_block* sb,
 		
 		if (rdreq->rr_pages[page]) {
 			void* page_data = kmap(rdreq->rr_pages[page]);
-			pr_spam("__microfs_copy_filedata_exceptionally: buf_offset=%u, remaining=%u\n",
+			pr_spam("__microfs_copy_filedata_entry: buf_offset=%u, remaining=%u\n",
 				buf_offset, remaining);
-			pr_spam("__microfs_copy_filedata_exceptionally: copying %u bytes to page %u\n",
+			pr_spam("__microfs_copy_filedata_entry: copying %u bytes to page %u\n",
 				available, page);
-			pr_spam("__microfs_copy_filedata_exceptionally: zeroing %u bytes for page %u\n",
+			pr_spam("__microfs_copy_filedata_entry: zeroing %u bytes for page %u\n",
 				unused, page);
-			memcpy(page_data, sbi->si_filedatabuf.d_data + buf_offset, available);
+			memcpy(page_data, entry->fe_buf.d_data + buf_offset, available);
 			memset(page_data + available, 0, unused);
 			kunmap(rdreq->rr_pages[page]);
 		}
 	}
+}
+
+/* Decompress the %length bytes of block data that starts at
+ * %bh_offset in %bhs to %destbuf.
+ */
+static int __microfs_decompress_exceptionally(struct microfs_sb_info* sbi,
+	struct buffer_head** bhs, __u32 nbhs, __u32* bh_offset, __u32 length,
+	struct microfs_data_buffer* destbuf)
+{
+	__u32 bh = 0;
+	__u32 decompressed = 0;
 	
-err_inflate:
-	WARN_ON(sbi->si_decompressor_data->dd_put(sbi, &decompressor));
-err_dd_get:
-	if (bhs) {
-		mutex_unlock(&sbi->si_filedatabuf.d_mutex);
+	void* decompressor = NULL;
+	
+	int err = 0;
+	int implerr = 0;
+	int repeat = 0;
+	
+	err = sbi->si_decompressor_data->dd_get(sbi, &decompressor);
+	if (err) {
+		pr_err("__microfs_decompress_exceptionally:"
+			" failed to get the decompressor data\n");
+		return err;
 	}
+	
+	sbi->si_decompressor->dc_reset(sbi, decompressor);
+	sbi->si_decompressor->dc_exceptionally_begin(sbi, decompressor, destbuf);
+	
+	do {
+		err = sbi->si_decompressor->dc_consumebhs(sbi, decompressor,
+			bhs, nbhs, &length, &bh, bh_offset,
+			&decompressed, &implerr);
+		repeat = sbi->si_decompressor->dc_continue(sbi, decompressor,
+			err, implerr, length, 0);
+	} while (repeat);
+	
+	if (sbi->si_decompressor->dc_end(sbi, decompressor, &err, &implerr, &decompressed) < 0
+			&& !err)
+		err = -EIO;
+	
+	WARN_ON(sbi->si_decompressor_data->dd_put(sbi, &decompressor));
+	
+	if (!err)
+		destbuf->d_used = decompressed;
+	
 	return err;
 }
 
-static int __microfs_recycle_filedata_exceptionally(struct super_block* sb,
-	void* data, __u32 offset, __u32 length,
-	microfs_read_blks_consumer consumer)
+static int __microfs_copy_filedata_exceptionally(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
 {
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_readpage_request* rdreq = data;
+	struct microfs_filedata_cache* fc = &sbi->si_filedatacache;
+	struct microfs_filedata_entry* scratch;
+	struct microfs_filedata_entry* entry;
+	
 	int err = 0;
-	int cached = 0;
+	
+	/* Another reader might have decompressed the block while
+	 * this one was waiting for the bhs.
+	 */
+	entry = microfs_filedata_cache_get(fc, offset);
+	if (entry) {
+		pr_spam("__microfs_copy_filedata_exceptionally: cache hit for offset 0x%llx"
+			" - %u bytes already decompressed\n", offset, entry->fe_buf.d_used);
+		__microfs_copy_filedata_entry(rdreq, entry);
+		microfs_filedata_cache_put(fc, entry);
+		return 0;
+	}
+	
+	scratch = microfs_filedata_cache_scratch_get(fc);
+	if (IS_ERR(scratch))
+		return PTR_ERR(scratch);
+	
+	pr_spam("__microfs_copy_filedata_exceptionally: offset=0x%llx, length=%u\n",
+		offset, length);
+	
+	err = __microfs_decompress_exceptionally(rdreq->rr_codec, bhs, nbhs,
+		&rdreq->rr_bhoffset, length, &scratch->fe_buf);
+	if (err)
+		goto err_decompress;
+	
+	entry = microfs_filedata_cache_insert(fc, scratch, offset);
+	if (entry) {
+		__microfs_copy_filedata_entry(rdreq, entry);
+		microfs_filedata_cache_put(fc, entry);
+	} else {
+		pr_spam("__microfs_copy_filedata_exceptionally: the cache is busy,"
+			" the block at offset 0x%llx is not cached\n", offset);
+		__microfs_copy_filedata_entry(rdreq, scratch);
+	}
+	
+err_decompress:
+	microfs_filedata_cache_scratch_put(fc, scratch);
+	return err;
+}
+
+/* Copy %length bytes starting at *%bh_offset in %bhs[*%bh] to
+ * %dest and advance *%bh and *%bh_offset past them. Nothing is
+ * copied if %dest is NULL.
+ */
+static int __microfs_copy_bhs(struct buffer_head** bhs, __u32 nbhs,
+	__u32* bh, __u32* bh_offset, char* dest, __u32 length)
+{
+	while (length > 0) {
+		__u32 avail;
+		
+		if (unlikely(*bh >= nbhs)) {
+			pr_err("__microfs_copy_bhs: bh %u is out of range"
+				" (nbhs=%u)\n", *bh, nbhs);
+			return -EIO;
+		}
+		
+		avail = min_t(__u32, length, PAGE_SIZE - *bh_offset);
+		if (dest) {
+			memcpy(dest, bhs[*bh]->b_data + *bh_offset, avail);
+			dest += avail;
+		}
+		
+		length -= avail;
+		*bh_offset += avail;
+		if (*bh_offset == PAGE_SIZE) {
+			*bh_offset = 0;
+			*bh += 1;
+		}
+	}
+	return 0;
+}
+
+/* Copy the %length bytes of data of a block of %size bytes
+ * which starts at %bh_offset in %bhs[0] to %dest. The block is
+ * decompressed unless it is stored uncompressed, the scratch
+ * buffer used for that is taken the first time it is needed
+ * and is left in *%scratch for the caller to return. Bytes of
+ * %dest past the decompressed data are zeroed.
+ */
+static int __microfs_copy_frame(struct microfs_readpage_request* rdreq,
+	struct buffer_head** bhs, __u32 nbhs, __u32 bh_offset, __u32 length,
+	char* dest, __u32 size, struct microfs_filedata_entry** scratch)
+{
+	__u32 bh = 0;
+	__u32 used;
+	
+	struct microfs_sb_info* sbi = MICROFS_SB(rdreq->rr_inode->i_sb);
+	struct microfs_filedata_cache* fc = &sbi->si_filedatacache;
+	
+	int err;
+	
+	if ((sbi->si_flags & MICROFS_FLAG_STOREDBLOCKS) && length == size)
+		return __microfs_copy_bhs(bhs, nbhs, &bh, &bh_offset, dest, size);
+	
+	if (!*scratch) {
+		*scratch = microfs_filedata_cache_scratch_get(fc);
+		if (IS_ERR(*scratch)) {
+			err = PTR_ERR(*scratch);
+			*scratch = NULL;
+			return err;
+		}
+	}
+	
+	err = __microfs_decompress_exceptionally(rdreq->rr_codec, bhs, nbhs,
+		&bh_offset, length, &(*scratch)->fe_buf);
+	if (!err) {
+		used = min_t(__u32, (*scratch)->fe_buf.d_used, size);
+		memcpy(dest, (*scratch)->fe_buf.d_data, used);
+		/* A block which decompresses to less than its size must
+		 * not leave whatever %dest held before in the page.
+		 */
+		memset(dest + used, 0, size - used);
+	}
+	
+	return err;
+}
+
+/* Copy the block data of a request for a page which is backed
+ * by several small blocks, where some of the blocks are stored
+ * uncompressed or are holes and some are not.
+ */
+static int __microfs_copy_filedata_mixed(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
+{
+	__u32 i;
+	__u32 covered = 0;
 	
 	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_readpage_request* rdreq = data;
+	struct microfs_filedata_cache* fc = &sbi->si_filedatacache;
+	struct microfs_filedata_entry* scratch = NULL;
+	struct inode* inode = rdreq->rr_inode;
+	
+	int fragments = sbi->si_flags & MICROFS_FLAG_FRAGMENTS;
+	
+	__u32 i_size = i_size_read(inode);
+	__u32 blksz = MICROFS_I(inode)->ii_blksz;
+	__u32 framesz = MICROFS_I(inode)->ii_framesz;
+	__u32 blk_ptrs = i_ptrblks(i_size, blksz, fragments);
+	__u32 data_size = i_size - i_fragtail(i_size, blksz, fragments);
+	__u32* blkptrs = __microfs_load_blkptrs(sb, inode);
+	
+	char* page_data;
+	
+	int err = 0;
+	
+	(void)length;
+	
+	if (unlikely(rdreq->rr_npages != 1))
+		return -EIO;
+	if (!rdreq->rr_pages[0])
+		return 0;
+	
+	page_data = kmap(rdreq->rr_pages[0]);
+	
+	for (i = 0; i < rdreq->rr_blks && !err; ++i) {
+		__u32 bh;
+		__u32 bh_offset;
+		__u64 blk_data_offset;
+		__u32 blk_data_length;
+		__u32 blk_size = i_blksz(data_size, rdreq->rr_blknr + i, framesz);
+		
+		err = __microfs_get_frame(sb, inode, blkptrs, blk_ptrs,
+			rdreq->rr_blknr + i, &blk_data_offset, &blk_data_length);
+		if (unlikely(err))
+			break;
+		
+		bh = (blk_data_offset - round_down(offset, PAGE_SIZE)) >> PAGE_SHIFT;
+		bh_offset = blk_data_offset & ~PAGE_MASK;
+		
+		if (blk_data_length == 0) {
+			memset(page_data + covered, 0, blk_size);
+		} else if (unlikely(bh >= nbhs)) {
+			err = -EIO;
+		} else {
+			err = __microfs_copy_frame(rdreq, bhs + bh, nbhs - bh,
+				bh_offset, blk_data_length, page_data + covered,
+				blk_size, &scratch);
+		}
+		
+		covered += blk_size;
+	}
+	
+	if (!err)
+		memset(page_data + covered, 0, PAGE_SIZE - covered);
 	
-	if (sbi->si_filedatabuf.d_offset == offset) {
-		mutex_lock(&sbi->si_filedatabuf.d_mutex);
-		if (likely(sbi->si_filedatabuf.d_offset == offset)) {
-			cached = 1;
-			err = consumer(sb, data, NULL, 0, offset, length);
+	kunmap(rdreq->rr_pages[0]);
+	
+	if (scratch)
+		microfs_filedata_cache_scratch_put(fc, scratch);
+	
+	return err;
+}
+
+/* Copy the block data of a request which blocks are all stored
+ * uncompressed (see %MICROFS_FLAG_STOREDBLOCKS) straight to its
+ * pages, busy pages are skipped. Requests where only some of the
+ * blocks are stored are handed to %__microfs_copy_filedata_mixed().
+ */
+static int __microfs_copy_filedata_stored(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
+{
+	__u32 bh = 0;
+	__u32 bh_offset;
+	__u32 page;
+	
+	struct microfs_readpage_request* rdreq = data;
+	
+	int err = 0;
+	
+	if (rdreq->rr_storedblks != rdreq->rr_blks || rdreq->rr_zeroblks) {
+		return __microfs_copy_filedata_mixed(sb, data, bhs, nbhs,
+			offset, length);
+	}
+	
+	pr_spam("__microfs_copy_filedata_stored: offset=0x%llx, length=%u\n",
+		offset, length);
+	
+	for (page = 0, bh_offset = rdreq->rr_bhoffset;
+			page < rdreq->rr_npages && !err; ++page) {
+		__u32 avail = min_t(__u32, length, PAGE_SIZE);
+		
+		if (rdreq->rr_pages[page]) {
+			char* page_data = kmap(rdreq->rr_pages[page]);
+			err = __microfs_copy_bhs(bhs, nbhs, &bh, &bh_offset,
+				page_data, avail);
+			memset(page_data + avail, 0, PAGE_SIZE - avail);
+			kunmap(rdreq->rr_pages[page]);
 		} else {
-			pr_spam("__microfs_recycle_filedata_exceptionally:"
-				" near cache miss at offset 0x%x (hit stolen)\n", offset);
+			err = __microfs_copy_bhs(bhs, nbhs, &bh, &bh_offset,
+				NULL, avail);
 		}
-		mutex_unlock(&sbi->si_filedatabuf.d_mutex);
+		
+		length -= avail;
 	}
-	return !err && cached ? 0 : -EIO;
+	
+	return err;
+}
+
+static int __microfs_recycle_filedata_exceptionally(struct super_block* sb,
+	void* data, __u64 offset, __u32 length,
+	microfs_read_blks_consumer consumer)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_filedata_entry* entry;
+	
+	(void)length;
+	(void)consumer;
+	
+	entry = microfs_filedata_cache_get(&sbi->si_filedatacache, offset);
+	if (!entry)
+		return -EIO;
+	
+	__microfs_copy_filedata_entry(data, entry);
+	microfs_filedata_cache_put(&sbi->si_filedatacache, entry);
+	
+	return 0;
 }
 
 static int __microfs_copy_filedata_nominally(struct super_block* sb,
 	void* data, struct buffer_head** bhs, __u32 nbhs,
-	__u32 offset, __u32 length)
+	__u64 offset, __u32 length)
 {
 	__u32 bh;
 	__u32 page;
@@ -238,8 +959,8 @@ static int __microfs_copy_filedata_nominally(struct super_block* sb,
 	__u32 decompressed = 0;
 	
 	void* decompressor = NULL;
-	struct microfs_sb_info* sbi = MICROFS_SB(sb);
 	struct microfs_readpage_request* rdreq = data;
+	struct microfs_sb_info* sbi = rdreq->rr_codec;
 	
 	int err = 0;
 	int repeat = 0;
@@ -254,7 +975,7 @@ static int __microfs_copy_filedata_nominally(struct super_block* sb,
 		goto err_dd_get;
 	}
 	
-	pr_spam("__microfs_copy_filedata_nominally: offset=0x%x, length=%u\n",
+	pr_spam("__microfs_copy_filedata_nominally: offset=0x%llx, length=%u\n",
 		offset, length);
 	
 	sbi->si_decompressor->dc_reset(sbi, decompressor);
@@ -312,7 +1033,7 @@ err_dd_get:
 }
 
 static int __microfs_recycle_filedata_nominally(struct super_block* sb,
-	void* data, __u32 offset, __u32 length,
+	void* data, __u64 offset, __u32 length,
 	microfs_read_blks_consumer consumer)
 {
 	(void)sb;
@@ -324,28 +1045,163 @@ static int __microfs_recycle_filedata_nominally(struct super_block* sb,
 	return -EIO;
 }
 
-int __microfs_read_blks(struct super_block* sb,
+/* Copy the tail of a file from the given uncompressed fragment
+ * block to the pages of %rdreq. Whatever follows the tail in the
+ * pages is zeroed.
+ */
+static int __microfs_copy_fragment_entry(struct microfs_readpage_request* rdreq,
+	struct microfs_filedata_entry* entry)
+{
+	__u32 page;
+	__u32 page_start;
+	__u32 from;
+	__u32 to;
+	
+	__u32 tail_end = rdreq->rr_fragpos + rdreq->rr_fraglength;
+	
+	if (unlikely(rdreq->rr_fragoffset + rdreq->rr_fraglength
+			> entry->fe_buf.d_used)) {
+		pr_err("__microfs_copy_fragment_entry: the tail (%u bytes at %u)"
+			" is outside of the fragment block (%u bytes)\n",
+			rdreq->rr_fraglength, rdreq->rr_fragoffset, entry->fe_buf.d_used);
+		return -EIO;
+	}
+	
+	for (page = 0, page_start = 0; page < rdreq->rr_npages;
+			page += 1, page_start += PAGE_SIZE) {
+		void* page_data;
+		
+		if (!rdreq->rr_pages[page] || page_start + PAGE_SIZE <= rdreq->rr_fragpos)
+			continue;
+		
+		from = max_t(__u32, rdreq->rr_fragpos, page_start);
+		to = min_t(__u32, tail_end, page_start + PAGE_SIZE);
+		
+		page_data = kmap(rdreq->rr_pages[page]);
+		if (from < to) {
+			memcpy(page_data + (from - page_start), entry->fe_buf.d_data
+				+ rdreq->rr_fragoffset + (from - rdreq->rr_fragpos), to - from);
+		}
+		from = min_t(__u32, max_t(__u32, tail_end, page_start),
+			page_start + PAGE_SIZE);
+		memset(page_data + (from - page_start), 0, PAGE_SIZE - (from - page_start));
+		kunmap(rdreq->rr_pages[page]);
+	}
+	
+	return 0;
+}
+
+static int __microfs_copy_fragment(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
+{
+	__u32 bh_offset = offset & ~PAGE_MASK;
+	
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_readpage_request* rdreq = data;
+	struct microfs_filedata_cache* fc = &sbi->si_filedatacache;
+	struct microfs_filedata_entry* scratch;
+	struct microfs_filedata_entry* entry;
+	
+	int err = 0;
+	
+	/* The fragment block is most likely shared with other files,
+	 * so it is always kept in the cache.
+	 */
+	entry = microfs_filedata_cache_get(fc, offset);
+	if (entry) {
+		err = __microfs_copy_fragment_entry(rdreq, entry);
+		microfs_filedata_cache_put(fc, entry);
+		return err;
+	}
+	
+	scratch = microfs_filedata_cache_scratch_get(fc);
+	if (IS_ERR(scratch))
+		return PTR_ERR(scratch);
+	
+	pr_spam("__microfs_copy_fragment: offset=0x%llx, length=%u\n",
+		offset, length);
+	
+	err = __microfs_decompress_exceptionally(sbi, bhs, nbhs,
+		&bh_offset, length, &scratch->fe_buf);
+	if (err)
+		goto err_decompress;
+	
+	entry = microfs_filedata_cache_insert(fc, scratch, offset);
+	if (entry) {
+		err = __microfs_copy_fragment_entry(rdreq, entry);
+		microfs_filedata_cache_put(fc, entry);
+	} else {
+		err = __microfs_copy_fragment_entry(rdreq, scratch);
+	}
+	
+err_decompress:
+	microfs_filedata_cache_scratch_put(fc, scratch);
+	return err;
+}
+
+static int __microfs_recycle_fragment(struct super_block* sb,
+	void* data, __u64 offset, __u32 length,
+	microfs_read_blks_consumer consumer)
+{
+	int err;
+	
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_filedata_entry* entry;
+	
+	(void)length;
+	(void)consumer;
+	
+	entry = microfs_filedata_cache_get(&sbi->si_filedatacache, offset);
+	if (!entry)
+		return -EIO;
+	
+	err = __microfs_copy_fragment_entry(data, entry);
+	microfs_filedata_cache_put(&sbi->si_filedatacache, entry);
+	
+	return err;
+}
+
+int __microfs_wait_blks(struct buffer_head** bhs, __u32 nbhs)
+{
+	__u32 i;
+	
+	for (i = 0; i < nbhs; ++i) {
+		wait_on_buffer(bhs[i]);
+		if (unlikely(!buffer_uptodate(bhs[i]))) {
+			pr_err("__microfs_wait_blks: bh 0x%p (#%u) is not up-to-date\n", bhs[i], i);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static int __microfs_read_blks_impl(struct super_block* sb,
 	struct address_space* mapping, void* data,
 	microfs_read_blks_recycler recycler,
 	microfs_read_blks_consumer consumer,
-	__u32 offset, __u32 length)
+	__u64 offset, __u32 length, int wait)
 {
 	__u32 i;
 	__u32 n;
-	__u32 dev_blks;
 	
 	int err = 0;
 	
-	__u32 blk_nr;
+	sector_t blk_nr;
+	sector_t dev_blks;
 	__u32 blk_offset;
 	
 	__u32 nbhs;
 	struct buffer_head** bhs;
 	
+	struct blk_plug plug;
+	
+	(void)mapping;
+	
 	if (recycler(sb, data, offset, length, consumer) == 0)
 		goto out_cachehit;
 	
-	blk_offset = offset - (offset & PAGE_MASK);
+	blk_offset = offset - round_down(offset, PAGE_SIZE);
 	
 	nbhs = i_blks(blk_offset + length, PAGE_SIZE);
 	bhs = kmalloc(nbhs * sizeof(void*), GFP_KERNEL);
@@ -358,22 +1214,23 @@ int __microfs_read_blks(struct super_block* sb,
 	blk_nr = offset >> PAGE_SHIFT;
 	dev_blks = sb->s_bdev->bd_inode->i_size >> PAGE_SHIFT;
 	
-	pr_spam("__microfs_read_blks: offset=0x%x, blk_offset=%u, length=%u\n",
+	pr_spam("__microfs_read_blks: offset=0x%llx, blk_offset=%u, length=%u\n",
 		offset, blk_offset, length);
-	pr_spam("__microfs_read_blks: nbhs=%u, blk_nr=%u, dev_blks=%u\n",
-		nbhs, blk_nr, dev_blks);
+	pr_spam("__microfs_read_blks: nbhs=%u, blk_nr=%llu, dev_blks=%llu\n",
+		nbhs, (__u64)blk_nr, (__u64)dev_blks);
 	
 	for (i = 0, n = 0; i < nbhs; ++i) {
 		if (likely(blk_nr + i < dev_blks)) {
 			bhs[n++] = sb_getblk(sb, blk_nr + i);
 			if (unlikely(bhs[n - 1] == NULL)) {
-				pr_err("__microfs_read_blks: failed to get a bh for block %u\n",
-					blk_nr + i);
+				pr_err("__microfs_read_blks: failed to get a bh for block %llu\n",
+					(__u64)blk_nr + i);
+				n -= 1;
 				err = -EIO;
 				goto err_bhs;
 			} else {
-				pr_spam("__microfs_read_blks: got bh 0x%p for block %u\n",
-					bhs[n - 1], blk_nr + i);
+				pr_spam("__microfs_read_blks: got bh 0x%p for block %llu\n",
+					bhs[n - 1], (__u64)blk_nr + i);
 			}
 		} else {
 			/* It is not possible to fill the entire read buffer this
@@ -383,21 +1240,23 @@ int __microfs_read_blks(struct super_block* sb,
 		}
 	}
 	
+	/* Plugging allows the block layer to merge the requests for
+	 * the (contiguous) buffer heads into as few I/Os as possible
+	 * before they are dispatched.
+	 */
+	blk_start_plug(&plug);
 	ll_rw_block(REQ_OP_READ, 0, n, bhs);
+	blk_finish_plug(&plug);
 	
 	pr_spam("__microfs_read_blks: bhs submitted for reading\n");
 	
-	for (i = 0; i < n; ++i) {
-		wait_on_buffer(bhs[i]);
-		if (unlikely(!buffer_uptodate(bhs[i]))) {
-			pr_err("__microfs_read_blks: bh 0x%p (#%u) is not up-to-date\n", bhs[i], i);
-			err = -EIO;
+	if (wait) {
+		err = __microfs_wait_blks(bhs, n);
+		if (unlikely(err))
 			goto err_bhs;
-		}
+		pr_spam("__microfs_read_blks: reading complete\n");
 	}
 	
-	pr_spam("__microfs_read_blks: reading complete\n");
-	
 	err = consumer(sb, data, bhs, n, offset, length);
 	
 	pr_spam("__microfs_read_blks: processing complete\n");
@@ -413,203 +1272,699 @@ out_cachehit:
 	return err;
 }
 
+int __microfs_read_blks(struct super_block* sb,
+	struct address_space* mapping, void* data,
+	microfs_read_blks_recycler recycler,
+	microfs_read_blks_consumer consumer,
+	__u64 offset, __u32 length)
+{
+	return __microfs_read_blks_impl(sb, mapping, data,
+		recycler, consumer, offset, length, 1);
+}
+
+int __microfs_read_blks_progressively(struct super_block* sb,
+	struct address_space* mapping, void* data,
+	microfs_read_blks_recycler recycler,
+	microfs_read_blks_consumer consumer,
+	__u64 offset, __u32 length)
+{
+	return __microfs_read_blks_impl(sb, mapping, data,
+		recycler, consumer, offset, length, 0);
+}
+
 /* The caller must hold the appropriate buffer lock.
  */
-void* __microfs_read(struct super_block* sb,
-	struct microfs_data_buffer* destbuf, __u32 offset, __u32 length)
+static int __microfs_copy_filedata_batch(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
 {
-	struct address_space* mapping = sb->s_bdev->bd_inode->i_mapping;
-	
-	__u32 buf_offset;
-	__u32 data_offset;
-	
-	int err = 0;
-	
-	pr_devel_once("__microfs_read: first call\n");
-	
-	pr_spam("__microfs_read: length=%u, offset=%u, mapping->host->i_size=%u\n",
-		length, offset, mapping->host->i_size);
-
-#define ABORT_READ_ON(Condition) \
-	do { \
-		if (unlikely(Condition)) { \
-			pr_err("__microfs_read: " #Condition "\n"); \
-			BUG(); \
-			return ERR_PTR(-EINVAL); \
-		} \
-	} while (0)
-	
-	ABORT_READ_ON(length == 0);
-	ABORT_READ_ON(length > destbuf->d_size);
-	ABORT_READ_ON(offset + length > mapping->host->i_size);
+	__u32 i;
+	__u32 bh;
 	
-#undef ABORT_READ_ON
+	struct microfs_readpages_request* rpreq = data;
 	
-	data_offset = offset & PAGE_MASK;
-	buf_offset = offset - data_offset;
+	(void)length;
 	
-	/* %destbuf will not be updated if an error is encountered.
-	 */
-	err = __microfs_read_blks(sb, mapping, destbuf,
-		__microfs_recycle_metadata, __microfs_copy_metadata,
-		offset, destbuf->d_size);
+	pr_spam("__microfs_copy_filedata_batch: offset=0x%llx, length=%u, nreqs=%u\n",
+		offset, length, rpreq->rp_nreqs);
 	
-	if (unlikely(err))
-		return ERR_PTR(err);
+	for (i = 0; i < rpreq->rp_nreqs; ++i) {
+		struct microfs_readpage_request* rdreq = &rpreq->rp_reqs[i];
+		
+		bh = (rdreq->rr_dataoffset - round_down(offset, PAGE_SIZE)) >> PAGE_SHIFT;
+		if (unlikely(bh >= nbhs)) {
+			pr_err("__microfs_copy_filedata_batch: bh %u is out of range"
+				" (nbhs=%u)\n", bh, nbhs);
+			rdreq->rr_err = -EIO;
+			continue;
+		}
+		
+		/* Only wait for the data needed by this request, the
+		 * data for the requests that follow might still be on
+		 * its way from the device while this one is inflated.
+		 */
+		rdreq->rr_err = __microfs_wait_blks(bhs + bh, min_t(__u32, nbhs - bh,
+			i_blks(rdreq->rr_bhoffset + rdreq->rr_datalength, PAGE_SIZE)));
+		if (unlikely(rdreq->rr_err))
+			continue;
+		
+		rdreq->rr_err = (rdreq->rr_storedblks
+			? __microfs_copy_filedata_stored
+			: __microfs_copy_filedata_nominally)(sb, rdreq,
+			bhs + bh, nbhs - bh, rdreq->rr_dataoffset, rdreq->rr_datalength);
+	}
 	
-	destbuf->d_offset = data_offset;
-	return destbuf->d_data + buf_offset;
+	return 0;
 }
 
-int __microfs_readpage(struct file* file, struct page* page)
+/* Determine which pages share block data with the page at
+ * %index and where that block data is stored in the image.
+ * The block pointers are read from the image unless the cached
+ * block pointers of %inode are given by %blkptrs. The pages are
+ * located in units of sub-frames, which are the blocks unless
+ * they are split, so that only the sub-frames covering the pages
+ * have to be decompressed.
+ */
+static int __microfs_locate_pages(struct super_block* sb,
+	struct inode* inode, const __u32* blkptrs, pgoff_t index,
+	struct microfs_readpage_request* rdreq)
 {
-	struct inode* inode = page->mapping->host;
-	struct super_block* sb = inode->i_sb;
 	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_inode_info* ii = MICROFS_I(inode);
 	
 	int err = 0;
-	int small_blks = sbi->si_blksz <= PAGE_SIZE;
+	int small_blks = ii->ii_framesz <= PAGE_SIZE;
+	int stored_blks = sbi->si_flags & MICROFS_FLAG_STOREDBLOCKS;
+	int zero_blks = sbi->si_flags & MICROFS_FLAG_ZEROBLOCKS;
+	int fragments = sbi->si_flags & MICROFS_FLAG_FRAGMENTS;
 	
 	__u32 i;
-	__u32 j;
-	
-	__u32 data_offset = 0;
-	__u32 data_length = 0;
-	__u32 blk_data_offset = 0;
+	__u64 blk_data_offset = 0;
 	__u32 blk_data_length = 0;
+	__u64 blk_data_end = 0;
 	
-	__u32 pgholes = 0;
-	
-	__u32 blk_ptrs = i_blks(i_size_read(inode), sbi->si_blksz);
+	__u32 i_size = i_size_read(inode);
+	__u32 blk_ptrs = i_ptrblks(i_size, ii->ii_blksz, fragments);
+	__u32 blk_tail = i_fragtail(i_size, ii->ii_blksz, fragments);
+	__u32 frames = i_blks(i_size - blk_tail, ii->ii_framesz);
+	__u32 tail_start = i_size - blk_tail;
 	__u32 blk_nr = small_blks
-		? page->index * (PAGE_SIZE >> sbi->si_blkshift)
-		: page->index / (sbi->si_blksz / PAGE_SIZE);
+		? index * (PAGE_SIZE >> ii->ii_frameshift)
+		: index / (ii->ii_framesz / PAGE_SIZE);
+	__u32 blk_count = small_blks
+		? PAGE_SIZE >> ii->ii_frameshift
+		: 1;
 	
-	int index_mask = small_blks
+	pgoff_t index_mask = small_blks
 		? 0
-		: (1 << (sbi->si_blkshift - PAGE_SHIFT)) - 1;
+		: (1 << (ii->ii_frameshift - PAGE_SHIFT)) - 1;
 	
-	__u32 max_index = i_blks(i_size_read(inode), PAGE_SIZE);
-	__u32 start_index = (small_blks ? page->index : page->index & ~index_mask);
-	__u32 end_index = (small_blks ? page->index : start_index | index_mask) + 1;
-	
-	struct microfs_readpage_request rdreq;
+	pgoff_t max_index = i_blks(i_size_read(inode), PAGE_SIZE);
+	pgoff_t start_index = index & ~index_mask;
+	pgoff_t end_index = (index | index_mask) + 1;
 	
 	if (end_index > max_index)
 		end_index = max_index;
 	
-	pr_spam("__microfs_readpage: sbi->si_blksz=%u, blk_ptrs=%u, blk_nr=%u\n",
-		sbi->si_blksz, blk_ptrs, blk_nr);
-	pr_spam("__microfs_readpage: start_index=%u, end_index=%u, max_index=%u\n",
+	pr_spam("__microfs_locate_pages: blksz=%u, framesz=%u, blk_ptrs=%u,"
+			" blk_nr=%u\n", ii->ii_blksz, ii->ii_framesz, blk_ptrs, blk_nr);
+	pr_spam("__microfs_locate_pages: start_index=%lu, end_index=%lu, max_index=%lu\n",
 		start_index, end_index, max_index);
 	
-	mutex_lock(&sbi->si_metadata_blkptrbuf.d_mutex);
-	for (i = 0; (data_length < PAGE_SIZE && blk_nr + i < blk_ptrs) &&
-			(i == 0 || sbi->si_blksz < PAGE_SIZE); ++i) {
-		err = __microfs_find_block(sb, inode, blk_ptrs, blk_nr + i,
+	rdreq->rr_pages = NULL;
+	rdreq->rr_npages = end_index - start_index;
+	rdreq->rr_pgholes = 0;
+	rdreq->rr_index = start_index;
+	rdreq->rr_dataoffset = 0;
+	rdreq->rr_datalength = 0;
+	rdreq->rr_inode = inode;
+	rdreq->rr_codec = ii->ii_codec;
+	rdreq->rr_blknr = blk_nr;
+	rdreq->rr_blks = 0;
+	rdreq->rr_storedblks = 0;
+	rdreq->rr_zeroblks = 0;
+	rdreq->rr_gaps = 0;
+	rdreq->rr_fraglength = 0;
+	rdreq->rr_fragoffset = 0;
+	rdreq->rr_fragpos = 0;
+	rdreq->rr_fragdataoffset = 0;
+	rdreq->rr_fragdatalength = 0;
+	rdreq->rr_err = 0;
+	
+	for (i = 0; i < blk_count && blk_nr + i < frames; ++i) {
+		err = __microfs_get_frame(sb, inode, blkptrs, blk_ptrs, blk_nr + i,
 			&blk_data_offset, &blk_data_length);
-		if (unlikely(err)) {
-			mutex_unlock(&sbi->si_metadata_blkptrbuf.d_mutex);
-			goto err_find_block;
+		if (unlikely(err))
+			return err;
+		/* Shared blocks need not follow each other, and they can
+		 * be anywhere in the image. Reading everything between
+		 * them could mean most of the image, so the blocks are
+		 * then read one by one.
+		 */
+		if (i == 0)
+			rdreq->rr_dataoffset = blk_data_offset;
+		else if (blk_data_offset != blk_data_end)
+			rdreq->rr_gaps = 1;
+		blk_data_end = blk_data_offset + blk_data_length;
+		if (!rdreq->rr_gaps)
+			rdreq->rr_datalength = blk_data_end - rdreq->rr_dataoffset;
+		rdreq->rr_blks += 1;
+		if (stored_blks && blk_data_length
+				== i_blksz(i_size - blk_tail, blk_nr + i, ii->ii_framesz))
+			rdreq->rr_storedblks += 1;
+		if (zero_blks && blk_data_length == 0)
+			rdreq->rr_zeroblks += 1;
+	}
+	
+	rdreq->rr_bhoffset = rdreq->rr_dataoffset
+		- round_down(rdreq->rr_dataoffset, PAGE_SIZE);
+	
+	if (blk_tail && tail_start < end_index * PAGE_SIZE
+			&& start_index * PAGE_SIZE < tail_start + blk_tail) {
+		/* The pages cover (a part of) the tail of the file. The
+		 * tail can span many pages when the blocks are split into
+		 * sub-frames, so each request copies the part of the tail
+		 * that overlaps its own pages.
+		 */
+		rdreq->rr_fraglength = blk_tail;
+		err = __microfs_find_fragment(sb, inode, rdreq);
+		if (unlikely(err))
+			return err;
+		if (tail_start < start_index * PAGE_SIZE) {
+			__u32 skip = start_index * PAGE_SIZE - tail_start;
+			rdreq->rr_fragoffset += skip;
+			rdreq->rr_fraglength -= skip;
+			rdreq->rr_fragpos = 0;
+		} else {
+			rdreq->rr_fragpos = tail_start - start_index * PAGE_SIZE;
 		}
-		if (!data_offset)
-			data_offset = blk_data_offset;
-		data_length += blk_data_length;
+		/* The tail can also go on past the last page.
+		 */
+		rdreq->rr_fraglength = min_t(__u32, rdreq->rr_fraglength,
+			rdreq->rr_npages * PAGE_SIZE - rdreq->rr_fragpos);
+		pr_spam("__microfs_locate_pages: frag_data_offset=0x%llx,"
+				" frag_data_length=%u, frag_offset=%u, frag_length=%u\n",
+			rdreq->rr_fragdataoffset, rdreq->rr_fragdatalength,
+			rdreq->rr_fragoffset, rdreq->rr_fraglength);
 	}
-	mutex_unlock(&sbi->si_metadata_blkptrbuf.d_mutex);
 	
-	pr_spam("__microfs_readpage: data_offset=0x%x, data_length=%u\n",
-		data_offset, data_length);
+	pr_spam("__microfs_locate_pages: data_offset=0x%llx, data_length=%u,"
+			" blks=%u, storedblks=%u, zeroblks=%u, gaps=%d\n",
+		rdreq->rr_dataoffset, rdreq->rr_datalength,
+		rdreq->rr_blks, rdreq->rr_storedblks, rdreq->rr_zeroblks,
+		rdreq->rr_gaps);
 	
-	rdreq.rr_bhoffset = data_offset - (data_offset & PAGE_MASK);
-	rdreq.rr_npages = end_index - start_index;
-	rdreq.rr_pages = kmalloc(rdreq.rr_npages * sizeof(void*), GFP_KERNEL);
-	if (!rdreq.rr_pages) {
-		pr_err("__microfs_readpage: failed to allocate rdreq.rr_pages (%u slots)\n",
-			rdreq.rr_npages);
-		err = -ENOMEM;
-		goto err_mem;
+	return 0;
+}
+
+/* Populate %rdreq->rr_pages, which must have room for
+ * %rdreq->rr_npages pages. The %npages locked pages given by
+ * %pages (sorted by index) are owned by the caller, the rest
+ * of the pages are grabbed from the page cache if possible.
+ */
+static void __microfs_grab_pages(struct address_space* mapping,
+	struct microfs_readpage_request* rdreq,
+	struct page** pages, __u32 npages)
+{
+	__u32 i;
+	__u32 j;
+	
+	pgoff_t index;
+	
+	for (i = 0, j = 0, index = rdreq->rr_index; i < rdreq->rr_npages;
+			++i, ++index) {
+		while (j < npages && pages[j]->index < index)
+			j++;
+		if (j < npages && pages[j]->index == index) {
+			rdreq->rr_pages[i] = pages[j];
+			pr_spam("__microfs_grab_pages: target page 0x%p at index %lu\n",
+				pages[j], index);
+			continue;
+		}
+		
+		rdreq->rr_pages[i] = grab_cache_page_nowait(mapping, index);
+		if (rdreq->rr_pages[i] == NULL) {
+			rdreq->rr_pgholes++;
+			pr_spam("__microfs_grab_pages: busy page at index %lu\n", index);
+		} else if (PageUptodate(rdreq->rr_pages[i])) {
+			unlock_page(rdreq->rr_pages[i]);
+			put_page(rdreq->rr_pages[i]);
+			rdreq->rr_pages[i] = NULL;
+			rdreq->rr_pgholes++;
+			pr_spam("__microfs_grab_pages: page up to date at index %lu\n", index);
+		} else {
+			pr_spam("__microfs_grab_pages: new page 0x%p added for index %lu\n",
+				rdreq->rr_pages[i], index);
+		}
 	}
 	
-	pr_spam("__microfs_readpage: rdreq.rr_pages=0x%p, rdreq.rr_npages=%u\n",
-		rdreq.rr_pages, rdreq.rr_npages);
+	pr_spam("__microfs_grab_pages: pgholes=%u\n", rdreq->rr_pgholes);
+}
+
+/* Mark the pages of %rdreq as up to date (or erroneous) and
+ * unlock them. All pages except %page are also released.
+ */
+static void __microfs_release_pages(struct microfs_readpage_request* rdreq,
+	struct page* page)
+{
+	__u32 i;
+	
+	for (i = 0; i < rdreq->rr_npages; ++i) {
+		if (rdreq->rr_pages[i]) {
+			flush_dcache_page(rdreq->rr_pages[i]);
+			if (likely(!rdreq->rr_err))
+				SetPageUptodate(rdreq->rr_pages[i]);
+			else
+				SetPageError(rdreq->rr_pages[i]);
+			unlock_page(rdreq->rr_pages[i]);
+			if (rdreq->rr_pages[i] != page)
+				put_page(rdreq->rr_pages[i]);
+		}
+	}
+}
+
+/* Zero the pages of a request which blocks are all holes, no
+ * I/O or decompression is needed.
+ */
+static void __microfs_zero_pages(struct microfs_readpage_request* rdreq)
+{
+	__u32 page;
+	
+	pr_spam("__microfs_zero_pages: zeroing %u pages from index %lu\n",
+		rdreq->rr_npages, rdreq->rr_index);
+	
+	for (page = 0; page < rdreq->rr_npages; ++page) {
+		if (rdreq->rr_pages[page])
+			zero_user(rdreq->rr_pages[page], 0, PAGE_SIZE);
+	}
+}
+
+static int __microfs_copy_filedata_frame(struct super_block* sb,
+	void* data, struct buffer_head** bhs, __u32 nbhs,
+	__u64 offset, __u32 length)
+{
+	struct microfs_readframe_request* rfreq = data;
+	
+	(void)sb;
+	
+	return __microfs_copy_frame(rfreq->rf_rdreq, bhs, nbhs,
+		offset & ~PAGE_MASK, length, rfreq->rf_dest, rfreq->rf_size,
+		&rfreq->rf_scratch);
+}
+
+/* Fill the page of a request which block data is not back to
+ * back (see %rr_gaps). Each block is read on its own, so that
+ * nothing but the blocks themselves is read from the image.
+ */
+static int __microfs_fill_blocks_apart(struct super_block* sb,
+	struct address_space* mapping, struct microfs_readpage_request* rdreq)
+{
+	__u32 i;
+	__u32 covered = 0;
+	
+	struct microfs_sb_info* sbi = MICROFS_SB(sb);
+	struct microfs_readframe_request rfreq;
+	struct inode* inode = rdreq->rr_inode;
+	
+	int fragments = sbi->si_flags & MICROFS_FLAG_FRAGMENTS;
+	
+	__u32 i_size = i_size_read(inode);
+	__u32 blksz = MICROFS_I(inode)->ii_blksz;
+	__u32 framesz = MICROFS_I(inode)->ii_framesz;
+	__u32 blk_ptrs = i_ptrblks(i_size, blksz, fragments);
+	__u32 data_size = i_size - i_fragtail(i_size, blksz, fragments);
+	__u32* blkptrs = __microfs_load_blkptrs(sb, inode);
+	
+	char* page_data;
+	
+	int err = 0;
+	
+	if (unlikely(rdreq->rr_npages != 1))
+		return -EIO;
+	if (!rdreq->rr_pages[0])
+		return 0;
+	
+	rfreq.rf_rdreq = rdreq;
+	rfreq.rf_scratch = NULL;
+	
+	page_data = kmap(rdreq->rr_pages[0]);
 	
-	for (i = 0, j = start_index; j < end_index; ++i, ++j) {
-		rdreq.rr_pages[i] = (j == page->index)
-			? page
-			: grab_cache_page_nowait(page->mapping, j);
-		if (rdreq.rr_pages[i] == page) {
-			pr_spam("__microfs_readpage: target page 0x%p at index %u\n",
-				page, j);
-		} else if (rdreq.rr_pages[i] == NULL) {
-			pgholes++;
-			pr_spam("__microfs_readpage: busy page at index %u\n", j);
-		} else if (PageUptodate(rdreq.rr_pages[i])) {
-			unlock_page(rdreq.rr_pages[i]);
-			put_page(rdreq.rr_pages[i]);
-			rdreq.rr_pages[i] = NULL;
-			pgholes++;
-			pr_spam("__microfs_readpage: page up to date at index %u\n", j);
+	for (i = 0; i < rdreq->rr_blks && !err; ++i) {
+		__u64 blk_data_offset;
+		__u32 blk_data_length;
+		__u32 blk_size = i_blksz(data_size, rdreq->rr_blknr + i, framesz);
+		
+		err = __microfs_get_frame(sb, inode, blkptrs, blk_ptrs,
+			rdreq->rr_blknr + i, &blk_data_offset, &blk_data_length);
+		if (unlikely(err))
+			break;
+		
+		if (blk_data_length == 0) {
+			memset(page_data + covered, 0, blk_size);
 		} else {
-			pr_spam("__microfs_readpage: new page 0x%p added for index %u\n",
-				rdreq.rr_pages[i], j);
+			rfreq.rf_dest = page_data + covered;
+			rfreq.rf_size = blk_size;
+			err = __microfs_read_blks(sb, mapping, &rfreq,
+				__microfs_recycle_filedata_nominally,
+				__microfs_copy_filedata_frame,
+				blk_data_offset, blk_data_length);
 		}
+		
+		covered += blk_size;
 	}
 	
-	pr_spam("__microfs_readpage: pgholes=%u\n", pgholes);
+	if (!err)
+		memset(page_data + covered, 0, PAGE_SIZE - covered);
+	
+	kunmap(rdreq->rr_pages[0]);
 	
-	if (pgholes) {
+	if (rfreq.rf_scratch)
+		microfs_filedata_cache_scratch_put(&sbi->si_filedatacache,
+			rfreq.rf_scratch);
+	
+	return err;
+}
+
+static int __microfs_fill_blocks(struct super_block* sb,
+	struct address_space* mapping, struct microfs_readpage_request* rdreq)
+{
+	if (rdreq->rr_zeroblks == rdreq->rr_blks) {
+		__microfs_zero_pages(rdreq);
+		return 0;
+	} else if (rdreq->rr_gaps) {
+		return __microfs_fill_blocks_apart(sb, mapping, rdreq);
+	} else if (rdreq->rr_storedblks || rdreq->rr_zeroblks) {
+		/* Stored blocks are copied as they are, page holes are
+		 * simply skipped as there is nothing to decompress. Blocks
+		 * which are holes are zeroed.
+		 */
+		return __microfs_read_blks(sb, mapping, rdreq,
+			__microfs_recycle_filedata_nominally,
+			__microfs_copy_filedata_stored,
+			rdreq->rr_dataoffset, rdreq->rr_datalength);
+	} else if (rdreq->rr_pgholes) {
 		/* It seems that one or more pages have been reclaimed, but
 		 * it is also possible that another thread is trying to read
 		 * the same data.
 		 */
-		err = __microfs_read_blks(sb, page->mapping, &rdreq,
+		return __microfs_read_blks(sb, mapping, rdreq,
 			__microfs_recycle_filedata_exceptionally,
 			__microfs_copy_filedata_exceptionally,
-			data_offset, data_length);
+			rdreq->rr_dataoffset, rdreq->rr_datalength);
 	} else {
 		/* It is possible to uncompress the file data directly into
 		 * the page cache. Neat.
 		 */
-		err = __microfs_read_blks(sb, page->mapping, &rdreq,
+		return __microfs_read_blks(sb, mapping, rdreq,
 			__microfs_recycle_filedata_nominally,
 			__microfs_copy_filedata_nominally,
-			data_offset, data_length);
+			rdreq->rr_dataoffset, rdreq->rr_datalength);
 	}
-	if (unlikely(err)) {
-		pr_err("__microfs_readpage: __microfs_read_blks failed\n");
-		goto err_io;
+}
+
+static int __microfs_fill_pages(struct super_block* sb,
+	struct address_space* mapping, struct microfs_readpage_request* rdreq)
+{
+	int err = 0;
+	
+	if (rdreq->rr_blks)
+		err = __microfs_fill_blocks(sb, mapping, rdreq);
+	
+	if (!err && rdreq->rr_fraglength) {
+		/* The tail must be copied after the blocks, since filling
+		 * the pages from the blocks zeroes whatever follows them.
+		 * The fragment block is most likely already cached if the
+		 * files sharing it are read together.
+		 */
+		err = __microfs_read_blks(sb, mapping, rdreq,
+			__microfs_recycle_fragment,
+			__microfs_copy_fragment,
+			rdreq->rr_fragdataoffset, rdreq->rr_fragdatalength);
 	}
 	
-	for (i = 0; i < rdreq.rr_npages; ++i) {
-		if (rdreq.rr_pages[i]) {
-			flush_dcache_page(rdreq.rr_pages[i]);
-			SetPageUptodate(rdreq.rr_pages[i]);
-			unlock_page(rdreq.rr_pages[i]);
-			if (rdreq.rr_pages[i] != page)
-				put_page(rdreq.rr_pages[i]);
-		}
+	return err;
+}
+
+/* Fill the given page with the data stored inline in the dentry
+ * of %inode, see %MICROFS_FLAG_INLINEDATA. The data is copied
+ * straight from the metadata.
+ */
+static int __microfs_readpage_inline(struct inode* inode, struct page* page)
+{
+	void* buf_data;
+	void* page_data;
+	
+	struct microfs_metadata_ref ref;
+	
+	__u32 i_size = i_size_read(inode);
+	
+	pr_devel_once("__microfs_readpage_inline: first call\n");
+	
+	buf_data = __microfs_get_metadata(inode->i_sb, microfs_get_offset(inode),
+		i_size, &ref);
+	if (unlikely(IS_ERR(buf_data))) {
+		pr_err("__microfs_readpage_inline: failed to read the inline data"
+			" for ino %lu\n", inode->i_ino);
+		SetPageError(page);
+		unlock_page(page);
+		return PTR_ERR(buf_data);
 	}
 	
-	kfree(rdreq.rr_pages);
+	page_data = kmap(page);
+	memcpy(page_data, buf_data, i_size);
+	memset(page_data + i_size, 0, PAGE_SIZE - i_size);
+	kunmap(page);
+	
+	__microfs_put_metadata(&ref);
+	
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
 	
 	return 0;
+}
+
+int __microfs_readpage(struct file* file, struct page* page)
+{
+	struct inode* inode = page->mapping->host;
+	struct super_block* sb = inode->i_sb;
 	
-err_io:
-	pr_spam("__microfs_readpage: failure\n");
-	for (i = 0; i < rdreq.rr_npages; ++i) {
-		if (rdreq.rr_pages[i]) {
-			flush_dcache_page(rdreq.rr_pages[i]);
-			SetPageError(rdreq.rr_pages[i]);
-			unlock_page(rdreq.rr_pages[i]);
-			if (rdreq.rr_pages[i] != page)
-				put_page(rdreq.rr_pages[i]);
-		}
+	struct microfs_readpage_request rdreq;
+	
+	int err = 0;
+	
+	__u32* blkptrs;
+	
+	(void)file;
+	
+	if (microfs_get_inlinesz(inode))
+		return __microfs_readpage_inline(inode, page);
+	
+	blkptrs = __microfs_load_blkptrs(sb, inode);
+	
+	err = __microfs_locate_pages(sb, inode, blkptrs, page->index, &rdreq);
+	if (unlikely(err))
+		goto err_find_block;
+	
+	rdreq.rr_pages = kmalloc(rdreq.rr_npages * sizeof(void*), GFP_KERNEL);
+	if (!rdreq.rr_pages) {
+		pr_err("__microfs_readpage: failed to allocate rdreq.rr_pages (%u slots)\n",
+			rdreq.rr_npages);
+		err = -ENOMEM;
+		goto err_mem;
+	}
+	
+	pr_spam("__microfs_readpage: rdreq.rr_pages=0x%p, rdreq.rr_npages=%u\n",
+		rdreq.rr_pages, rdreq.rr_npages);
+	
+	__microfs_grab_pages(page->mapping, &rdreq, &page, 1);
+	
+	rdreq.rr_err = __microfs_fill_pages(sb, page->mapping, &rdreq);
+	if (unlikely(rdreq.rr_err)) {
+		pr_err("__microfs_readpage: __microfs_read_blks failed\n");
+		err = rdreq.rr_err;
 	}
+	
+	__microfs_release_pages(&rdreq, page);
 	kfree(rdreq.rr_pages);
+	
+	return err;
+	
 err_mem:
-	/* Fall-trough. */
 err_find_block:
+	SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+static int __microfs_pageindexcmp(const void* a, const void* b)
+{
+	const struct page* const pa = *(const struct page* const*)a;
+	const struct page* const pb = *(const struct page* const*)b;
+	
+	if (pa->index < pb->index)
+		return -1;
+	return pa->index > pb->index;
+}
+
+int __microfs_readpages(struct file* file, struct address_space* mapping,
+	struct list_head* pages, unsigned nr_pages)
+{
+	struct inode* inode = mapping->host;
+	struct super_block* sb = inode->i_sb;
+	
+	int err = 0;
+	
+	__u32 i;
+	__u32 j;
+	__u32 k;
+	__u32 l;
+	__u32 npages = 0;
+	__u32 nslots = 0;
+	__u32 nreqs = 0;
+	
+	pgoff_t max_index = i_blks(i_size_read(inode), PAGE_SIZE);
+	
+	__u32* blkptrs;
+	
+	struct page** rapages;
+	struct page** slots;
+	struct microfs_readpage_request* rdreqs;
+	struct microfs_readpages_request rpreq;
+	
+	(void)file;
+	
+	pr_devel_once("__microfs_readpages: first call\n");
+	
+	rapages = kmalloc(nr_pages * sizeof(void*), GFP_KERNEL);
+	rdreqs = kmalloc(nr_pages * sizeof(*rdreqs), GFP_KERNEL);
+	if (!rapages || !rdreqs) {
+		pr_err("__microfs_readpages: failed to allocate the requests"
+			" (%u pages)\n", nr_pages);
+		err = -ENOMEM;
+		goto err_mem;
+	}
+	
+	/* Pages that are not taken off the list will be released
+	 * by the caller.
+	 */
+	for (i = 0; i < nr_pages; ++i) {
+		struct page* page = list_entry(pages->prev, struct page, lru);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+				readahead_gfp_mask(mapping))) {
+			put_page(page);
+			continue;
+		}
+		if (unlikely(page->index >= max_index)) {
+			zero_user(page, 0, PAGE_SIZE);
+			SetPageUptodate(page);
+			unlock_page(page);
+			put_page(page);
+			continue;
+		}
+		rapages[npages++] = page;
+	}
+	
+	/* The data of an inlined file fits in its first page.
+	 */
+	if (microfs_get_inlinesz(inode)) {
+		for (i = 0; i < npages; ++i) {
+			__microfs_readpage_inline(inode, rapages[i]);
+			put_page(rapages[i]);
+		}
+		goto err_mem;
+	}
+	
+	sort(rapages, npages, sizeof(*rapages), __microfs_pageindexcmp, NULL);
+	
+	pr_spam("__microfs_readpages: nr_pages=%u, npages=%u\n", nr_pages, npages);
+	
+	/* Work out the block data extents for the entire window
+	 * before any I/O is done.
+	 */
+	blkptrs = __microfs_load_blkptrs(sb, inode);
+	for (i = 0; i < npages; i = j) {
+		err = __microfs_locate_pages(sb, inode, blkptrs,
+			rapages[i]->index, &rdreqs[nreqs]);
+		if (unlikely(err))
+			break;
+		for (j = i + 1; j < npages && rapages[j]->index <
+			rdreqs[nreqs].rr_index + rdreqs[nreqs].rr_npages; ++j)
+			;
+		nslots += rdreqs[nreqs++].rr_npages;
+	}
+	
+	slots = kmalloc(nslots * sizeof(void*), GFP_KERNEL);
+	if (!slots) {
+		pr_err("__microfs_readpages: failed to allocate slots (%u slots)\n", nslots);
+		err = -ENOMEM;
+		nreqs = 0;
+	}
+	
+	for (i = 0, j = 0, k = 0, nslots = 0; k < nreqs; ++k, i = j) {
+		rdreqs[k].rr_pages = slots + nslots;
+		nslots += rdreqs[k].rr_npages;
+		for (j = i; j < npages && rapages[j]->index <
+			rdreqs[k].rr_index + rdreqs[k].rr_npages; ++j)
+			;
+		__microfs_grab_pages(mapping, &rdreqs[k], rapages + i, j - i);
+	}
+	
+	/* Pages which did not get a request (because of an error)
+	 * are left for %__microfs_readpage().
+	 */
+	for (; i < npages; ++i) {
+		unlock_page(rapages[i]);
+		put_page(rapages[i]);
+	}
+	
+	/* Requests which block data is stored back to back in the
+	 * image are read with a single call to %__microfs_read_blks().
+	 * Requests which could not get all their pages (or which hold
+	 * the tail of the file or a hole, or which block data is not
+	 * back to back) must take their own path, one by one.
+	 */
+	for (k = 0; k < nreqs; k = l) {
+		__u32 length = rdreqs[k].rr_datalength;
+		
+		if (rdreqs[k].rr_pgholes || rdreqs[k].rr_fraglength
+				|| rdreqs[k].rr_zeroblks || rdreqs[k].rr_gaps) {
+			rdreqs[k].rr_err = __microfs_fill_pages(sb, mapping, &rdreqs[k]);
+			l = k + 1;
+			continue;
+		}
+		
+		for (l = k + 1; l < nreqs && !rdreqs[l].rr_pgholes &&
+				!rdreqs[l].rr_fraglength && !rdreqs[l].rr_zeroblks &&
+				!rdreqs[l].rr_gaps &&
+				rdreqs[l].rr_dataoffset == rdreqs[k].rr_dataoffset + length; ++l)
+			length += rdreqs[l].rr_datalength;
+		
+		rpreq.rp_reqs = rdreqs + k;
+		rpreq.rp_nreqs = l - k;
+		
+		err = __microfs_read_blks_progressively(sb, mapping, &rpreq,
+			__microfs_recycle_filedata_nominally,
+			__microfs_copy_filedata_batch,
+			rdreqs[k].rr_dataoffset, length);
+		if (unlikely(err)) {
+			pr_err("__microfs_readpages: __microfs_read_blks failed\n");
+			for (i = k; i < l; ++i) {
+				if (!rdreqs[i].rr_err)
+					rdreqs[i].rr_err = err;
+			}
+		}
+	}
+	
+	for (k = 0; k < nreqs; ++k)
+		__microfs_release_pages(&rdreqs[k], NULL);
+	
+	kfree(slots);
+	
+err_mem:
+	kfree(rdreqs);
+	kfree(rapages);
 	return err;
 }
 
@@ -23,6 +23,8 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 
 MODULE_DESCRIPTION("microfs - Minimally Improved Compressed Read Only File System");
 MODULE_LICENSE("GPL");
@@ -50,9 +52,16 @@ int __debug_insid(void)
 
 static const struct super_operations microfs_s_ops;
 
+static struct kmem_cache* microfs_inode_cachep;
+
 enum {
 	Opt_metadata_blkptrbufsz,
 	Opt_metadata_dentrybufsz,
+	Opt_blkptr_cachesz,
+	Opt_filedata_cachesz,
+	Opt_dirindex_threshold,
+	Opt_dirindex_cachesz,
+	Opt_metadata_preload,
 	Opt_decompressor_data_acquirer,
 	Opt_decompressor_data_creator,
 	Opt_debug_mountid,
@@ -62,6 +71,11 @@ enum {
 static const match_table_t microfs_tokens = {
 	{ Opt_metadata_blkptrbufsz, "metadata_blkptrbufsz=%u" },
 	{ Opt_metadata_dentrybufsz, "metadata_dentrybufsz=%u" },
+	{ Opt_blkptr_cachesz, "blkptr_cachesz=%u" },
+	{ Opt_filedata_cachesz, "filedata_cachesz=%u" },
+	{ Opt_dirindex_threshold, "dirindex_threshold=%u" },
+	{ Opt_dirindex_cachesz, "dirindex_cachesz=%u" },
+	{ Opt_metadata_preload, "metadata_preload" },
 	{ Opt_decompressor_data_acquirer, "decompressor_data_acquirer=%s" },
 	{ Opt_decompressor_data_creator, "decompressor_data_creator=%s" },
 	{ Opt_debug_mountid, "debug_mountid=%u" },
@@ -69,28 +83,16 @@ static const match_table_t microfs_tokens = {
 };
 
 struct microfs_mount_options {
-	__u64 mo_metadata_blkptrbufsz;
-	__u64 mo_metadata_dentrybufsz;
+	__u64 mo_blkptr_cachesz;
+	__u64 mo_filedata_cachesz;
+	__u32 mo_dirindex_threshold;
+	__u64 mo_dirindex_cachesz;
+	int mo_metadata_preload;
 	microfs_decompressor_data_creator mo_decompressor_data_creator;
 	microfs_decompressor_data_acquirer mo_decompressor_data_acquirer;
 	int mo_debug_cksig;
 };
 
-static __u64 select_bufsz(const char* const name, int requested,
-	const __u64 minimum)
-{
-	if (requested <= minimum) {
-		pr_warn("%s=%d, it must be larger than %llu to be usable\n",
-			name, requested, minimum);
-		return minimum;
-	}
-	if (requested % PAGE_SIZE != 0) {
-		pr_warn("%s=%d, but it must be a multiple of %u\n",
-			name, requested, (__u32)PAGE_SIZE);
-	}
-	return sz_blkceil(requested, PAGE_SIZE);
-}
-
 static int microfs_parse_options(char* options, struct microfs_sb_info* const sbi,
 	struct microfs_mount_options* const mount_opts)
 {
@@ -113,17 +115,37 @@ static int microfs_parse_options(char* options, struct microfs_sb_info* const sb
 		token = match_token(part, microfs_tokens, args);
 		switch (token) {
 			
-#define OPT_SZ(Name) \
-	case Opt_##Name: \
-		if (match_int(&args[0], &option)) \
-			return 0; \
-		mount_opts->mo_##Name = select_bufsz(#Name, \
-			option, mount_opts->mo_##Name); \
-		break
-			
-			OPT_SZ(metadata_blkptrbufsz);
-			OPT_SZ(metadata_dentrybufsz);
-			
+			case Opt_metadata_blkptrbufsz:
+			case Opt_metadata_dentrybufsz:
+				/* Accepted for compatibility only, metadata is used
+				 * in place in the block device page cache.
+				 */
+				if (match_int(&args[0], &option))
+					return 0;
+				break;
+			case Opt_blkptr_cachesz:
+				if (match_int(&args[0], &option) || option < 0)
+					return 0;
+				mount_opts->mo_blkptr_cachesz = option;
+				break;
+			case Opt_filedata_cachesz:
+				if (match_int(&args[0], &option) || option < 0)
+					return 0;
+				mount_opts->mo_filedata_cachesz = option;
+				break;
+			case Opt_dirindex_threshold:
+				if (match_int(&args[0], &option) || option < 0)
+					return 0;
+				mount_opts->mo_dirindex_threshold = option;
+				break;
+			case Opt_dirindex_cachesz:
+				if (match_int(&args[0], &option) || option < 0)
+					return 0;
+				mount_opts->mo_dirindex_cachesz = option;
+				break;
+			case Opt_metadata_preload:
+				mount_opts->mo_metadata_preload = 1;
+				break;
 			case Opt_decompressor_data_acquirer:
 				acquirer = match_strdup(&args[0]);
 				if (strcmp(acquirer, "private") == 0) {
@@ -167,34 +189,12 @@ static int microfs_parse_options(char* options, struct microfs_sb_info* const sb
 				break;
 			default:
 				return 0;
-			
-#undef OPT_SZ
-			
 		}
 	}
 	
 	return 1;
 }
 
-static int create_data_buffer(struct microfs_data_buffer* dbuf,
-	__u32 sz, const char* const name)
-{
-	dbuf->d_offset = MICROFS_MAXIMGSIZE - 1;
-	dbuf->d_size = sz;
-	dbuf->d_data = kmalloc(dbuf->d_size, GFP_KERNEL);
-	if (!dbuf->d_data) {
-		pr_err("could not allocate data buffer %s\n", name);
-		return -ENOMEM;
-	}
-	mutex_init(&dbuf->d_mutex);
-	return 0;
-}
-
-static void destroy_data_buffer(struct microfs_data_buffer* dbuf)
-{
-	kfree(dbuf->d_data);
-}
-
 static int microfs_fill_super(struct super_block* sb, void* data, int silent)
 {
 	int err = 0;
@@ -207,6 +207,7 @@ static int microfs_fill_super(struct super_block* sb, void* data, int silent)
 	__u32 sb_actual_root_offset;
 	__u32 sb_expected_root_offset;
 	__u32 sb_padding = 0;
+	__u32 sb_codecs_ddsz = 0;
 	
 	__u64 sb_blksz = 0;
 	
@@ -221,6 +222,7 @@ static int microfs_fill_super(struct super_block* sb, void* data, int silent)
 		goto err_sbi;
 	}
 	sb->s_fs_info = sbi;
+	sbi->si_sb = sb;
 	
 /* As far as I know, this should never happen, but check it
  * anyway, what I do not know could fill a mid-sized space
@@ -238,13 +240,11 @@ static int microfs_fill_super(struct super_block* sb, void* data, int silent)
 #warning "PAGE_SIZE greater than MICROFS_MAXBLKSZ is not supported"
 #endif
 	
-	/* The metadata buffers must span at least two PAGE_SIZE
-	 * sized VFS "blocks" so that poor data alignment does not
-	 * cause oob errors (data starting in one VFS block and ending
-	 * at the start of the adjoining block).
-	 */
-	mount_opts.mo_metadata_blkptrbufsz = PAGE_SIZE * 2;
-	mount_opts.mo_metadata_dentrybufsz = PAGE_SIZE * 2;
+	mount_opts.mo_blkptr_cachesz = PAGE_SIZE * 1024;
+	mount_opts.mo_filedata_cachesz = PAGE_SIZE * 256;
+	mount_opts.mo_dirindex_threshold = PAGE_SIZE;
+	mount_opts.mo_dirindex_cachesz = PAGE_SIZE * 256;
+	mount_opts.mo_metadata_preload = 0;
 	mount_opts.mo_decompressor_data_creator = microfs_decompressor_data_singleton_create;
 	mount_opts.mo_decompressor_data_acquirer = microfs_decompressor_data_manager_acquire_private;
 	mount_opts.mo_debug_cksig = 0;
@@ -322,9 +322,31 @@ sb_retry:
 	sbi->si_flags = __le32_to_cpu(msb->s_flags);
 	sbi->si_blocks = __le32_to_cpu(msb->s_blocks);
 	sbi->si_files = __le16_to_cpu(msb->s_files);
+	sbi->si_fragbase = 0;
 	sbi->si_ctime = __le32_to_cpu(msb->s_ctime);
 	sbi->si_blkshift = __le16_to_cpu(msb->s_blkshift);
 	sbi->si_blksz = 1 << sbi->si_blkshift;
+	sbi->si_blkptrcachesz = mount_opts.mo_blkptr_cachesz;
+	atomic64_set(&sbi->si_blkptrcacheused, 0);
+	sbi->si_dirindexthreshold = mount_opts.mo_dirindex_threshold;
+	sbi->si_dirindexcachesz = mount_opts.mo_dirindex_cachesz;
+	atomic64_set(&sbi->si_dirindexcacheused, 0);
+	
+	if (sbi->si_flags & MICROFS_FLAG_LARGEIMAGE) {
+		struct microfs_sb_large* lsb = (struct microfs_sb_large*)(
+			bh->b_data + sb_padding + sizeof(*msb));
+		sbi->si_size = __le64_to_cpu(lsb->sl_size);
+		sbi->si_blocks = __le64_to_cpu(lsb->sl_blocks);
+		sbi->si_files = __le32_to_cpu(lsb->sl_files);
+		sbi->si_fragbase = __le64_to_cpu(lsb->sl_fragbase);
+		if (sbi->si_size > MICROFS_MAXLARGEIMGSIZE
+				|| sbi->si_fragbase > sbi->si_size) {
+			pr_err("bad large image size 0x%llx (fragment base 0x%llx)\n",
+				sbi->si_size, sbi->si_fragbase);
+			err = -EINVAL;
+			goto err_sb;
+		}
+	}
 	
 	msb->s_root.i_mode = __cpu_to_le16(
 		__le16_to_cpu(msb->s_root.i_mode) | (
@@ -350,31 +372,41 @@ sb_retry:
 		goto err_sb;
 	}
 	
-	/* The filedata buffer must be big enough to fit either an
-	 * entire block or a whole page, depending on the used block
+	/* Each filedata cache entry must be big enough to fit either
+	 * an entire block or a whole page, depending on the used block
 	 * size.
 	 */
-	if ((err = create_data_buffer(&sbi->si_filedatabuf,
-			max_t(__u32, sbi->si_blksz, PAGE_SIZE), "sbi->si_filedatabuf")) < 0)
-		goto err_filedatabuf;
-	
-	if ((err = create_data_buffer(&sbi->si_metadata_blkptrbuf,
-			mount_opts.mo_metadata_blkptrbufsz, "sbi->si_metadata_blkptrbuf")) < 0)
-		goto err_metadata_blkptrbuf;
-	if ((err = create_data_buffer(&sbi->si_metadata_dentrybuf,
-			mount_opts.mo_metadata_dentrybufsz, "sbi->si_metadata_dentrybuf")) < 0)
-		goto err_metadata_dentrybuf;
-	
-	err = microfs_decompressor_init(sbi, bh->b_data + sb_padding + sizeof(*msb),
+	if ((err = microfs_filedata_cache_create(&sbi->si_filedatacache,
+			mount_opts.mo_filedata_cachesz,
+			max_t(__u32, sbi->si_blksz, PAGE_SIZE))) < 0)
+		goto err_filedatacache;
+	
+	err = microfs_decompressor_init(sbi, bh->b_data + sb_padding + sizeof(*msb)
+			+ sb_largesz(sbi->si_flags),
 		mount_opts.mo_decompressor_data_acquirer, mount_opts.mo_decompressor_data_creator);
 	if (err < 0) {
 		pr_err("failed to init the decompressor\n");
 		goto err_decompressor_init;
 	}
 	
+	if (sbi->si_flags & MICROFS_FLAG_MIXEDCODECS) {
+		err = microfs_decompressor_init_codecs(sbi, bh->b_data + sb_padding
+				+ sizeof(*msb) + sb_largesz(sbi->si_flags)
+				+ libinfo_ddsz(sbi->si_decompressor->dc_info, sbi->si_flags),
+			((__u32)__le16_to_cpu(msb->s_codecs) << 8)
+				& ~(sbi->si_flags & MICROFS_FLAG_MASK_DECOMPRESSOR),
+			&sb_codecs_ddsz, mount_opts.mo_decompressor_data_acquirer,
+			mount_opts.mo_decompressor_data_creator);
+		if (err < 0) {
+			pr_err("failed to init the decompressors of the image\n");
+			goto err_decompressor_init;
+		}
+	}
+	
 	sb_actual_root_offset = __le32_to_cpu(msb->s_root.i_offset);
 	sb_expected_root_offset = sb_padding + sizeof(*msb)
-		+ sbi->si_decompressor->dc_info->li_dd_sz;
+		+ sb_largesz(sbi->si_flags)
+		+ libinfo_ddsz(sbi->si_decompressor->dc_info, sbi->si_flags) + sb_codecs_ddsz;
 	
 	if (sb_actual_root_offset == 0) {
 		pr_info("this image is empty\n");
@@ -385,6 +417,12 @@ sb_retry:
 		goto err_root_offset;
 	}
 	
+	if (mount_opts.mo_metadata_preload) {
+		err = __microfs_preload_metadata(sb, &msb->s_root);
+		if (err < 0)
+			goto err_preload;
+	}
+	
 	msb = NULL;
 	brelse(bh);
 	bh = NULL;
@@ -393,17 +431,15 @@ sb_retry:
 	
 	return 0;
 	
+err_preload:
 err_root_offset:
 	/* Fall-through. */
+	microfs_decompressor_exit_codecs(sbi);
 err_decompressor_init:
 	if (sbi->si_decompressor_data && sbi->si_decompressor_data->dd_release)
 		sbi->si_decompressor_data->dd_release(sbi);
-err_metadata_dentrybuf:
-	destroy_data_buffer(&sbi->si_metadata_dentrybuf);
-err_metadata_blkptrbuf:
-	destroy_data_buffer(&sbi->si_metadata_blkptrbuf);
-err_filedatabuf:
-	destroy_data_buffer(&sbi->si_filedatabuf);
+err_filedatacache:
+	microfs_filedata_cache_destroy(&sbi->si_filedatacache);
 err_sb:
 	msb = NULL;
 	brelse(bh);
@@ -433,9 +469,10 @@ static void microfs_put_super(struct super_block* sb)
 {
 	struct microfs_sb_info* sbi = MICROFS_SB(sb);
 	
-	destroy_data_buffer(&sbi->si_filedatabuf);
-	destroy_data_buffer(&sbi->si_metadata_blkptrbuf);
-	destroy_data_buffer(&sbi->si_metadata_dentrybuf);
+	microfs_filedata_cache_destroy(&sbi->si_filedatacache);
+	__microfs_unload_metadata(sb);
+	
+	microfs_decompressor_exit_codecs(sbi);
 	
 	if (sbi->si_decompressor_data)
 		sbi->si_decompressor_data->dd_release(sbi);
@@ -449,6 +486,60 @@ static void microfs_put_super(struct super_block* sb)
 	pr_devel("resources released for super block 0x%p\n", sb);
 }
 
+static struct inode* microfs_alloc_inode(struct super_block* sb)
+{
+	struct microfs_inode_info* ii;
+	
+	(void)sb;
+	
+	ii = kmem_cache_alloc(microfs_inode_cachep, GFP_KERNEL);
+	if (!ii)
+		return NULL;
+	
+	ii->ii_blkptrs = NULL;
+	ii->ii_blkptrssz = 0;
+	ii->ii_dirindex = NULL;
+	ii->ii_dirindexsz = 0;
+	ii->ii_codec = NULL;
+	ii->ii_blkshift = 0;
+	ii->ii_blksz = 0;
+	ii->ii_frameshift = 0;
+	ii->ii_framesz = 0;
+	ii->ii_lenbits = 0;
+	ii->ii_database = 0;
+	
+	return &ii->ii_vfs_inode;
+}
+
+static void microfs_free_inode(struct rcu_head* head)
+{
+	struct inode* inode = container_of(head, struct inode, i_rcu);
+	if (S_ISLNK(inode->i_mode))
+		kfree(inode->i_link);
+	kmem_cache_free(microfs_inode_cachep, MICROFS_I(inode));
+}
+
+static void microfs_destroy_inode(struct inode* inode)
+{
+	call_rcu(&inode->i_rcu, microfs_free_inode);
+}
+
+static void microfs_evict_inode(struct inode* inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	__microfs_unload_blkptrs(inode->i_sb, inode);
+	__microfs_unload_dirindex(inode->i_sb, inode);
+}
+
+static void microfs_init_inode_once(void* data)
+{
+	struct microfs_inode_info* ii = data;
+	
+	mutex_init(&ii->ii_mutex);
+	inode_init_once(&ii->ii_vfs_inode);
+}
+
 static int microfs_statfs(struct dentry* dentry, struct kstatfs* buf)
 {
 	struct super_block* sb = dentry->d_sb;
@@ -471,6 +562,21 @@ static int microfs_statfs(struct dentry* dentry, struct kstatfs* buf)
 	return 0;
 }
 
+static int microfs_show_stats(struct seq_file* m, struct dentry* root)
+{
+	struct microfs_sb_info* sbi = MICROFS_SB(root->d_sb);
+	
+	seq_printf(m, " filedata_cache: entries=%u entrysz=%u hits=%lld misses=%lld",
+		sbi->si_filedatacache.fc_nentries,
+		sbi->si_filedatacache.fc_entrysz,
+		atomic64_read(&sbi->si_filedatacache.fc_hits),
+		atomic64_read(&sbi->si_filedatacache.fc_misses));
+	seq_printf(m, " dirindex_cache: used=%lld",
+		atomic64_read(&sbi->si_dirindexcacheused));
+	
+	return 0;
+}
+
 static struct file_system_type microfs_fs_type = {
 	.owner = THIS_MODULE,
 	.name = "microfs",
@@ -480,9 +586,13 @@ static struct file_system_type microfs_fs_type = {
 };
 
 static const struct super_operations microfs_s_ops = {
+	.alloc_inode = microfs_alloc_inode,
+	.destroy_inode = microfs_destroy_inode,
+	.evict_inode = microfs_evict_inode,
 	.put_super = microfs_put_super,
 	.remount_fs = microfs_remount_fs,
 	.statfs = microfs_statfs,
+	.show_stats = microfs_show_stats,
 };
 
 static int __init microfs_init(void)
@@ -497,7 +607,20 @@ static int __init microfs_init(void)
 		" or FITNESS FOR A PARTICULAR PURPOSE. See the GNU"
 		" General Public License for more details.\n");
 	
+	microfs_inode_cachep = kmem_cache_create("microfs_inode_cache",
+		sizeof(struct microfs_inode_info), 0,
+		SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+		microfs_init_inode_once);
+	if (!microfs_inode_cachep) {
+		pr_err("failed to create the inode cache\n");
+		return -ENOMEM;
+	}
+	
 	err = register_filesystem(&microfs_fs_type);
+	if (err) {
+		kmem_cache_destroy(microfs_inode_cachep);
+		return err;
+	}
 	microfs_decompressor_data_manager_init();
 	
 	return err;
@@ -507,6 +630,11 @@ static void __exit microfs_exit(void)
 {
 	microfs_decompressor_data_manager_exit();
 	unregister_filesystem(&microfs_fs_type);
+	/* Make sure that all inodes have been freed before the
+	 * inode cache is destroyed.
+	 */
+	rcu_barrier();
+	kmem_cache_destroy(microfs_inode_cachep);
 	if (__debug_insid())
 		pr_info("[insid=%d] microfs_exit\n", __debug_insid());
 } module_exit(microfs_exit);
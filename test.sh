@@ -237,11 +237,21 @@ test_statfs=(
 	"\"${conf_insid}\""
 )
 test_statfs="statfs.sh ${test_statfs[@]}"
+test_fragtail=(
+	"\"${temp_dir}\""
+)
+test_fragtail="fragtail.sh ${test_fragtail[@]}"
+test_zstddict=(
+	"\"${temp_dir}\""
+)
+test_zstddict="zstddict.sh ${test_zstddict[@]}"
 
 spec_tests=(
 	"${test_debug_cksig}"
 	"${test_decompressor_data_manager}"
 	"${test_statfs}"
+	"${test_fragtail}"
+	"${test_zstddict}"
 )
 
 for spec_test in "${spec_tests[@]}" ; do
@@ -266,10 +276,45 @@ for compression_option in "${compression_options[@]}" ; do
 	readarray -t blksz_options \
 		< "${temp_file}"
 	
-	blksz_options=("${blksz_options[@]/#/-b }")
-	all_options=("${all_options[@]}" "${blksz_options[@]/#/-v -c ${compression_option} }")
+	# The smallest block size the library can be mounted with
+	# bounds the sub-frames and the block size rules, and the
+	# first other library (if any) is used for a library rule.
+	min_blksz="${blksz_options[0]}"
+	other_option=""
+	other_min_blksz=""
+	for lib_option in "${compression_options[@]}" ; do
+		if [[ "${lib_option}" != "${compression_option}" ]] ; then
+			other_option="${lib_option}"
+			other_min_blksz=`"${script_dir}/microfslib" -c ${lib_option} -t \
+				| head -n 1`
+			break
+		fi
+	done
+	
+	for blksz_option in "${blksz_options[@]}" ; do
+		framesz=$((blksz_option / 8))
+		if [[ ${framesz} -lt ${min_blksz} ]] ; then
+			framesz=${min_blksz}
+		fi
+		base_options="-v -c ${compression_option} -b ${blksz_option}"
+		all_options+=(
+			"${base_options}"
+			"${base_options} -i -f -I -z -k -x"
+			"${base_options} -r -F ${framesz}"
+			"${base_options} -L -B ${min_blksz}:'*[a-m]'"
+		)
+		if [[ "${other_option}" != "" && \
+				${blksz_option} -ge ${other_min_blksz} ]] ; then
+			all_options+=("${base_options} -m ${other_option}:'*[a-m]'")
+		fi
+		unset base_options
+		unset framesz
+	done
 	
 	unset blksz_options
+	unset other_min_blksz
+	unset other_option
+	unset min_blksz
 	unset temp_file
 done
 
@@ -214,6 +214,35 @@ START_TEST(test_hostprog_path)
 	ck_assert(hostprog_path_dotdir("..dotdot") == 0);
 END_TEST
 
+START_TEST(test_hostprog_iszero)
+	char buf[200];
+	memset(buf, 0, sizeof(buf));
+	
+	ck_assert(hostprog_iszero(buf, 0) == 1);
+	ck_assert(hostprog_iszero(buf, sizeof(buf)) == 1);
+	
+	buf[199] = 1;
+	ck_assert(hostprog_iszero(buf, sizeof(buf)) == 0);
+	ck_assert(hostprog_iszero(buf, 199) == 1);
+	
+	buf[70] = 1;
+	ck_assert(hostprog_iszero(buf, 199) == 0);
+	ck_assert(hostprog_iszero(buf + 71, 128) == 1);
+END_TEST
+
+START_TEST(test_hostprog_hash)
+	const char* data = "microfs duplicates";
+	const size_t sz = strlen(data);
+	
+	ck_assert(hostprog_hash(HOSTPROG_HASH_INIT, data, 0) == HOSTPROG_HASH_INIT);
+	ck_assert(hostprog_hash(HOSTPROG_HASH_INIT, "a", 1) == 0xaf63dc4c8601ec8cULL);
+	
+	__u64 hash = hostprog_hash(HOSTPROG_HASH_INIT, data, 7);
+	hash = hostprog_hash(hash, data + 7, sz - 7);
+	ck_assert(hash == hostprog_hash(HOSTPROG_HASH_INIT, data, sz));
+	ck_assert(hash != hostprog_hash(HOSTPROG_HASH_INIT, data, sz - 1));
+END_TEST
+
 Suite* create_hostprogs_suite(void)
 {
 	Suite* s;
@@ -226,6 +255,8 @@ Suite* create_hostprogs_suite(void)
 	
 	tcase_add_test(tc, test_hostprog_stack);
 	tcase_add_test(tc, test_hostprog_path);
+	tcase_add_test(tc, test_hostprog_iszero);
+	tcase_add_test(tc, test_hostprog_hash);
 	
 	return s;
 }
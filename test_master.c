@@ -35,8 +35,15 @@ END_TEST
 START_TEST(test_packed_structs)
 	_ck_assert_int(sizeof(struct microfs_inode), ==, 15);
 	_ck_assert_int(sizeof(struct microfs_sb), ==, 77);
+	_ck_assert_int(sizeof(struct microfs_sb_large), ==, 32);
 	
 	_ck_assert_int(sizeof(struct microfs_dd_xz), ==, 8);
+	_ck_assert_int(sizeof(struct microfs_dd_zstd), ==, 24);
+	
+	_ck_assert_int(sizeof(struct microfs_dirindex), ==, 8);
+	_ck_assert_int(sizeof(struct microfs_dirindex_entry), ==, 8);
+	
+	_ck_assert_int(sizeof(struct microfs_fragment), ==, 8);
 END_TEST
 
 START_TEST(test_i_xsize)
@@ -69,6 +76,102 @@ START_TEST(test_i_blks)
 	_ck_assert_int(i_blks(8192, 512), ==, 16);
 END_TEST
 
+START_TEST(test_i_blksz)
+	_ck_assert_int(i_blksz(8, 0, 512), ==, 8);
+	_ck_assert_int(i_blksz(512, 0, 512), ==, 512);
+	_ck_assert_int(i_blksz(768, 0, 512), ==, 512);
+	_ck_assert_int(i_blksz(768, 1, 512), ==, 256);
+	_ck_assert_int(i_blksz(8192, 15, 512), ==, 512);
+END_TEST
+
+START_TEST(test_i_fragments)
+	_ck_assert_int(i_ptrblks(768, 512, 0), ==, 2);
+	_ck_assert_int(i_ptrblks(768, 512, 1), ==, 1);
+	_ck_assert_int(i_ptrblks(100, 512, 1), ==, 0);
+	_ck_assert_int(i_fragtail(768, 512, 0), ==, 0);
+	_ck_assert_int(i_fragtail(768, 512, 1), ==, 256);
+	_ck_assert_int(i_fragtail(1024, 512, 1), ==, 0);
+	_ck_assert_int(i_blkptrsz(768, 512, 0, 0, 0), ==, 12);
+	_ck_assert_int(i_blkptrsz(768, 512, 1, 0, 0), ==, 16);
+	_ck_assert_int(i_blkptrsz(100, 512, 1, 0, 0), ==, 8);
+	_ck_assert_int(i_blkptrsz(1024, 512, 1, 0, 0), ==, 12);
+	_ck_assert_int(i_blkptrsz(768, 512, 1, 4, 0), ==, 20);
+	_ck_assert_int(i_blkptrsz(100, 512, 1, 4, 0), ==, 12);
+	_ck_assert_int(i_blkptrsz(768, 256, 1, 4, 0), ==, 20);
+END_TEST
+
+START_TEST(test_i_packedptrs)
+	_ck_assert_int(i_packedptrsz(32, 13), ==, 56);
+	_ck_assert_int(i_packedptrsz(33, 13), ==, 64);
+	_ck_assert_int(i_blkptrsz(40 * 4096, 4096, 0, 4, 13), ==, 80);
+	_ck_assert_int(i_blkptrsz(40 * 4096 + 100, 4096, 1, 4, 13), ==, 88);
+	{
+		const __u8 lens[] = { 0xab, 0xcd, 0xef, 0x00 };
+		_ck_assert_int(i_packedlen(lens, 0, 12), ==, 0xdab);
+		_ck_assert_int(i_packedlen(lens, 1, 12), ==, 0xefc);
+		_ck_assert_int(i_packedlen(lens, 3, 4), ==, 0xc);
+	}
+END_TEST
+
+START_TEST(test_i_blkextents)
+	_ck_assert_int(i_blkptrsz(768, 512, 0, 4, MICROFS_FILEINFO_EXTENTS), ==, 20);
+	_ck_assert_int(i_blkptrsz(768, 512, 1, 4, MICROFS_FILEINFO_EXTENTS), ==, 20);
+	_ck_assert_int(i_blkptrsz(100, 512, 1, 4, MICROFS_FILEINFO_EXTENTS), ==, 12);
+	_ck_assert_int(i_blkptrsz(40 * 4096, 4096, 0, 12, MICROFS_FILEINFO_EXTENTS), ==, 332);
+END_TEST
+
+START_TEST(test_i_hasfileinfo)
+	ck_assert(!i_hasfileinfo(0));
+	ck_assert(!i_hasfileinfo(MICROFS_FLAG_FRAGMENTS));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_MIXEDCODECS));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_FILEBLKSZ));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_SUBFRAMES));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_PACKEDBLKPTRS));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_LARGEIMAGE));
+	ck_assert(i_hasfileinfo(MICROFS_FLAG_SHAREDBLKS));
+	_ck_assert_int(i_fileinfosz(0), ==, 0);
+	_ck_assert_int(i_fileinfosz(MICROFS_FLAG_FILEBLKSZ), ==, 4);
+	_ck_assert_int(i_fileinfosz(MICROFS_FLAG_LARGEIMAGE), ==, 12);
+	_ck_assert_int(i_blkptrsz(768, 512, 1, i_fileinfosz(MICROFS_FLAG_LARGEIMAGE), 0), ==, 28);
+	_ck_assert_int(sb_largesz(0), ==, 0);
+	_ck_assert_int(sb_largesz(MICROFS_FLAG_LARGEIMAGE), ==, 32);
+END_TEST
+
+START_TEST(test_i_frameidxsz)
+	_ck_assert_int(i_frameidxsz(131072, 32768), ==, 12);
+	_ck_assert_int(i_frameidxsz(100000, 32768), ==, 12);
+	_ck_assert_int(i_frameidxsz(32768, 32768), ==, 0);
+	_ck_assert_int(i_frameidxsz(1000, 32768), ==, 0);
+END_TEST
+
+START_TEST(test_microfs_codecidx)
+	_ck_assert_int(microfs_codecidx(MICROFS_FLAG_DECOMPRESSOR_ZLIB), ==, 0);
+	_ck_assert_int(microfs_codecidx(MICROFS_FLAG_DECOMPRESSOR_LZ4), ==, 1);
+	_ck_assert_int(microfs_codecidx(MICROFS_FLAG_DECOMPRESSOR_ZSTD), ==, 4);
+	_ck_assert_int(microfs_codecidx(0), ==, -1);
+	_ck_assert_int(microfs_codecidx(MICROFS_FLAG_DECOMPRESSOR_ZLIB
+		| MICROFS_FLAG_DECOMPRESSOR_LZ4), ==, -1);
+END_TEST
+
+START_TEST(test_i_inlinedata)
+	struct microfs_inode ino;
+	memset(&ino, 0, sizeof(ino));
+	
+	_ck_assert_int(i_inlinesz(0, S_IFREG, 100), ==, 0);
+	_ck_assert_int(i_inlinesz(MICROFS_FLAG_INLINEDATA, S_IFREG, 100), ==, 100);
+	_ck_assert_int(i_inlinesz(MICROFS_FLAG_INLINEDATA, S_IFLNK, 7), ==, 7);
+	_ck_assert_int(i_inlinesz(MICROFS_FLAG_INLINEDATA, S_IFDIR, 7), ==, 0);
+	_ck_assert_int(i_inlinesz(MICROFS_FLAG_INLINEDATA, S_IFREG,
+		MICROFS_MAXINLINESZ + 1), ==, 0);
+	
+	ino.i_mode = __cpu_to_le16(S_IFREG);
+	ino.i_namelen = 3;
+	i_setsize(&ino, 42);
+	_ck_assert_int(i_dentrysz(&ino, 0), ==, sizeof(ino) + 3);
+	_ck_assert_int(i_dentrysz(&ino, MICROFS_FLAG_INLINEDATA), ==,
+		sizeof(ino) + 3 + 42);
+END_TEST
+
 START_TEST(test_sz_blkceil)
 	_ck_assert_int(sz_blkceil(42, 2048), ==, 2048);
 	_ck_assert_int(sz_blkceil(3784, 4096), ==, 4096);
@@ -80,6 +183,28 @@ START_TEST(test_sz_blkceil)
 	_ck_assert_int(sz_blkceil(32768, 32768), ==, 32768);
 END_TEST
 
+START_TEST(test_microfs_namehash)
+	_ck_assert_int(microfs_namehash("", 0), ==, 0x811c9dc5);
+	_ck_assert_int(microfs_namehash("a", 1), ==, 0xe40c292c);
+	_ck_assert_int(microfs_namehash("foobar", 6), ==, 0xbf9cf968);
+	_ck_assert_int(microfs_namehash("foobar", 3), ==,
+		microfs_namehash("foo", 3));
+END_TEST
+
+START_TEST(test_microfs_dirindex)
+	_ck_assert_int(microfs_dirindex_buckets(1), ==, 1);
+	_ck_assert_int(microfs_dirindex_buckets(2), ==, 2);
+	_ck_assert_int(microfs_dirindex_buckets(3), ==, 4);
+	_ck_assert_int(microfs_dirindex_buckets(300), ==, 512);
+	
+	_ck_assert_int(microfs_dirindex_offset(100, 16), ==, 116);
+	_ck_assert_int(microfs_dirindex_offset(100, 17), ==, 120);
+	_ck_assert_int(microfs_dirindex_offset(77, 18), ==, 96);
+	
+	_ck_assert_int(microfs_dirindex_size(1), ==, 8 + 2 * 4 + 8);
+	_ck_assert_int(microfs_dirindex_size(3), ==, 8 + 5 * 4 + 3 * 8);
+END_TEST
+
 Suite* create_master_suite(void)
 {
 	Suite* s;
@@ -93,7 +218,17 @@ Suite* create_master_suite(void)
 	tcase_add_test(tc, test_packed_structs);
 	tcase_add_test(tc, test_i_xsize);
 	tcase_add_test(tc, test_i_blks);
+	tcase_add_test(tc, test_i_blksz);
+	tcase_add_test(tc, test_i_fragments);
+	tcase_add_test(tc, test_microfs_codecidx);
+	tcase_add_test(tc, test_i_packedptrs);
+	tcase_add_test(tc, test_i_blkextents);
+	tcase_add_test(tc, test_i_hasfileinfo);
+	tcase_add_test(tc, test_i_frameidxsz);
+	tcase_add_test(tc, test_i_inlinedata);
 	tcase_add_test(tc, test_sz_blkceil);
+	tcase_add_test(tc, test_microfs_namehash);
+	tcase_add_test(tc, test_microfs_dirindex);
 	
 	return s;
 }
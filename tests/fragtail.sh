@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# microfs - Minimally Improved Compressed Read Only File System
+# Copyright (C) 2012, 2013, 2014, 2015, 2016, 2017, ..., +%Y
+# Erik Edlund <erik.edlund@32767.se>
+# 
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+# 
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+source "boilerplate.sh"
+
+script_path=`readlink -f "$0"`
+script_dir=`dirname "${script_path}"`
+top_dir=`dirname "${script_dir}"`
+
+if [[ $# -ne 1 || ! -d "$1" ]] ; then
+	cat <<EOF
+Usage: `basename $0` dirname
+
+Test file tails in fragments which are longer than a sub-frame.
+EOF
+	exit 1
+fi
+
+workdir="$1"
+
+img_src="${workdir}/fragtail"
+img_file="${img_src}.img"
+img_extract="${img_src}.ext"
+img_mount="${img_src}.mount"
+
+# The tails of the files are 10000 and 65535 bytes long, which
+# is many pages and sub-frames.
+mkdir "${img_src}"
+atexit_0 rm -rf "${img_src}"
+head -c 75536 /dev/urandom > "${img_src}/tail-10000"
+head -c 131071 /dev/urandom > "${img_src}/tail-65535"
+yes "microfs" | head -c 206608 > "${img_src}/tail-10000-text"
+
+"${top_dir}/microfsmki" -b 65536 -F 4096 -f "${img_src}" "${img_file}" > /dev/null
+atexit_0 rm "${img_file}"
+
+"${top_dir}/microfscki" -e -x "${img_extract}" "${img_file}" > /dev/null
+atexit_0 rm -rf "${img_extract}"
+
+cmptrees.sh -a "${img_src}" -b "${img_extract}" -c "sha512sum"
+
+mkdir "${img_mount}"
+atexit_0 rmdir "${img_mount}"
+
+eval "sudo mount -r -o loop -t microfs \"${img_file}\" \"${img_mount}\""
+atexit sudo umount "${img_mount}"
+
+cmptrees.sh -a "${img_src}" -b "${img_mount}" -c "sha512sum"
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# microfs - Minimally Improved Compressed Read Only File System
+# Copyright (C) 2012, 2013, 2014, 2015, 2016, 2017, ..., +%Y
+# Erik Edlund <erik.edlund@32767.se>
+# 
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+# 
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+source "boilerplate.sh"
+
+script_path=`readlink -f "$0"`
+script_dir=`dirname "${script_path}"`
+top_dir=`dirname "${script_dir}"`
+
+if [[ $# -ne 1 || ! -d "$1" ]] ; then
+	cat <<EOF
+Usage: `basename $0` dirname
+
+Test zstd images with and without a dictionary. An image without a
+dictionary has the same format as the zstd images made before
+MICROFS_FLAG_DICTIONARY, so it must still mount and read as before.
+EOF
+	exit 1
+fi
+
+workdir="$1"
+
+if ! "${top_dir}/microfslib" | grep -qx "zstd" ; then
+	echo "`basename $0`: zstd support has not been compiled, skipping"
+	exit 0
+fi
+
+img_src="${workdir}/zstddict"
+
+"mkrandtree.py" --size-budget=4194304 --file-content=compressable_bytes \
+	"${img_src}" > /dev/null
+atexit_0 rm -rf "${img_src}"
+
+mk_options=(
+	"-c zstd -b 4096"
+	"-c zstd -b 4096 -l dictionary=16384"
+)
+for i in "${!mk_options[@]}" ; do
+	img_file="${img_src}-${i}.img"
+	img_extract="${img_src}-${i}.ext"
+	img_mount="${img_src}-${i}.mount"
+	
+	eval "\"${top_dir}/microfsmki\" ${mk_options[$i]} \"${img_src}\" \"${img_file}\"" \
+		> /dev/null
+	atexit_0 rm "${img_file}"
+	
+	"${top_dir}/microfscki" -e -x "${img_extract}" "${img_file}" > /dev/null
+	atexit_0 rm -rf "${img_extract}"
+	
+	cmptrees.sh -a "${img_src}" -b "${img_extract}" -c "sha512sum"
+	
+	mkdir "${img_mount}"
+	atexit_0 rmdir "${img_mount}"
+	
+	eval "sudo mount -r -o loop -t microfs \"${img_file}\" \"${img_mount}\""
+	atexit sudo umount "${img_mount}"
+	
+	cmptrees.sh -a "${img_src}" -b "${img_mount}" -c "sha512sum"
+done